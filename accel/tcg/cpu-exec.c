@@ -898,11 +898,24 @@ static inline void cpu_loop_exec_tb(CPUState *cpu, TranslationBlock *tb,
      * If the next tb has more instructions than we have left to
      * execute we need to ensure we find/generate a TB with exactly
      * insns_left instructions in it.
+     *
+     * With -icount cycles=on the budget is in cycles: the TB is cut after
+     * the instructions whose cycles fit, a prefix of a TB costing the same
+     * in a shorter one. A single instruction that costs more than what is
+     * left is let run past the deadline, by extending the budget.
      */
-    if (insns_left > 0 && insns_left < tb->icount)  {
-        assert(insns_left <= CF_COUNT_MASK);
+    if (insns_left > 0 && insns_left < tb->cycles)  {
+        int fit = tb_icount_fit(tb, insns_left);
+
         assert(cpu->icount_extra == 0);
-        cpu->cflags_next_tb = (tb->cflags & ~CF_COUNT_MASK) | insns_left;
+        if (fit == 0 && tb->icount == 1) {
+            cpu->icount_budget += tb->cycles - insns_left;
+            cpu_neg(cpu)->icount_decr.u16.low = tb->cycles;
+        } else {
+            fit = MAX(1, fit);
+            assert(fit <= CF_COUNT_MASK);
+            cpu->cflags_next_tb = (tb->cflags & ~CF_COUNT_MASK) | fit;
+        }
     }
 #endif
 }
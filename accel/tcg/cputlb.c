@@ -294,6 +294,11 @@ void tlb_destroy(CPUState *cpu)
         g_free(fast->table);
         g_free(desc->fulltlb);
     }
+
+    if (cpu->mmio_poll.regs) {
+        g_byte_array_unref(cpu->mmio_poll.regs);
+        g_byte_array_unref(cpu->mmio_poll.prev_regs);
+    }
 }
 
 /* flush_all_helper: run fn across all cpus
@@ -1270,7 +1275,8 @@ void tlb_set_page_full(CPUState *cpu, int mmu_idx,
         if (prot & PAGE_WRITE_INV) {
             tn.addr_write |= TLB_INVALID_MASK;
         }
-        if (wp_flags & BP_MEM_WRITE) {
+        /* Stores watched for MMIO polling detection take the same path */
+        if ((wp_flags & BP_MEM_WRITE) || cpu->mmio_poll.watch_stores) {
             tn.addr_write |= TLB_WATCHPOINT;
         }
     }
@@ -1347,6 +1353,209 @@ static inline void cpu_transaction_failed(CPUState *cpu, hwaddr physaddr,
     }
 }
 
+/*
+ * MMIO polling detection. A vCPU reading the same value from a side-effect
+ * free device register, at the same instruction and many times in a row
+ * without any MMIO write in between, is busy waiting on the device. The
+ * vCPU is halted only if one iteration of its loop, from one of these reads
+ * to the next, had no other effect: its registers, pc included, did not
+ * change and it did not store to memory, so it keeps no timeout counter in
+ * a register or in memory. It then stays halted until the main loop
+ * dispatches an event (timer, I/O handler, bottom half) that may change
+ * the device state, until any vCPU writes to a device, or until it gets an
+ * interrupt. The main loop still wakes up at least every
+ * MMIO_POLL_MAX_SUSPEND_MS, for devices whose state depends on time
+ * without a timer being armed.
+ *
+ * The check is a heuristic and has limits: it only looks at one iteration
+ * and at the core registers the gdbstub exposes, so a loop that only
+ * changes other state (system registers, FPU registers on targets not
+ * exposing them as core registers) or that only makes progress on some
+ * iterations is taken for a pure poll; and the read value is compared,
+ * not the bits the loop tests.
+ */
+#define MMIO_POLL_THRESHOLD 64
+#define MMIO_POLL_MAX_SUSPEND_MS 1
+
+static bool mmio_poll_enabled;
+static bool mmio_poll_any_suspended;
+static Notifier mmio_poll_notifier;
+
+/*
+ * Called with the iothread lock held. The suspended vCPUs only read their
+ * halted flag from their own thread, hence the atomic accesses.
+ */
+static void mmio_poll_wake_all(void)
+{
+    CPUState *cpu;
+
+    g_assert(qemu_mutex_iothread_locked());
+
+    if (!qatomic_read(&mmio_poll_any_suspended)) {
+        return;
+    }
+    qatomic_set(&mmio_poll_any_suspended, false);
+
+    CPU_FOREACH(cpu) {
+        if (qatomic_read(&cpu->mmio_poll.suspended)) {
+            qatomic_set(&cpu->mmio_poll.suspended, false);
+            qatomic_set(&cpu->halted, 0);
+            qemu_cpu_kick(cpu);
+        }
+    }
+}
+
+static void mmio_poll_main_loop_notify(Notifier *notifier, void *data)
+{
+    MainLoopPoll *mlpoll = data;
+
+    if (mlpoll->state == MAIN_LOOP_POLL_FILL) {
+        if (qatomic_read(&mmio_poll_any_suspended)) {
+            mlpoll->timeout = MIN(mlpoll->timeout, MMIO_POLL_MAX_SUSPEND_MS);
+        }
+    } else {
+        /* Events have been dispatched, let the vCPUs check their device */
+        mmio_poll_wake_all();
+    }
+}
+
+void tlb_mmio_poll_enable(void)
+{
+    if (!mmio_poll_enabled) {
+        mmio_poll_enabled = true;
+        mmio_poll_notifier.notify = mmio_poll_main_loop_notify;
+        main_loop_poll_add_notifier(&mmio_poll_notifier);
+    }
+}
+
+/*
+ * Snapshot the core registers of the vCPU, as seen by the gdbstub, at the
+ * instruction at @retaddr.
+ */
+static void mmio_poll_save_regs(CPUState *cpu, GByteArray *buf,
+                                uintptr_t retaddr)
+{
+    CPUClass *cc = CPU_GET_CLASS(cpu);
+    uint64_t data[TARGET_INSN_START_WORDS];
+    int reg;
+
+    g_byte_array_set_size(buf, 0);
+    for (reg = 0; reg < cc->gdb_num_core_regs; reg++) {
+        cc->gdb_read_register(cpu, buf, reg);
+    }
+
+    /*
+     * The pc in the registers is stale in the middle of a TB, add the
+     * one of the instruction, as restored on an exception.
+     */
+    if (cpu_unwind_state_data(cpu, retaddr, data)) {
+        g_byte_array_append(buf, (const guint8 *)data, sizeof(data));
+    }
+}
+
+/*
+ * Make all the stores of @cpu take the slow path, where they are noted, or
+ * stop doing so. Only called from its thread, outside of a store since the
+ * TLB is flushed.
+ */
+static void mmio_poll_watch_stores(CPUState *cpu, bool watch)
+{
+    if (cpu->mmio_poll.watch_stores != watch) {
+        cpu->mmio_poll.watch_stores = watch;
+        tlb_flush(cpu);
+    }
+}
+
+static void mmio_poll_flush_work(CPUState *cpu, run_on_cpu_data data)
+{
+    tlb_flush(cpu);
+}
+
+/* Called for the stores of the vCPU that take the watchpoint path */
+static inline void mmio_poll_note_store(CPUState *cpu)
+{
+    if (unlikely(cpu->mmio_poll.watch_stores)) {
+        /*
+         * The loop makes progress, no need to watch further. The TLB entry
+         * of the store is in use, flush it once the store is done.
+         */
+        cpu->mmio_poll.watch_stores = false;
+        cpu->mmio_poll.stored = true;
+        async_run_on_cpu(cpu, mmio_poll_flush_work, RUN_ON_CPU_NULL);
+    }
+}
+
+/*
+ * Account an MMIO read, called with the iothread lock held. Returns true
+ * if the vCPU was found busy waiting and has been halted.
+ */
+static bool mmio_poll_check(CPUState *cpu, MemoryRegion *mr, hwaddr addr,
+                            uint64_t val, MemOp op, uintptr_t retaddr)
+{
+    MMIOPoll *poll = &cpu->mmio_poll;
+    bool progress;
+
+    /* Running, so any previous suspension was ended by an interrupt */
+    qatomic_set(&poll->suspended, false);
+
+    if (!mr->ops->read_is_idempotent ||
+        !mr->ops->read_is_idempotent(mr->opaque, addr, memop_size(op))) {
+        poll->mr = NULL;
+        poll->count = 0;
+        mmio_poll_watch_stores(cpu, false);
+        return false;
+    }
+
+    if (poll->mr != mr || poll->addr != addr || poll->val != val ||
+        poll->retaddr != retaddr) {
+        poll->mr = mr;
+        poll->addr = addr;
+        poll->val = val;
+        poll->retaddr = retaddr;
+        poll->count = 1;
+        mmio_poll_watch_stores(cpu, false);
+        return false;
+    }
+
+    if (++poll->count < MMIO_POLL_THRESHOLD - 1) {
+        return false;
+    }
+
+    if (!poll->regs) {
+        poll->regs = g_byte_array_new();
+        poll->prev_regs = g_byte_array_new();
+    }
+    if (poll->count == MMIO_POLL_THRESHOLD - 1) {
+        mmio_poll_save_regs(cpu, poll->prev_regs, retaddr);
+        poll->stored = false;
+        mmio_poll_watch_stores(cpu, true);
+        return false;
+    }
+
+    /*
+     * A loop counting down a timeout changes at least one register or
+     * stores to memory on each iteration. Leave it running at full speed
+     * so that it times out as it would on hardware, and check again after
+     * another batch of reads.
+     */
+    mmio_poll_watch_stores(cpu, false);
+    mmio_poll_save_regs(cpu, poll->regs, retaddr);
+    progress = poll->stored || poll->regs->len != poll->prev_regs->len ||
+               memcmp(poll->regs->data, poll->prev_regs->data,
+                      poll->regs->len);
+    poll->count = 0;
+    if (progress) {
+        return false;
+    }
+
+    poll->timed = mr->ops->read_is_timed &&
+                  mr->ops->read_is_timed(mr->opaque, addr, memop_size(op));
+    qatomic_set(&poll->suspended, true);
+    qatomic_set(&mmio_poll_any_suspended, true);
+    qatomic_set(&cpu->halted, 1);
+    return true;
+}
+
 static uint64_t io_readx(CPUArchState *env, CPUTLBEntryFull *full,
                          int mmu_idx, target_ulong addr, uintptr_t retaddr,
                          MMUAccessType access_type, MemOp op)
@@ -1357,6 +1566,7 @@ static uint64_t io_readx(CPUArchState *env, CPUTLBEntryFull *full,
     MemoryRegion *mr;
     uint64_t val;
     bool locked = false;
+    bool suspend = false;
     MemTxResult r;
 
     section = iotlb_to_section(cpu, full->xlat_section, full->attrs);
@@ -1379,11 +1589,19 @@ static uint64_t io_readx(CPUArchState *env, CPUTLBEntryFull *full,
 
         cpu_transaction_failed(cpu, physaddr, addr, memop_size(op), access_type,
                                mmu_idx, full->attrs, r, retaddr);
+    } else if (mmio_poll_enabled) {
+        suspend = mmio_poll_check(cpu, mr, mr_offset, val, op, retaddr);
     }
     if (locked) {
         qemu_mutex_unlock_iothread();
     }
 
+    if (suspend) {
+        /* The read has no side effect, it is done again once woken up */
+        cpu->exception_index = EXCP_HLT;
+        cpu_loop_exit_restore(cpu, retaddr);
+    }
+
     return val;
 }
 
@@ -1441,6 +1659,12 @@ static void io_writex(CPUArchState *env, CPUTLBEntryFull *full,
                                MMU_DATA_STORE, mmu_idx, full->attrs, r,
                                retaddr);
     }
+    if (mmio_poll_enabled) {
+        /* This may be what the other vCPUs are waiting for */
+        cpu->mmio_poll.count = 0;
+        mmio_poll_watch_stores(cpu, false);
+        mmio_poll_wake_all();
+    }
     if (locked) {
         qemu_mutex_unlock_iothread();
     }
@@ -1645,6 +1869,10 @@ void *probe_access(CPUArchState *env, target_ulong addr, int size,
         if (flags & TLB_WATCHPOINT) {
             int wp_access = (access_type == MMU_DATA_STORE
                              ? BP_MEM_WRITE : BP_MEM_READ);
+
+            if (access_type == MMU_DATA_STORE) {
+                mmio_poll_note_store(env_cpu(env));
+            }
             cpu_check_watchpoint(env_cpu(env), addr, size,
                                  full->attrs, wp_access, retaddr);
         }
@@ -2280,6 +2508,9 @@ store_helper_unaligned(CPUArchState *env, target_ulong addr, uint64_t val,
      * Handle watchpoints.  Since this may trap, all checks
      * must happen before any store.
      */
+    if (unlikely((tlb_addr | tlb_addr2) & TLB_WATCHPOINT)) {
+        mmio_poll_note_store(env_cpu(env));
+    }
     if (unlikely(tlb_addr & TLB_WATCHPOINT)) {
         cpu_check_watchpoint(env_cpu(env), addr, size - size2,
                              env_tlb(env)->d[mmu_idx].fulltlb[index].attrs,
@@ -2363,6 +2594,7 @@ store_helper(CPUArchState *env, target_ulong addr, uint64_t val,
 
         /* Handle watchpoints.  */
         if (unlikely(tlb_addr & TLB_WATCHPOINT)) {
+            mmio_poll_note_store(env_cpu(env));
             /* On watchpoint hit, this will longjmp out.  */
             cpu_check_watchpoint(env_cpu(env), addr, size,
                                  full->attrs, BP_MEM_WRITE, retaddr);
@@ -102,6 +102,16 @@ TranslationBlock *tb_gen_code(CPUState *cpu, target_ulong pc,
 G_NORETURN void cpu_io_recompile(CPUState *cpu, uintptr_t retaddr);
 void page_init(void);
 void tb_htable_init(void);
+/*
+ * Return how many of the first insns of @tb fit in @budget icount units,
+ * that is in @budget cycles with -icount cycles=on. This is 0 when even
+ * the first insn does not fit.
+ */
+int tb_icount_fit(TranslationBlock *tb, int budget);
+#ifdef CONFIG_SOFTMMU
+void tlb_mmio_poll_enable(void);
+void tb_manifest_init(const char *path);
+#endif
 void tb_reset_jump(TranslationBlock *tb, int n);
 TranslationBlock *tb_link_page(TranslationBlock *tb, tb_page_addr_t phys_pc,
                                tb_page_addr_t phys_page2);
@@ -24,6 +24,9 @@
 #include "exec/translate-all.h"
 #include "sysemu/tcg.h"
 #include "tcg/tcg.h"
+#ifndef CONFIG_USER_ONLY
+#include "exec/ram_addr.h"
+#endif
 #include "tb-hash.h"
 #include "tb-context.h"
 #include "internal.h"
@@ -378,7 +381,7 @@ static void page_unlock_tb(const TranslationBlock *tb)
  */
 void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr)
 {
-    if (page_addr == -1 && tb_page_addr0(tb) != -1) {
+    if (page_addr == -1 && tb_page_addr0(tb) != -1 && !tb->rom) {
         page_lock_tb(tb);
         do_tb_phys_invalidate(tb, true);
         page_unlock_tb(tb);
@@ -444,6 +447,27 @@ TranslationBlock *tb_link_page(TranslationBlock *tb, tb_page_addr_t phys_pc,
     assert_memory_lock();
     tcg_debug_assert(!(tb->cflags & CF_INVALID));
 
+#ifndef CONFIG_USER_ONLY
+    /*
+     * The guest cannot write to ROM, so there is no self-modifying code to
+     * catch there: skip the page lists and the write protection of the
+     * pages, and only publish the TB. Host side changes to the ROM contents
+     * go through tb_invalidate_rom_range() instead.
+     */
+    if (qemu_ram_addr_is_rom(phys_pc) &&
+        (phys_page2 == -1 || qemu_ram_addr_is_rom(phys_page2))) {
+        tb->rom = true;
+        qemu_ram_mark_rom_tb(phys_pc);
+        if (phys_page2 != -1) {
+            qemu_ram_mark_rom_tb(phys_page2);
+        }
+        h = tb_hash_func(phys_pc, (TARGET_TB_PCREL ? 0 : tb_pc(tb)),
+                         tb->flags, tb->cflags, tb->trace_vcpu_dstate);
+        qht_insert(&tb_ctx.htable, tb, h, &existing_tb);
+        return existing_tb ? existing_tb : tb;
+    }
+#endif
+
     /*
      * Add the TB to the page list, acquiring first the pages's locks.
      * We keep the locks held until after inserting the TB in the hash table,
@@ -617,6 +641,74 @@ void tb_invalidate_phys_range(tb_page_addr_t start, tb_page_addr_t end)
 }
 
 #ifdef CONFIG_SOFTMMU
+typedef struct RomRangeInvalidate {
+    tb_page_addr_t start;
+    tb_page_addr_t end;
+    GPtrArray *tbs;
+} RomRangeInvalidate;
+
+static bool tb_rom_overlaps(tb_page_addr_t tb_start, tb_page_addr_t tb_end,
+                            const RomRangeInvalidate *r)
+{
+    return tb_start < r->end && r->start < tb_end;
+}
+
+static gboolean tb_collect_rom(gpointer key, gpointer value, gpointer data)
+{
+    TranslationBlock *tb = value;
+    RomRangeInvalidate *r = data;
+    tb_page_addr_t start = tb_page_addr0(tb);
+    tb_page_addr_t end = start + tb->size;
+
+    if (!tb->rom || (tb_cflags(tb) & CF_INVALID)) {
+        return false;
+    }
+    if (tb_page_addr1(tb) != -1) {
+        /* the second page need not follow the first one in ram_addr space */
+        tb_page_addr_t page1_end = (start | ~TARGET_PAGE_MASK) + 1;
+
+        if (tb_rom_overlaps(start, page1_end, r) ||
+            tb_rom_overlaps(tb_page_addr1(tb),
+                            tb_page_addr1(tb) + (end - page1_end), r)) {
+            g_ptr_array_add(r->tbs, tb);
+        }
+    } else if (tb_rom_overlaps(start, end, r)) {
+        g_ptr_array_add(r->tbs, tb);
+    }
+    return false;
+}
+
+/*
+ * Invalidate all TBs translated from ROM in the range [start;end[. ROM
+ * TBs are not in the page lists, so the whole TB tree has to be walked:
+ * this is meant for the rare host side updates of ROM contents (loader,
+ * debugger, checkpoints), not for guest writes. The walk is skipped when
+ * no ROM TB was translated from the pages of the range since they were
+ * last invalidated, like on a reset before the code ran again.
+ */
+void tb_invalidate_rom_range(tb_page_addr_t start, tb_page_addr_t end)
+{
+    RomRangeInvalidate r = {
+        .start = start,
+        .end = end,
+    };
+    guint i;
+
+    assert_memory_lock();
+
+    if (!qemu_ram_test_and_clear_rom_tbs(start, end)) {
+        return;
+    }
+    r.tbs = g_ptr_array_new();
+
+    /* don't invalidate from within the traversal of the TB tree */
+    tcg_tb_foreach(tb_collect_rom, &r);
+    for (i = 0; i < r.tbs->len; i++) {
+        tb_phys_invalidate(g_ptr_array_index(r.tbs, i), -1);
+    }
+    g_ptr_array_free(r.tbs, true);
+}
+
 /*
  * len must be <= 8 and start must be a multiple of len.
  * Called via softmmu_template.h when code areas are written to with
@@ -0,0 +1,539 @@
+/*
+ * Persistent manifest of translation blocks from read-only memory
+ *
+ * Copyright (c) 2023 Julien Combattelli <julien.combattelli@gmail.com>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+/*
+ * Host code cannot be reused across processes: it embeds the addresses of
+ * helpers, of the prologue and of other TBs, all of which move from one run
+ * to the next. What can be kept is the set of blocks a previous run ended up
+ * translating. On exit the key of every TB built from ROM is written out
+ * together with the guest code it was translated from, and the next run
+ * translates those blocks up front, before the guest starts. Blocks whose
+ * guest code changed in between are skipped.
+ *
+ * This is warm-up prefetching of the translation work, not a cache of
+ * translated code. A standalone run would only pay up front for every block
+ * any run ever recorded, so blocks are only translated ahead of time by a
+ * fork server (the fork-server-fd machine property): it translates what its
+ * children will run once, in the parent, instead of once per child. Every
+ * run still records its blocks.
+ *
+ * The manifest is tied to the QEMU build, since the meaning of the TB flags
+ * may change with any rebuild. Every instance saves the union of its own
+ * blocks and of the ones already in the file, under a lock, so that
+ * concurrent instances (such as the children of a fork server) add to the
+ * manifest rather than overwrite each other's blocks.
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "qemu/error-report.h"
+#include "qemu/log.h"
+#include "qemu/notify.h"
+#include "qemu/rcu.h"
+#include "qemu/cutils.h"
+#include "exec/exec-all.h"
+#include "exec/memory.h"
+#include "exec/ram_addr.h"
+#include "hw/core/cpu.h"
+#include "sysemu/fork-server.h"
+#include "sysemu/runstate.h"
+#include "sysemu/sysemu.h"
+#include "tcg/tcg.h"
+#include "internal.h"
+
+#define TB_MANIFEST_MAGIC "QEMUTBM1"
+
+/*
+ * File layout, in host byte order:
+ *
+ *   char magic[8]
+ *   uint32_t length, char build[length]      qemu_get_build_id()
+ *   uint32_t length, char cpu_type[length]   QOM type of the vCPUs
+ *   uint32_t count
+ *   count times:
+ *     uint64_t pc, uint64_t cs_base, uint32_t flags, uint32_t cflags,
+ *     uint16_t size, uint8_t code[size]
+ */
+typedef struct TBManifestEntry {
+    uint64_t pc;
+    uint64_t cs_base;
+    uint32_t flags;
+    uint32_t cflags;
+    uint16_t size;
+    const uint8_t *code;
+} TBManifestEntry;
+
+typedef struct TBManifest {
+    char *path;
+    char *build_id;
+    /* Loaded file, the entries point into it */
+    gchar *data;
+    char *cpu_type;
+    GArray *entries;
+    Notifier exit_notifier;
+    VMChangeStateEntry *vmse;
+} TBManifest;
+
+static TBManifest tb_manifest;
+
+typedef struct TBManifestReader {
+    const uint8_t *p;
+    const uint8_t *end;
+} TBManifestReader;
+
+static const void *tb_manifest_read(TBManifestReader *r, size_t len)
+{
+    const void *p = r->p;
+
+    if (r->end - r->p < len) {
+        return NULL;
+    }
+    r->p += len;
+    return p;
+}
+
+static bool tb_manifest_read_val(TBManifestReader *r, void *val, size_t len)
+{
+    const void *p = tb_manifest_read(r, len);
+
+    if (p) {
+        memcpy(val, p, len);
+    }
+    return p != NULL;
+}
+
+static char *tb_manifest_read_str(TBManifestReader *r)
+{
+    const char *p;
+    uint32_t len;
+
+    if (!tb_manifest_read_val(r, &len, sizeof(len)) ||
+        !(p = tb_manifest_read(r, len))) {
+        return NULL;
+    }
+    return g_strndup(p, len);
+}
+
+/*
+ * Parse a manifest into @entries, which point into the buffer of @r. Only
+ * manifests written by this build for @cpu_type are accepted.
+ */
+static bool tb_manifest_parse(TBManifestReader *r, const char *cpu_type,
+                              GArray *entries)
+{
+    g_autofree char *build_id = NULL;
+    g_autofree char *type = NULL;
+    const void *magic;
+    uint32_t count, i;
+
+    magic = tb_manifest_read(r, strlen(TB_MANIFEST_MAGIC));
+    if (!magic || memcmp(magic, TB_MANIFEST_MAGIC, strlen(TB_MANIFEST_MAGIC))) {
+        return false;
+    }
+    build_id = tb_manifest_read_str(r);
+    if (!build_id || strcmp(build_id, tb_manifest.build_id)) {
+        /* The meaning of the TB flags may have changed */
+        return false;
+    }
+    type = tb_manifest_read_str(r);
+    if (!type || strcmp(type, cpu_type) ||
+        !tb_manifest_read_val(r, &count, sizeof(count))) {
+        return false;
+    }
+
+    for (i = 0; i < count; i++) {
+        TBManifestEntry e;
+
+        if (!tb_manifest_read_val(r, &e.pc, sizeof(e.pc)) ||
+            !tb_manifest_read_val(r, &e.cs_base, sizeof(e.cs_base)) ||
+            !tb_manifest_read_val(r, &e.flags, sizeof(e.flags)) ||
+            !tb_manifest_read_val(r, &e.cflags, sizeof(e.cflags)) ||
+            !tb_manifest_read_val(r, &e.size, sizeof(e.size))) {
+            return false;
+        }
+        e.code = tb_manifest_read(r, e.size);
+        if (!e.code || e.size == 0 || e.size > TARGET_PAGE_SIZE) {
+            return false;
+        }
+        g_array_append_val(entries, e);
+    }
+    return true;
+}
+
+/*
+ * Read the manifest file into @data and its entries into @entries. Returns
+ * false, with @entries left empty, if there is no valid manifest.
+ */
+static bool tb_manifest_read_file(const char *cpu_type, gchar **data,
+                                  GArray *entries)
+{
+    g_autoptr(GError) gerr = NULL;
+    TBManifestReader r;
+    gsize len;
+
+    if (!g_file_get_contents(tb_manifest.path, data, &len, &gerr)) {
+        if (!g_error_matches(gerr, G_FILE_ERROR, G_FILE_ERROR_NOENT)) {
+            warn_report("tb-manifest: %s", gerr->message);
+        }
+        return false;
+    }
+
+    r.p = (const uint8_t *)*data;
+    r.end = r.p + len;
+    if (!tb_manifest_parse(&r, cpu_type, entries)) {
+        g_array_set_size(entries, 0);
+        return false;
+    }
+    return true;
+}
+
+static void tb_manifest_load(void)
+{
+    if (!first_cpu) {
+        return;
+    }
+    tb_manifest.cpu_type = g_strdup(object_get_typename(OBJECT(first_cpu)));
+    if (!tb_manifest_read_file(tb_manifest.cpu_type, &tb_manifest.data,
+                               tb_manifest.entries) && tb_manifest.data) {
+        warn_report("tb-manifest: ignoring stale or invalid manifest '%s'",
+                    tb_manifest.path);
+    }
+}
+
+/* Whether @cpu sees the code of @e at its address, using @code as buffer */
+static bool tb_manifest_entry_matches(CPUState *cpu, const TBManifestEntry *e,
+                                      uint8_t *code)
+{
+    return !cpu_memory_rw_debug(cpu, e->pc, code, e->size, false) &&
+           !memcmp(code, e->code, e->size);
+}
+
+/*
+ * Translate one manifest entry. Translation runs outside of cpu_exec(), so
+ * catch the cpu_loop_exit() raised when the code buffer fills up.
+ */
+static bool tb_manifest_translate_one(CPUState *cpu,
+                                      const TBManifestEntry *e)
+{
+    if (sigsetjmp(cpu->jmp_env, 0) != 0) {
+        cpu->exception_index = -1;
+        return false;
+    }
+
+    mmap_lock();
+    tb_gen_code(cpu, e->pc, e->cs_base, e->flags, e->cflags);
+    mmap_unlock();
+    return true;
+}
+
+static void tb_manifest_translate(CPUState *cpu, run_on_cpu_data data)
+{
+    CPUArchState *env = cpu->env_ptr;
+    g_autofree uint8_t *code = g_malloc(TARGET_PAGE_SIZE);
+    unsigned int i, done = 0;
+
+    if (g_strcmp0(tb_manifest.cpu_type, object_get_typename(OBJECT(cpu)))) {
+        return;
+    }
+
+    for (i = 0; i < tb_manifest.entries->len; i++) {
+        TBManifestEntry *e = &g_array_index(tb_manifest.entries,
+                                            TBManifestEntry, i);
+
+        /* The entry was recorded for another cluster or TCG configuration */
+        if (e->cflags != curr_cflags(cpu)) {
+            continue;
+        }
+        /* Both ends must be mapped, code fetches must not fault */
+        if (get_page_addr_code(env, e->pc) == -1 ||
+            get_page_addr_code(env, e->pc + e->size - 1) == -1) {
+            continue;
+        }
+        if (!tb_manifest_entry_matches(cpu, e, code)) {
+            continue;
+        }
+        if (!tb_manifest_translate_one(cpu, e)) {
+            break;
+        }
+        done++;
+    }
+
+    qemu_log_mask(CPU_LOG_EXEC, "tb-manifest: CPU %d translated %u of %u "
+                  "blocks ahead of time\n",
+                  cpu->cpu_index, done, tb_manifest.entries->len);
+}
+
+static void tb_manifest_vm_state_change(void *opaque, bool running,
+                                        RunState state)
+{
+    CPUState *cpu;
+
+    if (!running) {
+        return;
+    }
+
+    /* Only the first start, before any guest code has run */
+    qemu_del_vm_change_state_handler(tb_manifest.vmse);
+    tb_manifest.vmse = NULL;
+
+    if (!fork_server_enabled()) {
+        return;
+    }
+    tb_manifest_load();
+    if (!tb_manifest.entries->len) {
+        return;
+    }
+    CPU_FOREACH(cpu) {
+        async_safe_run_on_cpu(cpu, tb_manifest_translate, RUN_ON_CPU_NULL);
+    }
+}
+
+static RAMBlock *tb_manifest_rom_block(tb_page_addr_t addr,
+                                       ram_addr_t *offset)
+{
+    RAMBlock *rb = qemu_ram_block_from_host(qemu_map_ram_ptr(NULL, addr),
+                                            false, offset);
+
+    return rb && memory_region_is_rom(rb->mr) ? rb : NULL;
+}
+
+/*
+ * Return in @pc the address to translate @tb at again, or false if @tb is
+ * not made of ROM code only.
+ */
+static bool tb_manifest_tb_pc(const TranslationBlock *tb, uint64_t *pc)
+{
+    ram_addr_t offset, offset1;
+    RAMBlock *rb;
+
+    if (tb_page_addr0(tb) == -1) {
+        return false;
+    }
+    rb = tb_manifest_rom_block(tb_page_addr0(tb), &offset);
+    if (!rb) {
+        return false;
+    }
+    if (tb_page_addr1(tb) != -1 &&
+        !tb_manifest_rom_block(tb_page_addr1(tb), &offset1)) {
+        return false;
+    }
+
+#if TARGET_TB_PCREL
+    {
+        MemoryRegion *mr;
+
+        /*
+         * Position independent TBs don't keep their virtual pc. Use the
+         * physical address instead, the contents check on load rejects
+         * it if the guest doesn't see the same code there.
+         */
+        *pc = offset;
+        for (mr = rb->mr; mr->container; mr = mr->container) {
+            *pc += mr->addr;
+        }
+    }
+#else
+    *pc = tb_pc(tb);
+#endif
+    return true;
+}
+
+typedef struct TBManifestWriter {
+    GByteArray *out;
+    uint32_t count;
+    /* Records written so far, to merge the file without duplicates */
+    GHashTable *records;
+    /* Guest code of the TB being written */
+    uint8_t *code;
+} TBManifestWriter;
+
+static void tb_manifest_write(GByteArray *out, const void *p, size_t len)
+{
+    g_byte_array_append(out, p, len);
+}
+
+static void tb_manifest_write_str(GByteArray *out, const char *str)
+{
+    uint32_t len = strlen(str);
+
+    tb_manifest_write(out, &len, sizeof(len));
+    tb_manifest_write(out, str, len);
+}
+
+static void tb_manifest_write_entry(TBManifestWriter *w,
+                                    const TBManifestEntry *e)
+{
+    GByteArray *rec = g_byte_array_new();
+    GBytes *bytes;
+
+    tb_manifest_write(rec, &e->pc, sizeof(e->pc));
+    tb_manifest_write(rec, &e->cs_base, sizeof(e->cs_base));
+    tb_manifest_write(rec, &e->flags, sizeof(e->flags));
+    tb_manifest_write(rec, &e->cflags, sizeof(e->cflags));
+    tb_manifest_write(rec, &e->size, sizeof(e->size));
+    tb_manifest_write(rec, e->code, e->size);
+
+    bytes = g_byte_array_free_to_bytes(rec);
+    if (g_hash_table_add(w->records, bytes)) {
+        tb_manifest_write(w->out, g_bytes_get_data(bytes, NULL),
+                          g_bytes_get_size(bytes));
+        w->count++;
+    }
+}
+
+static gboolean tb_manifest_write_tb(gpointer key, gpointer value,
+                                     gpointer data)
+{
+    const TranslationBlock *tb = value;
+    TBManifestWriter *w = data;
+    uint8_t *code = w->code;
+    TBManifestEntry e;
+    uint16_t size0;
+
+    if ((tb_cflags(tb) & CF_INVALID) || !tb_manifest_tb_pc(tb, &e.pc)) {
+        return false;
+    }
+    e.cs_base = tb->cs_base;
+    e.flags = tb->flags;
+    e.cflags = tb_cflags(tb);
+    e.size = tb->size;
+    e.code = code;
+
+    /* The code of a TB spanning two pages is not contiguous in RAM */
+    size0 = MIN(e.size, TARGET_PAGE_SIZE - (e.pc & ~TARGET_PAGE_MASK));
+    memcpy(code, qemu_map_ram_ptr(NULL, tb_page_addr0(tb)), size0);
+    if (size0 < e.size) {
+        memcpy(code + size0, qemu_map_ram_ptr(NULL, tb_page_addr1(tb)),
+               e.size - size0);
+    }
+
+    tb_manifest_write_entry(w, &e);
+    return false;
+}
+
+/*
+ * Serialise the writers of the manifest, so that none of them misses the
+ * blocks another one saves in the meantime. Returns the lock fd, or -1 if
+ * the manifest is written without the lock.
+ */
+static int tb_manifest_lock(void)
+{
+#ifndef _WIN32
+    g_autofree char *lock_path = g_strdup_printf("%s.lock", tb_manifest.path);
+    Error *err = NULL;
+    int fd, ret;
+
+    fd = qemu_create(lock_path, O_RDWR, 0644, &err);
+    if (fd < 0) {
+        warn_report_err(err);
+        return -1;
+    }
+    while ((ret = qemu_lock_fd(fd, 0, 0, true)) == -EAGAIN ||
+           ret == -EACCES) {
+        g_usleep(1000);
+    }
+    if (ret < 0) {
+        warn_report("tb-manifest: cannot lock '%s': %s", lock_path,
+                    strerror(-ret));
+        qemu_close(fd);
+        return -1;
+    }
+    return fd;
+#else
+    return -1;
+#endif
+}
+
+static void tb_manifest_unlock(int fd)
+{
+#ifndef _WIN32
+    if (fd >= 0) {
+        qemu_unlock_fd(fd, 0, 0);
+        qemu_close(fd);
+    }
+#endif
+}
+
+static void tb_manifest_save(Notifier *n, void *data)
+{
+    g_autoptr(GError) gerr = NULL;
+    g_autoptr(GArray) entries = NULL;
+    g_autofree gchar *old_data = NULL;
+    const char *cpu_type;
+    TBManifestWriter w;
+    size_t count_offset;
+    unsigned int i;
+    int lock_fd;
+
+    if (!first_cpu) {
+        return;
+    }
+    cpu_type = object_get_typename(OBJECT(first_cpu));
+
+    w.out = g_byte_array_new();
+    w.count = 0;
+    w.records = g_hash_table_new_full(g_bytes_hash, g_bytes_equal,
+                                      (GDestroyNotify)g_bytes_unref, NULL);
+    w.code = g_malloc(TARGET_PAGE_SIZE);
+    tb_manifest_write(w.out, TB_MANIFEST_MAGIC, strlen(TB_MANIFEST_MAGIC));
+    tb_manifest_write_str(w.out, tb_manifest.build_id);
+    tb_manifest_write_str(w.out, cpu_type);
+    count_offset = w.out->len;
+    tb_manifest_write(w.out, &w.count, sizeof(w.count));
+
+    WITH_RCU_READ_LOCK_GUARD() {
+        tcg_tb_foreach(tb_manifest_write_tb, &w);
+    }
+
+    lock_fd = tb_manifest_lock();
+
+    /*
+     * Merge the blocks in the file, which other instances may have updated
+     * since it was loaded. Those whose code is no longer in memory belong
+     * to an older firmware and are dropped, so the file doesn't keep
+     * growing as the firmware changes.
+     */
+    entries = g_array_new(false, false, sizeof(TBManifestEntry));
+    tb_manifest_read_file(cpu_type, &old_data, entries);
+    for (i = 0; i < entries->len; i++) {
+        TBManifestEntry *e = &g_array_index(entries, TBManifestEntry, i);
+
+        if (tb_manifest_entry_matches(first_cpu, e, w.code)) {
+            tb_manifest_write_entry(&w, e);
+        }
+    }
+    memcpy(w.out->data + count_offset, &w.count, sizeof(w.count));
+
+    /*
+     * g_file_set_contents() renames a temporary file into place, so that
+     * readers never see a partial manifest.
+     */
+    if (!g_file_set_contents(tb_manifest.path, (gchar *)w.out->data,
+                             w.out->len, &gerr)) {
+        warn_report("tb-manifest: %s", gerr->message);
+    }
+
+    tb_manifest_unlock(lock_fd);
+    g_hash_table_unref(w.records);
+    g_byte_array_unref(w.out);
+    g_free(w.code);
+}
+
+void tb_manifest_init(const char *path)
+{
+    tb_manifest.path = g_strdup(path);
+    tb_manifest.build_id = qemu_get_build_id();
+    tb_manifest.entries = g_array_new(false, false, sizeof(TBManifestEntry));
+
+    tb_manifest.exit_notifier.notify = tb_manifest_save;
+    qemu_add_exit_notifier(&tb_manifest.exit_notifier);
+    /* The vCPUs don't exist yet, the manifest is loaded on the first start */
+    tb_manifest.vmse =
+        qemu_add_vm_change_state_handler(tb_manifest_vm_state_change, NULL);
+}
@@ -31,6 +31,7 @@
 #include "qemu/notify.h"
 #include "qemu/guest-random.h"
 #include "exec/exec-all.h"
+#include "tcg/tcg.h"
 
 #include "tcg-accel-ops.h"
 #include "tcg-accel-ops-rr.h"
@@ -139,6 +140,13 @@ static void rr_force_rcu(Notifier *notify, void *data)
     rr_kick_next_cpu();
 }
 
+/*
+ * Translation context of the vCPU thread. A thread re-created after fork()
+ * must keep using it: claiming a fresh one would exhaust tcg_ctxs[] and
+ * lose track of the code buffer region already handed out.
+ */
+static TCGContext *rr_tcg_ctx;
+
 /*
  * In the single-threaded case each vCPU is simulated in turn. If
  * there is more than a single vCPU we create a simple timer to kick
@@ -156,7 +164,12 @@ static void *rr_cpu_thread_fn(void *arg)
     rcu_register_thread();
     force_rcu.notify = rr_force_rcu;
     rcu_add_force_rcu_notifier(&force_rcu);
-    tcg_register_thread();
+    if (rr_tcg_ctx) {
+        tcg_ctx = rr_tcg_ctx;
+    } else {
+        tcg_register_thread();
+        rr_tcg_ctx = tcg_ctx;
+    }
 
     qemu_mutex_lock_iothread();
     qemu_thread_get_self(cpu->thread);
@@ -252,10 +265,12 @@ static void *rr_cpu_thread_fn(void *arg)
             qatomic_mb_set(&cpu->exit_request, 0);
         }
 
-        if (icount_enabled() && all_cpu_threads_idle()) {
+        if ((icount_enabled() || cpu_idle_warp_enabled()) &&
+            all_cpu_threads_idle()) {
             /*
              * When all cpus are sleeping (e.g in WFI), to avoid a deadlock
-             * in the main_loop, wake it up in order to start the warp timer.
+             * in the main_loop, wake it up in order to start the warp timer
+             * or to warp the virtual clock.
              */
             qemu_notify_event();
         }
@@ -303,3 +318,29 @@ void rr_start_vcpu_thread(CPUState *cpu)
         cpu->created = true;
     }
 }
+
+void rr_restart_vcpu_threads(void)
+{
+    CPUState *cpu = first_cpu;
+
+    g_assert(rr_tcg_ctx);
+
+    /*
+     * Only the forking thread survives in the child. The old vCPU thread
+     * was parked on halt_cond, so reset it before anyone waits on it again.
+     */
+    qemu_cond_init(cpu->halt_cond);
+    qemu_thread_create(cpu->thread, "ALL CPUs/TCG",
+                       rr_cpu_thread_fn,
+                       cpu, QEMU_THREAD_JOINABLE);
+#ifdef _WIN32
+    cpu->hThread = qemu_thread_get_handle(cpu->thread);
+#endif
+
+    CPU_FOREACH(cpu) {
+        if (cpu != first_cpu) {
+            /* we share the thread */
+            cpu->created = true;
+        }
+    }
+}
@@ -18,4 +18,7 @@ void rr_kick_vcpu_thread(CPUState *unused);
 /* start the round robin vcpu thread */
 void rr_start_vcpu_thread(CPUState *cpu);
 
+/* re-create the round robin vcpu thread in a forked child */
+void rr_restart_vcpu_threads(void);
+
 #endif /* TCG_ACCEL_OPS_RR_H */
@@ -193,6 +193,7 @@ static void tcg_accel_ops_init(AccelOpsClass *ops)
     } else {
         ops->create_vcpu_thread = rr_start_vcpu_thread;
         ops->kick_vcpu_thread = rr_kick_vcpu_thread;
+        ops->restart_vcpu_threads = rr_restart_vcpu_threads;
 
         if (icount_enabled()) {
             ops->handle_interrupt = icount_handle_interrupt;
@@ -44,6 +44,9 @@ struct TCGState {
     bool mttcg_enabled;
     int splitwx_enabled;
     unsigned long tb_size;
+    bool idle_warp;
+    bool mmio_poll_suspend;
+    char *tb_manifest;
 };
 typedef struct TCGState TCGState;
 
@@ -132,6 +135,16 @@ static int tcg_init_machine(MachineState *ms)
      * initialize the prologue now.
      */
     tcg_prologue_init(tcg_ctx);
+
+    if (s->idle_warp) {
+        cpu_idle_warp_enable();
+    }
+    if (s->mmio_poll_suspend) {
+        tlb_mmio_poll_enable();
+    }
+    if (s->tb_manifest) {
+        tb_manifest_init(s->tb_manifest);
+    }
 #endif
 
     return 0;
@@ -208,6 +221,53 @@ static void tcg_set_splitwx(Object *obj, bool value, Error **errp)
     s->splitwx_enabled = value;
 }
 
+static bool tcg_get_idle_warp(Object *obj, Error **errp)
+{
+    TCGState *s = TCG_STATE(obj);
+    return s->idle_warp;
+}
+
+static void tcg_set_idle_warp(Object *obj, bool value, Error **errp)
+{
+    ERRP_GUARD();
+    TCGState *s = TCG_STATE(obj);
+
+    if (value && icount_enabled()) {
+        error_setg(errp, "idle-warp is incompatible with icount");
+        error_append_hint(errp, "Use -icount sleep=off instead\n");
+        return;
+    }
+    s->idle_warp = value;
+}
+
+static bool tcg_get_mmio_poll_suspend(Object *obj, Error **errp)
+{
+    TCGState *s = TCG_STATE(obj);
+    return s->mmio_poll_suspend;
+}
+
+static void tcg_set_mmio_poll_suspend(Object *obj, bool value, Error **errp)
+{
+    TCGState *s = TCG_STATE(obj);
+    s->mmio_poll_suspend = value;
+}
+
+#if !defined(CONFIG_USER_ONLY)
+static char *tcg_get_tb_manifest(Object *obj, Error **errp)
+{
+    TCGState *s = TCG_STATE(obj);
+    return g_strdup(s->tb_manifest);
+}
+
+static void tcg_set_tb_manifest(Object *obj, const char *value, Error **errp)
+{
+    TCGState *s = TCG_STATE(obj);
+
+    g_free(s->tb_manifest);
+    s->tb_manifest = g_strdup(value);
+}
+#endif
+
 static int tcg_gdbstub_supported_sstep_flags(void)
 {
     /*
@@ -245,6 +305,23 @@ static void tcg_accel_class_init(ObjectClass *oc, void *data)
         tcg_get_splitwx, tcg_set_splitwx);
     object_class_property_set_description(oc, "split-wx",
         "Map jit pages into separate RW and RX regions");
+
+#if !defined(CONFIG_USER_ONLY)
+    object_class_property_add_bool(oc, "idle-warp",
+        tcg_get_idle_warp, tcg_set_idle_warp);
+    object_class_property_set_description(oc, "idle-warp",
+        "Skip to the next virtual timer deadline while all vCPUs are idle");
+
+    object_class_property_add_bool(oc, "mmio-poll-suspend",
+        tcg_get_mmio_poll_suspend, tcg_set_mmio_poll_suspend);
+    object_class_property_set_description(oc, "mmio-poll-suspend",
+        "Suspend vCPUs busy waiting on a device register");
+
+    object_class_property_add_str(oc, "tb-manifest",
+        tcg_get_tb_manifest, tcg_set_tb_manifest);
+    object_class_property_set_description(oc, "tb-manifest",
+        "File recording the ROM blocks to translate ahead of time");
+#endif
 }
 
 static const TypeInfo tcg_accel_type = {
@@ -213,7 +213,11 @@ static target_long decode_sleb128(const uint8_t **pp)
    Each line of the table is encoded as sleb128 deltas from the previous
    line.  The seed for the first line is { tb->pc, 0..., tb->tc.ptr }.
    That is, the first column is seeded with the guest pc, the last column
-   with the host pc, and the middle columns with zeros.  */
+   with the host pc, and the middle columns with zeros.
+
+   When the TB charges stall cycles (tb->cycles != tb->icount), each line
+   ends with one more column: the stall cycles charged before the insn,
+   seeded with zero.  */
 
 static int encode_search(TranslationBlock *tb, uint8_t *block)
 {
@@ -234,6 +238,10 @@ static int encode_search(TranslationBlock *tb, uint8_t *block)
         }
         prev = (i == 0 ? 0 : tcg_ctx->gen_insn_end_off[i - 1]);
         p = encode_sleb128(p, tcg_ctx->gen_insn_end_off[i] - prev);
+        if (tb->cycles != tb->icount) {
+            prev = (i == 0 ? 0 : tcg_ctx->gen_insn_stalls[i - 1]);
+            p = encode_sleb128(p, tcg_ctx->gen_insn_stalls[i] - prev);
+        }
 
         /* Test for (pending) buffer overflow.  The assumption is that any
            one row beginning below the high water mark cannot overrun
@@ -247,13 +255,19 @@ static int encode_search(TranslationBlock *tb, uint8_t *block)
     return p - block;
 }
 
+/*
+ * Return how many insns of @tb, from the faulting one at @host_pc, were
+ * not executed, and the stall cycles charged before it in @stalls.
+ */
 static int cpu_unwind_data_from_tb(TranslationBlock *tb, uintptr_t host_pc,
-                                   uint64_t *data)
+                                   uint64_t *data, int *stalls)
 {
     uintptr_t iter_pc = (uintptr_t)tb->tc.ptr;
     const uint8_t *p = tb->tc.ptr + tb->tc.size;
     int i, j, num_insns = tb->icount;
 
+    *stalls = 0;
+
     host_pc -= GETPC_ADJ;
 
     if (host_pc < iter_pc) {
@@ -274,6 +288,9 @@ static int cpu_unwind_data_from_tb(TranslationBlock *tb, uintptr_t host_pc,
             data[j] += decode_sleb128(&p);
         }
         iter_pc += decode_sleb128(&p);
+        if (tb->cycles != tb->icount) {
+            *stalls += decode_sleb128(&p);
+        }
         if (iter_pc > host_pc) {
             return num_insns - i;
         }
@@ -281,6 +298,33 @@ static int cpu_unwind_data_from_tb(TranslationBlock *tb, uintptr_t host_pc,
     return -1;
 }
 
+int tb_icount_fit(TranslationBlock *tb, int budget)
+{
+    const uint8_t *p = tb->tc.ptr + tb->tc.size;
+    int i, j, stalls = 0;
+
+    if (tb->cycles == tb->icount) {
+        return MIN(budget, tb->icount);
+    }
+
+    /*
+     * The first i insns cost i plus the stalls charged before insn i.
+     * Those charged before insn 0, like the wait states of the fetch
+     * that enters the TB, are paid by the first insn.
+     */
+    for (i = 0; i < tb->icount; ++i) {
+        for (j = 0; j < TARGET_INSN_START_WORDS; ++j) {
+            decode_sleb128(&p);
+        }
+        decode_sleb128(&p);
+        stalls += decode_sleb128(&p);
+        if (i > 0 && i + stalls > budget) {
+            return i - 1;
+        }
+    }
+    return tb->cycles <= budget ? tb->icount : tb->icount - 1;
+}
+
 /*
  * The cpu state corresponding to 'host_pc' is restored in
  * preparation for exiting the TB.
@@ -293,7 +337,8 @@ void cpu_restore_state_from_tb(CPUState *cpu, TranslationBlock *tb,
     TCGProfile *prof = &tcg_ctx->prof;
     int64_t ti = profile_getclock();
 #endif
-    int insns_left = cpu_unwind_data_from_tb(tb, host_pc, data);
+    int stalls;
+    int insns_left = cpu_unwind_data_from_tb(tb, host_pc, data, &stalls);
 
     if (insns_left < 0) {
         return;
@@ -303,9 +348,11 @@ void cpu_restore_state_from_tb(CPUState *cpu, TranslationBlock *tb,
         assert(icount_enabled());
         /*
          * Reset the cycle counter to the start of the block and
-         * shift if to the number of actually executed instructions.
+         * shift if to the number of actually executed instructions,
+         * plus the stall cycles charged for them.
          */
-        cpu_neg(cpu)->icount_decr.u16.low += insns_left;
+        cpu_neg(cpu)->icount_decr.u16.low +=
+            tb->cycles - (tb->icount - insns_left) - stalls;
     }
 
     cpu->cc->tcg_ops->restore_state_to_opc(cpu, tb, data);
@@ -344,7 +391,9 @@ bool cpu_unwind_state_data(CPUState *cpu, uintptr_t host_pc, uint64_t *data)
     if (in_code_gen_buffer((const void *)(host_pc - tcg_splitwx_diff))) {
         TranslationBlock *tb = tcg_tb_lookup(host_pc);
         if (tb) {
-            return cpu_unwind_data_from_tb(tb, host_pc, data) >= 0;
+            int stalls;
+
+            return cpu_unwind_data_from_tb(tb, host_pc, data, &stalls) >= 0;
         }
     }
     return false;
@@ -825,6 +874,7 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
     tb->flags = flags;
     tb->cflags = cflags;
     tb->trace_vcpu_dstate = *cpu->trace_dstate;
+    tb->rom = false;
     tb_set_page_addr0(tb, phys_pc);
     tb_set_page_addr1(tb, -1);
     tcg_ctx->tb_cflags = cflags;
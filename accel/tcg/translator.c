@@ -55,6 +55,7 @@ void translator_loop(CPUState *cpu, TranslationBlock *tb, int max_insns,
     db->pc_next = pc;
     db->is_jmp = DISAS_NEXT;
     db->num_insns = 0;
+    db->num_stalls = 0;
     db->max_insns = max_insns;
     db->singlestep_enabled = cflags & CF_SINGLE_STEP;
     db->host_addr[0] = host_pc;
@@ -79,6 +80,8 @@ void translator_loop(CPUState *cpu, TranslationBlock *tb, int max_insns,
 
     while (true) {
         db->num_insns++;
+        /* Stalls of the previous insns, to unwind icount exactly */
+        tcg_ctx->gen_insn_stalls[db->num_insns - 1] = db->num_stalls;
         ops->insn_start(db, cpu);
         tcg_debug_assert(db->is_jmp == DISAS_NEXT);  /* no early exit */
 
@@ -123,7 +126,8 @@ void translator_loop(CPUState *cpu, TranslationBlock *tb, int max_insns,
 
     /* Emit code to exit the TB, as indicated by db->is_jmp.  */
     ops->tb_stop(db, cpu);
-    gen_tb_end(db->tb, db->num_insns);
+    tcg_debug_assert(db->num_insns + db->num_stalls <= UINT16_MAX);
+    gen_tb_end(db->tb, db->num_insns + db->num_stalls);
 
     if (plugin_enabled) {
         plugin_gen_tb_end(cpu);
@@ -132,6 +136,7 @@ void translator_loop(CPUState *cpu, TranslationBlock *tb, int max_insns,
     /* The disas_log hook may use these values rather than recompute.  */
     tb->size = db->pc_next - db->pc_first;
     tb->icount = db->num_insns;
+    tb->cycles = db->num_insns + db->num_stalls;
 
 #ifdef DEBUG_DISAS
     if (qemu_loglevel_mask(CPU_LOG_TB_IN_ASM)
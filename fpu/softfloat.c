@@ -241,6 +241,31 @@ static inline bool can_use_fpu(const float_status *s)
                   s->float_rounding_mode == float_round_nearest_even);
 }
 
+/*
+ * Without the inexact flag already set, float32 operations can still use
+ * the host FPU by evaluating them in double precision: the double result
+ * rounds to the correctly rounded float32 result (53 >= 2 * 24 + 2, so
+ * double rounding is innocuous for +, -, *, / and sqrt), and comparing
+ * the two tells whether the operation was exact. Guests that run with the
+ * flags cleared, e.g. because they test them, then stay on the fast path.
+ */
+static inline bool can_use_fpu_exact(const float_status *s)
+{
+    if (QEMU_NO_HARDFLOAT) {
+        return false;
+    }
+    return likely(s->float_rounding_mode == float_round_nearest_even);
+}
+
+/*
+ * Whether an integer of magnitude m converts to float32 exactly, i.e.
+ * once its trailing zeros are dropped it fits in the 24-bit significand.
+ */
+static inline bool uint64_fits_float32(uint64_t m)
+{
+    return m == 0 || (m >> ctz64(m)) < (1 << 24);
+}
+
 /*
  * Hardfloat generation functions. Each operation can have two flavors:
  * either using softfloat primitives (e.g. float32_is_zero_or_normal) for
@@ -270,6 +295,8 @@ typedef float32 (*soft_f32_op2_fn)(float32 a, float32 b, float_status *s);
 typedef float64 (*soft_f64_op2_fn)(float64 a, float64 b, float_status *s);
 typedef float   (*hard_f32_op2_fn)(float a, float b);
 typedef double  (*hard_f64_op2_fn)(double a, double b);
+/* Store the rounded result in @r and return whether it is exact */
+typedef bool    (*hard_f32_exact_op2_fn)(float a, float b, float *r);
 
 /* 2-input is-zero-or-normal */
 static inline bool f32_is_zon2(union_float32 a, union_float32 b)
@@ -339,10 +366,42 @@ static inline bool f64_is_inf(union_float64 a)
     return float64_is_infinity(a.s);
 }
 
+/* float32_gen2() when the inexact flag is clear, see can_use_fpu_exact() */
+static inline float32
+float32_gen2_exact(float32 xa, float32 xb, float_status *s,
+                   hard_f32_exact_op2_fn hard_exact, soft_f32_op2_fn soft,
+                   f32_check_fn pre, f32_check_fn post)
+{
+    union_float32 ua, ub, ur;
+    bool exact;
+
+    ua.s = xa;
+    ub.s = xb;
+
+    float32_input_flush2(&ua.s, &ub.s, s);
+    if (unlikely(!pre(ua, ub))) {
+        goto soft;
+    }
+
+    exact = hard_exact(ua.h, ub.h, &ur.h);
+    if (unlikely(f32_is_inf(ur))) {
+        float_raise(float_flag_overflow, s);
+    } else if (unlikely(fabsf(ur.h) <= FLT_MIN) && post(ua, ub)) {
+        goto soft;
+    }
+    if (!exact) {
+        float_raise(float_flag_inexact, s);
+    }
+    return ur.s;
+
+ soft:
+    return soft(ua.s, ub.s, s);
+}
+
 static inline float32
 float32_gen2(float32 xa, float32 xb, float_status *s,
-             hard_f32_op2_fn hard, soft_f32_op2_fn soft,
-             f32_check_fn pre, f32_check_fn post)
+             hard_f32_op2_fn hard, hard_f32_exact_op2_fn hard_exact,
+             soft_f32_op2_fn soft, f32_check_fn pre, f32_check_fn post)
 {
     union_float32 ua, ub, ur;
 
@@ -350,6 +409,9 @@ float32_gen2(float32 xa, float32 xb, float_status *s,
     ub.s = xb;
 
     if (unlikely(!can_use_fpu(s))) {
+        if (hard_exact && can_use_fpu_exact(s)) {
+            return float32_gen2_exact(xa, xb, s, hard_exact, soft, pre, post);
+        }
         goto soft;
     }
 
@@ -1931,6 +1993,23 @@ static double hard_f64_sub(double a, double b)
     return a - b;
 }
 
+static bool hard_f32_add_exact(float a, float b, float *r)
+{
+    double da = a, db = b;
+    double d = da + db;
+    double bb = d - da;
+    /* TwoSum: the rounding error of the double sum, computed exactly */
+    double err = (da - (d - bb)) + (db - bb);
+
+    *r = d;
+    return err == 0 && *r == d;
+}
+
+static bool hard_f32_sub_exact(float a, float b, float *r)
+{
+    return hard_f32_add_exact(a, -b, r);
+}
+
 static bool f32_addsubmul_post(union_float32 a, union_float32 b)
 {
     if (QEMU_HARDFLOAT_2F32_USE_FP) {
@@ -1949,9 +2028,11 @@ static bool f64_addsubmul_post(union_float64 a, union_float64 b)
 }
 
 static float32 float32_addsub(float32 a, float32 b, float_status *s,
-                              hard_f32_op2_fn hard, soft_f32_op2_fn soft)
+                              hard_f32_op2_fn hard,
+                              hard_f32_exact_op2_fn hard_exact,
+                              soft_f32_op2_fn soft)
 {
-    return float32_gen2(a, b, s, hard, soft,
+    return float32_gen2(a, b, s, hard, hard_exact, soft,
                         f32_is_zon2, f32_addsubmul_post);
 }
 
@@ -1965,13 +2046,15 @@ static float64 float64_addsub(float64 a, float64 b, float_status *s,
 float32 QEMU_FLATTEN
 float32_add(float32 a, float32 b, float_status *s)
 {
-    return float32_addsub(a, b, s, hard_f32_add, soft_f32_add);
+    return float32_addsub(a, b, s, hard_f32_add, hard_f32_add_exact,
+                          soft_f32_add);
 }
 
 float32 QEMU_FLATTEN
 float32_sub(float32 a, float32 b, float_status *s)
 {
-    return float32_addsub(a, b, s, hard_f32_sub, soft_f32_sub);
+    return float32_addsub(a, b, s, hard_f32_sub, hard_f32_sub_exact,
+                          soft_f32_sub);
 }
 
 float64 QEMU_FLATTEN
@@ -2125,11 +2208,20 @@ static double hard_f64_mul(double a, double b)
     return a * b;
 }
 
+static bool hard_f32_mul_exact(float a, float b, float *r)
+{
+    /* The product of two 24-bit significands is exact in double */
+    double d = (double)a * b;
+
+    *r = d;
+    return *r == d;
+}
+
 float32 QEMU_FLATTEN
 float32_mul(float32 a, float32 b, float_status *s)
 {
-    return float32_gen2(a, b, s, hard_f32_mul, soft_f32_mul,
-                        f32_is_zon2, f32_addsubmul_post);
+    return float32_gen2(a, b, s, hard_f32_mul, hard_f32_mul_exact,
+                        soft_f32_mul, f32_is_zon2, f32_addsubmul_post);
 }
 
 float64 QEMU_FLATTEN
@@ -2235,6 +2327,109 @@ soft_f64_muladd(float64 a, float64 b, float64 c, int flags,
 
 static bool force_soft_fma;
 
+/*
+ * a * b + c evaluated in double, see can_use_fpu_exact(). The product is
+ * exact and TwoSum gives the rounding error of the sum. That sum is only
+ * rounded twice when it is inexact; this goes wrong only if it lands
+ * exactly on a float32 midpoint, in which case return false.
+ */
+static bool hard_f32_muladd_exact(float a, float b, float c, float *r,
+                                  bool *exact)
+{
+    union_float64 ud;
+    double p = (double)a * b;
+    double bb, err;
+
+    ud.h = p + c;
+    bb = ud.h - p;
+    err = (p - (ud.h - bb)) + (c - bb);
+    if (err != 0 &&
+        (float64_val(ud.s) & MAKE_64BIT_MASK(0, 29)) == 1ULL << 28) {
+        return false;
+    }
+    *r = ud.h;
+    *exact = err == 0 && *r == ud.h;
+    return true;
+}
+
+/*
+ * float32_muladd() when the inexact flag is clear, see can_use_fpu_exact().
+ * Kept out of line so that the common path stays as tight as before.
+ */
+static float32 QEMU_SOFTFLOAT_ATTR
+float32_muladd_exact(float32 xa, float32 xb, float32 xc, int flags,
+                     float_status *s)
+{
+    union_float32 ua, ub, uc, ur;
+    bool exact = true;
+
+    ua.s = xa;
+    ub.s = xb;
+    uc.s = xc;
+
+    if (unlikely(flags & float_muladd_halve_result)) {
+        goto soft;
+    }
+
+    float32_input_flush3(&ua.s, &ub.s, &uc.s, s);
+    if (unlikely(!f32_is_zon3(ua, ub, uc))) {
+        goto soft;
+    }
+
+    if (unlikely(force_soft_fma)) {
+        goto soft;
+    }
+
+    if (float32_is_zero(ua.s) || float32_is_zero(ub.s)) {
+        union_float32 up;
+        bool prod_sign;
+
+        /* Adding to a zero product is exact */
+        prod_sign = float32_is_neg(ua.s) ^ float32_is_neg(ub.s);
+        prod_sign ^= !!(flags & float_muladd_negate_product);
+        up.s = float32_set_sign(float32_zero, prod_sign);
+
+        if (flags & float_muladd_negate_c) {
+            uc.h = -uc.h;
+        }
+        ur.h = up.h + uc.h;
+    } else {
+        union_float32 ua_orig = ua;
+        union_float32 uc_orig = uc;
+
+        if (flags & float_muladd_negate_product) {
+            ua.h = -ua.h;
+        }
+        if (flags & float_muladd_negate_c) {
+            uc.h = -uc.h;
+        }
+
+        if (!hard_f32_muladd_exact(ua.h, ub.h, uc.h, &ur.h, &exact)) {
+            ua = ua_orig;
+            uc = uc_orig;
+            goto soft;
+        }
+
+        if (unlikely(f32_is_inf(ur))) {
+            float_raise(float_flag_overflow, s);
+        } else if (unlikely(fabsf(ur.h) <= FLT_MIN)) {
+            ua = ua_orig;
+            uc = uc_orig;
+            goto soft;
+        }
+    }
+    if (!exact) {
+        float_raise(float_flag_inexact, s);
+    }
+    if (flags & float_muladd_negate_result) {
+        return float32_chs(ur.s);
+    }
+    return ur.s;
+
+ soft:
+    return soft_f32_muladd(ua.s, ub.s, uc.s, flags, s);
+}
+
 float32 QEMU_FLATTEN
 float32_muladd(float32 xa, float32 xb, float32 xc, int flags, float_status *s)
 {
@@ -2245,6 +2440,9 @@ float32_muladd(float32 xa, float32 xb, float32 xc, int flags, float_status *s)
     uc.s = xc;
 
     if (unlikely(!can_use_fpu(s))) {
+        if (can_use_fpu_exact(s)) {
+            return float32_muladd_exact(xa, xb, xc, flags, s);
+        }
         goto soft;
     }
     if (unlikely(flags & float_muladd_halve_result)) {
@@ -2465,6 +2663,13 @@ static double hard_f64_div(double a, double b)
     return a / b;
 }
 
+static bool hard_f32_div_exact(float a, float b, float *r)
+{
+    *r = (double)a / b;
+    /* Exact iff r * b == a, and that product is exact in double */
+    return (double)*r * b == a;
+}
+
 static bool f32_div_pre(union_float32 a, union_float32 b)
 {
     if (QEMU_HARDFLOAT_2F32_USE_FP) {
@@ -2502,8 +2707,8 @@ static bool f64_div_post(union_float64 a, union_float64 b)
 float32 QEMU_FLATTEN
 float32_div(float32 a, float32 b, float_status *s)
 {
-    return float32_gen2(a, b, s, hard_f32_div, soft_f32_div,
-                        f32_div_pre, f32_div_post);
+    return float32_gen2(a, b, s, hard_f32_div, hard_f32_div_exact,
+                        soft_f32_div, f32_div_pre, f32_div_post);
 }
 
 float64 QEMU_FLATTEN
@@ -3329,9 +3534,33 @@ int16_t float32_to_int16_round_to_zero(float32 a, float_status *s)
     return float32_to_int16_scalbn(a, float_round_to_zero, 0, s);
 }
 
+/*
+ * C casts truncate, so in range zero or normal inputs can use the host.
+ * Truncating to r loses nothing iff r converts back to the input, and it
+ * always does exactly: either the input is integral or |r| < 2^23.
+ */
 int32_t float32_to_int32_round_to_zero(float32 a, float_status *s)
 {
-    return float32_to_int32_scalbn(a, float_round_to_zero, 0, s);
+    union_float32 ua;
+    int32_t r;
+
+    ua.s = a;
+    if (QEMU_NO_HARDFLOAT) {
+        goto soft;
+    }
+    float32_input_flush1(&ua.s, s);
+    if (unlikely(!float32_is_zero_or_normal(ua.s) ||
+                 !(ua.h >= -2147483648.0f && ua.h < 2147483648.0f))) {
+        goto soft;
+    }
+    r = ua.h;
+    if ((float)r != ua.h) {
+        float_raise(float_flag_inexact, s);
+    }
+    return r;
+
+ soft:
+    return float32_to_int32_scalbn(ua.s, float_round_to_zero, 0, s);
 }
 
 int64_t float32_to_int64_round_to_zero(float32 a, float_status *s)
@@ -3688,9 +3917,29 @@ uint16_t float32_to_uint16_round_to_zero(float32 a, float_status *s)
     return float32_to_uint16_scalbn(a, float_round_to_zero, 0, s);
 }
 
+/* See float32_to_int32_round_to_zero() */
 uint32_t float32_to_uint32_round_to_zero(float32 a, float_status *s)
 {
-    return float32_to_uint32_scalbn(a, float_round_to_zero, 0, s);
+    union_float32 ua;
+    uint32_t r;
+
+    ua.s = a;
+    if (QEMU_NO_HARDFLOAT) {
+        goto soft;
+    }
+    float32_input_flush1(&ua.s, s);
+    if (unlikely(!float32_is_zero_or_normal(ua.s) ||
+                 !(ua.h >= 0.0f && ua.h < 4294967296.0f))) {
+        goto soft;
+    }
+    r = ua.h;
+    if ((float)r != ua.h) {
+        float_raise(float_flag_inexact, s);
+    }
+    return r;
+
+ soft:
+    return float32_to_uint32_scalbn(ua.s, float_round_to_zero, 0, s);
 }
 
 uint64_t float32_to_uint64_round_to_zero(float32 a, float_status *s)
@@ -3805,9 +4054,12 @@ float32 int64_to_float32_scalbn(int64_t a, int scale, float_status *status)
     FloatParts64 p;
 
     /* Without scaling, there are no overflow concerns. */
-    if (likely(scale == 0) && can_use_fpu(status)) {
+    if (likely(scale == 0) && can_use_fpu_exact(status)) {
         union_float32 ur;
         ur.h = a;
+        if (!uint64_fits_float32(uabs64(a))) {
+            float_raise(float_flag_inexact, status);
+        }
         return ur.s;
     }
 
@@ -4015,9 +4267,12 @@ float32 uint64_to_float32_scalbn(uint64_t a, int scale, float_status *status)
     FloatParts64 p;
 
     /* Without scaling, there are no overflow concerns. */
-    if (likely(scale == 0) && can_use_fpu(status)) {
+    if (likely(scale == 0) && can_use_fpu_exact(status)) {
         union_float32 ur;
         ur.h = a;
+        if (!uint64_fits_float32(a)) {
+            float_raise(float_flag_inexact, status);
+        }
         return ur.s;
     }
 
@@ -4519,12 +4774,34 @@ soft_f64_sqrt(float64 a, float_status *status)
     return float64_round_pack_canonical(&p, status);
 }
 
+/* float32_sqrt() when the inexact flag is clear, see can_use_fpu_exact() */
+static float32 QEMU_SOFTFLOAT_ATTR float32_sqrt_exact(float32 xa,
+                                                     float_status *s)
+{
+    union_float32 ua, ur;
+
+    ua.s = xa;
+    float32_input_flush1(&ua.s, s);
+    if (unlikely(!float32_is_zero_or_normal(ua.s) ||
+                 float32_is_neg(ua.s))) {
+        return soft_f32_sqrt(ua.s, s);
+    }
+    ur.h = sqrt((double)ua.h);
+    if ((double)ur.h * ur.h != ua.h) {
+        float_raise(float_flag_inexact, s);
+    }
+    return ur.s;
+}
+
 float32 QEMU_FLATTEN float32_sqrt(float32 xa, float_status *s)
 {
     union_float32 ua, ur;
 
     ua.s = xa;
     if (unlikely(!can_use_fpu(s))) {
+        if (can_use_fpu_exact(s)) {
+            return float32_sqrt_exact(xa, s);
+        }
         goto soft;
     }
 
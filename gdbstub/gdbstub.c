@@ -2682,8 +2682,17 @@ static int gdb_handle_packet(const char *line_buf)
 
 void gdb_set_stop_cpu(CPUState *cpu)
 {
-    GDBProcess *p = gdb_get_cpu_process(cpu);
+    GDBProcess *p;
 
+    if (!gdbserver_state.init) {
+        /*
+         * Guest debug breakpoints can be inserted without a gdbstub, e.g.
+         * by the fork server. There is no process to report the stop to.
+         */
+        return;
+    }
+
+    p = gdb_get_cpu_process(cpu);
     if (!p->attached) {
         /*
          * Having a stop CPU corresponding to a process that is not attached
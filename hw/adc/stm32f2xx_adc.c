@@ -24,6 +24,7 @@
 
 #include "qemu/osdep.h"
 #include "hw/sysbus.h"
+#include "hw/irq.h"
 #include "migration/vmstate.h"
 #include "qemu/log.h"
 #include "qemu/module.h"
@@ -41,6 +42,13 @@
 
 #define DB_PRINT(fmt, args...) DB_PRINT_L(1, fmt, ## args)
 
+static void stm32f2xx_adc_update_dma(STM32F2XXADCState *s)
+{
+    qemu_set_irq(s->dma_request, (s->adc_cr2 & ADC_CR2_ADON) &&
+                                 (s->adc_cr2 & ADC_CR2_DMA) &&
+                                 (s->adc_cr2 & ADC_CR2_SWSTART));
+}
+
 static void stm32f2xx_adc_reset(DeviceState *dev)
 {
     STM32F2XXADCState *s = STM32F2XX_ADC(dev);
@@ -65,6 +73,8 @@ static void stm32f2xx_adc_reset(DeviceState *dev)
     s->adc_jdr[2] = 0x00000000;
     s->adc_jdr[3] = 0x00000000;
     s->adc_dr = 0x00000000;
+
+    stm32f2xx_adc_update_dma(s);
 }
 
 static uint32_t stm32f2xx_adc_generate_value(STM32F2XXADCState *s)
@@ -155,6 +165,7 @@ static uint64_t stm32f2xx_adc_read(void *opaque, hwaddr addr,
     case ADC_DR:
         if ((s->adc_cr2 & ADC_CR2_ADON) && (s->adc_cr2 & ADC_CR2_SWSTART)) {
             s->adc_cr2 ^= ADC_CR2_SWSTART;
+            stm32f2xx_adc_update_dma(s);
             return stm32f2xx_adc_generate_value(s);
         } else {
             return 0;
@@ -190,6 +201,7 @@ static void stm32f2xx_adc_write(void *opaque, hwaddr addr,
         break;
     case ADC_CR2:
         s->adc_cr2 = value;
+        stm32f2xx_adc_update_dma(s);
         break;
     case ADC_SMPR1:
         s->adc_smpr1 = value;
@@ -278,6 +290,7 @@ static void stm32f2xx_adc_init(Object *obj)
     STM32F2XXADCState *s = STM32F2XX_ADC(obj);
 
     sysbus_init_irq(SYS_BUS_DEVICE(obj), &s->irq);
+    qdev_init_gpio_out_named(DEVICE(obj), &s->dma_request, "dma-request", 1);
 
     memory_region_init_io(&s->mmio, obj, &stm32f2xx_adc_ops, s,
                           TYPE_STM32F2XX_ADC, 0x100);
@@ -20,8 +20,10 @@
 #include "qemu/error-report.h"
 #include "qemu/module.h"
 #include "qemu/log.h"
+#include "qemu/rcu.h"
 #include "target/arm/idau.h"
 #include "migration/vmstate.h"
+#include "sysemu/cpu-timers.h"
 
 /* Bitbanded IO.  Each word corresponds to a single bit.  */
 
@@ -31,6 +33,27 @@ static inline hwaddr bitband_addr(BitBandState *s, hwaddr offset)
     return s->base | (offset & 0x1ffffff) >> 5;
 }
 
+/*
+ * Return a host pointer to the byte holding the bit of a bitband access if
+ * it is backed by RAM, or NULL if it must go through the source address
+ * space. Whatever the access size, the bit lives in that single byte, so
+ * RAM targets need neither a full-width read nor a read-modify-write
+ * dispatch. Must be called within an RCU critical section.
+ */
+static uint8_t *bitband_ram_ptr(BitBandState *s, hwaddr offset, bool is_write,
+                                MemTxAttrs attrs, MemoryRegion **mr,
+                                hwaddr *xlat)
+{
+    hwaddr len = 1;
+
+    *mr = address_space_translate(&s->source_as, bitband_addr(s, offset),
+                                  xlat, &len, is_write, attrs);
+    if (!memory_access_is_direct(*mr, is_write)) {
+        return NULL;
+    }
+    return qemu_map_ram_ptr((*mr)->ram_block, *xlat);
+}
+
 static MemTxResult bitband_read(void *opaque, hwaddr offset,
                                 uint64_t *data, unsigned size, MemTxAttrs attrs)
 {
@@ -39,9 +62,19 @@ static MemTxResult bitband_read(void *opaque, hwaddr offset,
     MemTxResult res;
     int bitpos, bit;
     hwaddr addr;
+    uint8_t *ptr;
+    MemoryRegion *mr;
+    hwaddr xlat;
 
     assert(size <= 4);
 
+    RCU_READ_LOCK_GUARD();
+    ptr = bitband_ram_ptr(s, offset, false, attrs, &mr, &xlat);
+    if (ptr) {
+        *data = (qatomic_read(ptr) >> ((offset >> 2) & 7)) & 1;
+        return MEMTX_OK;
+    }
+
     /* Find address in underlying memory and round down to multiple of size */
     addr = bitband_addr(s, offset) & (-size);
     res = address_space_read(&s->source_as, addr, attrs, buf, size);
@@ -64,9 +97,25 @@ static MemTxResult bitband_write(void *opaque, hwaddr offset, uint64_t value,
     MemTxResult res;
     int bitpos, bit;
     hwaddr addr;
+    uint8_t *ptr;
+    MemoryRegion *mr;
+    hwaddr xlat;
 
     assert(size <= 4);
 
+    RCU_READ_LOCK_GUARD();
+    ptr = bitband_ram_ptr(s, offset, true, attrs, &mr, &xlat);
+    if (ptr) {
+        bit = 1 << ((offset >> 2) & 7);
+        if (value & 1) {
+            qatomic_or(ptr, bit);
+        } else {
+            qatomic_and(ptr, (uint8_t)~bit);
+        }
+        memory_region_flush_ram(mr, xlat, 1);
+        return MEMTX_OK;
+    }
+
     /* Find address in underlying memory and round down to multiple of size */
     addr = bitband_addr(s, offset) & (-size);
     res = address_space_read(&s->source_as, addr, attrs, buf, size);
@@ -243,6 +292,19 @@ static const MemoryRegionOps ppb_default_ops = {
     .valid.max_access_size = 8,
 };
 
+static void armv7m_cpuclk_update(void *opaque, ClockEvent event)
+{
+    ARMv7MState *s = opaque;
+
+    /*
+     * With -icount cycles=on, time runs at the CPU clock. The rate is
+     * global, so with several CPUs the last one to change it wins.
+     */
+    if (icount_cycles && clock_is_enabled(s->cpuclk)) {
+        icount_set_cycle_hz(clock_get_hz(s->cpuclk));
+    }
+}
+
 static void armv7m_instance_init(Object *obj)
 {
     ARMv7MState *s = ARMV7M(obj);
@@ -269,7 +331,8 @@ static void armv7m_instance_init(Object *obj)
     }
 
     s->refclk = qdev_init_clock_in(DEVICE(obj), "refclk", NULL, NULL, 0);
-    s->cpuclk = qdev_init_clock_in(DEVICE(obj), "cpuclk", NULL, NULL, 0);
+    s->cpuclk = qdev_init_clock_in(DEVICE(obj), "cpuclk",
+                                   armv7m_cpuclk_update, s, ClockUpdate);
 }
 
 static void armv7m_realize(DeviceState *dev, Error **errp)
@@ -289,6 +352,7 @@ static void armv7m_realize(DeviceState *dev, Error **errp)
         error_setg(errp, "armv7m: cpuclk must be connected");
         return;
     }
+    armv7m_cpuclk_update(s, ClockUpdate);
 
     memory_region_add_subregion_overlap(&s->container, 0, s->board_memory, -1);
 
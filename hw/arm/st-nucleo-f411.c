@@ -24,39 +24,510 @@
 
 #include "qemu/osdep.h"
 #include "qapi/error.h"
+#include "qapi/visitor.h"
 #include "hw/boards.h"
 #include "hw/qdev-properties.h"
+#include "hw/qdev-properties-system.h"
 #include "hw/qdev-clock.h"
+#include "exec/address-spaces.h"
 #include "qemu/error-report.h"
+#include "crypto/hash.h"
+#include "sysemu/reset.h"
+#include "sysemu/runstate.h"
+#include "sysemu/sysemu.h"
+#include "sysemu/fork-server.h"
+#include "qemu/cutils.h"
+#include "qemu/config-file.h"
+#include "qemu/option.h"
+#include "hw/loader.h"
 #include "hw/arm/stm32f411_soc.h"
 #include "hw/arm/boot.h"
 
-/* Main SYSCLK frequency in Hz (100MHz) */
-#define SYSCLK_FRQ 100000000ULL
+/* HSE frequency in Hz, the 8MHz MCO output of the on-board ST-LINK */
+#define HSE_FRQ 8000000ULL
+
+/* Each board is a full SoC with one CPU, selected with -smp */
+#define ST_NUCLEO_F411_MAX_BOARDS 32
+
+struct NucleoF411MachineState
+{
+    MachineState parent_obj;
+
+    char *flash_file;
+    char *warm_boot_cache;
+    char *fork_server_fd;
+    bool has_fork_server_pc;
+    uint32_t fork_server_pc;
+    bool has_watchdog_exit_code;
+    uint8_t watchdog_exit_code;
+
+    STM32F411State *soc[ST_NUCLEO_F411_MAX_BOARDS];
+    MemoryRegion board_memory[ST_NUCLEO_F411_MAX_BOARDS];
+    char *warm_boot_flash;
+    char *warm_boot_sram;
+    bool warm_boot_save;
+};
+
+#define TYPE_ST_NUCLEO_F411_MACHINE MACHINE_TYPE_NAME("st-nucleo-f411")
+
+OBJECT_DECLARE_SIMPLE_TYPE(NucleoF411MachineState, ST_NUCLEO_F411_MACHINE)
+
+static bool st_nucleo_f411_warm_boot_valid(const char *path, off_t size)
+{
+    struct stat st;
+
+    return stat(path, &st) == 0 && st.st_size == size;
+}
+
+static int st_nucleo_f411_warm_boot_add_opt(void *opaque, const char *name,
+                                            const char *value, Error **errp)
+{
+    g_string_append_printf(opaque, ",%s=%s", name, value);
+    return 0;
+}
+
+static gint st_nucleo_f411_warm_boot_cmp(gconstpointer a, gconstpointer b)
+{
+    return strcmp(*(const char *const *)a, *(const char *const *)b);
+}
+
+static int st_nucleo_f411_warm_boot_add_opts(void *opaque, QemuOpts *opts,
+                                             Error **errp)
+{
+    g_string_append_printf(opaque, "\n%s", qemu_opts_id(opts) ?: "");
+    return qemu_opt_foreach(opts, st_nucleo_f411_warm_boot_add_opt, opaque,
+                            errp);
+}
+
+/*
+ * Describe everything besides the firmware that the cached images depend
+ * on: the QEMU build, the scalar machine properties, and the -global and
+ * -device options, which may change devices or load extra data into
+ * memory. Properties that only matter once the guest runs are left out.
+ */
+static char *st_nucleo_f411_warm_boot_config(MachineState *machine)
+{
+    static const char *const ignored[] = {
+        "kernel", "warm-boot-cache", "fork-server-fd", "fork-server-pc",
+    };
+    GString *config = g_string_new(NULL);
+    g_autofree char *build_id = qemu_get_build_id();
+    g_autoptr(GPtrArray) props = g_ptr_array_new_with_free_func(g_free);
+    ObjectPropertyIterator iter;
+    ObjectProperty *prop;
+    const char *group;
+    unsigned int i;
+
+    g_string_append_printf(config, "%s\n%s", build_id,
+                           object_get_typename(OBJECT(machine)));
+
+    object_property_iter_init(&iter, OBJECT(machine));
+    while ((prop = object_property_iter_next(&iter)))
+    {
+        g_autofree char *value = NULL;
+        bool skip = !prop->get ||
+                    !(g_str_equal(prop->type, "string") ||
+                      g_str_equal(prop->type, "str") ||
+                      g_str_equal(prop->type, "bool") ||
+                      g_str_equal(prop->type, "size") ||
+                      g_str_has_prefix(prop->type, "int") ||
+                      g_str_has_prefix(prop->type, "uint"));
+
+        for (i = 0; i < ARRAY_SIZE(ignored) && !skip; i++)
+        {
+            skip = g_str_equal(prop->name, ignored[i]);
+        }
+        if (skip)
+        {
+            continue;
+        }
+        value = object_property_print(OBJECT(machine), prop->name, false,
+                                      NULL);
+        g_ptr_array_add(props, g_strdup_printf("%s=%s", prop->name,
+                                               value ?: ""));
+    }
+
+    /* Properties are iterated in hash table order, sort them by name */
+    g_ptr_array_sort(props, st_nucleo_f411_warm_boot_cmp);
+    for (i = 0; i < props->len; i++)
+    {
+        g_string_append_printf(config, "\n%s",
+                               (char *)g_ptr_array_index(props, i));
+    }
+
+    for (i = 0; i < 2; i++)
+    {
+        QemuOptsList *list;
+
+        group = i ? "device" : "global";
+        list = qemu_find_opts_err(group, NULL);
+        if (list)
+        {
+            g_string_append_printf(config, "\n-%s", group);
+            qemu_opts_foreach(list, st_nucleo_f411_warm_boot_add_opts,
+                              config, NULL);
+        }
+    }
+
+    return g_string_free(config, false);
+}
+
+/*
+ * Look the firmware up in the warm boot cache. The key is the hash of the
+ * firmware file and of the build and machine configuration, so a rebuilt
+ * image, a rebuilt QEMU or a different command line never hits a stale
+ * entry.
+ *
+ * Returns true on a cache hit, in which case the flash and SRAM images can
+ * be used as they are instead of loading the firmware.
+ */
+static bool st_nucleo_f411_warm_boot_lookup(NucleoF411MachineState *nms,
+                                            const char *kernel_filename)
+{
+    g_autofree char *config = NULL;
+    g_autofree char *contents = NULL;
+    g_autofree char *digest = NULL;
+    g_autoptr(GError) gerr = NULL;
+    struct iovec iov[2];
+    gsize length;
+
+    if (g_mkdir_with_parents(nms->warm_boot_cache, 0755) < 0)
+    {
+        error_report("could not create warm boot cache directory '%s': %s",
+                     nms->warm_boot_cache, strerror(errno));
+        exit(1);
+    }
+
+    if (!g_file_get_contents(kernel_filename, &contents, &length, &gerr))
+    {
+        error_report("could not read kernel '%s': %s",
+                     kernel_filename, gerr->message);
+        exit(1);
+    }
+    config = st_nucleo_f411_warm_boot_config(MACHINE(nms));
+    iov[0].iov_base = config;
+    iov[0].iov_len = strlen(config) + 1;
+    iov[1].iov_base = contents;
+    iov[1].iov_len = length;
+    qcrypto_hash_digestv(QCRYPTO_HASH_ALG_SHA256, iov, ARRAY_SIZE(iov),
+                         &digest, &error_fatal);
+
+    nms->warm_boot_flash = g_strdup_printf("%s/%s.flash",
+                                           nms->warm_boot_cache, digest);
+    nms->warm_boot_sram = g_strdup_printf("%s/%s.sram",
+                                          nms->warm_boot_cache, digest);
+
+    return st_nucleo_f411_warm_boot_valid(nms->warm_boot_flash, FLASH_SIZE) &&
+           st_nucleo_f411_warm_boot_valid(nms->warm_boot_sram, SRAM_SIZE);
+}
+
+static void st_nucleo_f411_warm_boot_write(const char *path, MemoryRegion *mr)
+{
+    g_autoptr(GError) gerr = NULL;
+
+    /*
+     * g_file_set_contents() renames a temporary file into place, so
+     * concurrent instances never map a partially written image.
+     */
+    if (!g_file_set_contents(path, memory_region_get_ram_ptr(mr),
+                             memory_region_size(mr), &gerr))
+    {
+        warn_report("could not write warm boot image '%s': %s",
+                    path, gerr->message);
+    }
+}
+
+/*
+ * Right after the first reset, flash and SRAM hold the post-reset state:
+ * the loader has copied the firmware in and nothing has executed yet.
+ * This is also before the main loop runs, so neither the monitor nor a
+ * debugger (even with -S), nor -loadvm or -incoming, has touched them.
+ * Snapshot them so that later runs can skip loading.
+ */
+static void st_nucleo_f411_reset(MachineState *machine, ShutdownCause reason)
+{
+    NucleoF411MachineState *nms = ST_NUCLEO_F411_MACHINE(machine);
+
+    qemu_devices_reset(reason);
+
+    if (nms->warm_boot_save)
+    {
+        nms->warm_boot_save = false;
+        /* The firmware is only loaded into the first board */
+        st_nucleo_f411_warm_boot_write(nms->warm_boot_sram,
+                                       &nms->soc[0]->sram);
+        st_nucleo_f411_warm_boot_write(nms->warm_boot_flash,
+                                       &nms->soc[0]->flash);
+    }
+}
 
 static void st_nucleo_f411_init(MachineState *machine)
 {
+    NucleoF411MachineState *nms = ST_NUCLEO_F411_MACHINE(machine);
+    const char *kernel_filename = machine->kernel_filename;
+    bool warm_boot = false;
     DeviceState *dev;
-    Clock *sysclk;
+    Clock *hse;
+    unsigned int i, j;
+
+    /*
+     * A mapped flash image already holds the firmware, loading a kernel on
+     * top of it would write into the shared read-only mapping.
+     */
+    if (nms->flash_file && kernel_filename)
+    {
+        error_report("-kernel and flash-file can not be used together");
+        exit(1);
+    }
+
+    if (nms->warm_boot_cache)
+    {
+        if (!kernel_filename)
+        {
+            error_report("warm-boot-cache requires -kernel");
+            exit(1);
+        }
+        warm_boot = st_nucleo_f411_warm_boot_lookup(nms, kernel_filename);
+    }
 
     /* This clock doesn't need migration because it is fixed-frequency */
-    sysclk = clock_new(OBJECT(machine), "SYSCLK");
-    clock_set_hz(sysclk, SYSCLK_FRQ);
+    hse = clock_new(OBJECT(machine), "HSE");
+    clock_set_hz(hse, HSE_FRQ);
+
+    /*
+     * Extra boards get their own address space and serial ports, but map
+     * the flash of the first one: they run the same firmware, so they also
+     * share its translated code.
+     */
+    for (i = 0; i < machine->smp.cpus; i++)
+    {
+        MemoryRegion *memory = get_system_memory();
+        g_autofree char *name = NULL;
+
+        if (i > 0)
+        {
+            name = g_strdup_printf("board[%u]", i);
+            memory = &nms->board_memory[i];
+            memory_region_init(memory, OBJECT(machine), name, UINT64_MAX);
+        }
+
+        dev = qdev_new(TYPE_STM32F411_SOC);
+        object_property_add_child(OBJECT(machine), "soc[*]", OBJECT(dev));
+        qdev_prop_set_string(dev, "cpu-type", ARM_CPU_TYPE_NAME("cortex-m4"));
+        qdev_prop_set_uint32(dev, "index", i);
+        object_property_set_link(OBJECT(dev), "memory", OBJECT(memory),
+                                 &error_fatal);
+        if (i > 0)
+        {
+            object_property_set_link(OBJECT(dev), "flash-source",
+                                     OBJECT(&nms->soc[0]->flash),
+                                     &error_fatal);
+        }
+        else if (nms->flash_file)
+        {
+            qdev_prop_set_string(dev, "flash-file", nms->flash_file);
+        }
+        if (warm_boot && i == 0)
+        {
+            /*
+             * Device and CPU state after reset only depend on the memory
+             * images, which are mapped rather than copied in. The SoC
+             * brings the SRAM image back on every reset.
+             */
+            qdev_prop_set_string(dev, "flash-file", nms->warm_boot_flash);
+            qdev_prop_set_string(dev, "sram-file", nms->warm_boot_sram);
+        }
+        for (j = 0; j < STM_NUM_USARTS; j++)
+        {
+            g_free(name);
+            name = g_strdup_printf("serial%u", j);
+            qdev_prop_set_chr(dev, name, serial_hd(i * STM_NUM_USARTS + j));
+        }
+        if (nms->has_watchdog_exit_code)
+        {
+            qdev_prop_set_int32(dev, "watchdog-exit-code",
+                                nms->watchdog_exit_code);
+        }
+        qdev_connect_clock_in(dev, "hse", hse);
+        sysbus_realize_and_unref(SYS_BUS_DEVICE(dev), &error_fatal);
+        nms->soc[i] = STM32F411_SOC(dev);
+
+        /*
+         * The firmware only needs loading once into the shared flash, the
+         * other boards just need their CPU reset hooked up.
+         */
+        armv7m_load_kernel(ARM_CPU(nms->soc[i]->armv7m.cpu),
+                           (i == 0 && !warm_boot) ? kernel_filename : NULL,
+                           0, FLASH_SIZE);
+    }
+
+    nms->warm_boot_save = nms->warm_boot_cache && !warm_boot;
+
+    if (nms->fork_server_fd)
+    {
+        /*
+         * No monitor is current at machine init, so monitor fd names
+         * cannot be resolved here: only inherited fd numbers are accepted.
+         */
+        int fd = qemu_parse_fd(nms->fork_server_fd);
+
+        if (fd < 0)
+        {
+            error_report("fork-server-fd must be a file descriptor number");
+            exit(1);
+        }
+        fork_server_init(fd, nms->has_fork_server_pc, nms->fork_server_pc,
+                         &error_fatal);
+    }
+    else if (nms->has_fork_server_pc)
+    {
+        error_report("fork-server-pc requires fork-server-fd");
+        exit(1);
+    }
+}
+
+static char *st_nucleo_f411_get_flash_file(Object *obj, Error **errp)
+{
+    NucleoF411MachineState *nms = ST_NUCLEO_F411_MACHINE(obj);
+
+    return g_strdup(nms->flash_file);
+}
 
-    dev = qdev_new(TYPE_STM32F411_SOC);
-    qdev_prop_set_string(dev, "cpu-type", ARM_CPU_TYPE_NAME("cortex-m4"));
-    qdev_connect_clock_in(dev, "sysclk", sysclk);
-    sysbus_realize_and_unref(SYS_BUS_DEVICE(dev), &error_fatal);
+static void st_nucleo_f411_set_flash_file(Object *obj, const char *value,
+                                          Error **errp)
+{
+    NucleoF411MachineState *nms = ST_NUCLEO_F411_MACHINE(obj);
+
+    g_free(nms->flash_file);
+    nms->flash_file = g_strdup(value);
+}
+
+static char *st_nucleo_f411_get_warm_boot_cache(Object *obj, Error **errp)
+{
+    NucleoF411MachineState *nms = ST_NUCLEO_F411_MACHINE(obj);
+
+    return g_strdup(nms->warm_boot_cache);
+}
+
+static void st_nucleo_f411_set_warm_boot_cache(Object *obj, const char *value,
+                                               Error **errp)
+{
+    NucleoF411MachineState *nms = ST_NUCLEO_F411_MACHINE(obj);
+
+    g_free(nms->warm_boot_cache);
+    nms->warm_boot_cache = g_strdup(value);
+}
+
+static char *st_nucleo_f411_get_fork_server_fd(Object *obj, Error **errp)
+{
+    NucleoF411MachineState *nms = ST_NUCLEO_F411_MACHINE(obj);
 
-    armv7m_load_kernel(ARM_CPU(first_cpu),
-                       machine->kernel_filename,
-                       0, FLASH_SIZE);
+    return g_strdup(nms->fork_server_fd);
 }
 
-static void st_nucleo_f411_machine_init(MachineClass *mc)
+static void st_nucleo_f411_set_fork_server_fd(Object *obj, const char *value,
+                                              Error **errp)
 {
+    NucleoF411MachineState *nms = ST_NUCLEO_F411_MACHINE(obj);
+
+    g_free(nms->fork_server_fd);
+    nms->fork_server_fd = g_strdup(value);
+}
+
+static void st_nucleo_f411_get_fork_server_pc(Object *obj, Visitor *v,
+                                              const char *name, void *opaque,
+                                              Error **errp)
+{
+    NucleoF411MachineState *nms = ST_NUCLEO_F411_MACHINE(obj);
+
+    visit_type_uint32(v, name, &nms->fork_server_pc, errp);
+}
+
+static void st_nucleo_f411_set_fork_server_pc(Object *obj, Visitor *v,
+                                              const char *name, void *opaque,
+                                              Error **errp)
+{
+    NucleoF411MachineState *nms = ST_NUCLEO_F411_MACHINE(obj);
+
+    if (visit_type_uint32(v, name, &nms->fork_server_pc, errp))
+    {
+        nms->has_fork_server_pc = true;
+    }
+}
+
+static void st_nucleo_f411_get_watchdog_exit_code(Object *obj, Visitor *v,
+                                                  const char *name,
+                                                  void *opaque, Error **errp)
+{
+    NucleoF411MachineState *nms = ST_NUCLEO_F411_MACHINE(obj);
+
+    visit_type_uint8(v, name, &nms->watchdog_exit_code, errp);
+}
+
+static void st_nucleo_f411_set_watchdog_exit_code(Object *obj, Visitor *v,
+                                                  const char *name,
+                                                  void *opaque, Error **errp)
+{
+    NucleoF411MachineState *nms = ST_NUCLEO_F411_MACHINE(obj);
+
+    if (visit_type_uint8(v, name, &nms->watchdog_exit_code, errp))
+    {
+        nms->has_watchdog_exit_code = true;
+    }
+}
+
+static void st_nucleo_f411_machine_class_init(ObjectClass *oc, void *data)
+{
+    MachineClass *mc = MACHINE_CLASS(oc);
+
     mc->desc = "ST Nucleo F411 Machine (Cortex-M4)";
     mc->init = st_nucleo_f411_init;
+    mc->reset = st_nucleo_f411_reset;
+    mc->default_cpus = 1;
+    mc->max_cpus = ST_NUCLEO_F411_MAX_BOARDS;
+
+    object_class_property_add_str(oc, "flash-file",
+                                  st_nucleo_f411_get_flash_file,
+                                  st_nucleo_f411_set_flash_file);
+    object_class_property_set_description(oc, "flash-file",
+        "Raw flash image mapped copy-on-write as the on-chip flash");
+    object_class_property_add_str(oc, "warm-boot-cache",
+                                  st_nucleo_f411_get_warm_boot_cache,
+                                  st_nucleo_f411_set_warm_boot_cache);
+    object_class_property_set_description(oc, "warm-boot-cache",
+        "Directory caching the post-reset memory images of -kernel firmware");
+    object_class_property_add_str(oc, "fork-server-fd",
+                                  st_nucleo_f411_get_fork_server_fd,
+                                  st_nucleo_f411_set_fork_server_fd);
+    object_class_property_set_description(oc, "fork-server-fd",
+        "Control fd number, inherited from the parent process, of the fork "
+        "server, which forks a child resuming the guest for every request "
+        "once the machine first stops");
+    object_class_property_add(oc, "fork-server-pc", "uint32",
+                              st_nucleo_f411_get_fork_server_pc,
+                              st_nucleo_f411_set_fork_server_pc,
+                              NULL, NULL);
+    object_class_property_set_description(oc, "fork-server-pc",
+        "Guest address at which the fork server stops the machine");
+    object_class_property_add(oc, "watchdog-exit-code", "uint8",
+                              st_nucleo_f411_get_watchdog_exit_code,
+                              st_nucleo_f411_set_watchdog_exit_code,
+                              NULL, NULL);
+    object_class_property_set_description(oc, "watchdog-exit-code",
+        "Exit with this status and dump the CPU state when a watchdog "
+        "resets the chip, instead of performing the -action watchdog");
+}
+
+static const TypeInfo st_nucleo_f411_info = {
+    .name = TYPE_ST_NUCLEO_F411_MACHINE,
+    .parent = TYPE_MACHINE,
+    .instance_size = sizeof(NucleoF411MachineState),
+    .class_init = st_nucleo_f411_machine_class_init,
+};
+
+static void st_nucleo_f411_machine_init(void)
+{
+    type_register_static(&st_nucleo_f411_info);
 }
 
-DEFINE_MACHINE("st-nucleo-f411", st_nucleo_f411_machine_init)
+type_init(st_nucleo_f411_machine_init)
@@ -26,11 +26,16 @@
 
 #include "qemu/osdep.h"
 #include "qapi/error.h"
+#include "qemu/error-report.h"
 #include "exec/address-spaces.h"
-#include "sysemu/sysemu.h"
 #include "hw/arm/stm32f411_soc.h"
+#include "hw/core/cpu.h"
 #include "hw/qdev-clock.h"
+#include "hw/qdev-properties.h"
 #include "hw/misc/unimp.h"
+#include "migration/vmstate.h"
+#include "sysemu/reset.h"
+#include "sysemu/watchdog.h"
 
 #define RCC_ADDR 0x40023800
 #define SYSCFG_ADDR 0x40013800
@@ -58,7 +63,46 @@ static const uint32_t spi_addr[] = {
     0x40013400, // SPI4
     0x40015000, // SPI5
 };
+static const uint32_t dma_addr[] = {
+    0x40026000, // DMA1
+    0x40026400, // DMA2
+};
+static const uint32_t gpio_addr[] = {
+    0x40020000, // GPIOA
+    0x40020400, // GPIOB
+    0x40020800, // GPIOC
+    0x40020C00, // GPIOD
+    0x40021000, // GPIOE
+    0x40021400, // GPIOF
+    0x40021800, // GPIOG
+    0x40021C00, // GPIOH
+};
 #define EXTI_ADDR 0x40013C00
+#define IWDG_ADDR 0x40003000
+#define WWDG_ADDR 0x40002C00
+
+/* Clock and reset lines of the peripherals in the RCC, same order as above */
+static const STM32F4xxRccPeriph usart_rcc[] = {
+    STM32F4XX_RCC_USART1,
+    STM32F4XX_RCC_USART2,
+    STM32F4XX_RCC_USART6,
+};
+static const STM32F4xxRccPeriph timer_rcc[] = {
+    STM32F4XX_RCC_TIM2,
+    STM32F4XX_RCC_TIM3,
+    STM32F4XX_RCC_TIM4,
+    STM32F4XX_RCC_TIM5,
+};
+static const STM32F4xxRccPeriph adc_rcc[] = {
+    STM32F4XX_RCC_ADC1,
+};
+static const STM32F4xxRccPeriph spi_rcc[] = {
+    STM32F4XX_RCC_SPI2,
+    STM32F4XX_RCC_SPI3,
+    STM32F4XX_RCC_SPI1,
+    STM32F4XX_RCC_SPI4,
+    STM32F4XX_RCC_SPI5,
+};
 
 #define RCC_IRQ 5
 #define SYSCFG_IRQ 71
@@ -75,13 +119,18 @@ static const int timer_irq[] = {
     50, // TIM5
 };
 #define ADC_IRQ 18
+#define WWDG_IRQ 0
 static const int spi_irq[] = {
-    35, // SPI1
     36, // SPI2
     51, // SPI3
+    35, // SPI1
     84, // SPI4
     85, // SPI5
 };
+static const int dma_irq[STM_NUM_DMAS][STM32F4XX_DMA_NUM_STREAMS] = {
+    { 11, 12, 13, 14, 15, 16, 17, 47 }, // DMA1_Stream0..7
+    { 56, 57, 58, 59, 60, 68, 69, 70 }, // DMA2_Stream0..7
+};
 static const int exti_irq[] = {
     6,  // EXTI0
     7,  // EXTI1
@@ -101,9 +150,181 @@ static const int exti_irq[] = {
     40, // EXTI15_10
 };
 
+/* DMA request sources of the peripherals, same order as above */
+static const STM32F411DmaRequest usart_dma[] = {
+    STM32F411_DMA_USART1_RX,
+    STM32F411_DMA_USART2_RX,
+    STM32F411_DMA_USART6_RX,
+};
+static const STM32F411DmaRequest spi_dma[] = {
+    STM32F411_DMA_SPI2_RX,
+    STM32F411_DMA_SPI3_RX,
+    STM32F411_DMA_SPI1_RX,
+    STM32F411_DMA_SPI4_RX,
+    STM32F411_DMA_SPI5_RX,
+};
+static const STM32F411DmaRequest timer_dma[] = {
+    STM32F411_DMA_TIM2_UP,
+    STM32F411_DMA_TIM3_UP,
+    STM32F411_DMA_TIM4_UP,
+    STM32F411_DMA_TIM5_UP,
+};
+
+typedef struct
+{
+    uint8_t dma; /* 1 or 2, 0 if there is no route */
+    uint8_t stream;
+    uint8_t channel;
+} STM32F411DmaRoute;
+
+/* DMA streams and channels the requests are mapped to (RM0383 tables 27-28) */
+static const STM32F411DmaRoute
+dma_routes[STM32F411_DMA_REQUEST_COUNT][STM32F411_DMA_MAX_ROUTES] = {
+    [STM32F411_DMA_USART1_RX] = { { 2, 2, 4 }, { 2, 5, 4 } },
+    [STM32F411_DMA_USART1_TX] = { { 2, 7, 4 } },
+    [STM32F411_DMA_USART2_RX] = { { 1, 5, 4 } },
+    [STM32F411_DMA_USART2_TX] = { { 1, 6, 4 } },
+    [STM32F411_DMA_USART6_RX] = { { 2, 1, 5 }, { 2, 2, 5 } },
+    [STM32F411_DMA_USART6_TX] = { { 2, 6, 5 }, { 2, 7, 5 } },
+    [STM32F411_DMA_SPI1_RX] = { { 2, 0, 3 }, { 2, 2, 3 } },
+    [STM32F411_DMA_SPI1_TX] = { { 2, 3, 3 }, { 2, 5, 3 } },
+    [STM32F411_DMA_SPI2_RX] = { { 1, 3, 0 } },
+    [STM32F411_DMA_SPI2_TX] = { { 1, 4, 0 } },
+    [STM32F411_DMA_SPI3_RX] = { { 1, 0, 0 }, { 1, 2, 0 } },
+    [STM32F411_DMA_SPI3_TX] = { { 1, 5, 0 }, { 1, 7, 0 } },
+    [STM32F411_DMA_SPI4_RX] = { { 2, 0, 4 }, { 2, 3, 5 } },
+    [STM32F411_DMA_SPI4_TX] = { { 2, 1, 4 }, { 2, 4, 5 } },
+    [STM32F411_DMA_SPI5_RX] = { { 2, 3, 2 }, { 2, 5, 7 } },
+    [STM32F411_DMA_SPI5_TX] = { { 2, 4, 2 }, { 2, 6, 7 } },
+    [STM32F411_DMA_ADC1] = { { 2, 0, 0 }, { 2, 4, 0 } },
+    [STM32F411_DMA_TIM2_UP] = { { 1, 1, 3 }, { 1, 7, 3 } },
+    [STM32F411_DMA_TIM3_UP] = { { 1, 2, 5 } },
+    [STM32F411_DMA_TIM4_UP] = { { 1, 6, 2 } },
+    [STM32F411_DMA_TIM5_UP] = { { 1, 0, 6 }, { 1, 6, 6 } },
+};
+
+/* Forward a DMA request to every stream it is mapped to */
+static void stm32f411_soc_dma_request(void *opaque, int n, int level)
+{
+    STM32F411State *s = STM32F411_SOC(opaque);
+    int i;
+
+    for (i = 0; i < STM32F411_DMA_MAX_ROUTES; i++)
+    {
+        qemu_set_irq(s->dma_route[n][i], level);
+    }
+}
+
+/* Forward the acknowledgement of a DMA stream to the requesting peripheral */
+static void stm32f411_soc_dma_ack(void *opaque, int n, int level)
+{
+    STM32F411State *s = STM32F411_SOC(opaque);
+
+    qemu_set_irq(s->dma_ack[n], level);
+}
+
+/* Connect a DMA request output of a peripheral to the router */
+static void stm32f411_soc_connect_dma(STM32F411State *s, DeviceState *dev,
+                                      int n, STM32F411DmaRequest request)
+{
+    qdev_connect_gpio_out_named(dev, "dma-request", n,
+                                qdev_get_gpio_in_named(DEVICE(s),
+                                                       "dma-request",
+                                                       request));
+}
+
+/* Deliver the DMA acknowledgements of a request to a peripheral */
+static void stm32f411_soc_connect_dma_ack(STM32F411State *s, DeviceState *dev,
+                                          int n, STM32F411DmaRequest request)
+{
+    s->dma_ack[request] = qdev_get_gpio_in_named(dev, "dma-ack", n);
+}
+
+/* Hold a peripheral in reset while its bit is set in RCC_APBxRSTR */
+static void stm32f411_soc_periph_reset(void *opaque, int n, int level)
+{
+    STM32F411State *s = STM32F411_SOC(opaque);
+    DeviceState *dev = s->rcc_periph[n];
+
+    if (!dev)
+    {
+        return;
+    }
+    if (level)
+    {
+        resettable_assert_reset(OBJECT(dev), RESET_TYPE_COLD);
+    }
+    else
+    {
+        resettable_release_reset(OBJECT(dev), RESET_TYPE_COLD);
+    }
+}
+
+/* Wire a peripheral to its clock and reset lines in the RCC */
+static void stm32f411_soc_connect_rcc(STM32F411State *s, DeviceState *dev,
+                                      STM32F4xxRccPeriph periph,
+                                      const char *clk_name)
+{
+    s->rcc_periph[periph] = dev;
+    qdev_connect_gpio_out_named(DEVICE(&s->rcc), "periph-reset", periph,
+                                qdev_get_gpio_in_named(DEVICE(s),
+                                                       "periph-reset", periph));
+    if (clk_name)
+    {
+        qdev_connect_clock_in(dev, clk_name, s->rcc.periph_clk[periph]);
+    }
+}
+
+/* GPIO inputs of the SoC receiving the watchdog timeouts */
+enum
+{
+    STM32F411_WATCHDOG_IWDG,
+    STM32F411_WATCHDOG_WWDG,
+    STM32F411_WATCHDOG_COUNT
+};
+
+/* Feed the flash access timing set up by the firmware to the cycle model */
+static void stm32f411_soc_flash_acr_changed(Notifier *notifier, void *data)
+{
+    STM32F411State *s = container_of(notifier, STM32F411State,
+                                     flash_acr_notifier);
+    uint32_t acr = s->flash_r.flash_acr;
+
+    arm_cpu_set_flash_timing(s->armv7m.cpu, acr & FLASH_ACR_LATENCY_MASK,
+                             acr & FLASH_ACR_PRFTEN, acr & FLASH_ACR_ICEN,
+                             acr & FLASH_ACR_DCEN);
+}
+
+/*
+ * A watchdog resets the chip. Either perform the action chosen with
+ * -action watchdog=..., or exit right away with a distinctive status and
+ * the CPU state for post-mortem, so that a hung firmware ends the run.
+ */
+static void stm32f411_soc_watchdog_timeout(void *opaque, int n, int level)
+{
+    STM32F411State *s = STM32F411_SOC(opaque);
+
+    if (!level)
+    {
+        return;
+    }
+    if (s->watchdog_exit_code < 0)
+    {
+        watchdog_perform_action();
+        return;
+    }
+
+    error_report("%s reset, exiting with status %" PRId32,
+                 n == STM32F411_WATCHDOG_IWDG ? "IWDG" : "WWDG",
+                 s->watchdog_exit_code);
+    cpu_dump_state(CPU(s->armv7m.cpu), stderr, CPU_DUMP_FPU);
+    exit(s->watchdog_exit_code);
+}
+
 static void stm32f411_soc_initfn(Object *obj)
 {
     STM32F411State *s = STM32F411_SOC(obj);
+    g_autofree char *name = NULL;
     int i;
 
     object_initialize_child(obj, "armv7m", &s->armv7m, TYPE_ARMV7M);
@@ -118,6 +339,9 @@ static void stm32f411_soc_initfn(Object *obj)
     {
         object_initialize_child(obj, "usart[*]", &s->usart[i],
                                 TYPE_STM32F2XX_USART);
+        g_free(name);
+        name = g_strdup_printf("serial%d", i);
+        object_property_add_alias(obj, name, OBJECT(&s->usart[i]), "chardev");
     }
 
     for (i = 0; i < STM_NUM_TIMERS; i++)
@@ -138,16 +362,166 @@ static void stm32f411_soc_initfn(Object *obj)
 
     object_initialize_child(obj, "exti", &s->exti, TYPE_STM32F4XX_EXTI);
 
-    s->sysclk = qdev_init_clock_in(DEVICE(s), "sysclk", NULL, NULL, 0);
+    object_initialize_child(obj, "iwdg", &s->iwdg, TYPE_STM32F4XX_IWDG);
+
+    object_initialize_child(obj, "wwdg", &s->wwdg, TYPE_STM32F4XX_WWDG);
+
+    for (i = 0; i < STM_NUM_DMAS; i++)
+    {
+        object_initialize_child(obj, "dma[*]", &s->dma[i], TYPE_STM32F4XX_DMA);
+    }
+
+    for (i = 0; i < STM_NUM_GPIOS; i++)
+    {
+        object_initialize_child(obj, "gpio[*]", &s->gpio[i],
+                                TYPE_STM32F4XX_GPIO);
+    }
+
+    object_initialize_child(obj, "gpio-link", &s->gpio_link,
+                            TYPE_STM32F4XX_GPIO_LINK);
+    object_property_add_alias(obj, "gpio-chardev", OBJECT(&s->gpio_link),
+                              "chardev");
+
+    s->hse = qdev_init_clock_in(DEVICE(s), "hse", NULL, NULL, 0);
     s->refclk = qdev_init_clock_in(DEVICE(s), "refclk", NULL, NULL, 0);
+
+    qdev_init_gpio_in_named(DEVICE(s), stm32f411_soc_periph_reset,
+                            "periph-reset", STM32F4XX_RCC_PERIPH_COUNT);
+    qdev_init_gpio_in_named(DEVICE(s), stm32f411_soc_watchdog_timeout,
+                            "watchdog-timeout", STM32F411_WATCHDOG_COUNT);
+    qdev_init_gpio_in_named(DEVICE(s), stm32f411_soc_dma_request,
+                            "dma-request", STM32F411_DMA_REQUEST_COUNT);
+    qdev_init_gpio_in_named(DEVICE(s), stm32f411_soc_dma_ack,
+                            "dma-ack", STM32F411_DMA_REQUEST_COUNT);
+}
+
+/*
+ * Name a memory region of the SoC. RAM block names must be unique, so SoCs
+ * other than the first one of a machine get their index in the name.
+ */
+static char *stm32f411_soc_region_name(STM32F411State *s, const char *name)
+{
+    if (s->index == 0)
+    {
+        return g_strdup_printf("STM32F411.%s", name);
+    }
+    return g_strdup_printf("STM32F411[%" PRIu32 "].%s", s->index, name);
+}
+
+static void stm32f411_soc_mmio_map(STM32F411State *s, SysBusDevice *busdev,
+                                   hwaddr addr)
+{
+    memory_region_add_subregion(s->memory, addr,
+                                sysbus_mmio_get_region(busdev, 0));
+}
+
+/*
+ * Like create_unimplemented_device(), but mapped in the SoC address space
+ * rather than in the system memory.
+ */
+static void stm32f411_soc_create_unimplemented(STM32F411State *s,
+                                               const char *name,
+                                               hwaddr base, hwaddr size)
+{
+    DeviceState *dev = qdev_new(TYPE_UNIMPLEMENTED_DEVICE);
+
+    qdev_prop_set_string(dev, "name", name);
+    qdev_prop_set_uint64(dev, "size", size);
+    sysbus_realize_and_unref(SYS_BUS_DEVICE(dev), &error_fatal);
+
+    memory_region_add_subregion_overlap(s->memory, base,
+        sysbus_mmio_get_region(SYS_BUS_DEVICE(dev), 0), -1000);
+}
+
+/*
+ * Back a memory region with a private (copy-on-write) mapping of a raw
+ * image file. Instances booting the same image share its page cache pages,
+ * and nothing is copied into guest memory at startup. The region gets the
+ * same owner, hence the same RAMBlock idstr, as when it isn't file backed.
+ */
+static bool stm32f411_soc_init_from_file(Object *owner, MemoryRegion *mr,
+                                         const char *name, const char *path,
+                                         uint64_t size, Error **errp)
+{
+#ifdef CONFIG_POSIX
+    Error *err = NULL;
+    struct stat st;
+    int fd;
+
+    fd = qemu_open(path, O_RDONLY, errp);
+    if (fd < 0)
+    {
+        return false;
+    }
+    if (fstat(fd, &st) < 0)
+    {
+        error_setg_errno(errp, errno, "could not stat image '%s'", path);
+        qemu_close(fd);
+        return false;
+    }
+    if ((uint64_t)st.st_size != size)
+    {
+        error_setg(errp, "image '%s' must be exactly %" PRIu64 " bytes",
+                   path, size);
+        qemu_close(fd);
+        return false;
+    }
+
+    /* The RAMBlock takes ownership of fd once the mapping succeeds */
+    memory_region_init_ram_from_fd(mr, owner, name, size, 0, fd, 0, &err);
+    if (err != NULL)
+    {
+        error_propagate(errp, err);
+        qemu_close(fd);
+        return false;
+    }
+    vmstate_register_ram(mr, owner ? DEVICE(owner) : NULL);
+    return true;
+#else
+    error_setg(errp, "mapping '%s' from a file is not supported on this host",
+               name);
+    return false;
+#endif
+}
+
+/*
+ * A file backed SRAM starts out as the image and must go back to it on
+ * every system reset. Dropping the private copies of the pages the guest
+ * wrote makes them fault in from the file again, so nothing is copied.
+ */
+static void stm32f411_soc_sram_reset(void *opaque)
+{
+    STM32F411State *s = opaque;
+    void *host = memory_region_get_ram_ptr(&s->sram);
+
+#ifdef CONFIG_LINUX
+    if (qemu_madvise(host, SRAM_SIZE, QEMU_MADV_DONTNEED) < 0)
+#endif
+    {
+        /* Other hosts may keep the private pages, read the image back */
+        if (pread(memory_region_get_fd(&s->sram), host, SRAM_SIZE, 0) !=
+            SRAM_SIZE)
+        {
+            error_report("could not reload SRAM image '%s'", s->sram_file);
+            exit(1);
+        }
+    }
+
+    /* Code may have been translated from the old contents */
+    memory_region_flush_ram(&s->sram, 0, SRAM_SIZE);
 }
 
 static void stm32f411_soc_realize(DeviceState *dev_soc, Error **errp)
 {
     STM32F411State *s = STM32F411_SOC(dev_soc);
-    MemoryRegion *system_memory = get_system_memory();
+    g_autofree char *flash_name = stm32f411_soc_region_name(s, "flash");
+    g_autofree char *flash_alias_name =
+        stm32f411_soc_region_name(s, "flash.alias");
+    g_autofree char *sram_name = stm32f411_soc_region_name(s, "sram");
     DeviceState *dev, *armv7m;
     SysBusDevice *busdev;
+    Clock *hclk;
+    g_autofree char *name = NULL;
     Error *err = NULL;
     int i;
 
@@ -162,52 +536,95 @@ static void stm32f411_soc_realize(DeviceState *dev_soc, Error **errp)
         return;
     }
 
-    if (!clock_has_source(s->sysclk))
-    {
-        error_setg(errp, "sysclk clock must be wired up by the board code");
-        return;
-    }
-
     /*
-     * TODO: ideally we should model the SoC RCC and its ability to
-     * change the sysclk frequency and define different sysclk sources.
+     * The RCC derives all the clocks from its internal oscillator or the
+     * optional HSE one, whose frequency is set by the board.
      */
+    qdev_connect_clock_in(DEVICE(&s->rcc), "hse", s->hse);
+    hclk = qdev_get_clock_out(DEVICE(&s->rcc), "hclk");
 
     /* The refclk always runs at frequency HCLK / 8 */
     clock_set_mul_div(s->refclk, 8, 1);
-    clock_set_source(s->refclk, s->sysclk);
+    clock_set_source(s->refclk, hclk);
 
-    memory_region_init_rom(&s->flash, OBJECT(dev_soc), "STM32F411.flash",
-                           FLASH_SIZE, &err);
-    if (err != NULL)
+    if (!s->memory)
     {
-        error_propagate(errp, err);
-        return;
+        s->memory = get_system_memory();
+    }
+
+    if (s->flash_source)
+    {
+        /*
+         * Share the flash of another SoC running the same firmware. As TBs
+         * are looked up by RAM address, the code is translated only once.
+         */
+        if (s->flash_file)
+        {
+            error_setg(errp, "flash-file and flash-source are exclusive");
+            return;
+        }
+        if (memory_region_size(s->flash_source) != FLASH_SIZE)
+        {
+            error_setg(errp, "flash-source must be %d bytes", FLASH_SIZE);
+            return;
+        }
+        memory_region_init_alias(&s->flash, OBJECT(dev_soc), flash_name,
+                                 s->flash_source, 0, FLASH_SIZE);
+    }
+    else if (s->flash_file)
+    {
+        if (!stm32f411_soc_init_from_file(OBJECT(s), &s->flash, flash_name,
+                                          s->flash_file, FLASH_SIZE, errp))
+        {
+            return;
+        }
+        /* The guest sees it read-only, exactly like the ROM it replaces */
+        memory_region_set_readonly(&s->flash, true);
+    }
+    else
+    {
+        memory_region_init_rom(&s->flash, OBJECT(dev_soc), flash_name,
+                               FLASH_SIZE, &err);
+        if (err != NULL)
+        {
+            error_propagate(errp, err);
+            return;
+        }
     }
     memory_region_init_alias(&s->flash_alias, OBJECT(dev_soc),
-                             "STM32F411.flash.alias", &s->flash, 0,
-                             FLASH_SIZE);
+                             flash_alias_name, &s->flash, 0, FLASH_SIZE);
 
-    memory_region_add_subregion(system_memory, FLASH_BASE_ADDRESS, &s->flash);
-    memory_region_add_subregion(system_memory, 0, &s->flash_alias);
+    memory_region_add_subregion(s->memory, FLASH_BASE_ADDRESS, &s->flash);
+    memory_region_add_subregion(s->memory, 0, &s->flash_alias);
 
-    memory_region_init_ram(&s->sram, NULL, "STM32F411.sram", SRAM_SIZE,
-                           &err);
-    if (err != NULL)
+    if (s->sram_file)
     {
-        error_propagate(errp, err);
-        return;
+        if (!stm32f411_soc_init_from_file(NULL, &s->sram, sram_name,
+                                          s->sram_file, SRAM_SIZE, errp))
+        {
+            return;
+        }
+        qemu_register_reset(stm32f411_soc_sram_reset, s);
     }
-    memory_region_add_subregion(system_memory, SRAM_BASE_ADDRESS, &s->sram);
+    else
+    {
+        memory_region_init_ram(&s->sram, NULL, sram_name, SRAM_SIZE, &err);
+        if (err != NULL)
+        {
+            error_propagate(errp, err);
+            return;
+        }
+    }
+    memory_region_add_subregion(s->memory, SRAM_BASE_ADDRESS, &s->sram);
 
     armv7m = DEVICE(&s->armv7m);
     qdev_prop_set_uint32(armv7m, "num-irq", 100);
     qdev_prop_set_string(armv7m, "cpu-type", s->cpu_type);
     qdev_prop_set_bit(armv7m, "enable-bitband", true);
-    qdev_connect_clock_in(armv7m, "cpuclk", s->sysclk);
+    qdev_connect_clock_in(armv7m, "cpuclk", hclk);
     qdev_connect_clock_in(armv7m, "refclk", s->refclk);
     object_property_set_link(OBJECT(&s->armv7m), "memory",
-                             OBJECT(system_memory), &error_abort);
+                             OBJECT(s->memory), &error_abort);
     if (!sysbus_realize(SYS_BUS_DEVICE(&s->armv7m), errp))
     {
         return;
@@ -220,7 +637,7 @@ static void stm32f411_soc_realize(DeviceState *dev_soc, Error **errp)
         return;
     }
     busdev = SYS_BUS_DEVICE(dev);
-    sysbus_mmio_map(busdev, 0, RCC_ADDR);
+    stm32f411_soc_mmio_map(s, busdev, RCC_ADDR);
     sysbus_connect_irq(busdev, 0, qdev_get_gpio_in(armv7m, RCC_IRQ));
 
     /* System configuration controller */
@@ -230,8 +647,9 @@ static void stm32f411_soc_realize(DeviceState *dev_soc, Error **errp)
         return;
     }
     busdev = SYS_BUS_DEVICE(dev);
-    sysbus_mmio_map(busdev, 0, SYSCFG_ADDR);
+    stm32f411_soc_mmio_map(s, busdev, SYSCFG_ADDR);
     sysbus_connect_irq(busdev, 0, qdev_get_gpio_in(armv7m, SYSCFG_IRQ));
+    stm32f411_soc_connect_rcc(s, dev, STM32F4XX_RCC_SYSCFG, NULL);
 
     /* Flash controller */
     dev = DEVICE(&s->flash_r);
@@ -240,35 +658,84 @@ static void stm32f411_soc_realize(DeviceState *dev_soc, Error **errp)
         return;
     }
     busdev = SYS_BUS_DEVICE(dev);
-    sysbus_mmio_map(busdev, 0, FLASH_R_ADDR);
+    stm32f411_soc_mmio_map(s, busdev, FLASH_R_ADDR);
     sysbus_connect_irq(busdev, 0, qdev_get_gpio_in(armv7m, FLASH_R_IRQ));
+    s->flash_acr_notifier.notify = stm32f411_soc_flash_acr_changed;
+    stm32f4xx_flash_add_acr_notifier(&s->flash_r, &s->flash_acr_notifier);
+
+    /* DMA controllers, only DMA2 can copy from memory to memory */
+    for (i = 0; i < STM_NUM_DMAS; i++)
+    {
+        int j, k;
+
+        dev = DEVICE(&s->dma[i]);
+        object_property_set_link(OBJECT(dev), "memory", OBJECT(s->memory),
+                                 &error_abort);
+        qdev_prop_set_bit(dev, "memory-to-memory", i == 1);
+        if (!sysbus_realize(SYS_BUS_DEVICE(dev), errp))
+        {
+            return;
+        }
+        busdev = SYS_BUS_DEVICE(dev);
+        stm32f411_soc_mmio_map(s, busdev, dma_addr[i]);
+        for (j = 0; j < STM32F4XX_DMA_NUM_STREAMS; j++)
+        {
+            sysbus_connect_irq(busdev, j,
+                               qdev_get_gpio_in(armv7m, dma_irq[i][j]));
+        }
+        for (j = 0; j < STM32F411_DMA_REQUEST_COUNT; j++)
+        {
+            for (k = 0; k < STM32F411_DMA_MAX_ROUTES; k++)
+            {
+                const STM32F411DmaRoute *route = &dma_routes[j][k];
+
+                if (route->dma != i + 1)
+                {
+                    continue;
+                }
+                s->dma_route[j][k] = qdev_get_gpio_in_named(dev, "request",
+                    route->stream * STM32F4XX_DMA_NUM_CHANNELS +
+                    route->channel);
+                qdev_connect_gpio_out_named(dev, "ack",
+                    route->stream * STM32F4XX_DMA_NUM_CHANNELS +
+                    route->channel,
+                    qdev_get_gpio_in_named(dev_soc, "dma-ack", j));
+            }
+        }
+    }
 
     /* Attach UART (uses USART registers) and USART controllers */
     for (i = 0; i < STM_NUM_USARTS; i++)
     {
         dev = DEVICE(&(s->usart[i]));
-        qdev_prop_set_chr(dev, "chardev", serial_hd(i));
+        stm32f411_soc_connect_rcc(s, dev, usart_rcc[i], "clk");
         if (!sysbus_realize(SYS_BUS_DEVICE(&s->usart[i]), errp))
         {
             return;
         }
         busdev = SYS_BUS_DEVICE(dev);
-        sysbus_mmio_map(busdev, 0, usart_addr[i]);
+        stm32f411_soc_mmio_map(s, busdev, usart_addr[i]);
         sysbus_connect_irq(busdev, 0, qdev_get_gpio_in(armv7m, usart_irq[i]));
+        stm32f411_soc_connect_dma(s, dev, STM32F2XX_USART_DMA_RX,
+                                  usart_dma[i]);
+        stm32f411_soc_connect_dma(s, dev, STM32F2XX_USART_DMA_TX,
+                                  usart_dma[i] + 1);
     }
 
     /* Timer 2 to 5 */
     for (i = 0; i < STM_NUM_TIMERS; i++)
     {
         dev = DEVICE(&(s->timer[i]));
-        qdev_prop_set_uint64(dev, "clock-frequency", 1000000000);
+        stm32f411_soc_connect_rcc(s, dev, timer_rcc[i], "clk");
         if (!sysbus_realize(SYS_BUS_DEVICE(&s->timer[i]), errp))
         {
             return;
         }
         busdev = SYS_BUS_DEVICE(dev);
-        sysbus_mmio_map(busdev, 0, timer_addr[i]);
+        stm32f411_soc_mmio_map(s, busdev, timer_addr[i]);
         sysbus_connect_irq(busdev, 0, qdev_get_gpio_in(armv7m, timer_irq[i]));
+        stm32f411_soc_connect_dma(s, dev, 0, timer_dma[i]);
+        stm32f411_soc_connect_dma_ack(s, dev, 0, timer_dma[i]);
     }
 
     /* ADC device, the IRQs are ORed together */
@@ -290,27 +757,37 @@ static void stm32f411_soc_realize(DeviceState *dev_soc, Error **errp)
     for (i = 0; i < STM_NUM_ADCS; i++)
     {
         dev = DEVICE(&(s->adc[i]));
+        stm32f411_soc_connect_rcc(s, dev, adc_rcc[i], NULL);
         if (!sysbus_realize(SYS_BUS_DEVICE(&s->adc[i]), errp))
         {
             return;
         }
         busdev = SYS_BUS_DEVICE(dev);
-        sysbus_mmio_map(busdev, 0, adc_addr[i]);
+        stm32f411_soc_mmio_map(s, busdev, adc_addr[i]);
         sysbus_connect_irq(busdev, 0,
                            qdev_get_gpio_in(DEVICE(&s->adc_irqs), i));
+        stm32f411_soc_connect_dma(s, dev, 0, STM32F411_DMA_ADC1);
     }
 
     /* SPI devices */
     for (i = 0; i < STM_NUM_SPIS; i++)
     {
         dev = DEVICE(&(s->spi[i]));
+        stm32f411_soc_connect_rcc(s, dev, spi_rcc[i], "clk");
         if (!sysbus_realize(SYS_BUS_DEVICE(&s->spi[i]), errp))
         {
             return;
         }
         busdev = SYS_BUS_DEVICE(dev);
-        sysbus_mmio_map(busdev, 0, spi_addr[i]);
+        stm32f411_soc_mmio_map(s, busdev, spi_addr[i]);
         sysbus_connect_irq(busdev, 0, qdev_get_gpio_in(armv7m, spi_irq[i]));
+        stm32f411_soc_connect_dma(s, dev, STM32F2XX_SPI_DMA_RX, spi_dma[i]);
+        stm32f411_soc_connect_dma(s, dev, STM32F2XX_SPI_DMA_TX,
+                                  spi_dma[i] + 1);
+        stm32f411_soc_connect_dma_ack(s, dev, STM32F2XX_SPI_DMA_RX,
+                                      spi_dma[i]);
+        stm32f411_soc_connect_dma_ack(s, dev, STM32F2XX_SPI_DMA_TX,
+                                      spi_dma[i] + 1);
     }
 
     /* EXTI device */
@@ -320,7 +797,7 @@ static void stm32f411_soc_realize(DeviceState *dev_soc, Error **errp)
         return;
     }
     busdev = SYS_BUS_DEVICE(dev);
-    sysbus_mmio_map(busdev, 0, EXTI_ADDR);
+    stm32f411_soc_mmio_map(s, busdev, EXTI_ADDR);
     for (i = 0; i < 16; i++)
     {
         sysbus_connect_irq(busdev, i, qdev_get_gpio_in(armv7m, exti_irq[i]));
@@ -330,52 +807,121 @@ static void stm32f411_soc_realize(DeviceState *dev_soc, Error **errp)
         qdev_connect_gpio_out(DEVICE(&s->syscfg), i, qdev_get_gpio_in(dev, i));
     }
 
+    /* GPIO ports, their pins go to the EXTI through SYSCFG */
+    for (i = 0; i < STM_NUM_GPIOS; i++)
+    {
+        int j;
+
+        dev = DEVICE(&s->gpio[i]);
+        /* The debug port pins of GPIOA and GPIOB are set up at reset */
+        if (i == 0)
+        {
+            qdev_prop_set_uint32(dev, "moder-reset", 0xA8000000);
+            qdev_prop_set_uint32(dev, "ospeedr-reset", 0x0C000000);
+            qdev_prop_set_uint32(dev, "pupdr-reset", 0x64000000);
+        }
+        else if (i == 1)
+        {
+            qdev_prop_set_uint32(dev, "moder-reset", 0x00000280);
+            qdev_prop_set_uint32(dev, "ospeedr-reset", 0x000000C0);
+            qdev_prop_set_uint32(dev, "pupdr-reset", 0x00000100);
+        }
+        if (!sysbus_realize(SYS_BUS_DEVICE(dev), errp))
+        {
+            return;
+        }
+        busdev = SYS_BUS_DEVICE(dev);
+        stm32f411_soc_mmio_map(s, busdev, gpio_addr[i]);
+        for (j = 0; j < STM32F4XX_GPIO_NUM_PINS; j++)
+        {
+            qdev_connect_gpio_out(dev, j,
+                                  qdev_get_gpio_in(DEVICE(&s->syscfg),
+                                                   i * STM32F4XX_GPIO_NUM_PINS +
+                                                   j));
+        }
+        g_free(name);
+        name = g_strdup_printf("port[%d]", i);
+        object_property_set_link(OBJECT(&s->gpio_link), name, OBJECT(dev),
+                                 &error_abort);
+    }
+
+    /* Batched access to the GPIO pins from the host */
+    if (!qdev_realize(DEVICE(&s->gpio_link), NULL, errp))
+    {
+        return;
+    }
+
+    /* Independent watchdog, clocked by the LSI */
+    dev = DEVICE(&s->iwdg);
+    qdev_connect_clock_in(dev, "clk",
+                          qdev_get_clock_out(DEVICE(&s->rcc), "lsi"));
+    if (!sysbus_realize(SYS_BUS_DEVICE(&s->iwdg), errp))
+    {
+        return;
+    }
+    busdev = SYS_BUS_DEVICE(dev);
+    stm32f411_soc_mmio_map(s, busdev, IWDG_ADDR);
+    qdev_connect_gpio_out_named(dev, "timeout", 0,
+        qdev_get_gpio_in_named(dev_soc, "watchdog-timeout",
+                               STM32F411_WATCHDOG_IWDG));
+
+    /* Window watchdog */
+    dev = DEVICE(&s->wwdg);
+    stm32f411_soc_connect_rcc(s, dev, STM32F4XX_RCC_WWDG, "clk");
+    if (!sysbus_realize(SYS_BUS_DEVICE(&s->wwdg), errp))
+    {
+        return;
+    }
+    busdev = SYS_BUS_DEVICE(dev);
+    stm32f411_soc_mmio_map(s, busdev, WWDG_ADDR);
+    sysbus_connect_irq(busdev, 0, qdev_get_gpio_in(armv7m, WWDG_IRQ));
+    qdev_connect_gpio_out_named(dev, "timeout", 0,
+        qdev_get_gpio_in_named(dev_soc, "watchdog-timeout",
+                               STM32F411_WATCHDOG_WWDG));
+
     // TODO update with unimplemented devices for stm32f411
-    create_unimplemented_device("timer[7]", 0x40001400, 0x400);
-    create_unimplemented_device("timer[12]", 0x40001800, 0x400);
-    create_unimplemented_device("timer[6]", 0x40001000, 0x400);
-    create_unimplemented_device("timer[13]", 0x40001C00, 0x400);
-    create_unimplemented_device("timer[14]", 0x40002000, 0x400);
-    create_unimplemented_device("RTC and BKP", 0x40002800, 0x400);
-    create_unimplemented_device("WWDG", 0x40002C00, 0x400);
-    create_unimplemented_device("IWDG", 0x40003000, 0x400);
-    create_unimplemented_device("I2S2ext", 0x40003000, 0x400);
-    create_unimplemented_device("I2S3ext", 0x40004000, 0x400);
-    create_unimplemented_device("I2C1", 0x40005400, 0x400);
-    create_unimplemented_device("I2C2", 0x40005800, 0x400);
-    create_unimplemented_device("I2C3", 0x40005C00, 0x400);
-    create_unimplemented_device("CAN1", 0x40006400, 0x400);
-    create_unimplemented_device("CAN2", 0x40006800, 0x400);
-    create_unimplemented_device("PWR", 0x40007000, 0x400);
-    create_unimplemented_device("DAC", 0x40007400, 0x400);
-    create_unimplemented_device("timer[1]", 0x40010000, 0x400);
-    create_unimplemented_device("timer[8]", 0x40010400, 0x400);
-    create_unimplemented_device("SDIO", 0x40012C00, 0x400);
-    create_unimplemented_device("timer[9]", 0x40014000, 0x400);
-    create_unimplemented_device("timer[10]", 0x40014400, 0x400);
-    create_unimplemented_device("timer[11]", 0x40014800, 0x400);
-    create_unimplemented_device("GPIOA", 0x40020000, 0x400);
-    create_unimplemented_device("GPIOB", 0x40020400, 0x400);
-    create_unimplemented_device("GPIOC", 0x40020800, 0x400);
-    create_unimplemented_device("GPIOD", 0x40020C00, 0x400);
-    create_unimplemented_device("GPIOE", 0x40021000, 0x400);
-    create_unimplemented_device("GPIOF", 0x40021400, 0x400);
-    create_unimplemented_device("GPIOG", 0x40021800, 0x400);
-    create_unimplemented_device("GPIOH", 0x40021C00, 0x400);
-    create_unimplemented_device("GPIOI", 0x40022000, 0x400);
-    create_unimplemented_device("CRC", 0x40023000, 0x400);
-    create_unimplemented_device("BKPSRAM", 0x40024000, 0x400);
-    create_unimplemented_device("DMA1", 0x40026000, 0x400);
-    create_unimplemented_device("DMA2", 0x40026400, 0x400);
-    create_unimplemented_device("Ethernet", 0x40028000, 0x1400);
-    create_unimplemented_device("USB OTG HS", 0x40040000, 0x30000);
-    create_unimplemented_device("USB OTG FS", 0x50000000, 0x31000);
-    create_unimplemented_device("DCMI", 0x50050000, 0x400);
-    create_unimplemented_device("RNG", 0x50060800, 0x400);
+    stm32f411_soc_create_unimplemented(s, "timer[7]", 0x40001400, 0x400);
+    stm32f411_soc_create_unimplemented(s, "timer[12]", 0x40001800, 0x400);
+    stm32f411_soc_create_unimplemented(s, "timer[6]", 0x40001000, 0x400);
+    stm32f411_soc_create_unimplemented(s, "timer[13]", 0x40001C00, 0x400);
+    stm32f411_soc_create_unimplemented(s, "timer[14]", 0x40002000, 0x400);
+    stm32f411_soc_create_unimplemented(s, "RTC and BKP", 0x40002800, 0x400);
+    stm32f411_soc_create_unimplemented(s, "I2S2ext", 0x40003000, 0x400);
+    stm32f411_soc_create_unimplemented(s, "I2S3ext", 0x40004000, 0x400);
+    stm32f411_soc_create_unimplemented(s, "I2C1", 0x40005400, 0x400);
+    stm32f411_soc_create_unimplemented(s, "I2C2", 0x40005800, 0x400);
+    stm32f411_soc_create_unimplemented(s, "I2C3", 0x40005C00, 0x400);
+    stm32f411_soc_create_unimplemented(s, "CAN1", 0x40006400, 0x400);
+    stm32f411_soc_create_unimplemented(s, "CAN2", 0x40006800, 0x400);
+    stm32f411_soc_create_unimplemented(s, "PWR", 0x40007000, 0x400);
+    stm32f411_soc_create_unimplemented(s, "DAC", 0x40007400, 0x400);
+    stm32f411_soc_create_unimplemented(s, "timer[1]", 0x40010000, 0x400);
+    stm32f411_soc_create_unimplemented(s, "timer[8]", 0x40010400, 0x400);
+    stm32f411_soc_create_unimplemented(s, "SDIO", 0x40012C00, 0x400);
+    stm32f411_soc_create_unimplemented(s, "timer[9]", 0x40014000, 0x400);
+    stm32f411_soc_create_unimplemented(s, "timer[10]", 0x40014400, 0x400);
+    stm32f411_soc_create_unimplemented(s, "timer[11]", 0x40014800, 0x400);
+    stm32f411_soc_create_unimplemented(s, "GPIOI", 0x40022000, 0x400);
+    stm32f411_soc_create_unimplemented(s, "CRC", 0x40023000, 0x400);
+    stm32f411_soc_create_unimplemented(s, "BKPSRAM", 0x40024000, 0x400);
+    stm32f411_soc_create_unimplemented(s, "Ethernet", 0x40028000, 0x1400);
+    stm32f411_soc_create_unimplemented(s, "USB OTG HS", 0x40040000, 0x30000);
+    stm32f411_soc_create_unimplemented(s, "USB OTG FS", 0x50000000, 0x31000);
+    stm32f411_soc_create_unimplemented(s, "DCMI", 0x50050000, 0x400);
+    stm32f411_soc_create_unimplemented(s, "RNG", 0x50060800, 0x400);
 }
 
 static Property stm32f411_soc_properties[] = {
     DEFINE_PROP_STRING("cpu-type", STM32F411State, cpu_type),
+    DEFINE_PROP_STRING("flash-file", STM32F411State, flash_file),
+    DEFINE_PROP_STRING("sram-file", STM32F411State, sram_file),
+    DEFINE_PROP_UINT32("index", STM32F411State, index, 0),
+    DEFINE_PROP_LINK("memory", STM32F411State, memory, TYPE_MEMORY_REGION,
+                     MemoryRegion *),
+    DEFINE_PROP_LINK("flash-source", STM32F411State, flash_source,
+                     TYPE_MEMORY_REGION, MemoryRegion *),
+    DEFINE_PROP_INT32("watchdog-exit-code", STM32F411State, watchdog_exit_code,
+                      -1),
     DEFINE_PROP_END_OF_LIST(),
 };
 
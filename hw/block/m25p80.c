@@ -1584,6 +1584,35 @@ static uint32_t m25p80_transfer8(SSIPeripheral *ss, uint32_t tx)
     return r;
 }
 
+static void m25p80_transfer_buf(SSIPeripheral *ss, const uint8_t *tx,
+                                uint8_t *rx, size_t len)
+{
+    Flash *s = M25P80(ss);
+    size_t i = 0;
+
+    while (i < len) {
+        if (s->state == STATE_READ) {
+            /* Copy data reads straight from the storage, up to the wrap */
+            size_t n = MIN(len - i, s->size - s->cur_addr);
+
+            trace_m25p80_read_buf(s, s->cur_addr, n);
+            if (rx) {
+                memcpy(&rx[i], &s->storage[s->cur_addr], n);
+            }
+            s->cur_addr = (s->cur_addr + n) & (s->size - 1);
+            i += n;
+            continue;
+        }
+
+        if (rx) {
+            rx[i] = m25p80_transfer8(ss, tx ? tx[i] : 0);
+        } else {
+            m25p80_transfer8(ss, tx ? tx[i] : 0);
+        }
+        i++;
+    }
+}
+
 static void m25p80_write_protect_pin_irq_handler(void *opaque, int n, int level)
 {
     Flash *s = M25P80(opaque);
@@ -1796,6 +1825,7 @@ static void m25p80_class_init(ObjectClass *klass, void *data)
 
     k->realize = m25p80_realize;
     k->transfer = m25p80_transfer8;
+    k->transfer_buf = m25p80_transfer_buf;
     k->set_cs = m25p80_cs;
     k->cs_polarity = SSI_CS_LOW;
     dc->vmsd = &vmstate_m25p80;
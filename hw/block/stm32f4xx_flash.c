@@ -29,6 +29,17 @@
 #include "migration/vmstate.h"
 #include "hw/block/stm32f4xx_flash.h"
 
+void stm32f4xx_flash_add_acr_notifier(STM32F4xxFlashState *s,
+                                      Notifier *notifier)
+{
+    notifier_list_add(&s->acr_notifiers, notifier);
+}
+
+static void stm32f4xx_flash_acr_changed(STM32F4xxFlashState *s)
+{
+    notifier_list_notify(&s->acr_notifiers, s);
+}
+
 static void stm32f4xx_flash_reset(DeviceState *dev)
 {
     STM32F4xxFlashState *s = STM32F4XX_FLASH(dev);
@@ -40,6 +51,8 @@ static void stm32f4xx_flash_reset(DeviceState *dev)
     s->flash_cr = 0x80000000;
     s->flash_optcr = 0x0FFFAAED;
     s->flash_optcr1 = 0x0FFF0000;
+
+    stm32f4xx_flash_acr_changed(s);
 }
 
 static void stm32f4xx_flash_set_irq(void *opaque, int irq, int level)
@@ -127,6 +140,7 @@ static void stm32f4xx_flash_write(void *opaque, hwaddr addr,
     {
     case FLASH_ACR:
         s->flash_acr = value;
+        stm32f4xx_flash_acr_changed(s);
         return;
     case FLASH_KEYR:
         s->flash_keyr = value;
@@ -152,10 +166,26 @@ static void stm32f4xx_flash_write(void *opaque, hwaddr addr,
     }
 }
 
+/* Firmware busy waits on FLASH_SR, reading registers changes nothing */
+static bool stm32f4xx_flash_read_is_idempotent(void *opaque, hwaddr addr,
+                                               unsigned int size)
+{
+    return true;
+}
+
+/* FLASH_SR only changes on writes to the flash interface */
+static bool stm32f4xx_flash_read_is_timed(void *opaque, hwaddr addr,
+                                          unsigned int size)
+{
+    return true;
+}
+
 static const MemoryRegionOps stm32f4xx_flash_ops = {
     .read = stm32f4xx_flash_read,
     .write = stm32f4xx_flash_write,
     .endianness = DEVICE_NATIVE_ENDIAN,
+    .read_is_idempotent = stm32f4xx_flash_read_is_idempotent,
+    .read_is_timed = stm32f4xx_flash_read_is_timed,
 };
 
 static void stm32f4xx_flash_init(Object *obj)
@@ -169,12 +199,23 @@ static void stm32f4xx_flash_init(Object *obj)
     sysbus_init_mmio(SYS_BUS_DEVICE(obj), &s->mmio);
 
     qdev_init_gpio_in(DEVICE(obj), stm32f4xx_flash_set_irq, 1);
+
+    notifier_list_init(&s->acr_notifiers);
+}
+
+static int stm32f4xx_flash_post_load(void *opaque, int version_id)
+{
+    STM32F4xxFlashState *s = opaque;
+
+    stm32f4xx_flash_acr_changed(s);
+    return 0;
 }
 
 static const VMStateDescription vmstate_stm32f4xx_flash = {
     .name = TYPE_STM32F4XX_FLASH,
     .version_id = 1,
     .minimum_version_id = 1,
+    .post_load = stm32f4xx_flash_post_load,
     .fields = (VMStateField[]){
         VMSTATE_UINT32(flash_acr, STM32F4xxFlashState),
         VMSTATE_UINT32(flash_keyr, STM32F4xxFlashState),
@@ -25,9 +25,13 @@
 #include "qemu/osdep.h"
 #include "hw/char/stm32f2xx_usart.h"
 #include "hw/irq.h"
+#include "hw/qdev-clock.h"
 #include "hw/qdev-properties.h"
 #include "hw/qdev-properties-system.h"
+#include "migration/vmstate.h"
+#include "qemu/bitops.h"
 #include "qemu/log.h"
+#include "qemu/main-loop.h"
 #include "qemu/module.h"
 
 #ifndef STM_USART_ERR_DEBUG
@@ -42,15 +46,227 @@
 
 #define DB_PRINT(fmt, args...) DB_PRINT_L(1, fmt, ## args)
 
+/*
+ * The USART does nothing while its clock is gated off or while it is held in
+ * reset. Without a clock connected, it is always running.
+ */
+static bool stm32f2xx_usart_is_active(STM32F2XXUsartState *s)
+{
+    if (clock_has_source(s->clk) && !clock_is_enabled(s->clk)) {
+        return false;
+    }
+    return !device_is_in_reset(DEVICE(s));
+}
+
+static void stm32f2xx_usart_update_irq(STM32F2XXUsartState *s)
+{
+    uint32_t mask = 0;
+
+    if (s->usart_cr1 & USART_CR1_TXEIE) {
+        mask |= USART_SR_TXE;
+    }
+    if (s->usart_cr1 & USART_CR1_TCIE) {
+        mask |= USART_SR_TC;
+    }
+    if (s->usart_cr1 & USART_CR1_RXNEIE) {
+        mask |= USART_SR_RXNE | USART_SR_ORE;
+    }
+    if (s->usart_cr1 & USART_CR1_IDLEIE) {
+        mask |= USART_SR_IDLE;
+    }
+    qemu_set_irq(s->irq, !!(s->usart_sr & mask));
+
+    qemu_set_irq(s->dma_request[STM32F2XX_USART_DMA_RX],
+                 (s->usart_cr3 & USART_CR3_DMAR) &&
+                 (s->usart_sr & USART_SR_RXNE));
+    qemu_set_irq(s->dma_request[STM32F2XX_USART_DMA_TX],
+                 (s->usart_cr3 & USART_CR3_DMAT) &&
+                 (s->usart_sr & USART_SR_TXE));
+}
+
+/*
+ * Time taken to shift a character in or out at the rate programmed in BRR,
+ * or 0 when it is unknown because the USART has no clock or no rate.
+ */
+static int64_t stm32f2xx_usart_char_time_ns(STM32F2XXUsartState *s)
+{
+    /* 1, 0.5, 2 and 1.5 stop bits */
+    static const uint32_t stop_half_bits[] = { 2, 1, 4, 3 };
+    uint32_t div, half_bits;
+
+    if (!clock_has_source(s->clk) || !clock_is_enabled(s->clk)) {
+        return 0;
+    }
+
+    if (s->usart_cr1 & USART_CR1_OVER8) {
+        div = extract32(s->usart_brr, 4, 12) * 8 + extract32(s->usart_brr, 0, 3);
+    } else {
+        div = extract32(s->usart_brr, 0, 16);
+    }
+    if (!div) {
+        return 0;
+    }
+
+    /* Start bit, data bits and stop bits */
+    half_bits = 2 * (1 + (s->usart_cr1 & USART_CR1_M ? 9 : 8)) +
+                stop_half_bits[(s->usart_cr2 & USART_CR2_STOP_MASK) >>
+                               USART_CR2_STOP_SHIFT];
+    return clock_ticks_to_ns(s->clk, (uint64_t)div * half_bits) / 2;
+}
+
+static bool stm32f2xx_usart_tx_paced(STM32F2XXUsartState *s)
+{
+    return s->tx_pacing && stm32f2xx_usart_char_time_ns(s);
+}
+
+/*
+ * Move the byte waiting in DR to the transmit FIFO. Without pacing, this
+ * happens as soon as the FIFO has room, so TXE only drops while the host
+ * side lags behind. With pacing, DR is also held while the previous
+ * character is being shifted out.
+ */
+static void stm32f2xx_usart_tx_pump(STM32F2XXUsartState *s)
+{
+    if (s->usart_sr & USART_SR_TXE || fifo8_is_full(&s->tx_fifo) ||
+        timer_pending(s->tx_timer)) {
+        return;
+    }
+
+    /* The character backend only carries the low 8 bits */
+    fifo8_push(&s->tx_fifo, s->tx_dr & 0xff);
+    s->usart_sr |= USART_SR_TXE;
+    if (stm32f2xx_usart_tx_paced(s)) {
+        timer_mod(s->tx_timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) +
+                               stm32f2xx_usart_char_time_ns(s));
+    }
+    qemu_bh_schedule(s->tx_bh);
+}
+
+static gboolean stm32f2xx_usart_tx_ready(void *do_not_use, GIOCondition cond,
+                                         void *opaque)
+{
+    STM32F2XXUsartState *s = opaque;
+
+    s->tx_watch_tag = 0;
+    qemu_bh_schedule(s->tx_bh);
+    return G_SOURCE_REMOVE;
+}
+
+static void stm32f2xx_usart_tx_drain(void *opaque)
+{
+    STM32F2XXUsartState *s = opaque;
+    const uint8_t *buf;
+    uint32_t len;
+    int ret;
+
+    while (!fifo8_is_empty(&s->tx_fifo)) {
+        buf = fifo8_peek_buf(&s->tx_fifo, fifo8_num_used(&s->tx_fifo), &len);
+        ret = qemu_chr_fe_write(&s->chr, buf, len);
+        if (ret <= 0) {
+            break;
+        }
+        fifo8_pop_buf(&s->tx_fifo, ret, &len);
+    }
+
+    if (!fifo8_is_empty(&s->tx_fifo) && !s->tx_watch_tag) {
+        s->tx_watch_tag = qemu_chr_fe_add_watch(&s->chr, G_IO_OUT | G_IO_HUP,
+                                                stm32f2xx_usart_tx_ready, s);
+        if (!s->tx_watch_tag) {
+            /* No backend, or nothing to wait for: drop the data */
+            fifo8_reset(&s->tx_fifo);
+        }
+    }
+
+    stm32f2xx_usart_tx_pump(s);
+    /* Unpaced, the transmission completes once the host took everything */
+    if (!stm32f2xx_usart_tx_paced(s) && s->usart_sr & USART_SR_TXE &&
+        fifo8_is_empty(&s->tx_fifo)) {
+        s->usart_sr |= USART_SR_TC;
+    }
+    stm32f2xx_usart_update_irq(s);
+}
+
+/* A paced character has been shifted out */
+static void stm32f2xx_usart_tx_timer(void *opaque)
+{
+    STM32F2XXUsartState *s = opaque;
+
+    stm32f2xx_usart_tx_pump(s);
+    if (s->usart_sr & USART_SR_TXE && !timer_pending(s->tx_timer)) {
+        s->usart_sr |= USART_SR_TC;
+    }
+    stm32f2xx_usart_update_irq(s);
+}
+
+/*
+ * Move received characters from the FIFO to DR. When the baud rate is
+ * known, characters are shifted in one at a time by rx_timer, and are lost
+ * with ORE set if software did not read the previous one in time. Otherwise
+ * they are handed over as soon as DR is free.
+ */
+static void stm32f2xx_usart_rx_pump(STM32F2XXUsartState *s)
+{
+    if (!stm32f2xx_usart_is_active(s)) {
+        return;
+    }
+
+    if (stm32f2xx_usart_char_time_ns(s)) {
+        if ((!fifo8_is_empty(&s->rx_fifo) || s->rx_idle_armed) &&
+            !timer_pending(s->rx_timer)) {
+            timer_mod(s->rx_timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) +
+                                   stm32f2xx_usart_char_time_ns(s));
+        }
+        return;
+    }
+
+    if (!fifo8_is_empty(&s->rx_fifo) && !(s->usart_sr & USART_SR_RXNE)) {
+        s->usart_dr = fifo8_pop(&s->rx_fifo);
+        s->usart_sr |= USART_SR_RXNE;
+        if (fifo8_is_empty(&s->rx_fifo)) {
+            /* No line timing to wait for, the burst ends here */
+            s->usart_sr |= USART_SR_IDLE;
+        }
+    }
+}
+
+static void stm32f2xx_usart_rx_timer(void *opaque)
+{
+    STM32F2XXUsartState *s = opaque;
+
+    if (!stm32f2xx_usart_is_active(s)) {
+        /* Resumed by stm32f2xx_usart_clk_update() */
+        return;
+    }
+
+    if (!fifo8_is_empty(&s->rx_fifo)) {
+        uint8_t ch = fifo8_pop(&s->rx_fifo);
+
+        if (s->usart_sr & USART_SR_RXNE) {
+            s->usart_sr |= USART_SR_ORE;
+        } else {
+            s->usart_dr = ch;
+            s->usart_sr |= USART_SR_RXNE;
+        }
+        s->rx_idle_armed = true;
+    } else if (s->rx_idle_armed) {
+        s->usart_sr |= USART_SR_IDLE;
+        s->rx_idle_armed = false;
+    }
+
+    stm32f2xx_usart_rx_pump(s);
+    stm32f2xx_usart_update_irq(s);
+    qemu_chr_fe_accept_input(&s->chr);
+}
+
 static int stm32f2xx_usart_can_receive(void *opaque)
 {
     STM32F2XXUsartState *s = opaque;
 
-    if (!(s->usart_sr & USART_SR_RXNE)) {
-        return 1;
+    if (!stm32f2xx_usart_is_active(s)) {
+        return 0;
     }
 
-    return 0;
+    return fifo8_num_free(&s->rx_fifo);
 }
 
 static void stm32f2xx_usart_receive(void *opaque, const uint8_t *buf, int size)
@@ -63,14 +279,11 @@ static void stm32f2xx_usart_receive(void *opaque, const uint8_t *buf, int size)
         return;
     }
 
-    s->usart_dr = *buf;
-    s->usart_sr |= USART_SR_RXNE;
+    DB_PRINT("Receiving %d chars\n", size);
 
-    if (s->usart_cr1 & USART_CR1_RXNEIE) {
-        qemu_set_irq(s->irq, 1);
-    }
-
-    DB_PRINT("Receiving: %c\n", s->usart_dr);
+    fifo8_push_all(&s->rx_fifo, buf, MIN(size, fifo8_num_free(&s->rx_fifo)));
+    stm32f2xx_usart_rx_pump(s);
+    stm32f2xx_usart_update_irq(s);
 }
 
 static void stm32f2xx_usart_reset(DeviceState *dev)
@@ -85,7 +298,13 @@ static void stm32f2xx_usart_reset(DeviceState *dev)
     s->usart_cr3 = 0x00000000;
     s->usart_gtpr = 0x00000000;
 
-    qemu_set_irq(s->irq, 0);
+    fifo8_reset(&s->tx_fifo);
+    timer_del(s->tx_timer);
+    fifo8_reset(&s->rx_fifo);
+    timer_del(s->rx_timer);
+    s->rx_idle_armed = false;
+
+    stm32f2xx_usart_update_irq(s);
 }
 
 static uint64_t stm32f2xx_usart_read(void *opaque, hwaddr addr,
@@ -104,9 +323,14 @@ static uint64_t stm32f2xx_usart_read(void *opaque, hwaddr addr,
     case USART_DR:
         DB_PRINT("Value: 0x%" PRIx32 ", %c\n", s->usart_dr, (char) s->usart_dr);
         retvalue = s->usart_dr & 0x3FF;
-        s->usart_sr &= ~USART_SR_RXNE;
+        /*
+         * ORE and IDLE are cleared by reading SR then DR, software always
+         * does the former first.
+         */
+        s->usart_sr &= ~(USART_SR_RXNE | USART_SR_ORE | USART_SR_IDLE);
+        stm32f2xx_usart_rx_pump(s);
+        stm32f2xx_usart_update_irq(s);
         qemu_chr_fe_accept_input(&s->chr);
-        qemu_set_irq(s->irq, 0);
         return retvalue;
     case USART_BRR:
         return s->usart_brr;
@@ -132,35 +356,25 @@ static void stm32f2xx_usart_write(void *opaque, hwaddr addr,
 {
     STM32F2XXUsartState *s = opaque;
     uint32_t value = val64;
-    unsigned char ch;
 
     DB_PRINT("Write 0x%" PRIx32 ", 0x%"HWADDR_PRIx"\n", value, addr);
 
+    if (!stm32f2xx_usart_is_active(s)) {
+        /* Clock gated off or held in reset: the write is lost */
+        return;
+    }
+
     switch (addr) {
     case USART_SR:
-        if (value <= 0x3FF) {
-            /* I/O being synchronous, TXE is always set. In addition, it may
-               only be set by hardware, so keep it set here. */
-            s->usart_sr = value | USART_SR_TXE;
-        } else {
-            s->usart_sr &= value;
-        }
-        if (!(s->usart_sr & USART_SR_RXNE)) {
-            qemu_set_irq(s->irq, 0);
-        }
+        s->usart_sr &= value | ~USART_SR_RC_W0;
+        stm32f2xx_usart_update_irq(s);
         return;
     case USART_DR:
         if (value < 0xF000) {
-            ch = value;
-            /* XXX this blocks entire thread. Rewrite to use
-             * qemu_chr_fe_write and background I/O callbacks */
-            qemu_chr_fe_write_all(&s->chr, &ch, 1);
-            /* XXX I/O are currently synchronous, making it impossible for
-               software to observe transient states where TXE or TC aren't
-               set. Unlike TXE however, which is read-only, software may
-               clear TC by writing 0 to the SR register, so set it again
-               on each write. */
-            s->usart_sr |= USART_SR_TC;
+            s->tx_dr = value;
+            s->usart_sr &= ~(USART_SR_TXE | USART_SR_TC);
+            stm32f2xx_usart_tx_pump(s);
+            stm32f2xx_usart_update_irq(s);
         }
         return;
     case USART_BRR:
@@ -168,16 +382,14 @@ static void stm32f2xx_usart_write(void *opaque, hwaddr addr,
         return;
     case USART_CR1:
         s->usart_cr1 = value;
-            if (s->usart_cr1 & USART_CR1_RXNEIE &&
-                s->usart_sr & USART_SR_RXNE) {
-                qemu_set_irq(s->irq, 1);
-            }
+        stm32f2xx_usart_update_irq(s);
         return;
     case USART_CR2:
         s->usart_cr2 = value;
         return;
     case USART_CR3:
         s->usart_cr3 = value;
+        stm32f2xx_usart_update_irq(s);
         return;
     case USART_GTPR:
         s->usart_gtpr = value;
@@ -188,14 +400,127 @@ static void stm32f2xx_usart_write(void *opaque, hwaddr addr,
     }
 }
 
+static bool stm32f2xx_usart_read_is_idempotent(void *opaque, hwaddr addr,
+                                               unsigned int size)
+{
+    /* Reading USART_DR clears RXNE */
+    return addr != USART_DR;
+}
+
 static const MemoryRegionOps stm32f2xx_usart_ops = {
     .read = stm32f2xx_usart_read,
     .write = stm32f2xx_usart_write,
     .endianness = DEVICE_NATIVE_ENDIAN,
+    .read_is_idempotent = stm32f2xx_usart_read_is_idempotent,
+};
+
+static void stm32f2xx_usart_clk_update(void *opaque, ClockEvent event)
+{
+    STM32F2XXUsartState *s = opaque;
+
+    if (clock_is_enabled(s->clk) && DEVICE(s)->realized) {
+        /* Characters may have been held back while the clock was off */
+        stm32f2xx_usart_rx_pump(s);
+        stm32f2xx_usart_update_irq(s);
+        qemu_chr_fe_accept_input(&s->chr);
+    }
+}
+
+static bool stm32f2xx_usart_clk_needed(void *opaque)
+{
+    STM32F2XXUsartState *s = opaque;
+
+    return clock_has_source(s->clk);
+}
+
+static const VMStateDescription vmstate_stm32f2xx_usart_clk = {
+    .name = TYPE_STM32F2XX_USART "/clk",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .needed = stm32f2xx_usart_clk_needed,
+    .fields = (VMStateField[]) {
+        VMSTATE_CLOCK(clk, STM32F2XXUsartState),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static bool stm32f2xx_usart_tx_needed(void *opaque)
+{
+    STM32F2XXUsartState *s = opaque;
+
+    return !(s->usart_sr & USART_SR_TXE) || !fifo8_is_empty(&s->tx_fifo) ||
+           timer_pending(s->tx_timer);
+}
+
+static int stm32f2xx_usart_tx_post_load(void *opaque, int version_id)
+{
+    STM32F2XXUsartState *s = opaque;
+
+    qemu_bh_schedule(s->tx_bh);
+    return 0;
+}
+
+static const VMStateDescription vmstate_stm32f2xx_usart_tx = {
+    .name = TYPE_STM32F2XX_USART "/tx",
+    .version_id = 2,
+    .minimum_version_id = 2,
+    .needed = stm32f2xx_usart_tx_needed,
+    .post_load = stm32f2xx_usart_tx_post_load,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT16(tx_dr, STM32F2XXUsartState),
+        VMSTATE_FIFO8(tx_fifo, STM32F2XXUsartState),
+        VMSTATE_TIMER_PTR(tx_timer, STM32F2XXUsartState),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static bool stm32f2xx_usart_rx_needed(void *opaque)
+{
+    STM32F2XXUsartState *s = opaque;
+
+    return !fifo8_is_empty(&s->rx_fifo) || timer_pending(s->rx_timer) ||
+           s->rx_idle_armed;
+}
+
+static const VMStateDescription vmstate_stm32f2xx_usart_rx = {
+    .name = TYPE_STM32F2XX_USART "/rx",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .needed = stm32f2xx_usart_rx_needed,
+    .fields = (VMStateField[]) {
+        VMSTATE_FIFO8(rx_fifo, STM32F2XXUsartState),
+        VMSTATE_TIMER_PTR(rx_timer, STM32F2XXUsartState),
+        VMSTATE_BOOL(rx_idle_armed, STM32F2XXUsartState),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static const VMStateDescription vmstate_stm32f2xx_usart = {
+    .name = TYPE_STM32F2XX_USART,
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32(usart_sr, STM32F2XXUsartState),
+        VMSTATE_UINT32(usart_dr, STM32F2XXUsartState),
+        VMSTATE_UINT32(usart_brr, STM32F2XXUsartState),
+        VMSTATE_UINT32(usart_cr1, STM32F2XXUsartState),
+        VMSTATE_UINT32(usart_cr2, STM32F2XXUsartState),
+        VMSTATE_UINT32(usart_cr3, STM32F2XXUsartState),
+        VMSTATE_UINT32(usart_gtpr, STM32F2XXUsartState),
+        VMSTATE_END_OF_LIST()
+    },
+    .subsections = (const VMStateDescription * []) {
+        &vmstate_stm32f2xx_usart_clk,
+        &vmstate_stm32f2xx_usart_tx,
+        &vmstate_stm32f2xx_usart_rx,
+        NULL
+    }
 };
 
 static Property stm32f2xx_usart_properties[] = {
     DEFINE_PROP_CHR("chardev", STM32F2XXUsartState, chr),
+    /* Send characters at the rate programmed in BRR, in virtual time */
+    DEFINE_PROP_BOOL("tx-pacing", STM32F2XXUsartState, tx_pacing, false),
     DEFINE_PROP_END_OF_LIST(),
 };
 
@@ -204,16 +529,28 @@ static void stm32f2xx_usart_init(Object *obj)
     STM32F2XXUsartState *s = STM32F2XX_USART(obj);
 
     sysbus_init_irq(SYS_BUS_DEVICE(obj), &s->irq);
+    qdev_init_gpio_out_named(DEVICE(obj), s->dma_request, "dma-request",
+                             ARRAY_SIZE(s->dma_request));
 
     memory_region_init_io(&s->mmio, obj, &stm32f2xx_usart_ops, s,
                           TYPE_STM32F2XX_USART, 0x400);
     sysbus_init_mmio(SYS_BUS_DEVICE(obj), &s->mmio);
+
+    /* Optional, the USART is gated off while it runs at 0 Hz */
+    s->clk = qdev_init_clock_in(DEVICE(obj), "clk", stm32f2xx_usart_clk_update,
+                                s, ClockUpdate);
 }
 
 static void stm32f2xx_usart_realize(DeviceState *dev, Error **errp)
 {
     STM32F2XXUsartState *s = STM32F2XX_USART(dev);
 
+    fifo8_create(&s->tx_fifo, STM32F2XX_USART_TX_FIFO_SIZE);
+    s->tx_bh = qemu_bh_new(stm32f2xx_usart_tx_drain, s);
+    s->tx_timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, stm32f2xx_usart_tx_timer, s);
+    fifo8_create(&s->rx_fifo, STM32F2XX_USART_RX_FIFO_SIZE);
+    s->rx_timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, stm32f2xx_usart_rx_timer, s);
+
     qemu_chr_fe_set_handlers(&s->chr, stm32f2xx_usart_can_receive,
                              stm32f2xx_usart_receive, NULL, NULL,
                              s, NULL, true);
@@ -226,6 +563,7 @@ static void stm32f2xx_usart_class_init(ObjectClass *klass, void *data)
     dc->reset = stm32f2xx_usart_reset;
     device_class_set_props(dc, stm32f2xx_usart_properties);
     dc->realize = stm32f2xx_usart_realize;
+    dc->vmsd = &vmstate_stm32f2xx_usart;
 }
 
 static const TypeInfo stm32f2xx_usart_info = {
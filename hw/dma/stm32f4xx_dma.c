@@ -0,0 +1,850 @@
+/*
+ * STM32F4XX DMA controller
+ *
+ * Copyright (c) 2023 Julien Combattelli <julien.combattelli@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "qemu/bitops.h"
+#include "qemu/log.h"
+#include "qemu/main-loop.h"
+#include "qemu/module.h"
+#include "qemu/rcu.h"
+#include "trace.h"
+#include "hw/irq.h"
+#include "hw/qdev-properties.h"
+#include "hw/dma/stm32f4xx_dma.h"
+#include "migration/vmstate.h"
+
+#define DMA_SxCR_EN BIT(0)
+#define DMA_SxCR_DMEIE BIT(1)
+#define DMA_SxCR_TEIE BIT(2)
+#define DMA_SxCR_HTIE BIT(3)
+#define DMA_SxCR_TCIE BIT(4)
+#define DMA_SxCR_PFCTRL BIT(5)
+#define DMA_SxCR_DIR_SHIFT 6
+#define DMA_SxCR_CIRC BIT(8)
+#define DMA_SxCR_PINC BIT(9)
+#define DMA_SxCR_MINC BIT(10)
+#define DMA_SxCR_PSIZE_SHIFT 11
+#define DMA_SxCR_MSIZE_SHIFT 13
+#define DMA_SxCR_PINCOS BIT(15)
+#define DMA_SxCR_DBM BIT(18)
+#define DMA_SxCR_CT BIT(19)
+#define DMA_SxCR_CHSEL_SHIFT 25
+#define DMA_SxCR_MASK 0x0FEFFFFF
+
+#define DMA_SxFCR_DMDIS BIT(2)
+#define DMA_SxFCR_FS_SHIFT 3
+#define DMA_SxFCR_FEIE BIT(7)
+#define DMA_SxFCR_MASK 0x87
+
+/* Transfer directions in DMA_SxCR.DIR */
+#define DMA_DIR_P2M 0
+#define DMA_DIR_M2P 1
+#define DMA_DIR_M2M 2
+
+/* Event flags of stream 0, streams 1 to 3 are at the offsets below */
+#define DMA_FEIF BIT(0)
+#define DMA_DMEIF BIT(2)
+#define DMA_TEIF BIT(3)
+#define DMA_HTIF BIT(4)
+#define DMA_TCIF BIT(5)
+#define DMA_FLAGS_MASK 0x3D
+
+static const unsigned int dma_flags_shift[] = { 0, 6, 16, 22 };
+
+static unsigned int stm32f4xx_dma_dir(STM32F4xxDmaStream *st)
+{
+    return extract32(st->cr, DMA_SxCR_DIR_SHIFT, 2);
+}
+
+static unsigned int stm32f4xx_dma_psize(STM32F4xxDmaStream *st)
+{
+    return 1 << MIN(extract32(st->cr, DMA_SxCR_PSIZE_SHIFT, 2), 2);
+}
+
+/* In direct mode, data is written out with the size it was read with */
+static unsigned int stm32f4xx_dma_msize(STM32F4xxDmaStream *st)
+{
+    if (!(st->fcr & DMA_SxFCR_DMDIS))
+    {
+        return stm32f4xx_dma_psize(st);
+    }
+    return 1 << MIN(extract32(st->cr, DMA_SxCR_MSIZE_SHIFT, 2), 2);
+}
+
+static hwaddr stm32f4xx_dma_periph_addr(STM32F4xxDmaStream *st)
+{
+    return st->par + st->periph_pos;
+}
+
+static hwaddr stm32f4xx_dma_mem_addr(STM32F4xxDmaStream *st)
+{
+    bool m1 = (st->cr & DMA_SxCR_DBM) && (st->cr & DMA_SxCR_CT);
+
+    return (m1 ? st->m1ar : st->m0ar) + st->mem_pos;
+}
+
+static void stm32f4xx_dma_update_irq(STM32F4xxDmaState *s, int n)
+{
+    STM32F4xxDmaStream *st = &s->stream[n];
+    uint32_t mask = 0;
+
+    if (st->cr & DMA_SxCR_TCIE)
+    {
+        mask |= DMA_TCIF;
+    }
+    if (st->cr & DMA_SxCR_HTIE)
+    {
+        mask |= DMA_HTIF;
+    }
+    if (st->cr & DMA_SxCR_TEIE)
+    {
+        mask |= DMA_TEIF;
+    }
+    if (st->cr & DMA_SxCR_DMEIE)
+    {
+        mask |= DMA_DMEIF;
+    }
+    if (st->fcr & DMA_SxFCR_FEIE)
+    {
+        mask |= DMA_FEIF;
+    }
+    qemu_set_irq(s->irq[n], !!(st->isr & mask));
+}
+
+static void stm32f4xx_dma_unmap(STM32F4xxDmaState *s, STM32F4xxDmaStream *st)
+{
+    if (st->map)
+    {
+        address_space_unmap(&s->as, st->map, st->map_len, st->map_is_write,
+                            st->map_used);
+        st->map = NULL;
+    }
+}
+
+/* Whether @addr is RAM or ROM, which can be accessed ahead of time */
+static bool stm32f4xx_dma_is_direct(STM32F4xxDmaState *s, hwaddr addr,
+                                    bool is_write)
+{
+    MemoryRegion *mr;
+    hwaddr xlat, len = 1;
+
+    RCU_READ_LOCK_GUARD();
+    mr = address_space_translate(&s->as, addr, &xlat, &len, is_write,
+                                 MEMTXATTRS_UNSPECIFIED);
+    return memory_access_is_direct(mr, is_write);
+}
+
+/*
+ * Access the memory side of a stream. The rest of the buffer is mapped on
+ * the first access, so that a burst of transfers to or from RAM only costs
+ * a copy per item.
+ */
+static MemTxResult stm32f4xx_dma_mem_rw(STM32F4xxDmaState *s,
+                                        STM32F4xxDmaStream *st,
+                                        uint8_t *buf, hwaddr len,
+                                        bool is_write)
+{
+    hwaddr addr = stm32f4xx_dma_mem_addr(st);
+    MemTxResult res = MEMTX_OK;
+    hwaddr offset;
+
+    if (!st->map || st->map_is_write != is_write || addr < st->map_addr ||
+        addr + len > st->map_addr + st->map_len)
+    {
+        stm32f4xx_dma_unmap(s, st);
+        st->map_addr = addr;
+        st->map_len = len;
+        st->map_used = 0;
+        st->map_is_write = is_write;
+        if (st->cr & DMA_SxCR_MINC)
+        {
+            uint32_t total = st->ndtr_reload * stm32f4xx_dma_psize(st);
+
+            st->map_len = MAX(len, total - MIN(st->mem_pos, total));
+        }
+        if (stm32f4xx_dma_is_direct(s, addr, is_write))
+        {
+            st->map = address_space_map(&s->as, addr, &st->map_len, is_write,
+                                        MEMTXATTRS_UNSPECIFIED);
+        }
+        if (st->map && st->map_len < len)
+        {
+            stm32f4xx_dma_unmap(s, st);
+        }
+    }
+
+    if (st->map)
+    {
+        offset = addr - st->map_addr;
+        if (is_write)
+        {
+            memcpy((uint8_t *)st->map + offset, buf, len);
+            st->map_used = MAX(st->map_used, offset + len);
+        }
+        else
+        {
+            memcpy(buf, (uint8_t *)st->map + offset, len);
+        }
+    }
+    else
+    {
+        res = address_space_rw(&s->as, addr, MEMTXATTRS_UNSPECIFIED, buf, len,
+                               is_write);
+    }
+
+    if (st->cr & DMA_SxCR_MINC)
+    {
+        st->mem_pos += len;
+    }
+    return res;
+}
+
+/* Access the peripheral side of a stream, or the source of a memory copy */
+static MemTxResult stm32f4xx_dma_periph_rw(STM32F4xxDmaState *s,
+                                           STM32F4xxDmaStream *st,
+                                           uint8_t *buf, hwaddr len,
+                                           bool is_write)
+{
+    MemTxResult res;
+
+    res = address_space_rw(&s->as, stm32f4xx_dma_periph_addr(st),
+                           MEMTXATTRS_UNSPECIFIED, buf, len, is_write);
+    if (st->cr & DMA_SxCR_PINC)
+    {
+        st->periph_pos += (st->cr & DMA_SxCR_PINCOS) ? 4 : len;
+    }
+    return res;
+}
+
+static void stm32f4xx_dma_fifo_pop(STM32F4xxDmaStream *st, uint32_t len)
+{
+    st->fifo_len -= len;
+    memmove(st->fifo, st->fifo + len, st->fifo_len);
+}
+
+/*
+ * Move one data item of the peripheral size, packing or unpacking it
+ * through the FIFO when the memory size differs.
+ */
+static bool stm32f4xx_dma_transfer_item(STM32F4xxDmaState *s,
+                                        STM32F4xxDmaStream *st)
+{
+    unsigned int psize = stm32f4xx_dma_psize(st);
+    unsigned int msize = stm32f4xx_dma_msize(st);
+    MemTxResult res = MEMTX_OK;
+
+    if (stm32f4xx_dma_dir(st) == DMA_DIR_M2P)
+    {
+        while (st->fifo_len < psize && res == MEMTX_OK)
+        {
+            res = stm32f4xx_dma_mem_rw(s, st, st->fifo + st->fifo_len, msize,
+                                       false);
+            st->fifo_len += msize;
+        }
+        if (res == MEMTX_OK)
+        {
+            res = stm32f4xx_dma_periph_rw(s, st, st->fifo, psize, true);
+            stm32f4xx_dma_fifo_pop(st, psize);
+        }
+    }
+    else
+    {
+        res = stm32f4xx_dma_periph_rw(s, st, st->fifo + st->fifo_len, psize,
+                                      false);
+        st->fifo_len += psize;
+        while (st->fifo_len >= msize && res == MEMTX_OK)
+        {
+            res = stm32f4xx_dma_mem_rw(s, st, st->fifo, msize, true);
+            stm32f4xx_dma_fifo_pop(st, msize);
+        }
+    }
+
+    if (res != MEMTX_OK)
+    {
+        return false;
+    }
+    st->ndtr--;
+    return true;
+}
+
+/*
+ * Copy as much of a memory-to-memory transfer as possible between mapped
+ * RAM, and return the number of bytes copied.
+ */
+static hwaddr stm32f4xx_dma_copy_bulk(STM32F4xxDmaState *s,
+                                      STM32F4xxDmaStream *st)
+{
+    unsigned int unit = MAX(stm32f4xx_dma_psize(st), stm32f4xx_dma_msize(st));
+    hwaddr src = stm32f4xx_dma_periph_addr(st);
+    hwaddr dst = stm32f4xx_dma_mem_addr(st);
+    hwaddr src_len = (hwaddr)st->ndtr * stm32f4xx_dma_psize(st);
+    hwaddr dst_len = src_len;
+    hwaddr len = 0;
+    void *src_map, *dst_map;
+
+    if (!stm32f4xx_dma_is_direct(s, src, false) ||
+        !stm32f4xx_dma_is_direct(s, dst, true))
+    {
+        return 0;
+    }
+
+    src_map = address_space_map(&s->as, src, &src_len, false,
+                                MEMTXATTRS_UNSPECIFIED);
+    dst_map = address_space_map(&s->as, dst, &dst_len, true,
+                                MEMTXATTRS_UNSPECIFIED);
+    if (src_map && dst_map)
+    {
+        len = MIN(src_len, dst_len);
+        len -= len % unit;
+        memmove(dst_map, src_map, len);
+    }
+    if (src_map)
+    {
+        address_space_unmap(&s->as, src_map, src_len, false, len);
+    }
+    if (dst_map)
+    {
+        address_space_unmap(&s->as, dst_map, dst_len, true, len);
+    }
+
+    st->periph_pos += len;
+    st->mem_pos += len;
+    st->ndtr -= len / stm32f4xx_dma_psize(st);
+    return len;
+}
+
+static void stm32f4xx_dma_error(STM32F4xxDmaStream *st)
+{
+    st->isr |= DMA_TEIF;
+    st->cr &= ~DMA_SxCR_EN;
+}
+
+/* Memory-to-memory transfers have no request and complete at once */
+static void stm32f4xx_dma_run_mem_to_mem(STM32F4xxDmaState *s, int n)
+{
+    STM32F4xxDmaStream *st = &s->stream[n];
+    bool bulk = (st->cr & DMA_SxCR_PINC) && (st->cr & DMA_SxCR_MINC) &&
+                !(st->cr & DMA_SxCR_PINCOS);
+
+    if (!s->mem_to_mem)
+    {
+        qemu_log_mask(LOG_GUEST_ERROR,
+                      "%s: stream %d: memory-to-memory is not supported\n",
+                      __func__, n);
+        stm32f4xx_dma_error(st);
+        return;
+    }
+
+    while (st->ndtr)
+    {
+        /* Increasing both addresses moves the same byte stream */
+        if (bulk && stm32f4xx_dma_copy_bulk(s, st))
+        {
+            continue;
+        }
+        if (!stm32f4xx_dma_transfer_item(s, st))
+        {
+            stm32f4xx_dma_error(st);
+            return;
+        }
+    }
+    st->isr |= DMA_HTIF | DMA_TCIF;
+    st->cr &= ~DMA_SxCR_EN;
+    trace_stm32f4xx_dma_complete(n);
+}
+
+/* Tell the requesting peripheral an item moved, and how many are left */
+static void stm32f4xx_dma_ack(STM32F4xxDmaState *s, int n, uint32_t left)
+{
+    STM32F4xxDmaStream *st = &s->stream[n];
+
+    qemu_set_irq(s->ack[n * STM32F4XX_DMA_NUM_CHANNELS +
+                        extract32(st->cr, DMA_SxCR_CHSEL_SHIFT, 3)],
+                 left);
+}
+
+/*
+ * Serve the requests of a stream. Returns true if the stream stopped at
+ * the end of a circular buffer with its request still raised, to be
+ * resumed later rather than looping forever here.
+ */
+static bool stm32f4xx_dma_run_stream(STM32F4xxDmaState *s, int n)
+{
+    STM32F4xxDmaStream *st = &s->stream[n];
+    uint8_t channel = BIT(extract32(st->cr, DMA_SxCR_CHSEL_SHIFT, 3));
+    bool more = false;
+
+    if (!(st->cr & DMA_SxCR_EN))
+    {
+        return false;
+    }
+
+    if (stm32f4xx_dma_dir(st) == DMA_DIR_M2M)
+    {
+        stm32f4xx_dma_run_mem_to_mem(s, n);
+        stm32f4xx_dma_update_irq(s, n);
+        return false;
+    }
+
+    while ((st->cr & DMA_SxCR_EN) && (st->request & channel) && st->ndtr)
+    {
+        if (!stm32f4xx_dma_transfer_item(s, st))
+        {
+            stm32f4xx_dma_error(st);
+            break;
+        }
+        if (st->ndtr == st->ndtr_reload / 2)
+        {
+            st->isr |= DMA_HTIF;
+        }
+        if (st->ndtr)
+        {
+            stm32f4xx_dma_ack(s, n, st->ndtr);
+            continue;
+        }
+
+        st->isr |= DMA_TCIF;
+        trace_stm32f4xx_dma_complete(n);
+        if (!(st->cr & (DMA_SxCR_CIRC | DMA_SxCR_DBM)))
+        {
+            st->cr &= ~DMA_SxCR_EN;
+            stm32f4xx_dma_ack(s, n, 0);
+            break;
+        }
+        stm32f4xx_dma_unmap(s, st);
+        st->ndtr = st->ndtr_reload;
+        st->periph_pos = 0;
+        st->mem_pos = 0;
+        if (st->cr & DMA_SxCR_DBM)
+        {
+            st->cr ^= DMA_SxCR_CT;
+        }
+        stm32f4xx_dma_ack(s, n, st->ndtr);
+        more = st->request & channel;
+        break;
+    }
+
+    stm32f4xx_dma_unmap(s, st);
+    stm32f4xx_dma_update_irq(s, n);
+    return more;
+}
+
+static void stm32f4xx_dma_run(STM32F4xxDmaState *s)
+{
+    bool more = false;
+    int i;
+
+    if (s->running)
+    {
+        /* A stream that was already served asks again, from the main loop */
+        qemu_bh_schedule(s->bh);
+        return;
+    }
+
+    s->running = true;
+    for (i = 0; i < STM32F4XX_DMA_NUM_STREAMS; i++)
+    {
+        more |= stm32f4xx_dma_run_stream(s, i);
+    }
+    s->running = false;
+
+    if (more)
+    {
+        qemu_bh_schedule(s->bh);
+    }
+}
+
+static void stm32f4xx_dma_bh(void *opaque)
+{
+    stm32f4xx_dma_run(opaque);
+}
+
+static void stm32f4xx_dma_request(void *opaque, int n, int level)
+{
+    STM32F4xxDmaState *s = opaque;
+    STM32F4xxDmaStream *st = &s->stream[n / STM32F4XX_DMA_NUM_CHANNELS];
+    uint8_t channel = BIT(n % STM32F4XX_DMA_NUM_CHANNELS);
+
+    if (!level)
+    {
+        st->request &= ~channel;
+        return;
+    }
+    if (st->request & channel)
+    {
+        return;
+    }
+    st->request |= channel;
+    stm32f4xx_dma_run(s);
+}
+
+static void stm32f4xx_dma_reset(DeviceState *dev)
+{
+    STM32F4xxDmaState *s = STM32F4XX_DMA(dev);
+    int i;
+
+    for (i = 0; i < STM32F4XX_DMA_NUM_STREAMS; i++)
+    {
+        STM32F4xxDmaStream *st = &s->stream[i];
+
+        st->cr = 0x00000000;
+        st->ndtr = 0x00000000;
+        st->par = 0x00000000;
+        st->m0ar = 0x00000000;
+        st->m1ar = 0x00000000;
+        st->fcr = 0x00000021;
+        st->isr = 0;
+        st->ndtr_reload = 0;
+        st->periph_pos = 0;
+        st->mem_pos = 0;
+        st->fifo_len = 0;
+        stm32f4xx_dma_update_irq(s, i);
+    }
+}
+
+static uint32_t stm32f4xx_dma_read_isr(STM32F4xxDmaState *s, int first)
+{
+    uint32_t value = 0;
+    int i;
+
+    for (i = 0; i < 4; i++)
+    {
+        value |= s->stream[first + i].isr << dma_flags_shift[i];
+    }
+    return value;
+}
+
+static void stm32f4xx_dma_write_ifcr(STM32F4xxDmaState *s, int first,
+                                     uint32_t value)
+{
+    int i;
+
+    for (i = 0; i < 4; i++)
+    {
+        s->stream[first + i].isr &=
+            ~((value >> dma_flags_shift[i]) & DMA_FLAGS_MASK);
+        stm32f4xx_dma_update_irq(s, first + i);
+    }
+}
+
+static uint32_t stm32f4xx_dma_read_fcr(STM32F4xxDmaStream *st)
+{
+    uint32_t fs;
+
+    if (st->fifo_len == 0)
+    {
+        fs = 4;
+    }
+    else if (st->fifo_len == STM32F4XX_DMA_FIFO_SIZE)
+    {
+        fs = 5;
+    }
+    else
+    {
+        fs = st->fifo_len * 4 / STM32F4XX_DMA_FIFO_SIZE;
+    }
+    return (st->fcr & DMA_SxFCR_MASK) | (fs << DMA_SxFCR_FS_SHIFT);
+}
+
+static uint64_t stm32f4xx_dma_read(void *opaque, hwaddr addr,
+                                   unsigned int size)
+{
+    STM32F4xxDmaState *s = opaque;
+    STM32F4xxDmaStream *st;
+
+    trace_stm32f4xx_dma_read(addr);
+
+    switch (addr)
+    {
+    case DMA_LISR:
+        return stm32f4xx_dma_read_isr(s, 0);
+    case DMA_HISR:
+        return stm32f4xx_dma_read_isr(s, 4);
+    case DMA_LIFCR:
+    case DMA_HIFCR:
+        return 0;
+    }
+
+    if (addr < DMA_STREAM_BASE ||
+        addr >= DMA_STREAM_BASE + STM32F4XX_DMA_NUM_STREAMS * DMA_STREAM_SIZE)
+    {
+        qemu_log_mask(LOG_GUEST_ERROR,
+                      "%s: Bad offset 0x%" HWADDR_PRIx "\n", __func__, addr);
+        return 0;
+    }
+
+    st = &s->stream[(addr - DMA_STREAM_BASE) / DMA_STREAM_SIZE];
+    switch ((addr - DMA_STREAM_BASE) % DMA_STREAM_SIZE)
+    {
+    case DMA_SxCR:
+        return st->cr;
+    case DMA_SxNDTR:
+        return st->ndtr;
+    case DMA_SxPAR:
+        return st->par;
+    case DMA_SxM0AR:
+        return st->m0ar;
+    case DMA_SxM1AR:
+        return st->m1ar;
+    case DMA_SxFCR:
+        return stm32f4xx_dma_read_fcr(st);
+    }
+    return 0;
+}
+
+static void stm32f4xx_dma_write_cr(STM32F4xxDmaState *s, int n,
+                                   uint32_t value)
+{
+    STM32F4xxDmaStream *st = &s->stream[n];
+
+    if (st->cr & DMA_SxCR_EN)
+    {
+        /* Only EN can be written while the stream is enabled */
+        if (!(value & DMA_SxCR_EN))
+        {
+            st->cr &= ~DMA_SxCR_EN;
+            /* Aborting a transfer sets TCIF once the stream stops */
+            st->isr |= DMA_TCIF;
+            stm32f4xx_dma_update_irq(s, n);
+        }
+        return;
+    }
+
+    st->cr = value & DMA_SxCR_MASK;
+    if (st->cr & DMA_SxCR_PFCTRL)
+    {
+        qemu_log_mask(LOG_UNIMP, "%s: stream %d: peripheral flow control "
+                      "is not implemented\n", __func__, n);
+    }
+    if (st->cr & DMA_SxCR_EN)
+    {
+        if (st->ndtr == 0)
+        {
+            st->cr &= ~DMA_SxCR_EN;
+            return;
+        }
+        st->ndtr_reload = st->ndtr;
+        st->periph_pos = 0;
+        st->mem_pos = 0;
+        st->fifo_len = 0;
+        stm32f4xx_dma_run(s);
+    }
+    else
+    {
+        stm32f4xx_dma_update_irq(s, n);
+    }
+}
+
+static void stm32f4xx_dma_write(void *opaque, hwaddr addr,
+                                uint64_t val64, unsigned int size)
+{
+    STM32F4xxDmaState *s = opaque;
+    uint32_t value = (uint32_t)val64;
+    STM32F4xxDmaStream *st;
+    bool enabled;
+    int n;
+
+    trace_stm32f4xx_dma_write(addr, value);
+
+    switch (addr)
+    {
+    case DMA_LISR:
+    case DMA_HISR:
+        qemu_log_mask(LOG_GUEST_ERROR, "%s: Read only register: "
+                      "0x%" HWADDR_PRIx "\n", __func__, addr);
+        return;
+    case DMA_LIFCR:
+        stm32f4xx_dma_write_ifcr(s, 0, value);
+        return;
+    case DMA_HIFCR:
+        stm32f4xx_dma_write_ifcr(s, 4, value);
+        return;
+    }
+
+    if (addr < DMA_STREAM_BASE ||
+        addr >= DMA_STREAM_BASE + STM32F4XX_DMA_NUM_STREAMS * DMA_STREAM_SIZE)
+    {
+        qemu_log_mask(LOG_GUEST_ERROR,
+                      "%s: Bad offset 0x%" HWADDR_PRIx "\n", __func__, addr);
+        return;
+    }
+
+    n = (addr - DMA_STREAM_BASE) / DMA_STREAM_SIZE;
+    st = &s->stream[n];
+    enabled = st->cr & DMA_SxCR_EN;
+    switch ((addr - DMA_STREAM_BASE) % DMA_STREAM_SIZE)
+    {
+    case DMA_SxCR:
+        stm32f4xx_dma_write_cr(s, n, value);
+        return;
+    case DMA_SxNDTR:
+        if (!enabled)
+        {
+            st->ndtr = value & 0xFFFF;
+        }
+        return;
+    case DMA_SxPAR:
+        if (!enabled)
+        {
+            st->par = value;
+        }
+        return;
+    case DMA_SxM0AR:
+        /* In double-buffer mode, the buffer not in use can be changed */
+        if (!enabled || (st->cr & DMA_SxCR_CT))
+        {
+            st->m0ar = value;
+        }
+        return;
+    case DMA_SxM1AR:
+        if (!enabled || !(st->cr & DMA_SxCR_CT))
+        {
+            st->m1ar = value;
+        }
+        return;
+    case DMA_SxFCR:
+        if (!enabled)
+        {
+            st->fcr = value & DMA_SxFCR_MASK;
+            stm32f4xx_dma_update_irq(s, n);
+        }
+        return;
+    }
+}
+
+static const MemoryRegionOps stm32f4xx_dma_ops = {
+    .read = stm32f4xx_dma_read,
+    .write = stm32f4xx_dma_write,
+    .endianness = DEVICE_NATIVE_ENDIAN,
+    .impl.min_access_size = 4,
+    .impl.max_access_size = 4,
+};
+
+static void stm32f4xx_dma_init(Object *obj)
+{
+    STM32F4xxDmaState *s = STM32F4XX_DMA(obj);
+    int i;
+
+    for (i = 0; i < STM32F4XX_DMA_NUM_STREAMS; i++)
+    {
+        sysbus_init_irq(SYS_BUS_DEVICE(obj), &s->irq[i]);
+    }
+
+    memory_region_init_io(&s->mmio, obj, &stm32f4xx_dma_ops, s,
+                          TYPE_STM32F4XX_DMA, 0x400);
+    sysbus_init_mmio(SYS_BUS_DEVICE(obj), &s->mmio);
+
+    qdev_init_gpio_in_named(DEVICE(obj), stm32f4xx_dma_request, "request",
+                            STM32F4XX_DMA_NUM_STREAMS *
+                            STM32F4XX_DMA_NUM_CHANNELS);
+    qdev_init_gpio_out_named(DEVICE(obj), s->ack, "ack", ARRAY_SIZE(s->ack));
+}
+
+static void stm32f4xx_dma_realize(DeviceState *dev, Error **errp)
+{
+    STM32F4xxDmaState *s = STM32F4XX_DMA(dev);
+
+    if (!s->memory)
+    {
+        error_setg(errp, "DMA 'memory' link not set");
+        return;
+    }
+
+    address_space_init(&s->as, s->memory, TYPE_STM32F4XX_DMA);
+    s->bh = qemu_bh_new(stm32f4xx_dma_bh, s);
+}
+
+static int stm32f4xx_dma_post_load(void *opaque, int version_id)
+{
+    STM32F4xxDmaState *s = opaque;
+
+    /* Streams may have been waiting to be resumed */
+    qemu_bh_schedule(s->bh);
+    return 0;
+}
+
+static const VMStateDescription vmstate_stm32f4xx_dma_stream = {
+    .name = TYPE_STM32F4XX_DMA "/stream",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]){
+        VMSTATE_UINT32(cr, STM32F4xxDmaStream),
+        VMSTATE_UINT32(ndtr, STM32F4xxDmaStream),
+        VMSTATE_UINT32(par, STM32F4xxDmaStream),
+        VMSTATE_UINT32(m0ar, STM32F4xxDmaStream),
+        VMSTATE_UINT32(m1ar, STM32F4xxDmaStream),
+        VMSTATE_UINT32(fcr, STM32F4xxDmaStream),
+        VMSTATE_UINT32(isr, STM32F4xxDmaStream),
+        VMSTATE_UINT32(ndtr_reload, STM32F4xxDmaStream),
+        VMSTATE_UINT32(periph_pos, STM32F4xxDmaStream),
+        VMSTATE_UINT32(mem_pos, STM32F4xxDmaStream),
+        VMSTATE_UINT8_ARRAY(fifo, STM32F4xxDmaStream,
+                            STM32F4XX_DMA_FIFO_SIZE),
+        VMSTATE_UINT32(fifo_len, STM32F4xxDmaStream),
+        VMSTATE_UINT8(request, STM32F4xxDmaStream),
+        VMSTATE_END_OF_LIST()}};
+
+static const VMStateDescription vmstate_stm32f4xx_dma = {
+    .name = TYPE_STM32F4XX_DMA,
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .post_load = stm32f4xx_dma_post_load,
+    .fields = (VMStateField[]){
+        VMSTATE_STRUCT_ARRAY(stream, STM32F4xxDmaState,
+                             STM32F4XX_DMA_NUM_STREAMS, 1,
+                             vmstate_stm32f4xx_dma_stream, STM32F4xxDmaStream),
+        VMSTATE_END_OF_LIST()}};
+
+static Property stm32f4xx_dma_properties[] = {
+    DEFINE_PROP_LINK("memory", STM32F4xxDmaState, memory, TYPE_MEMORY_REGION,
+                     MemoryRegion *),
+    DEFINE_PROP_BOOL("memory-to-memory", STM32F4xxDmaState, mem_to_mem, true),
+    DEFINE_PROP_END_OF_LIST(),
+};
+
+static void stm32f4xx_dma_class_init(ObjectClass *klass, void *data)
+{
+    DeviceClass *dc = DEVICE_CLASS(klass);
+
+    dc->reset = stm32f4xx_dma_reset;
+    dc->realize = stm32f4xx_dma_realize;
+    dc->vmsd = &vmstate_stm32f4xx_dma;
+    device_class_set_props(dc, stm32f4xx_dma_properties);
+}
+
+static const TypeInfo stm32f4xx_dma_info = {
+    .name = TYPE_STM32F4XX_DMA,
+    .parent = TYPE_SYS_BUS_DEVICE,
+    .instance_size = sizeof(STM32F4xxDmaState),
+    .instance_init = stm32f4xx_dma_init,
+    .class_init = stm32f4xx_dma_class_init,
+};
+
+static void stm32f4xx_dma_register_types(void)
+{
+    type_register_static(&stm32f4xx_dma_info);
+}
+
+type_init(stm32f4xx_dma_register_types)
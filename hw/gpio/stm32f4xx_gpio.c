@@ -0,0 +1,416 @@
+/*
+ * STM32F4XX GPIO
+ *
+ * Copyright (c) 2023 Julien Combattelli <julien.combattelli@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/bitops.h"
+#include "qemu/log.h"
+#include "qemu/module.h"
+#include "trace.h"
+#include "hw/irq.h"
+#include "hw/qdev-properties.h"
+#include "hw/gpio/stm32f4xx_gpio.h"
+#include "migration/vmstate.h"
+
+#define GPIO_MODE_INPUT 0
+#define GPIO_MODE_OUTPUT 1
+#define GPIO_MODE_ANALOG 3
+
+#define GPIO_PUPD_UP 1
+
+#define GPIO_LCKR_LCKK BIT(16)
+#define GPIO_LCKR_LCK_MASK 0xFFFF
+
+/* Spread a mask of pins to the fields of a register with @width bits each */
+static uint32_t stm32f4xx_gpio_field_mask(uint16_t pins, int width)
+{
+    uint32_t mask = 0;
+    int pin;
+
+    for (pin = 0; pin < 32 / width; pin++)
+    {
+        if (pins & BIT(pin))
+        {
+            mask |= MAKE_64BIT_MASK(pin * width, width);
+        }
+    }
+    return mask;
+}
+
+static uint16_t stm32f4xx_gpio_locked(STM32F4xxGpioState *s)
+{
+    if (!(s->gpio_lckr & GPIO_LCKR_LCKK))
+    {
+        return 0;
+    }
+    return s->gpio_lckr & GPIO_LCKR_LCK_MASK;
+}
+
+/*
+ * Write a configuration register, leaving the fields of the @locked pins
+ * alone. Bit 0 of @locked is the pin of the register's first field.
+ */
+static uint32_t stm32f4xx_gpio_write_config(uint32_t old, uint32_t value,
+                                            uint16_t locked, int width)
+{
+    uint32_t mask = stm32f4xx_gpio_field_mask(locked, width);
+
+    return (old & mask) | (value & ~mask);
+}
+
+uint16_t stm32f4xx_gpio_output_mask(STM32F4xxGpioState *s)
+{
+    uint16_t mask = 0;
+    int pin;
+
+    for (pin = 0; pin < STM32F4XX_GPIO_NUM_PINS; pin++)
+    {
+        if (extract32(s->gpio_moder, pin * 2, 2) == GPIO_MODE_OUTPUT)
+        {
+            mask |= BIT(pin);
+        }
+    }
+    return mask;
+}
+
+static uint32_t stm32f4xx_gpio_compute_idr(STM32F4xxGpioState *s)
+{
+    uint32_t idr = 0;
+    int pin;
+
+    for (pin = 0; pin < STM32F4XX_GPIO_NUM_PINS; pin++)
+    {
+        uint32_t mode = extract32(s->gpio_moder, pin * 2, 2);
+        bool open_drain = s->gpio_otyper & BIT(pin);
+        bool level;
+
+        if (mode == GPIO_MODE_ANALOG)
+        {
+            /* The input Schmitt trigger is disabled, IDR reads 0 */
+            continue;
+        }
+
+        if (mode == GPIO_MODE_OUTPUT && !(open_drain &&
+                                          (s->gpio_odr & BIT(pin))))
+        {
+            /* Driven by the output stage */
+            level = s->gpio_odr & BIT(pin);
+        }
+        else if (s->ext_mask & BIT(pin))
+        {
+            level = s->ext_level & BIT(pin);
+        }
+        else
+        {
+            /* Floating pins read 0 */
+            level = extract32(s->gpio_pupdr, pin * 2, 2) == GPIO_PUPD_UP;
+        }
+
+        if (level)
+        {
+            idr |= BIT(pin);
+        }
+    }
+    return idr;
+}
+
+/* Recompute IDR, forward its changes, and tell about output changes */
+static void stm32f4xx_gpio_update(STM32F4xxGpioState *s, uint32_t old_odr,
+                                  uint16_t old_outputs)
+{
+    uint32_t idr = stm32f4xx_gpio_compute_idr(s);
+    uint32_t changed = idr ^ s->gpio_idr;
+    int pin;
+
+    s->gpio_idr = idr;
+    for (pin = 0; pin < STM32F4XX_GPIO_NUM_PINS; pin++)
+    {
+        if (changed & BIT(pin))
+        {
+            qemu_set_irq(s->pin[pin], !!(idr & BIT(pin)));
+        }
+    }
+
+    if (s->gpio_odr != old_odr ||
+        stm32f4xx_gpio_output_mask(s) != old_outputs)
+    {
+        notifier_list_notify(&s->output_notifiers, s);
+    }
+}
+
+void stm32f4xx_gpio_drive(STM32F4xxGpioState *s, uint16_t mask,
+                          uint16_t level)
+{
+    trace_stm32f4xx_gpio_drive(mask, level);
+
+    s->ext_mask |= mask;
+    s->ext_level = (s->ext_level & ~mask) | (level & mask);
+    stm32f4xx_gpio_update(s, s->gpio_odr, stm32f4xx_gpio_output_mask(s));
+}
+
+void stm32f4xx_gpio_release(STM32F4xxGpioState *s, uint16_t mask)
+{
+    trace_stm32f4xx_gpio_release(mask);
+
+    s->ext_mask &= ~mask;
+    s->ext_level &= ~mask;
+    stm32f4xx_gpio_update(s, s->gpio_odr, stm32f4xx_gpio_output_mask(s));
+}
+
+void stm32f4xx_gpio_add_output_notifier(STM32F4xxGpioState *s,
+                                        Notifier *notifier)
+{
+    notifier_list_add(&s->output_notifiers, notifier);
+}
+
+static void stm32f4xx_gpio_set_input(void *opaque, int n, int level)
+{
+    STM32F4xxGpioState *s = opaque;
+
+    stm32f4xx_gpio_drive(s, BIT(n), level ? BIT(n) : 0);
+}
+
+static void stm32f4xx_gpio_reset(DeviceState *dev)
+{
+    STM32F4xxGpioState *s = STM32F4XX_GPIO(dev);
+    uint32_t old_odr = s->gpio_odr;
+    uint16_t old_outputs = stm32f4xx_gpio_output_mask(s);
+
+    s->gpio_moder = s->moder_reset;
+    s->gpio_otyper = 0x00000000;
+    s->gpio_ospeedr = s->ospeedr_reset;
+    s->gpio_pupdr = s->pupdr_reset;
+    s->gpio_odr = 0x00000000;
+    s->gpio_lckr = 0x00000000;
+    s->gpio_afr[0] = 0x00000000;
+    s->gpio_afr[1] = 0x00000000;
+    s->lock_step = 0;
+
+    /* Pins driven from outside the chip stay driven */
+    stm32f4xx_gpio_update(s, old_odr, old_outputs);
+}
+
+static uint64_t stm32f4xx_gpio_read(void *opaque, hwaddr addr,
+                                    unsigned int size)
+{
+    STM32F4xxGpioState *s = opaque;
+
+    trace_stm32f4xx_gpio_read(addr);
+
+    switch (addr)
+    {
+    case GPIO_MODER:
+        return s->gpio_moder;
+    case GPIO_OTYPER:
+        return s->gpio_otyper;
+    case GPIO_OSPEEDR:
+        return s->gpio_ospeedr;
+    case GPIO_PUPDR:
+        return s->gpio_pupdr;
+    case GPIO_IDR:
+        return s->gpio_idr;
+    case GPIO_ODR:
+        return s->gpio_odr;
+    case GPIO_BSRR:
+        /* Write only */
+        return 0;
+    case GPIO_LCKR:
+        /* The lock sequence ends with a read */
+        if (s->lock_step == 3)
+        {
+            s->gpio_lckr |= GPIO_LCKR_LCKK;
+        }
+        s->lock_step = 0;
+        return s->gpio_lckr;
+    case GPIO_AFRL:
+    case GPIO_AFRH:
+        return s->gpio_afr[(addr - GPIO_AFRL) / 4];
+    default:
+        qemu_log_mask(LOG_GUEST_ERROR,
+                      "%s: Bad offset 0x%" HWADDR_PRIx "\n", __func__, addr);
+    }
+    return 0;
+}
+
+/* Follow the LCKK=1, LCKK=0, LCKK=1 writes of the lock sequence */
+static void stm32f4xx_gpio_write_lckr(STM32F4xxGpioState *s, uint32_t value)
+{
+    static const bool lckk_sequence[] = { true, false, true };
+    bool lckk = value & GPIO_LCKR_LCKK;
+
+    if (s->gpio_lckr & GPIO_LCKR_LCKK)
+    {
+        /* Locked until the next reset */
+        return;
+    }
+
+    if (s->lock_step < ARRAY_SIZE(lckk_sequence) &&
+        lckk == lckk_sequence[s->lock_step] &&
+        (s->lock_step == 0 ||
+         (value & GPIO_LCKR_LCK_MASK) == s->gpio_lckr))
+    {
+        s->lock_step++;
+    }
+    else
+    {
+        s->lock_step = lckk ? 1 : 0;
+    }
+    s->gpio_lckr = value & GPIO_LCKR_LCK_MASK;
+}
+
+static void stm32f4xx_gpio_write(void *opaque, hwaddr addr,
+                                 uint64_t val64, unsigned int size)
+{
+    STM32F4xxGpioState *s = opaque;
+    uint32_t value = (uint32_t)val64;
+    uint32_t old_odr = s->gpio_odr;
+    uint16_t old_outputs = stm32f4xx_gpio_output_mask(s);
+    uint16_t locked = stm32f4xx_gpio_locked(s);
+
+    trace_stm32f4xx_gpio_write(addr, value);
+
+    if (addr != GPIO_LCKR)
+    {
+        s->lock_step = 0;
+    }
+
+    switch (addr)
+    {
+    case GPIO_MODER:
+        s->gpio_moder = stm32f4xx_gpio_write_config(s->gpio_moder, value,
+                                                    locked, 2);
+        break;
+    case GPIO_OTYPER:
+        s->gpio_otyper = stm32f4xx_gpio_write_config(s->gpio_otyper,
+                                                     value & 0xFFFF, locked, 1);
+        break;
+    case GPIO_OSPEEDR:
+        s->gpio_ospeedr = stm32f4xx_gpio_write_config(s->gpio_ospeedr, value,
+                                                      locked, 2);
+        return;
+    case GPIO_PUPDR:
+        s->gpio_pupdr = stm32f4xx_gpio_write_config(s->gpio_pupdr, value,
+                                                    locked, 2);
+        break;
+    case GPIO_IDR:
+        qemu_log_mask(LOG_GUEST_ERROR, "%s: Read only register: "
+                      "0x%" HWADDR_PRIx "\n", __func__, addr);
+        return;
+    case GPIO_ODR:
+        s->gpio_odr = value & 0xFFFF;
+        break;
+    case GPIO_BSRR:
+        /* Set takes priority over reset */
+        s->gpio_odr = (s->gpio_odr & ~(value >> 16)) | (value & 0xFFFF);
+        break;
+    case GPIO_LCKR:
+        stm32f4xx_gpio_write_lckr(s, value);
+        return;
+    case GPIO_AFRL:
+        s->gpio_afr[0] = stm32f4xx_gpio_write_config(s->gpio_afr[0], value,
+                                                     locked, 4);
+        return;
+    case GPIO_AFRH:
+        s->gpio_afr[1] = stm32f4xx_gpio_write_config(s->gpio_afr[1], value,
+                                                     locked >> 8, 4);
+        return;
+    default:
+        qemu_log_mask(LOG_GUEST_ERROR,
+                      "%s: Bad offset 0x%" HWADDR_PRIx "\n", __func__, addr);
+        return;
+    }
+
+    stm32f4xx_gpio_update(s, old_odr, old_outputs);
+}
+
+static const MemoryRegionOps stm32f4xx_gpio_ops = {
+    .read = stm32f4xx_gpio_read,
+    .write = stm32f4xx_gpio_write,
+    .endianness = DEVICE_NATIVE_ENDIAN,
+    .impl.min_access_size = 4,
+    .impl.max_access_size = 4,
+};
+
+static void stm32f4xx_gpio_init(Object *obj)
+{
+    STM32F4xxGpioState *s = STM32F4XX_GPIO(obj);
+
+    memory_region_init_io(&s->mmio, obj, &stm32f4xx_gpio_ops, s,
+                          TYPE_STM32F4XX_GPIO, 0x400);
+    sysbus_init_mmio(SYS_BUS_DEVICE(obj), &s->mmio);
+
+    qdev_init_gpio_out(DEVICE(obj), s->pin, STM32F4XX_GPIO_NUM_PINS);
+    qdev_init_gpio_in_named(DEVICE(obj), stm32f4xx_gpio_set_input, "input",
+                            STM32F4XX_GPIO_NUM_PINS);
+
+    notifier_list_init(&s->output_notifiers);
+}
+
+static const VMStateDescription vmstate_stm32f4xx_gpio = {
+    .name = TYPE_STM32F4XX_GPIO,
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]){
+        VMSTATE_UINT32(gpio_moder, STM32F4xxGpioState),
+        VMSTATE_UINT32(gpio_otyper, STM32F4xxGpioState),
+        VMSTATE_UINT32(gpio_ospeedr, STM32F4xxGpioState),
+        VMSTATE_UINT32(gpio_pupdr, STM32F4xxGpioState),
+        VMSTATE_UINT32(gpio_idr, STM32F4xxGpioState),
+        VMSTATE_UINT32(gpio_odr, STM32F4xxGpioState),
+        VMSTATE_UINT32(gpio_lckr, STM32F4xxGpioState),
+        VMSTATE_UINT32_ARRAY(gpio_afr, STM32F4xxGpioState, 2),
+        VMSTATE_UINT32(lock_step, STM32F4xxGpioState),
+        VMSTATE_UINT32(ext_mask, STM32F4xxGpioState),
+        VMSTATE_UINT32(ext_level, STM32F4xxGpioState),
+        VMSTATE_END_OF_LIST()}};
+
+static Property stm32f4xx_gpio_properties[] = {
+    DEFINE_PROP_UINT32("moder-reset", STM32F4xxGpioState, moder_reset, 0),
+    DEFINE_PROP_UINT32("ospeedr-reset", STM32F4xxGpioState, ospeedr_reset, 0),
+    DEFINE_PROP_UINT32("pupdr-reset", STM32F4xxGpioState, pupdr_reset, 0),
+    DEFINE_PROP_END_OF_LIST(),
+};
+
+static void stm32f4xx_gpio_class_init(ObjectClass *klass, void *data)
+{
+    DeviceClass *dc = DEVICE_CLASS(klass);
+
+    dc->reset = stm32f4xx_gpio_reset;
+    dc->vmsd = &vmstate_stm32f4xx_gpio;
+    device_class_set_props(dc, stm32f4xx_gpio_properties);
+}
+
+static const TypeInfo stm32f4xx_gpio_info = {
+    .name = TYPE_STM32F4XX_GPIO,
+    .parent = TYPE_SYS_BUS_DEVICE,
+    .instance_size = sizeof(STM32F4xxGpioState),
+    .instance_init = stm32f4xx_gpio_init,
+    .class_init = stm32f4xx_gpio_class_init,
+};
+
+static void stm32f4xx_gpio_register_types(void)
+{
+    type_register_static(&stm32f4xx_gpio_info);
+}
+
+type_init(stm32f4xx_gpio_register_types)
@@ -0,0 +1,330 @@
+/*
+ * STM32F4XX GPIO host link
+ *
+ * Copyright (c) 2023 Julien Combattelli <julien.combattelli@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/bswap.h"
+#include "qemu/error-report.h"
+#include "qemu/main-loop.h"
+#include "qemu/module.h"
+#include "qemu/timer.h"
+#include "qapi/error.h"
+#include "trace.h"
+#include "hw/qdev-properties.h"
+#include "hw/qdev-properties-system.h"
+#include "hw/gpio/stm32f4xx_gpio_link.h"
+
+static void stm32f4xx_gpio_link_push_state(STM32F4xxGpioLinkState *s,
+                                           unsigned int index)
+{
+    STM32F4xxGpioState *port = s->port[index];
+    uint8_t event[STM32F4XX_GPIO_LINK_EVENT_SIZE] = {
+        STM32F4XX_GPIO_LINK_EVENT_OUTPUT, index,
+    };
+    uint16_t odr = port->gpio_odr;
+    uint16_t outputs = stm32f4xx_gpio_output_mask(port);
+
+    trace_stm32f4xx_gpio_link_output(index, odr, outputs);
+
+    stw_le_p(&event[2], odr);
+    stw_le_p(&event[4], outputs);
+    stq_le_p(&event[8], s->port_link[index].changed_ns);
+    fifo8_push_all(&s->tx_fifo, event, sizeof(event));
+    s->port_link[index].dirty = false;
+}
+
+/*
+ * Queue the latest state of the ports whose changes did not fit. Returns
+ * true if some of them still do not.
+ */
+static bool stm32f4xx_gpio_link_push_dirty(STM32F4xxGpioLinkState *s)
+{
+    unsigned int i;
+
+    for (i = 0; i < STM32F4XX_GPIO_LINK_MAX_PORTS; i++)
+    {
+        if (!s->port_link[i].dirty)
+        {
+            continue;
+        }
+        if (fifo8_num_free(&s->tx_fifo) < STM32F4XX_GPIO_LINK_EVENT_SIZE)
+        {
+            return true;
+        }
+        stm32f4xx_gpio_link_push_state(s, i);
+    }
+    return false;
+}
+
+static void stm32f4xx_gpio_link_send_state(STM32F4xxGpioLinkState *s,
+                                           unsigned int index)
+{
+    STM32F4xxGpioLinkPort *port = &s->port_link[index];
+
+    if (!qemu_chr_fe_backend_connected(&s->chr))
+    {
+        return;
+    }
+
+    port->changed_ns = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    if (port->dirty ||
+        fifo8_num_free(&s->tx_fifo) < STM32F4XX_GPIO_LINK_EVENT_SIZE)
+    {
+        /*
+         * The host is not keeping up. Only its latest state is sent for
+         * the port, once there is room again.
+         */
+        port->dirty = true;
+        qemu_bh_schedule(s->tx_bh);
+        return;
+    }
+
+    stm32f4xx_gpio_link_push_state(s, index);
+    qemu_bh_schedule(s->tx_bh);
+}
+
+static void stm32f4xx_gpio_link_output_changed(Notifier *notifier, void *data)
+{
+    STM32F4xxGpioLinkPort *port =
+        container_of(notifier, STM32F4xxGpioLinkPort, output_notifier);
+
+    stm32f4xx_gpio_link_send_state(port->link, port->index);
+}
+
+static gboolean stm32f4xx_gpio_link_tx_ready(void *do_not_use,
+                                             GIOCondition cond, void *opaque)
+{
+    STM32F4xxGpioLinkState *s = opaque;
+
+    s->tx_watch_tag = 0;
+    qemu_bh_schedule(s->tx_bh);
+    return G_SOURCE_REMOVE;
+}
+
+/* Write out the events queued during the last main loop turn at once */
+static void stm32f4xx_gpio_link_tx_drain(void *opaque)
+{
+    STM32F4xxGpioLinkState *s = opaque;
+    const uint8_t *buf;
+    uint32_t len;
+    unsigned int i;
+    bool dirty;
+    int ret;
+
+    /* Writing out the queue makes room for the ports left dirty */
+    do
+    {
+        dirty = stm32f4xx_gpio_link_push_dirty(s);
+        while (!fifo8_is_empty(&s->tx_fifo))
+        {
+            buf = fifo8_peek_buf(&s->tx_fifo, fifo8_num_used(&s->tx_fifo),
+                                 &len);
+            ret = qemu_chr_fe_write(&s->chr, buf, len);
+            if (ret <= 0)
+            {
+                break;
+            }
+            fifo8_pop_buf(&s->tx_fifo, ret, &len);
+        }
+    } while (dirty && fifo8_is_empty(&s->tx_fifo));
+
+    if (!fifo8_is_empty(&s->tx_fifo) && !s->tx_watch_tag)
+    {
+        s->tx_watch_tag = qemu_chr_fe_add_watch(&s->chr, G_IO_OUT | G_IO_HUP,
+                                                stm32f4xx_gpio_link_tx_ready,
+                                                s);
+        if (!s->tx_watch_tag)
+        {
+            /* No backend, or nothing to wait for: drop the data */
+            fifo8_reset(&s->tx_fifo);
+            for (i = 0; i < STM32F4XX_GPIO_LINK_MAX_PORTS; i++)
+            {
+                s->port_link[i].dirty = false;
+            }
+        }
+    }
+}
+
+static void stm32f4xx_gpio_link_command(STM32F4xxGpioLinkState *s,
+                                        const uint8_t *cmd)
+{
+    unsigned int index = cmd[1];
+    uint16_t mask = lduw_le_p(&cmd[2]);
+    uint16_t level = lduw_le_p(&cmd[4]);
+
+    trace_stm32f4xx_gpio_link_command(cmd[0], index, mask, level);
+
+    if (index >= STM32F4XX_GPIO_LINK_MAX_PORTS || !s->port[index])
+    {
+        warn_report_once("%s: command for unknown port %u",
+                         TYPE_STM32F4XX_GPIO_LINK, index);
+        return;
+    }
+
+    switch (cmd[0])
+    {
+    case STM32F4XX_GPIO_LINK_CMD_DRIVE:
+        stm32f4xx_gpio_drive(s->port[index], mask, level);
+        break;
+    case STM32F4XX_GPIO_LINK_CMD_RELEASE:
+        stm32f4xx_gpio_release(s->port[index], mask);
+        break;
+    default:
+        warn_report_once("%s: unknown command 0x%02x",
+                         TYPE_STM32F4XX_GPIO_LINK, cmd[0]);
+    }
+}
+
+static int stm32f4xx_gpio_link_can_receive(void *opaque)
+{
+    /* Commands are applied as soon as they are received */
+    return 4096;
+}
+
+static void stm32f4xx_gpio_link_receive(void *opaque, const uint8_t *buf,
+                                        int size)
+{
+    STM32F4xxGpioLinkState *s = opaque;
+    uint32_t len;
+
+    if (s->rx_len)
+    {
+        len = MIN(size, sizeof(s->rx_buf) - s->rx_len);
+        memcpy(&s->rx_buf[s->rx_len], buf, len);
+        s->rx_len += len;
+        buf += len;
+        size -= len;
+        if (s->rx_len < sizeof(s->rx_buf))
+        {
+            return;
+        }
+        stm32f4xx_gpio_link_command(s, s->rx_buf);
+        s->rx_len = 0;
+    }
+
+    while (size >= STM32F4XX_GPIO_LINK_CMD_SIZE)
+    {
+        stm32f4xx_gpio_link_command(s, buf);
+        buf += STM32F4XX_GPIO_LINK_CMD_SIZE;
+        size -= STM32F4XX_GPIO_LINK_CMD_SIZE;
+    }
+
+    memcpy(s->rx_buf, buf, size);
+    s->rx_len = size;
+}
+
+static void stm32f4xx_gpio_link_event(void *opaque, QEMUChrEvent event)
+{
+    STM32F4xxGpioLinkState *s = opaque;
+    unsigned int i;
+
+    if (event != CHR_EVENT_OPENED)
+    {
+        return;
+    }
+
+    /* Start from a clean slate with every new host connection */
+    s->rx_len = 0;
+    fifo8_reset(&s->tx_fifo);
+    for (i = 0; i < STM32F4XX_GPIO_LINK_MAX_PORTS; i++)
+    {
+        s->port_link[i].dirty = false;
+        if (s->port[i])
+        {
+            stm32f4xx_gpio_link_send_state(s, i);
+        }
+    }
+}
+
+static void stm32f4xx_gpio_link_init(Object *obj)
+{
+    STM32F4xxGpioLinkState *s = STM32F4XX_GPIO_LINK(obj);
+    unsigned int i;
+
+    for (i = 0; i < STM32F4XX_GPIO_LINK_MAX_PORTS; i++)
+    {
+        g_autofree char *name = g_strdup_printf("port[%u]", i);
+
+        object_property_add_link(obj, name, TYPE_STM32F4XX_GPIO,
+                                 (Object **)&s->port[i],
+                                 qdev_prop_allow_set_link_before_realize,
+                                 OBJ_PROP_LINK_STRONG);
+    }
+}
+
+static void stm32f4xx_gpio_link_realize(DeviceState *dev, Error **errp)
+{
+    STM32F4xxGpioLinkState *s = STM32F4XX_GPIO_LINK(dev);
+    unsigned int i;
+
+    for (i = 0; i < STM32F4XX_GPIO_LINK_MAX_PORTS; i++)
+    {
+        if (!s->port[i])
+        {
+            continue;
+        }
+        s->port_link[i].link = s;
+        s->port_link[i].index = i;
+        s->port_link[i].output_notifier.notify =
+            stm32f4xx_gpio_link_output_changed;
+        stm32f4xx_gpio_add_output_notifier(s->port[i],
+                                           &s->port_link[i].output_notifier);
+    }
+
+    fifo8_create(&s->tx_fifo, STM32F4XX_GPIO_LINK_TX_FIFO_SIZE);
+    s->tx_bh = qemu_bh_new(stm32f4xx_gpio_link_tx_drain, s);
+
+    qemu_chr_fe_set_handlers(&s->chr, stm32f4xx_gpio_link_can_receive,
+                             stm32f4xx_gpio_link_receive,
+                             stm32f4xx_gpio_link_event, NULL, s, NULL, true);
+}
+
+static Property stm32f4xx_gpio_link_properties[] = {
+    DEFINE_PROP_CHR("chardev", STM32F4xxGpioLinkState, chr),
+    DEFINE_PROP_END_OF_LIST(),
+};
+
+static void stm32f4xx_gpio_link_class_init(ObjectClass *klass, void *data)
+{
+    DeviceClass *dc = DEVICE_CLASS(klass);
+
+    dc->realize = stm32f4xx_gpio_link_realize;
+    /* Created by the SoC, which links it to its ports */
+    dc->user_creatable = false;
+    device_class_set_props(dc, stm32f4xx_gpio_link_properties);
+}
+
+static const TypeInfo stm32f4xx_gpio_link_info = {
+    .name = TYPE_STM32F4XX_GPIO_LINK,
+    .parent = TYPE_DEVICE,
+    .instance_size = sizeof(STM32F4xxGpioLinkState),
+    .instance_init = stm32f4xx_gpio_link_init,
+    .class_init = stm32f4xx_gpio_link_class_init,
+};
+
+static void stm32f4xx_gpio_link_register_types(void)
+{
+    type_register_static(&stm32f4xx_gpio_link_info);
+}
+
+type_init(stm32f4xx_gpio_link_register_types)
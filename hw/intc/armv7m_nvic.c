@@ -219,6 +219,68 @@ static int exc_group_prio(NVICState *s, int rawprio, bool targets_secure)
     return rawprio;
 }
 
+static void nvic_prio_map_set(NVICPrioMap *map, int irq, bool in, int prio)
+{
+    int old = map->bucket[irq];
+    int new = in ? prio - NVIC_MIN_PRIO : -1;
+
+    if (old == new) {
+        return;
+    }
+    if (old >= 0) {
+        clear_bit(irq, map->vectors[old]);
+        if (find_first_bit(map->vectors[old], NVIC_MAX_VECTORS) ==
+            NVIC_MAX_VECTORS) {
+            clear_bit(old, map->prios);
+        }
+    }
+    if (new >= 0) {
+        set_bit(irq, map->vectors[new]);
+        set_bit(new, map->prios);
+    }
+    map->bucket[irq] = new;
+}
+
+static void nvic_prio_map_clear(NVICPrioMap *map)
+{
+    int i;
+
+    bitmap_zero(map->prios, NVIC_PRIO_BUCKETS);
+    memset(map->vectors, 0, sizeof(map->vectors));
+    for (i = 0; i < NVIC_MAX_VECTORS; i++) {
+        map->bucket[i] = -1;
+    }
+}
+
+/* Update the priority maps after a change to s->vectors[irq]. */
+static void nvic_vec_reindex(NVICState *s, int irq)
+{
+    VecInfo *vec = &s->vectors[irq];
+
+    nvic_prio_map_set(&s->pending_map, irq, vec->enabled && vec->pending,
+                      vec->prio);
+    nvic_prio_map_set(&s->active_map, irq, vec->active, vec->prio);
+}
+
+/* Likewise for @vec, which may also be a (never indexed) sec_vectors[] */
+static void nvic_vec_changed(NVICState *s, VecInfo *vec)
+{
+    uintptr_t offset = (uintptr_t)vec - (uintptr_t)s->vectors;
+
+    if (offset < sizeof(s->vectors)) {
+        nvic_vec_reindex(s, offset / sizeof(*vec));
+    }
+}
+
+static void nvic_vec_reindex_range(NVICState *s, int start, int end)
+{
+    int i;
+
+    for (i = start; i < end; i++) {
+        nvic_vec_reindex(s, i);
+    }
+}
+
 /* Recompute vectpending and exception_prio for a CPU which implements
  * the Security extension
  */
@@ -287,7 +349,7 @@ static void nvic_recompute_state_secure(NVICState *s)
 /* Recompute vectpending and exception_prio */
 static void nvic_recompute_state(NVICState *s)
 {
-    int i;
+    unsigned long bucket;
     int pend_prio = NVIC_NOEXC_PRIO;
     int active_prio = NVIC_NOEXC_PRIO;
     int pend_irq = 0;
@@ -304,16 +366,19 @@ static void nvic_recompute_state(NVICState *s)
         return;
     }
 
-    for (i = 1; i < s->num_irq; i++) {
-        VecInfo *vec = &s->vectors[i];
-
-        if (vec->enabled && vec->pending && vec->prio < pend_prio) {
-            pend_prio = vec->prio;
-            pend_irq = i;
-        }
-        if (vec->active && vec->prio < active_prio) {
-            active_prio = vec->prio;
-        }
+    /* Without banking, precedence is by lowest raw priority and then by
+     * lowest exception number, which is the first vector of the first
+     * non-empty bucket.
+     */
+    bucket = find_first_bit(s->pending_map.prios, NVIC_PRIO_BUCKETS);
+    if (bucket < NVIC_PRIO_BUCKETS) {
+        pend_prio = bucket + NVIC_MIN_PRIO;
+        pend_irq = find_first_bit(s->pending_map.vectors[bucket],
+                                  NVIC_MAX_VECTORS);
+    }
+    bucket = find_first_bit(s->active_map.prios, NVIC_PRIO_BUCKETS);
+    if (bucket < NVIC_PRIO_BUCKETS) {
+        active_prio = bucket + NVIC_MIN_PRIO;
     }
 
     if (active_prio > 0) {
@@ -448,6 +513,7 @@ static void set_prio(NVICState *s, unsigned irq, bool secure, uint8_t prio)
         s->sec_vectors[irq].prio = prio;
     } else {
         s->vectors[irq].prio = prio;
+        nvic_vec_reindex(s, irq);
     }
 
     trace_nvic_set_prio(irq, secure, prio);
@@ -522,6 +588,7 @@ static void armv7m_nvic_clear_pending(void *opaque, int irq, bool secure)
     trace_nvic_clear_pending(irq, secure, vec->enabled, vec->prio);
     if (vec->pending) {
         vec->pending = 0;
+        nvic_vec_changed(s, vec);
         nvic_irq_update(s);
     }
 }
@@ -662,6 +729,7 @@ static void do_armv7m_nvic_set_pending(void *opaque, int irq, bool secure,
 
     if (!vec->pending) {
         vec->pending = 1;
+        nvic_vec_changed(s, vec);
         nvic_irq_update(s);
     }
 }
@@ -760,6 +828,7 @@ void armv7m_nvic_set_pending_lazyfp(void *opaque, int irq, bool secure)
     }
     if (!vec->pending) {
         vec->pending = 1;
+        nvic_vec_changed(s, vec);
         /*
          * We do not call nvic_irq_update(), because we know our caller
          * is going to handle causing us to take the exception by
@@ -798,6 +867,7 @@ void armv7m_nvic_acknowledge_irq(void *opaque)
 
     vec->active = 1;
     vec->pending = 0;
+    nvic_vec_changed(s, vec);
 
     write_v7m_exception(env, s->vectpending);
 
@@ -909,6 +979,7 @@ int armv7m_nvic_complete_irq(void *opaque, int irq, bool secure)
         assert(irq >= NVIC_FIRST_IRQ);
         vec->pending = 1;
     }
+    nvic_vec_changed(s, vec);
 
     nvic_irq_update(s);
 
@@ -1656,6 +1727,7 @@ static void nvic_writel(NVICState *s, uint32_t offset, uint32_t value,
                     s->sec_vectors[ARMV7M_EXCP_HARD].prio = -1;
                     s->vectors[ARMV7M_EXCP_HARD].enabled = 0;
                 }
+                nvic_vec_reindex(s, ARMV7M_EXCP_HARD);
             }
             nvic_irq_update(s);
         }
@@ -1787,6 +1859,7 @@ static void nvic_writel(NVICState *s, uint32_t offset, uint32_t value,
 
         /* TODO: this is RAZ/WI from NS if DEMCR.SDME is set */
         s->vectors[ARMV7M_EXCP_DEBUG].active = (value & (1 << 8)) != 0;
+        nvic_vec_reindex_range(s, 1, NVIC_INTERNAL_VECTORS);
         nvic_irq_update(s);
         break;
     case 0xd2c: /* Hard Fault Status.  */
@@ -1848,6 +1921,7 @@ static void nvic_writel(NVICState *s, uint32_t offset, uint32_t value,
             = value & (R_V7M_MPU_CTRL_ENABLE_MASK |
                        R_V7M_MPU_CTRL_HFNMIENA_MASK |
                        R_V7M_MPU_CTRL_PRIVDEFENA_MASK);
+        pmsav7_map_invalidate(cpu);
         tlb_flush(CPU(cpu));
         break;
     case 0xd98: /* MPU_RNR */
@@ -1907,6 +1981,7 @@ static void nvic_writel(NVICState *s, uint32_t offset, uint32_t value,
         }
 
         cpu->env.pmsav7.drbar[region] = value & ~0x1f;
+        pmsav7_map_invalidate(cpu);
         tlb_flush(CPU(cpu));
         break;
     }
@@ -1942,6 +2017,7 @@ static void nvic_writel(NVICState *s, uint32_t offset, uint32_t value,
 
         cpu->env.pmsav7.drsr[region] = value & 0xff3f;
         cpu->env.pmsav7.dracr[region] = (value >> 16) & 0x173f;
+        pmsav7_map_invalidate(cpu);
         tlb_flush(CPU(cpu));
         break;
     }
@@ -2374,6 +2450,7 @@ static MemTxResult nvic_sysreg_write(void *opaque, hwaddr addr,
             if (value & (1 << i) &&
                 (attrs.secure || s->itns[startvec + i])) {
                 s->vectors[startvec + i].enabled = setval;
+                nvic_vec_reindex(s, startvec + i);
             }
         }
         nvic_irq_update(s);
@@ -2399,6 +2476,7 @@ static MemTxResult nvic_sysreg_write(void *opaque, hwaddr addr,
                 !(setval == 0 && s->vectors[startvec + i].level &&
                   !s->vectors[startvec + i].active)) {
                 s->vectors[startvec + i].pending = setval;
+                nvic_vec_reindex(s, startvec + i);
             }
         }
         nvic_irq_update(s);
@@ -2497,6 +2575,9 @@ static int nvic_post_load(void *opaque, int version_id)
         }
     }
 
+    nvic_prio_map_clear(&s->pending_map);
+    nvic_prio_map_clear(&s->active_map);
+    nvic_vec_reindex_range(s, 0, s->num_irq);
     nvic_recompute_state(s);
 
     return 0;
@@ -2629,6 +2710,10 @@ static void armv7m_nvic_reset(DeviceState *dev)
      * So we leave it disabled to catch logic errors.
      */
 
+    nvic_prio_map_clear(&s->pending_map);
+    nvic_prio_map_clear(&s->active_map);
+    nvic_vec_reindex_range(s, 0, s->num_irq);
+
     s->exception_prio = NVIC_NOEXC_PRIO;
     s->vectpending = 0;
     s->vectpending_is_s_banked = false;
@@ -44,17 +44,25 @@ static void stm32f4xx_exti_reset(DeviceState *dev)
 static void stm32f4xx_exti_set_irq(void *opaque, int irq, int level)
 {
     STM32F4xxExtiState *s = opaque;
+    bool edge = false;
 
     trace_stm32f4xx_exti_set_irq(irq, level);
 
     if (((1 << irq) & s->exti_rtsr) && level) {
         /* Rising Edge */
         s->exti_pr |= 1 << irq;
+        edge = true;
     }
 
     if (((1 << irq) & s->exti_ftsr) && !level) {
         /* Falling Edge */
         s->exti_pr |= 1 << irq;
+        edge = true;
+    }
+
+    if (!edge) {
+        /* No trigger selected for this edge */
+        return;
     }
 
     if (!((1 << irq) & s->exti_imr)) {
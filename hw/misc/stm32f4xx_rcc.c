@@ -26,6 +26,7 @@
 #include "qemu/log.h"
 #include "trace.h"
 #include "hw/irq.h"
+#include "hw/qdev-clock.h"
 #include "migration/vmstate.h"
 #include "hw/misc/stm32f4xx_rcc.h"
 
@@ -44,13 +45,185 @@ typedef enum
 #define RCC_CIR_ENABLE_BIT_OFFSET 7
 #define RCC_CIR_CLEAR_BIT_OFFSET 16
 
-static void stm32f4xx_rcc_reset(DeviceState *dev)
+#define RCC_CR_HSION BIT(0)
+#define RCC_CR_HSIRDY BIT(1)
+#define RCC_CR_HSEON BIT(16)
+#define RCC_CR_HSERDY BIT(17)
+#define RCC_CR_PLLON BIT(24)
+#define RCC_CR_PLLRDY BIT(25)
+
+#define RCC_PLLCFGR_PLLSRC_HSE BIT(22)
+
+/* System clock switch (SW) and switch status (SWS) values */
+#define RCC_CFGR_SW_HSI 0
+#define RCC_CFGR_SW_HSE 1
+#define RCC_CFGR_SW_PLL 2
+#define RCC_CFGR_SWS_SHIFT 2
+#define RCC_CFGR_SWS_MASK (0x3 << RCC_CFGR_SWS_SHIFT)
+
+#define RCC_DCKCFGR_TIMPRE BIT(24)
+
+typedef struct
+{
+    const char *name;
+    bool apb2;    /* on APB2 rather than APB1 */
+    uint32_t bit; /* in RCC_APBxENR and RCC_APBxRSTR */
+    bool timer;   /* clocked by the APB timer clock rather than PCLK */
+} RccPeriphInfo;
+
+static const RccPeriphInfo rcc_periph_info[STM32F4XX_RCC_PERIPH_COUNT] = {
+    [STM32F4XX_RCC_TIM2] = { "tim2", false, 0, true },
+    [STM32F4XX_RCC_TIM3] = { "tim3", false, 1, true },
+    [STM32F4XX_RCC_TIM4] = { "tim4", false, 2, true },
+    [STM32F4XX_RCC_TIM5] = { "tim5", false, 3, true },
+    [STM32F4XX_RCC_WWDG] = { "wwdg", false, 11, false },
+    [STM32F4XX_RCC_SPI2] = { "spi2", false, 14, false },
+    [STM32F4XX_RCC_SPI3] = { "spi3", false, 15, false },
+    [STM32F4XX_RCC_USART2] = { "usart2", false, 17, false },
+    [STM32F4XX_RCC_USART1] = { "usart1", true, 4, false },
+    [STM32F4XX_RCC_USART6] = { "usart6", true, 5, false },
+    [STM32F4XX_RCC_ADC1] = { "adc1", true, 8, false },
+    [STM32F4XX_RCC_SPI1] = { "spi1", true, 12, false },
+    [STM32F4XX_RCC_SPI4] = { "spi4", true, 13, false },
+    [STM32F4XX_RCC_SYSCFG] = { "syscfg", true, 14, false },
+    [STM32F4XX_RCC_SPI5] = { "spi5", true, 20, false },
+};
+
+static uint64_t stm32f4xx_rcc_pll_freq(STM32F4xxRccState *s)
+{
+    const uint32_t pllm = extract32(s->rcc_pllcfgr, 0, 6);
+    const uint32_t plln = extract32(s->rcc_pllcfgr, 6, 9);
+    const uint32_t pllp = 2 * (extract32(s->rcc_pllcfgr, 16, 2) + 1);
+    const uint64_t input = (s->rcc_pllcfgr & RCC_PLLCFGR_PLLSRC_HSE) ?
+                           clock_get_hz(s->hse) : RCC_HSI_FREQ;
+
+    if (pllm < 2 || plln < 50 || plln > 432)
+    {
+        qemu_log_mask(LOG_GUEST_ERROR,
+                      "%s: invalid PLL configuration M=%u N=%u\n",
+                      __func__, pllm, plln);
+        return 0;
+    }
+    return muldiv64(input, plln, pllm * pllp);
+}
+
+static uint64_t stm32f4xx_rcc_sysclk_freq(STM32F4xxRccState *s)
+{
+    switch (extract32(s->rcc_cfgr, RCC_CFGR_SWS_SHIFT, 2))
+    {
+    case RCC_CFGR_SW_HSI:
+        return RCC_HSI_FREQ;
+    case RCC_CFGR_SW_HSE:
+        return clock_get_hz(s->hse);
+    case RCC_CFGR_SW_PLL:
+        return stm32f4xx_rcc_pll_freq(s);
+    default:
+        return 0;
+    }
+}
+
+/*
+ * Timers run at twice their APB clock when it is divided, or at four times
+ * with TIMPRE set, but never faster than HCLK.
+ */
+static uint64_t stm32f4xx_rcc_timer_freq(STM32F4xxRccState *s, uint64_t hclk,
+                                         uint32_t apb_div)
+{
+    if (s->rcc_dckcfgr & RCC_DCKCFGR_TIMPRE)
+    {
+        return apb_div <= 4 ? hclk : 4 * (hclk / apb_div);
+    }
+    return apb_div == 1 ? hclk : 2 * (hclk / apb_div);
+}
+
+static void stm32f4xx_rcc_set_clock(Clock *clk, uint64_t hz, bool propagate)
+{
+    if (propagate)
+    {
+        clock_update_hz(clk, hz);
+    }
+    else
+    {
+        clock_set_hz(clk, hz);
+    }
+}
+
+/*
+ * Recompute the clock tree from the register values. Consumers are only
+ * notified when @propagate is set: after a migration they restore their
+ * own view of their input clocks.
+ */
+static void stm32f4xx_rcc_update_clocks(STM32F4xxRccState *s, bool propagate)
 {
-    STM32F4xxRccState *s = STM32F4XX_RCC(dev);
+    static const uint32_t ahb_div[] = { 2, 4, 8, 16, 64, 128, 256, 512 };
+    const uint32_t hpre = extract32(s->rcc_cfgr, 4, 4);
+    const uint32_t ppre1 = extract32(s->rcc_cfgr, 10, 3);
+    const uint32_t ppre2 = extract32(s->rcc_cfgr, 13, 3);
+    const uint32_t apb1_div = (ppre1 & 0x4) ? 2 << (ppre1 & 0x3) : 1;
+    const uint32_t apb2_div = (ppre2 & 0x4) ? 2 << (ppre2 & 0x3) : 1;
+    const uint64_t sysclk = stm32f4xx_rcc_sysclk_freq(s);
+    const uint64_t hclk = sysclk / ((hpre & 0x8) ? ahb_div[hpre & 0x7] : 1);
+    const uint64_t pclk1 = hclk / apb1_div;
+    const uint64_t pclk2 = hclk / apb2_div;
+    const uint64_t apb1_timclk = stm32f4xx_rcc_timer_freq(s, hclk, apb1_div);
+    const uint64_t apb2_timclk = stm32f4xx_rcc_timer_freq(s, hclk, apb2_div);
+    int i;
+
+    trace_stm32f4xx_rcc_update_clocks(sysclk, hclk, pclk1, pclk2);
+
+    stm32f4xx_rcc_set_clock(s->sysclk, sysclk, propagate);
+    stm32f4xx_rcc_set_clock(s->hclk, hclk, propagate);
+    stm32f4xx_rcc_set_clock(s->pclk1, pclk1, propagate);
+    stm32f4xx_rcc_set_clock(s->pclk2, pclk2, propagate);
+    stm32f4xx_rcc_set_clock(s->apb1_timclk, apb1_timclk, propagate);
+    stm32f4xx_rcc_set_clock(s->apb2_timclk, apb2_timclk, propagate);
+    stm32f4xx_rcc_set_clock(s->lsi, RCC_LSI_FREQ, propagate);
+
+    for (i = 0; i < STM32F4XX_RCC_PERIPH_COUNT; i++)
+    {
+        const RccPeriphInfo *info = &rcc_periph_info[i];
+        const uint32_t enr = info->apb2 ? s->rcc_apb2enr : s->rcc_apb1enr;
+        uint64_t hz;
+
+        if (info->timer)
+        {
+            hz = info->apb2 ? apb2_timclk : apb1_timclk;
+        }
+        else
+        {
+            hz = info->apb2 ? pclk2 : pclk1;
+        }
+        stm32f4xx_rcc_set_clock(s->periph_clk[i],
+                                (enr & BIT(info->bit)) ? hz : 0, propagate);
+    }
+}
+
+/* Assert or release the reset lines whose RCC_APBxRSTR bit changed */
+static void stm32f4xx_rcc_update_resets(STM32F4xxRccState *s)
+{
+    int i;
+
+    for (i = 0; i < STM32F4XX_RCC_PERIPH_COUNT; i++)
+    {
+        const RccPeriphInfo *info = &rcc_periph_info[i];
+        const uint32_t rstr = info->apb2 ? s->rcc_apb2rstr : s->rcc_apb1rstr;
+        const bool held = rstr & BIT(info->bit);
+
+        if (held != !!(s->periph_reset_state & BIT(i)))
+        {
+            s->periph_reset_state ^= BIT(i);
+            qemu_set_irq(s->periph_reset[i], held);
+        }
+    }
+}
+
+static void stm32f4xx_rcc_reset_enter(Object *obj, ResetType type)
+{
+    STM32F4xxRccState *s = STM32F4XX_RCC(obj);
 
     /* Leave reserved registers uninitialized */
 
-    s->rcc_cr = 0x0000FF81; // bits[15:8] are HSI calibration value, TODO use real on-board value
+    s->rcc_cr = 0x0000FF83; // bits[15:8] are HSI calibration value, TODO use real on-board value
     s->rcc_pllcfgr = 0x24003010;
     s->rcc_cfgr = 0x00000000;
     s->rcc_cir = 0x00000000;
@@ -73,6 +246,21 @@ static void stm32f4xx_rcc_reset(DeviceState *dev)
     s->rcc_dckcfgr = 0x00000000;
 }
 
+static void stm32f4xx_rcc_reset_hold(Object *obj)
+{
+    STM32F4xxRccState *s = STM32F4XX_RCC(obj);
+
+    stm32f4xx_rcc_update_clocks(s, true);
+    stm32f4xx_rcc_update_resets(s);
+}
+
+static void stm32f4xx_rcc_hse_update(void *opaque, ClockEvent event)
+{
+    STM32F4xxRccState *s = opaque;
+
+    stm32f4xx_rcc_update_clocks(s, true);
+}
+
 static void stm32f4xx_rcc_set_irq(void *opaque, int irq, int level)
 {
     STM32F4xxRccState *s = opaque;
@@ -167,23 +355,65 @@ static inline uint32_t set_or_clear_if(uint32_t value, uint32_t mask, uint32_t c
     return value;
 }
 
-static uint32_t handle_rcc_cr_write(uint32_t rcc_cr)
+static uint32_t handle_rcc_cr_write(uint32_t rcc_cr, uint32_t sysclk_source,
+                                    uint32_t rcc_pllcfgr, bool hse_fitted)
 {
+    const bool pll_hse = rcc_pllcfgr & RCC_PLLCFGR_PLLSRC_HSE;
+
+    /* The oscillator feeding the system clock can not be stopped */
+    switch (sysclk_source)
+    {
+    case RCC_CFGR_SW_HSI:
+        rcc_cr |= RCC_CR_HSION;
+        break;
+    case RCC_CFGR_SW_HSE:
+        rcc_cr |= RCC_CR_HSEON;
+        break;
+    case RCC_CFGR_SW_PLL:
+        rcc_cr |= RCC_CR_PLLON;
+        break;
+    }
+    /* Neither can the oscillator feeding the PLL while it runs */
+    if (rcc_cr & RCC_CR_PLLON)
+    {
+        rcc_cr |= pll_hse ? RCC_CR_HSEON : RCC_CR_HSION;
+    }
+
     rcc_cr = set_or_clear_if(rcc_cr, BIT(1), rcc_cr & BIT(0)); /* Set or clear HSIRDY depending on HSION */
-    rcc_cr = set_or_clear_if(rcc_cr, BIT(17), rcc_cr & BIT(16)); /* Set or clear HSERDY depending on HSEON */
-    rcc_cr = set_or_clear_if(rcc_cr, BIT(25), rcc_cr & BIT(24)); /* Set or clear PLLRDY depending on PLLON */
+    rcc_cr = set_or_clear_if(rcc_cr, BIT(17), (rcc_cr & BIT(16)) && hse_fitted); /* Set or clear HSERDY depending on HSEON */
+    rcc_cr = set_or_clear_if(rcc_cr, BIT(25), (rcc_cr & BIT(24)) && (rcc_cr & (pll_hse ? RCC_CR_HSERDY : RCC_CR_HSIRDY))); /* Set or clear PLLRDY depending on PLLON and its source being ready */
     rcc_cr = set_or_clear_if(rcc_cr, BIT(27), rcc_cr & BIT(26)); /* Set or clear PLLI2SRDY depending on PLLI2SON */
     return rcc_cr;
 }
 
-static uint32_t handle_rcc_cfgr_write(uint32_t rcc_cfgr)
+static uint32_t handle_rcc_cfgr_write(uint32_t rcc_cfgr, uint32_t rcc_cr)
 {
     // Update the clock status (bits[3:2]) with the selected clock (bits[1:0])
-    const uint32_t sysclk_switch_status_offset = 2;
-    const uint32_t sysclk_switch_status_bits = 0x3 << sysclk_switch_status_offset;
-    const uint32_t sysclk_switch_bits = 0x3;
-    const uint32_t sysclk_switch = rcc_cfgr & sysclk_switch_bits;
-    return (rcc_cfgr & ~sysclk_switch_status_bits) | (sysclk_switch << sysclk_switch_status_offset);
+    // once it is ready, the switch is delayed until then
+    const uint32_t sysclk_switch = rcc_cfgr & 0x3;
+    bool ready;
+
+    switch (sysclk_switch)
+    {
+    case RCC_CFGR_SW_HSI:
+        ready = rcc_cr & RCC_CR_HSIRDY;
+        break;
+    case RCC_CFGR_SW_HSE:
+        ready = rcc_cr & RCC_CR_HSERDY;
+        break;
+    case RCC_CFGR_SW_PLL:
+        ready = rcc_cr & RCC_CR_PLLRDY;
+        break;
+    default:
+        ready = false;
+    }
+
+    if (!ready)
+    {
+        return rcc_cfgr;
+    }
+    return (rcc_cfgr & ~RCC_CFGR_SWS_MASK) |
+           (sysclk_switch << RCC_CFGR_SWS_SHIFT);
 }
 
 static void stm32f4xx_rcc_write(void *opaque, hwaddr addr,
@@ -197,13 +427,27 @@ static void stm32f4xx_rcc_write(void *opaque, hwaddr addr,
     switch (addr)
     {
     case RCC_CR:
-        s->rcc_cr = handle_rcc_cr_write(value);
+        s->rcc_cr = handle_rcc_cr_write(value,
+            extract32(s->rcc_cfgr, RCC_CFGR_SWS_SHIFT, 2), s->rcc_pllcfgr,
+            clock_get_hz(s->hse) != 0);
+        s->rcc_cfgr = handle_rcc_cfgr_write(s->rcc_cfgr, s->rcc_cr);
+        stm32f4xx_rcc_update_clocks(s, true);
         return;
     case RCC_PLLCFGR:
         s->rcc_pllcfgr = value;
+        /* A new PLL source must be on and ready for the PLL to be */
+        s->rcc_cr = handle_rcc_cr_write(s->rcc_cr,
+            extract32(s->rcc_cfgr, RCC_CFGR_SWS_SHIFT, 2), s->rcc_pllcfgr,
+            clock_get_hz(s->hse) != 0);
+        s->rcc_cfgr = handle_rcc_cfgr_write(s->rcc_cfgr, s->rcc_cr);
+        stm32f4xx_rcc_update_clocks(s, true);
         return;
     case RCC_CFGR:
-        s->rcc_cfgr = handle_rcc_cfgr_write(value);
+        /* SWS is read-only */
+        value = (value & ~RCC_CFGR_SWS_MASK) |
+                (s->rcc_cfgr & RCC_CFGR_SWS_MASK);
+        s->rcc_cfgr = handle_rcc_cfgr_write(value, s->rcc_cr);
+        stm32f4xx_rcc_update_clocks(s, true);
         return;
     case RCC_CIR:
         s->rcc_cir = value; // TODO handle reset of flag  bits when clear bits are set
@@ -216,9 +460,11 @@ static void stm32f4xx_rcc_write(void *opaque, hwaddr addr,
         return;
     case RCC_APB1RSTR:
         s->rcc_apb1rstr = value;
+        stm32f4xx_rcc_update_resets(s);
         return;
     case RCC_APB2RSTR:
         s->rcc_apb2rstr = value;
+        stm32f4xx_rcc_update_resets(s);
         return;
     case RCC_AHB1ENR:
         s->rcc_ahb1enr = value;
@@ -228,9 +474,11 @@ static void stm32f4xx_rcc_write(void *opaque, hwaddr addr,
         return;
     case RCC_APB1ENR:
         s->rcc_apb1enr = value;
+        stm32f4xx_rcc_update_clocks(s, true);
         return;
     case RCC_APB2ENR:
         s->rcc_apb2enr = value;
+        stm32f4xx_rcc_update_clocks(s, true);
         return;
     case RCC_AHB1LPENR:
         s->rcc_ahb1lpenr = value;
@@ -258,6 +506,7 @@ static void stm32f4xx_rcc_write(void *opaque, hwaddr addr,
         return;
     case RCC_DCKCFGR:
         s->rcc_dckcfgr = value;
+        stm32f4xx_rcc_update_clocks(s, true);
         return;
     default:
         qemu_log_mask(LOG_GUEST_ERROR,
@@ -265,15 +514,32 @@ static void stm32f4xx_rcc_write(void *opaque, hwaddr addr,
     }
 }
 
+/* Firmware busy waits on the ready bits, reading registers changes nothing */
+static bool stm32f4xx_rcc_read_is_idempotent(void *opaque, hwaddr addr,
+                                             unsigned int size)
+{
+    return true;
+}
+
+/* Oscillators and PLL are ready at once, the ready bits follow writes */
+static bool stm32f4xx_rcc_read_is_timed(void *opaque, hwaddr addr,
+                                        unsigned int size)
+{
+    return true;
+}
+
 static const MemoryRegionOps stm32f4xx_rcc_ops = {
     .read = stm32f4xx_rcc_read,
     .write = stm32f4xx_rcc_write,
     .endianness = DEVICE_NATIVE_ENDIAN,
+    .read_is_idempotent = stm32f4xx_rcc_read_is_idempotent,
+    .read_is_timed = stm32f4xx_rcc_read_is_timed,
 };
 
 static void stm32f4xx_rcc_init(Object *obj)
 {
     STM32F4xxRccState *s = STM32F4XX_RCC(obj);
+    int i;
 
     sysbus_init_irq(SYS_BUS_DEVICE(obj), &s->irq);
 
@@ -283,12 +549,79 @@ static void stm32f4xx_rcc_init(Object *obj)
 
     qdev_init_gpio_in(DEVICE(obj), stm32f4xx_rcc_set_irq,
                       RCC_IRQ_COUNT);
+
+    s->hse = qdev_init_clock_in(DEVICE(obj), "hse", stm32f4xx_rcc_hse_update,
+                                s, ClockUpdate);
+    s->sysclk = qdev_init_clock_out(DEVICE(obj), "sysclk");
+    s->hclk = qdev_init_clock_out(DEVICE(obj), "hclk");
+    s->pclk1 = qdev_init_clock_out(DEVICE(obj), "pclk1");
+    s->pclk2 = qdev_init_clock_out(DEVICE(obj), "pclk2");
+    s->apb1_timclk = qdev_init_clock_out(DEVICE(obj), "apb1-timclk");
+    s->apb2_timclk = qdev_init_clock_out(DEVICE(obj), "apb2-timclk");
+    s->lsi = qdev_init_clock_out(DEVICE(obj), "lsi");
+
+    for (i = 0; i < STM32F4XX_RCC_PERIPH_COUNT; i++)
+    {
+        g_autofree char *name = g_strdup_printf("%s-clk",
+                                                rcc_periph_info[i].name);
+
+        s->periph_clk[i] = qdev_init_clock_out(DEVICE(obj), name);
+    }
+    qdev_init_gpio_out_named(DEVICE(obj), s->periph_reset, "periph-reset",
+                             STM32F4XX_RCC_PERIPH_COUNT);
+}
+
+static int stm32f4xx_rcc_pre_load(void *opaque)
+{
+    STM32F4xxRccState *s = opaque;
+
+    /* Lines held by this instance, the stream says which ones should be */
+    s->periph_reset_live = s->periph_reset_state;
+    s->periph_reset_state = 0;
+    return 0;
 }
 
+static int stm32f4xx_rcc_post_load(void *opaque, int version_id)
+{
+    STM32F4xxRccState *s = opaque;
+    uint32_t changed = s->periph_reset_state ^ s->periph_reset_live;
+    int i;
+
+    stm32f4xx_rcc_update_clocks(s, false);
+
+    for (i = 0; i < STM32F4XX_RCC_PERIPH_COUNT; i++)
+    {
+        if (changed & BIT(i))
+        {
+            qemu_set_irq(s->periph_reset[i],
+                         !!(s->periph_reset_state & BIT(i)));
+        }
+    }
+    return 0;
+}
+
+static bool stm32f4xx_rcc_reset_needed(void *opaque)
+{
+    STM32F4xxRccState *s = opaque;
+
+    return s->periph_reset_state != 0;
+}
+
+static const VMStateDescription vmstate_stm32f4xx_rcc_reset = {
+    .name = TYPE_STM32F4XX_RCC "/reset",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .needed = stm32f4xx_rcc_reset_needed,
+    .fields = (VMStateField[]){
+        VMSTATE_UINT32(periph_reset_state, STM32F4xxRccState),
+        VMSTATE_END_OF_LIST()}};
+
 static const VMStateDescription vmstate_stm32f4xx_rcc = {
     .name = TYPE_STM32F4XX_RCC,
-    .version_id = 1,
+    .version_id = 2,
     .minimum_version_id = 1,
+    .pre_load = stm32f4xx_rcc_pre_load,
+    .post_load = stm32f4xx_rcc_post_load,
     .fields = (VMStateField[]){
         VMSTATE_UINT32(rcc_cr, STM32F4xxRccState),
         VMSTATE_UINT32(rcc_pllcfgr, STM32F4xxRccState),
@@ -311,13 +644,19 @@ static const VMStateDescription vmstate_stm32f4xx_rcc = {
         VMSTATE_UINT32(rcc_sscgr, STM32F4xxRccState),
         VMSTATE_UINT32(rcc_plli2scfgr, STM32F4xxRccState),
         VMSTATE_UINT32(rcc_dckcfgr, STM32F4xxRccState),
-        VMSTATE_END_OF_LIST()}};
+        VMSTATE_CLOCK_V(hse, STM32F4xxRccState, 2),
+        VMSTATE_END_OF_LIST()},
+    .subsections = (const VMStateDescription *[]){
+        &vmstate_stm32f4xx_rcc_reset,
+        NULL}};
 
 static void stm32f4xx_rcc_class_init(ObjectClass *klass, void *data)
 {
     DeviceClass *dc = DEVICE_CLASS(klass);
+    ResettableClass *rc = RESETTABLE_CLASS(klass);
 
-    dc->reset = stm32f4xx_rcc_reset;
+    rc->phases.enter = stm32f4xx_rcc_reset_enter;
+    rc->phases.hold = stm32f4xx_rcc_reset_hold;
     dc->vmsd = &vmstate_stm32f4xx_rcc;
 }
 
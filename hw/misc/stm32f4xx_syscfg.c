@@ -45,18 +45,20 @@ static void stm32f4xx_syscfg_reset(DeviceState *dev)
 static void stm32f4xx_syscfg_set_irq(void *opaque, int irq, int level)
 {
     STM32F4xxSyscfgState *s = opaque;
-    int icrreg = irq / 4;
-    int startbit = (irq & 3) * 4;
+    /* Input irq is pin 'irq % 16' of GPIO port 'irq / 16' */
+    int pin = irq % 16;
+    int icrreg = pin / 4;
+    int startbit = (pin & 3) * 4;
     uint8_t config = irq / 16;
 
-    trace_stm32f4xx_syscfg_set_irq(irq / 16, irq % 16, level);
+    trace_stm32f4xx_syscfg_set_irq(irq / 16, pin, level);
 
     g_assert(icrreg < SYSCFG_NUM_EXTICR);
 
     if (extract32(s->syscfg_exticr[icrreg], startbit, 4) == config) {
-        qemu_set_irq(s->gpio_out[irq], level);
-        trace_stm32f4xx_pulse_exti(irq);
-   }
+        qemu_set_irq(s->gpio_out[pin], level);
+        trace_stm32f4xx_pulse_exti(pin);
+    }
 }
 
 static uint64_t stm32f4xx_syscfg_read(void *opaque, hwaddr addr,
@@ -45,13 +45,20 @@ static void ssi_cs_default(void *opaque, int n, int level)
     s->cs = cs;
 }
 
+static bool ssi_peripheral_selected(SSIPeripheral *dev)
+{
+    SSIPeripheralClass *ssc = dev->spc;
+
+    return (dev->cs && ssc->cs_polarity == SSI_CS_HIGH) ||
+           (!dev->cs && ssc->cs_polarity == SSI_CS_LOW) ||
+           ssc->cs_polarity == SSI_CS_NONE;
+}
+
 static uint32_t ssi_transfer_raw_default(SSIPeripheral *dev, uint32_t val)
 {
     SSIPeripheralClass *ssc = dev->spc;
 
-    if ((dev->cs && ssc->cs_polarity == SSI_CS_HIGH) ||
-        (!dev->cs && ssc->cs_polarity == SSI_CS_LOW) ||
-        ssc->cs_polarity == SSI_CS_NONE) {
+    if (ssi_peripheral_selected(dev)) {
         return ssc->transfer(dev, val);
     }
     return 0;
@@ -125,6 +132,60 @@ uint32_t ssi_transfer(SSIBus *bus, uint32_t val)
     return r;
 }
 
+void ssi_transfer_buf(SSIBus *bus, const uint8_t *tx, uint8_t *rx,
+                      size_t len)
+{
+    BusState *b = BUS(bus);
+    BusChild *kid;
+    g_autofree uint8_t *tmp = NULL;
+    bool rx_used = false;
+    size_t i;
+
+    if (rx) {
+        memset(rx, 0, len);
+    }
+
+    QTAILQ_FOREACH(kid, &b->children, sibling) {
+        SSIPeripheral *p = SSI_PERIPHERAL(kid->child);
+        SSIPeripheralClass *ssc = p->spc;
+        uint8_t *out = NULL;
+
+        if (ssc->transfer_raw != ssi_transfer_raw_default ||
+            !ssc->transfer_buf) {
+            for (i = 0; i < len; i++) {
+                uint32_t r = ssc->transfer_raw(p, tx ? tx[i] : 0);
+
+                if (rx) {
+                    rx[i] |= r;
+                }
+            }
+            rx_used = true;
+            continue;
+        }
+
+        if (!ssi_peripheral_selected(p)) {
+            continue;
+        }
+
+        /* Like ssi_transfer(), OR together what every peripheral returns */
+        if (rx && !rx_used) {
+            out = rx;
+            rx_used = true;
+        } else if (rx) {
+            if (!tmp) {
+                tmp = g_malloc(len);
+            }
+            out = tmp;
+        }
+        ssc->transfer_buf(p, tx, out, len);
+        if (out && out == tmp) {
+            for (i = 0; i < len; i++) {
+                rx[i] |= tmp[i];
+            }
+        }
+    }
+}
+
 const VMStateDescription vmstate_ssi_peripheral = {
     .name = "SSISlave",
     .version_id = 1,
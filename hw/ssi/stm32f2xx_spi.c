@@ -24,7 +24,10 @@
 
 #include "qemu/osdep.h"
 #include "qemu/log.h"
+#include "qemu/main-loop.h"
 #include "qemu/module.h"
+#include "hw/irq.h"
+#include "hw/qdev-clock.h"
 #include "hw/ssi/stm32f2xx_spi.h"
 #include "migration/vmstate.h"
 
@@ -40,6 +43,48 @@
 
 #define DB_PRINT(fmt, args...) DB_PRINT_L(1, fmt, ## args)
 
+static bool stm32f2xx_spi_is_active(STM32F2XXSPIState *s)
+{
+    if (clock_has_source(s->clk) && !clock_is_enabled(s->clk)) {
+        return false;
+    }
+    return !device_is_in_reset(DEVICE(s));
+}
+
+/* Frames which can be received before the oldest one is read */
+static uint32_t stm32f2xx_spi_rx_depth(STM32F2XXSPIState *s)
+{
+    if (s->spi_cr2 & STM_SPI_CR2_RXDMAEN ||
+        s->spi_cr1 & STM_SPI_CR1_RXONLY) {
+        return STM_SPI_RX_FIFO_SIZE;
+    }
+    return 1;
+}
+
+static void stm32f2xx_spi_update_irq(STM32F2XXSPIState *s)
+{
+    bool txe = s->spi_sr & STM_SPI_SR_TXE;
+    bool rxne = s->spi_sr & STM_SPI_SR_RXNE;
+    bool tx_request;
+
+    qemu_set_irq(s->irq,
+                 (s->spi_cr2 & STM_SPI_CR2_TXEIE && txe) ||
+                 (s->spi_cr2 & STM_SPI_CR2_RXNEIE && rxne) ||
+                 (s->spi_cr2 & STM_SPI_CR2_ERRIE &&
+                  s->spi_sr & STM_SPI_SR_OVR));
+
+    /*
+     * When the DMA also reads what comes back, hold transmission off while
+     * the queue of received frames is full, rather than overrunning it.
+     */
+    tx_request = s->spi_cr2 & STM_SPI_CR2_TXDMAEN && txe &&
+                 (!(s->spi_cr2 & STM_SPI_CR2_RXDMAEN) ||
+                  s->rx_count + s->tx_len < stm32f2xx_spi_rx_depth(s));
+    qemu_set_irq(s->dma_request[STM32F2XX_SPI_DMA_RX],
+                 s->spi_cr2 & STM_SPI_CR2_RXDMAEN && rxne);
+    qemu_set_irq(s->dma_request[STM32F2XX_SPI_DMA_TX], tx_request);
+}
+
 static void stm32f2xx_spi_reset(DeviceState *dev)
 {
     STM32F2XXSPIState *s = STM32F2XX_SPI(dev);
@@ -53,38 +98,209 @@ static void stm32f2xx_spi_reset(DeviceState *dev)
     s->spi_txcrcr = 0x00000000;
     s->spi_i2scfgr = 0x00000000;
     s->spi_i2spr = 0x00000002;
+
+    s->rx_head = 0;
+    s->rx_count = 0;
+    s->ovr_dr_read = false;
+    s->tx_len = 0;
+    qemu_bh_cancel(s->tx_bh);
+
+    stm32f2xx_spi_update_irq(s);
+}
+
+static void stm32f2xx_spi_push_rx(STM32F2XXSPIState *s, uint32_t value)
+{
+    if (s->rx_count >= stm32f2xx_spi_rx_depth(s)) {
+        /* The frame is lost, the ones received before are kept */
+        s->spi_sr |= STM_SPI_SR_OVR;
+        return;
+    }
+
+    s->rx_fifo[(s->rx_head + s->rx_count) % STM_SPI_RX_FIFO_SIZE] = value;
+    s->rx_count++;
+    s->spi_sr |= STM_SPI_SR_RXNE;
 }
 
 static void stm32f2xx_spi_transfer(STM32F2XXSPIState *s)
 {
+    uint32_t rx;
+
     DB_PRINT("Data to send: 0x%x\n", s->spi_dr);
 
-    s->spi_dr = ssi_transfer(s->ssi, s->spi_dr);
-    s->spi_sr |= STM_SPI_SR_RXNE;
+    rx = ssi_transfer(s->ssi, s->spi_dr);
+    stm32f2xx_spi_push_rx(s, rx);
 
-    DB_PRINT("Data received: 0x%x\n", s->spi_dr);
+    DB_PRINT("Data received: 0x%x\n", rx);
+}
+
+/*
+ * With the TX DMA and 8-bit frames, DR writes are queued and sent as one
+ * burst through ssi_transfer_buf(). TXE stays set, so the DMA keeps on
+ * writing until the stream completes, the queue is full or, when the RX
+ * DMA reads what comes back, the frames sent would fill the RX queue.
+ * Whatever is left is sent from a bottom half once the DMA is done, and
+ * before any other register access, so the guest never sees the delay.
+ */
+static bool stm32f2xx_spi_tx_batched(STM32F2XXSPIState *s)
+{
+    return s->spi_cr2 & STM_SPI_CR2_TXDMAEN &&
+           !(s->spi_cr1 & STM_SPI_CR1_DFF);
+}
+
+static void stm32f2xx_spi_flush_tx(STM32F2XXSPIState *s)
+{
+    uint8_t rx[STM_SPI_TX_BURST_SIZE];
+    uint32_t i;
+
+    if (!s->tx_len) {
+        return;
+    }
+
+    ssi_transfer_buf(s->ssi, s->tx_burst, rx, s->tx_len);
+    for (i = 0; i < s->tx_len; i++) {
+        stm32f2xx_spi_push_rx(s, rx[i]);
+    }
+    s->tx_len = 0;
+    qemu_bh_cancel(s->tx_bh);
+}
+
+static void stm32f2xx_spi_tx_bh(void *opaque)
+{
+    STM32F2XXSPIState *s = opaque;
+
+    stm32f2xx_spi_flush_tx(s);
+    stm32f2xx_spi_update_irq(s);
+}
+
+static void stm32f2xx_spi_write_dr(STM32F2XXSPIState *s, uint32_t value)
+{
+    s->spi_dr = value;
+    if (!stm32f2xx_spi_tx_batched(s)) {
+        stm32f2xx_spi_transfer(s);
+        return;
+    }
+
+    s->tx_burst[s->tx_len++] = value;
+    if (s->tx_len == STM_SPI_TX_BURST_SIZE ||
+        (s->spi_cr2 & STM_SPI_CR2_RXDMAEN &&
+         s->rx_count + s->tx_len >= stm32f2xx_spi_rx_depth(s))) {
+        stm32f2xx_spi_flush_tx(s);
+    } else {
+        qemu_bh_schedule(s->tx_bh);
+    }
+}
+
+/*
+ * In receive-only master mode the clock runs for as long as the SPI is
+ * enabled. Clock in up to @count frames once the previous ones were read:
+ * one at a time for software, as many as the RX DMA stream still has to
+ * move when it reads them.
+ */
+static void stm32f2xx_spi_rx_only(STM32F2XXSPIState *s, uint32_t count)
+{
+    uint8_t buf[STM_SPI_RX_FIFO_SIZE];
+    uint32_t i;
+
+    if ((s->spi_cr1 & (STM_SPI_CR1_RXONLY | STM_SPI_CR1_SPE |
+                       STM_SPI_CR1_MSTR)) !=
+        (STM_SPI_CR1_RXONLY | STM_SPI_CR1_SPE | STM_SPI_CR1_MSTR) ||
+        s->rx_count || !stm32f2xx_spi_is_active(s)) {
+        return;
+    }
+
+    count = MIN(count, STM_SPI_RX_FIFO_SIZE);
+    if (s->spi_cr1 & STM_SPI_CR1_DFF) {
+        for (i = 0; i < count; i++) {
+            stm32f2xx_spi_push_rx(s, ssi_transfer(s->ssi, 0));
+        }
+        return;
+    }
+
+    ssi_transfer_buf(s->ssi, NULL, buf, count);
+    for (i = 0; i < count; i++) {
+        stm32f2xx_spi_push_rx(s, buf[i]);
+    }
+}
+
+/* Drop the frames received ahead, when the SPI stops or changes mode */
+static void stm32f2xx_spi_flush_rx(STM32F2XXSPIState *s)
+{
+    s->rx_head = 0;
+    s->rx_count = 0;
+    s->spi_sr &= ~STM_SPI_SR_RXNE;
+}
+
+static uint32_t stm32f2xx_spi_read_dr(STM32F2XXSPIState *s)
+{
+    if (s->spi_sr & STM_SPI_SR_OVR) {
+        s->ovr_dr_read = true;
+    }
+
+    if (s->rx_count) {
+        s->spi_dr = s->rx_fifo[s->rx_head];
+        s->rx_head = (s->rx_head + 1) % STM_SPI_RX_FIFO_SIZE;
+        s->rx_count--;
+    }
+    if (!s->rx_count) {
+        s->spi_sr &= ~STM_SPI_SR_RXNE;
+        /* With DMA, the next frames are clocked in on its acknowledgement */
+        if (!(s->spi_cr2 & STM_SPI_CR2_RXDMAEN)) {
+            stm32f2xx_spi_rx_only(s, 1);
+        }
+    }
+    return s->spi_dr;
+}
+
+/* The DMA moved an item, @level more are still to be moved by the stream */
+static void stm32f2xx_spi_dma_ack(void *opaque, int n, int level)
+{
+    STM32F2XXSPIState *s = opaque;
+
+    if (n == STM32F2XX_SPI_DMA_TX && !level) {
+        /* The stream completed, send the end of the burst right away */
+        stm32f2xx_spi_flush_tx(s);
+        stm32f2xx_spi_update_irq(s);
+        return;
+    }
+    if (n != STM32F2XX_SPI_DMA_RX || !(s->spi_cr2 & STM_SPI_CR2_RXDMAEN)) {
+        return;
+    }
+
+    stm32f2xx_spi_rx_only(s, level);
+    stm32f2xx_spi_update_irq(s);
 }
 
 static uint64_t stm32f2xx_spi_read(void *opaque, hwaddr addr,
                                      unsigned int size)
 {
     STM32F2XXSPIState *s = opaque;
+    uint32_t value;
 
     DB_PRINT("Address: 0x%" HWADDR_PRIx "\n", addr);
 
+    if (s->tx_len) {
+        stm32f2xx_spi_flush_tx(s);
+        stm32f2xx_spi_update_irq(s);
+    }
+
     switch (addr) {
     case STM_SPI_CR1:
         return s->spi_cr1;
     case STM_SPI_CR2:
-        qemu_log_mask(LOG_UNIMP, "%s: Interrupts and DMA are not implemented\n",
-                      __func__);
         return s->spi_cr2;
     case STM_SPI_SR:
-        return s->spi_sr;
+        value = s->spi_sr;
+        if (s->ovr_dr_read) {
+            /* A DR read followed by a SR read clears OVR */
+            s->spi_sr &= ~STM_SPI_SR_OVR;
+            s->ovr_dr_read = false;
+            stm32f2xx_spi_update_irq(s);
+        }
+        return value;
     case STM_SPI_DR:
-        stm32f2xx_spi_transfer(s);
-        s->spi_sr &= ~STM_SPI_SR_RXNE;
-        return s->spi_dr;
+        value = stm32f2xx_spi_read_dr(s);
+        stm32f2xx_spi_update_irq(s);
+        return value;
     case STM_SPI_CRCPR:
         qemu_log_mask(LOG_UNIMP, "%s: CRC is not implemented, the registers " \
                       "are included for compatibility\n", __func__);
@@ -118,17 +334,45 @@ static void stm32f2xx_spi_write(void *opaque, hwaddr addr,
 {
     STM32F2XXSPIState *s = opaque;
     uint32_t value = val64;
+    uint32_t changed;
 
     DB_PRINT("Address: 0x%" HWADDR_PRIx ", Value: 0x%x\n", addr, value);
 
+    if (!stm32f2xx_spi_is_active(s)) {
+        /* Clock gated off or held in reset: the write is lost */
+        return;
+    }
+
+    if (addr != STM_SPI_DR && s->tx_len) {
+        stm32f2xx_spi_flush_tx(s);
+        stm32f2xx_spi_update_irq(s);
+    }
+
     switch (addr) {
     case STM_SPI_CR1:
+        if ((s->spi_cr1 & ~value & STM_SPI_CR1_SPE) ||
+            ((s->spi_cr1 ^ value) & STM_SPI_CR1_RXONLY)) {
+            stm32f2xx_spi_flush_rx(s);
+        }
+        changed = s->spi_cr1 ^ value;
         s->spi_cr1 = value;
+        if (changed & (STM_SPI_CR1_RXONLY | STM_SPI_CR1_SPE |
+                       STM_SPI_CR1_MSTR)) {
+            /* Receive-only mode starts with a single frame */
+            stm32f2xx_spi_rx_only(s, 1);
+        }
+        stm32f2xx_spi_update_irq(s);
         return;
     case STM_SPI_CR2:
-        qemu_log_mask(LOG_UNIMP, "%s: " \
-                      "Interrupts and DMA are not implemented\n", __func__);
+        changed = s->spi_cr2 ^ value;
+        if (changed & STM_SPI_CR2_RXDMAEN) {
+            stm32f2xx_spi_flush_rx(s);
+        }
         s->spi_cr2 = value;
+        if (changed & STM_SPI_CR2_RXDMAEN) {
+            stm32f2xx_spi_rx_only(s, 1);
+        }
+        stm32f2xx_spi_update_irq(s);
         return;
     case STM_SPI_SR:
         /* Read only register, except for clearing the CRCERR bit, which
@@ -136,8 +380,8 @@ static void stm32f2xx_spi_write(void *opaque, hwaddr addr,
          */
         return;
     case STM_SPI_DR:
-        s->spi_dr = value;
-        stm32f2xx_spi_transfer(s);
+        stm32f2xx_spi_write_dr(s, value);
+        stm32f2xx_spi_update_irq(s);
         return;
     case STM_SPI_CRCPR:
         qemu_log_mask(LOG_UNIMP, "%s: CRC is not implemented\n", __func__);
@@ -170,6 +414,66 @@ static const MemoryRegionOps stm32f2xx_spi_ops = {
     .endianness = DEVICE_NATIVE_ENDIAN,
 };
 
+static bool stm32f2xx_spi_clk_needed(void *opaque)
+{
+    STM32F2XXSPIState *s = opaque;
+
+    return clock_has_source(s->clk);
+}
+
+static const VMStateDescription vmstate_stm32f2xx_spi_clk = {
+    .name = TYPE_STM32F2XX_SPI "/clk",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .needed = stm32f2xx_spi_clk_needed,
+    .fields = (VMStateField[]) {
+        VMSTATE_CLOCK(clk, STM32F2XXSPIState),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static bool stm32f2xx_spi_rx_needed(void *opaque)
+{
+    STM32F2XXSPIState *s = opaque;
+
+    return s->rx_count || s->ovr_dr_read;
+}
+
+static const VMStateDescription vmstate_stm32f2xx_spi_rx = {
+    .name = TYPE_STM32F2XX_SPI "/rx",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .needed = stm32f2xx_spi_rx_needed,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT16_ARRAY(rx_fifo, STM32F2XXSPIState,
+                             STM_SPI_RX_FIFO_SIZE),
+        VMSTATE_UINT32(rx_head, STM32F2XXSPIState),
+        VMSTATE_UINT32(rx_count, STM32F2XXSPIState),
+        VMSTATE_BOOL(ovr_dr_read, STM32F2XXSPIState),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static bool stm32f2xx_spi_tx_needed(void *opaque)
+{
+    STM32F2XXSPIState *s = opaque;
+
+    return s->tx_len;
+}
+
+static const VMStateDescription vmstate_stm32f2xx_spi_tx = {
+    .name = TYPE_STM32F2XX_SPI "/tx",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .needed = stm32f2xx_spi_tx_needed,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT8_ARRAY(tx_burst, STM32F2XXSPIState,
+                            STM_SPI_TX_BURST_SIZE),
+        VMSTATE_UINT32(tx_len, STM32F2XXSPIState),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static const VMStateDescription vmstate_stm32f2xx_spi = {
     .name = TYPE_STM32F2XX_SPI,
     .version_id = 1,
@@ -185,6 +489,12 @@ static const VMStateDescription vmstate_stm32f2xx_spi = {
         VMSTATE_UINT32(spi_i2scfgr, STM32F2XXSPIState),
         VMSTATE_UINT32(spi_i2spr, STM32F2XXSPIState),
         VMSTATE_END_OF_LIST()
+    },
+    .subsections = (const VMStateDescription * []) {
+        &vmstate_stm32f2xx_spi_clk,
+        &vmstate_stm32f2xx_spi_rx,
+        &vmstate_stm32f2xx_spi_tx,
+        NULL
     }
 };
 
@@ -198,14 +508,29 @@ static void stm32f2xx_spi_init(Object *obj)
     sysbus_init_mmio(SYS_BUS_DEVICE(obj), &s->mmio);
 
     sysbus_init_irq(SYS_BUS_DEVICE(obj), &s->irq);
+    qdev_init_gpio_out_named(dev, s->dma_request, "dma-request",
+                             ARRAY_SIZE(s->dma_request));
+    qdev_init_gpio_in_named(dev, stm32f2xx_spi_dma_ack, "dma-ack",
+                            ARRAY_SIZE(s->dma_request));
 
     s->ssi = ssi_create_bus(dev, "ssi");
+
+    /* Optional, the SPI is gated off while it runs at 0 Hz */
+    s->clk = qdev_init_clock_in(dev, "clk", NULL, NULL, 0);
+}
+
+static void stm32f2xx_spi_realize(DeviceState *dev, Error **errp)
+{
+    STM32F2XXSPIState *s = STM32F2XX_SPI(dev);
+
+    s->tx_bh = qemu_bh_new(stm32f2xx_spi_tx_bh, s);
 }
 
 static void stm32f2xx_spi_class_init(ObjectClass *klass, void *data)
 {
     DeviceClass *dc = DEVICE_CLASS(klass);
 
+    dc->realize = stm32f2xx_spi_realize;
     dc->reset = stm32f2xx_spi_reset;
     dc->vmsd = &vmstate_stm32f2xx_spi;
 }
@@ -24,6 +24,7 @@
 
 #include "qemu/osdep.h"
 #include "hw/irq.h"
+#include "hw/qdev-clock.h"
 #include "hw/qdev-properties.h"
 #include "hw/timer/stm32f2xx_timer.h"
 #include "migration/vmstate.h"
@@ -50,9 +51,15 @@ static void stm32f2xx_timer_interrupt(void *opaque)
 
     DB_PRINT("Interrupt\n");
 
-    if (s->tim_dier & TIM_DIER_UIE && s->tim_cr1 & TIM_CR1_CEN) {
-        s->tim_sr |= 1;
-        qemu_irq_pulse(s->irq);
+    if (s->tim_dier & (TIM_DIER_UIE | TIM_DIER_UDE) &&
+        s->tim_cr1 & TIM_CR1_CEN) {
+        if (s->tim_dier & TIM_DIER_UIE) {
+            s->tim_sr |= 1;
+            qemu_irq_pulse(s->irq);
+        }
+        if (s->tim_dier & TIM_DIER_UDE) {
+            qemu_irq_raise(s->dma_request);
+        }
         stm32f2xx_timer_set_alarm(s, s->hit_time);
     }
 
@@ -76,6 +83,11 @@ static void stm32f2xx_timer_set_alarm(STM32F2XXTimerState *s, int64_t now)
     uint64_t ticks;
     int64_t now_ticks;
 
+    if (s->freq_hz == 0) {
+        /* The clock is gated off, the counter is frozen */
+        timer_del(s->timer);
+        return;
+    }
     if (s->tim_arr == 0) {
         return;
     }
@@ -94,6 +106,14 @@ static void stm32f2xx_timer_set_alarm(STM32F2XXTimerState *s, int64_t now)
     DB_PRINT("Wait Time: %" PRId64 " ticks\n", s->hit_time);
 }
 
+/* The DMA moved the item requested by the last update event */
+static void stm32f2xx_timer_dma_ack(void *opaque, int n, int level)
+{
+    STM32F2XXTimerState *s = opaque;
+
+    qemu_irq_lower(s->dma_request);
+}
+
 static void stm32f2xx_timer_reset(DeviceState *dev)
 {
     STM32F2XXTimerState *s = STM32F2XXTIMER(dev);
@@ -119,6 +139,8 @@ static void stm32f2xx_timer_reset(DeviceState *dev)
     s->tim_or = 0;
 
     s->tick_offset = stm32f2xx_ns_to_ticks(s, now);
+    timer_del(s->timer);
+    qemu_irq_lower(s->dma_request);
 }
 
 static uint64_t stm32f2xx_timer_read(void *opaque, hwaddr offset,
@@ -186,6 +208,11 @@ static void stm32f2xx_timer_write(void *opaque, hwaddr offset,
 
     DB_PRINT("Write 0x%x, 0x%"HWADDR_PRIx"\n", value, offset);
 
+    if (s->freq_hz == 0 || device_is_in_reset(DEVICE(s))) {
+        /* Clock gated off or held in reset: the write is lost */
+        return;
+    }
+
     switch (offset) {
     case TIM_CR1:
         s->tim_cr1 = value;
@@ -198,6 +225,9 @@ static void stm32f2xx_timer_write(void *opaque, hwaddr offset,
         return;
     case TIM_DIER:
         s->tim_dier = value;
+        if (!(s->tim_dier & TIM_DIER_UDE)) {
+            qemu_irq_lower(s->dma_request);
+        }
         return;
     case TIM_SR:
         /* This is set by hardware and cleared by software */
@@ -264,16 +294,81 @@ static void stm32f2xx_timer_write(void *opaque, hwaddr offset,
     stm32f2xx_timer_set_alarm(s, now);
 }
 
+static void stm32f2xx_timer_clk_update(void *opaque, ClockEvent event)
+{
+    STM32F2XXTimerState *s = opaque;
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+
+    switch (event) {
+    case ClockPreUpdate:
+        /* Hold the counter value in tick_offset until the new rate is known */
+        s->tick_offset = stm32f2xx_ns_to_ticks(s, now) - s->tick_offset;
+        break;
+    case ClockUpdate:
+        s->freq_hz = clock_get_hz(s->clk);
+        s->tick_offset = stm32f2xx_ns_to_ticks(s, now) - s->tick_offset;
+        stm32f2xx_timer_set_alarm(s, now);
+        break;
+    default:
+        g_assert_not_reached();
+    }
+}
+
+static bool stm32f2xx_timer_read_is_idempotent(void *opaque, hwaddr addr,
+                                               unsigned size)
+{
+    /* Flags in TIM_SR are cleared by writes only */
+    return true;
+}
+
+static bool stm32f2xx_timer_read_is_timed(void *opaque, hwaddr addr,
+                                          unsigned size)
+{
+    /* The counter and the update flag move with the timer only */
+    return true;
+}
+
 static const MemoryRegionOps stm32f2xx_timer_ops = {
     .read = stm32f2xx_timer_read,
     .write = stm32f2xx_timer_write,
     .endianness = DEVICE_NATIVE_ENDIAN,
+    .read_is_idempotent = stm32f2xx_timer_read_is_idempotent,
+    .read_is_timed = stm32f2xx_timer_read_is_timed,
+};
+
+static bool stm32f2xx_timer_clk_needed(void *opaque)
+{
+    STM32F2XXTimerState *s = opaque;
+
+    return clock_has_source(s->clk);
+}
+
+static const VMStateDescription vmstate_stm32f2xx_timer_clk = {
+    .name = TYPE_STM32F2XX_TIMER "/clk",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .needed = stm32f2xx_timer_clk_needed,
+    .fields = (VMStateField[]) {
+        VMSTATE_CLOCK(clk, STM32F2XXTimerState),
+        VMSTATE_END_OF_LIST()
+    }
 };
 
+static int stm32f2xx_timer_post_load(void *opaque, int version_id)
+{
+    STM32F2XXTimerState *s = opaque;
+
+    if (clock_has_source(s->clk)) {
+        s->freq_hz = clock_get_hz(s->clk);
+    }
+    return 0;
+}
+
 static const VMStateDescription vmstate_stm32f2xx_timer = {
     .name = TYPE_STM32F2XX_TIMER,
     .version_id = 1,
     .minimum_version_id = 1,
+    .post_load = stm32f2xx_timer_post_load,
     .fields = (VMStateField[]) {
         VMSTATE_INT64(tick_offset, STM32F2XXTimerState),
         VMSTATE_UINT32(tim_cr1, STM32F2XXTimerState),
@@ -295,6 +390,10 @@ static const VMStateDescription vmstate_stm32f2xx_timer = {
         VMSTATE_UINT32(tim_dmar, STM32F2XXTimerState),
         VMSTATE_UINT32(tim_or, STM32F2XXTimerState),
         VMSTATE_END_OF_LIST()
+    },
+    .subsections = (const VMStateDescription * []) {
+        &vmstate_stm32f2xx_timer_clk,
+        NULL
     }
 };
 
@@ -309,16 +408,26 @@ static void stm32f2xx_timer_init(Object *obj)
     STM32F2XXTimerState *s = STM32F2XXTIMER(obj);
 
     sysbus_init_irq(SYS_BUS_DEVICE(obj), &s->irq);
+    qdev_init_gpio_out_named(DEVICE(obj), &s->dma_request, "dma-request", 1);
+    qdev_init_gpio_in_named(DEVICE(obj), stm32f2xx_timer_dma_ack, "dma-ack", 1);
 
     memory_region_init_io(&s->iomem, obj, &stm32f2xx_timer_ops, s,
                           "stm32f2xx_timer", 0x400);
     sysbus_init_mmio(SYS_BUS_DEVICE(obj), &s->iomem);
+
+    /* When connected, the clock overrides the clock-frequency property */
+    s->clk = qdev_init_clock_in(DEVICE(obj), "clk", stm32f2xx_timer_clk_update,
+                                s, ClockPreUpdate | ClockUpdate);
 }
 
 static void stm32f2xx_timer_realize(DeviceState *dev, Error **errp)
 {
     STM32F2XXTimerState *s = STM32F2XXTIMER(dev);
     s->timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, stm32f2xx_timer_interrupt, s);
+
+    if (clock_has_source(s->clk)) {
+        s->freq_hz = clock_get_hz(s->clk);
+    }
 }
 
 static void stm32f2xx_timer_class_init(ObjectClass *klass, void *data)
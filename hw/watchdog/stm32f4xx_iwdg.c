@@ -0,0 +1,229 @@
+/*
+ * STM32F4XX IWDG
+ *
+ * Copyright (c) 2023 Julien Combattelli <julien.combattelli@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "qemu/log.h"
+#include "qemu/module.h"
+#include "trace.h"
+#include "hw/irq.h"
+#include "hw/qdev-clock.h"
+#include "hw/watchdog/stm32f4xx_iwdg.h"
+#include "migration/vmstate.h"
+
+#define IWDG_KR_UNLOCK 0x5555
+#define IWDG_KR_RELOAD 0xAAAA
+#define IWDG_KR_START 0xCCCC
+
+#define IWDG_PR_MASK 0x7
+#define IWDG_RLR_MASK 0xFFF
+
+/* The LSI clock is divided by 4 for PR = 0, up to 256 for PR = 6 or 7 */
+static uint32_t stm32f4xx_iwdg_prescaler(STM32F4xxIwdgState *s)
+{
+    return 4 << MIN(s->iwdg_pr, 6);
+}
+
+/* Load the counter with RLR, and schedule the reset for when it reaches 0 */
+static void stm32f4xx_iwdg_reload(STM32F4xxIwdgState *s)
+{
+    uint64_t ticks = (uint64_t)(s->iwdg_rlr + 1) * stm32f4xx_iwdg_prescaler(s);
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+
+    if (!s->running || !clock_is_enabled(s->clk))
+    {
+        timer_del(s->timer);
+        return;
+    }
+
+    trace_stm32f4xx_iwdg_reload(s->iwdg_rlr, stm32f4xx_iwdg_prescaler(s));
+    timer_mod(s->timer, now + clock_ticks_to_ns(s->clk, ticks));
+}
+
+static void stm32f4xx_iwdg_expired(void *opaque)
+{
+    STM32F4xxIwdgState *s = opaque;
+
+    trace_stm32f4xx_iwdg_expired();
+    qemu_irq_pulse(s->timeout);
+}
+
+static void stm32f4xx_iwdg_reset(DeviceState *dev)
+{
+    STM32F4xxIwdgState *s = STM32F4XX_IWDG(dev);
+
+    s->iwdg_pr = 0x00000000;
+    s->iwdg_rlr = 0x00000FFF;
+    s->unlocked = false;
+    s->running = false;
+
+    timer_del(s->timer);
+}
+
+static uint64_t stm32f4xx_iwdg_read(void *opaque, hwaddr addr,
+                                    unsigned int size)
+{
+    STM32F4xxIwdgState *s = opaque;
+
+    trace_stm32f4xx_iwdg_read(addr);
+
+    switch (addr)
+    {
+    case IWDG_KR:
+        /* Write only */
+        return 0;
+    case IWDG_PR:
+        return s->iwdg_pr;
+    case IWDG_RLR:
+        return s->iwdg_rlr;
+    case IWDG_SR:
+        /* Updates of PR and RLR are immediate, PVU and RVU are never set */
+        return 0;
+    default:
+        qemu_log_mask(LOG_GUEST_ERROR,
+                      "STM32F4XX_iwdg_read: Bad offset %x\n", (int)addr);
+    }
+    return 0;
+}
+
+static void stm32f4xx_iwdg_write(void *opaque, hwaddr addr,
+                                 uint64_t val64, unsigned int size)
+{
+    STM32F4xxIwdgState *s = opaque;
+    uint32_t value = (uint32_t)val64;
+
+    trace_stm32f4xx_iwdg_write(addr, value);
+
+    switch (addr)
+    {
+    case IWDG_KR:
+        value &= 0xFFFF;
+        s->unlocked = value == IWDG_KR_UNLOCK;
+        if (value == IWDG_KR_START)
+        {
+            s->running = true;
+            stm32f4xx_iwdg_reload(s);
+        }
+        else if (value == IWDG_KR_RELOAD)
+        {
+            stm32f4xx_iwdg_reload(s);
+        }
+        return;
+    case IWDG_PR:
+    case IWDG_RLR:
+        if (!s->unlocked)
+        {
+            qemu_log_mask(LOG_GUEST_ERROR,
+                          "STM32F4XX_iwdg_write: write access to %s is "
+                          "locked\n", addr == IWDG_PR ? "PR" : "RLR");
+            return;
+        }
+        /* Both take effect on the next reload */
+        if (addr == IWDG_PR)
+        {
+            s->iwdg_pr = value & IWDG_PR_MASK;
+        }
+        else
+        {
+            s->iwdg_rlr = value & IWDG_RLR_MASK;
+        }
+        return;
+    case IWDG_SR:
+        return;
+    default:
+        qemu_log_mask(LOG_GUEST_ERROR,
+                      "STM32F4XX_iwdg_write: Bad offset %x\n", (int)addr);
+    }
+}
+
+static const MemoryRegionOps stm32f4xx_iwdg_ops = {
+    .read = stm32f4xx_iwdg_read,
+    .write = stm32f4xx_iwdg_write,
+    .endianness = DEVICE_NATIVE_ENDIAN,
+};
+
+static void stm32f4xx_iwdg_init(Object *obj)
+{
+    STM32F4xxIwdgState *s = STM32F4XX_IWDG(obj);
+
+    memory_region_init_io(&s->mmio, obj, &stm32f4xx_iwdg_ops, s,
+                          TYPE_STM32F4XX_IWDG, 0x400);
+    sysbus_init_mmio(SYS_BUS_DEVICE(obj), &s->mmio);
+
+    qdev_init_gpio_out_named(DEVICE(obj), &s->timeout, "timeout", 1);
+
+    /* The LSI frequency is fixed, the running countdown is left as is */
+    s->clk = qdev_init_clock_in(DEVICE(obj), "clk", NULL, NULL, 0);
+}
+
+static void stm32f4xx_iwdg_realize(DeviceState *dev, Error **errp)
+{
+    STM32F4xxIwdgState *s = STM32F4XX_IWDG(dev);
+
+    if (!clock_has_source(s->clk))
+    {
+        error_setg(errp, "IWDG clock must be connected");
+        return;
+    }
+
+    s->timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, stm32f4xx_iwdg_expired, s);
+}
+
+static const VMStateDescription vmstate_stm32f4xx_iwdg = {
+    .name = TYPE_STM32F4XX_IWDG,
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]){
+        VMSTATE_UINT32(iwdg_pr, STM32F4xxIwdgState),
+        VMSTATE_UINT32(iwdg_rlr, STM32F4xxIwdgState),
+        VMSTATE_BOOL(unlocked, STM32F4xxIwdgState),
+        VMSTATE_BOOL(running, STM32F4xxIwdgState),
+        VMSTATE_TIMER_PTR(timer, STM32F4xxIwdgState),
+        VMSTATE_CLOCK(clk, STM32F4xxIwdgState),
+        VMSTATE_END_OF_LIST()}};
+
+static void stm32f4xx_iwdg_class_init(ObjectClass *klass, void *data)
+{
+    DeviceClass *dc = DEVICE_CLASS(klass);
+
+    dc->reset = stm32f4xx_iwdg_reset;
+    dc->realize = stm32f4xx_iwdg_realize;
+    dc->vmsd = &vmstate_stm32f4xx_iwdg;
+    set_bit(DEVICE_CATEGORY_WATCHDOG, dc->categories);
+}
+
+static const TypeInfo stm32f4xx_iwdg_info = {
+    .name = TYPE_STM32F4XX_IWDG,
+    .parent = TYPE_SYS_BUS_DEVICE,
+    .instance_size = sizeof(STM32F4xxIwdgState),
+    .instance_init = stm32f4xx_iwdg_init,
+    .class_init = stm32f4xx_iwdg_class_init,
+};
+
+static void stm32f4xx_iwdg_register_types(void)
+{
+    type_register_static(&stm32f4xx_iwdg_info);
+}
+
+type_init(stm32f4xx_iwdg_register_types)
@@ -0,0 +1,313 @@
+/*
+ * STM32F4XX WWDG
+ *
+ * Copyright (c) 2023 Julien Combattelli <julien.combattelli@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "qemu/log.h"
+#include "qemu/module.h"
+#include "trace.h"
+#include "hw/irq.h"
+#include "hw/qdev-clock.h"
+#include "hw/watchdog/stm32f4xx_wwdg.h"
+#include "migration/vmstate.h"
+
+#define WWDG_CR_T_MASK 0x7F
+#define WWDG_CR_T6 BIT(6)
+#define WWDG_CR_WDGA BIT(7)
+
+#define WWDG_CFR_W_MASK 0x7F
+#define WWDG_CFR_WDGTB_SHIFT 7
+#define WWDG_CFR_WDGTB_MASK (0x3 << WWDG_CFR_WDGTB_SHIFT)
+#define WWDG_CFR_EWI BIT(9)
+
+#define WWDG_SR_EWIF BIT(0)
+
+/* Counter values raising the early wakeup interrupt and the reset */
+#define WWDG_EWI_VALUE 0x40
+#define WWDG_RESET_VALUE 0x3F
+
+/* The counter decrements every 4096 * 2^WDGTB PCLK1 cycles */
+static uint64_t stm32f4xx_wwdg_tick_ns(STM32F4xxWwdgState *s)
+{
+    uint32_t wdgtb = (s->wwdg_cfr & WWDG_CFR_WDGTB_MASK) >>
+                     WWDG_CFR_WDGTB_SHIFT;
+
+    return clock_ticks_to_ns(s->clk, 4096 << wdgtb);
+}
+
+static uint32_t stm32f4xx_wwdg_counter(STM32F4xxWwdgState *s, int64_t now)
+{
+    uint64_t tick_ns = stm32f4xx_wwdg_tick_ns(s);
+    uint64_t elapsed;
+
+    /* Only count once activated, while the clock runs and until expiry */
+    if (!(s->wwdg_cr & WWDG_CR_WDGA) || tick_ns == 0 ||
+        s->load_value <= WWDG_RESET_VALUE)
+    {
+        return s->load_value;
+    }
+    elapsed = (now - s->load_time) / tick_ns;
+    return s->load_value - MIN(elapsed, s->load_value - WWDG_RESET_VALUE);
+}
+
+/* Restart counting from the current counter value, e.g. on a rate change */
+static void stm32f4xx_wwdg_hold(STM32F4xxWwdgState *s, int64_t now)
+{
+    s->load_value = stm32f4xx_wwdg_counter(s, now);
+    s->load_time = now;
+}
+
+static void stm32f4xx_wwdg_update_irq(STM32F4xxWwdgState *s)
+{
+    qemu_set_irq(s->irq, s->wwdg_sr & WWDG_SR_EWIF);
+}
+
+/* Schedule the next early wakeup interrupt or reset */
+static void stm32f4xx_wwdg_schedule(STM32F4xxWwdgState *s)
+{
+    uint64_t tick_ns = stm32f4xx_wwdg_tick_ns(s);
+    uint32_t target = WWDG_RESET_VALUE;
+
+    if (!(s->wwdg_cr & WWDG_CR_WDGA) || tick_ns == 0)
+    {
+        timer_del(s->timer);
+        return;
+    }
+
+    if ((s->wwdg_cfr & WWDG_CFR_EWI) && !(s->wwdg_sr & WWDG_SR_EWIF) &&
+        s->load_value > WWDG_EWI_VALUE)
+    {
+        target = WWDG_EWI_VALUE;
+    }
+    timer_mod(s->timer, s->load_time + (s->load_value - target) * tick_ns);
+}
+
+static void stm32f4xx_wwdg_expire(STM32F4xxWwdgState *s)
+{
+    trace_stm32f4xx_wwdg_expired(s->wwdg_cr & WWDG_CR_T_MASK);
+    timer_del(s->timer);
+    qemu_irq_pulse(s->timeout);
+}
+
+static void stm32f4xx_wwdg_tick(void *opaque)
+{
+    STM32F4xxWwdgState *s = opaque;
+    uint32_t counter = stm32f4xx_wwdg_counter(s,
+        qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL));
+
+    if (counter <= WWDG_RESET_VALUE)
+    {
+        stm32f4xx_wwdg_expire(s);
+        return;
+    }
+    if (counter <= WWDG_EWI_VALUE && (s->wwdg_cfr & WWDG_CFR_EWI))
+    {
+        s->wwdg_sr |= WWDG_SR_EWIF;
+        stm32f4xx_wwdg_update_irq(s);
+    }
+    stm32f4xx_wwdg_schedule(s);
+}
+
+static void stm32f4xx_wwdg_clk_update(void *opaque, ClockEvent event)
+{
+    STM32F4xxWwdgState *s = opaque;
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+
+    switch (event)
+    {
+    case ClockPreUpdate:
+        stm32f4xx_wwdg_hold(s, now);
+        break;
+    case ClockUpdate:
+        s->load_time = now;
+        stm32f4xx_wwdg_schedule(s);
+        break;
+    default:
+        g_assert_not_reached();
+    }
+}
+
+static void stm32f4xx_wwdg_reset(DeviceState *dev)
+{
+    STM32F4xxWwdgState *s = STM32F4XX_WWDG(dev);
+
+    s->wwdg_cr = 0x0000007F;
+    s->wwdg_cfr = 0x0000007F;
+    s->wwdg_sr = 0x00000000;
+    s->load_value = s->wwdg_cr & WWDG_CR_T_MASK;
+    s->load_time = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+
+    timer_del(s->timer);
+    stm32f4xx_wwdg_update_irq(s);
+}
+
+static uint64_t stm32f4xx_wwdg_read(void *opaque, hwaddr addr,
+                                    unsigned int size)
+{
+    STM32F4xxWwdgState *s = opaque;
+
+    trace_stm32f4xx_wwdg_read(addr);
+
+    switch (addr)
+    {
+    case WWDG_CR:
+        return (s->wwdg_cr & WWDG_CR_WDGA) |
+               stm32f4xx_wwdg_counter(s, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL));
+    case WWDG_CFR:
+        return s->wwdg_cfr;
+    case WWDG_SR:
+        return s->wwdg_sr;
+    default:
+        qemu_log_mask(LOG_GUEST_ERROR,
+                      "STM32F4XX_wwdg_read: Bad offset %x\n", (int)addr);
+    }
+    return 0;
+}
+
+static void stm32f4xx_wwdg_write(void *opaque, hwaddr addr,
+                                 uint64_t val64, unsigned int size)
+{
+    STM32F4xxWwdgState *s = opaque;
+    uint32_t value = (uint32_t)val64;
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    uint32_t counter;
+
+    trace_stm32f4xx_wwdg_write(addr, value);
+
+    switch (addr)
+    {
+    case WWDG_CR:
+        counter = stm32f4xx_wwdg_counter(s, now);
+        if ((s->wwdg_cr & WWDG_CR_WDGA) &&
+            counter > (s->wwdg_cfr & WWDG_CFR_W_MASK))
+        {
+            /* Refreshed outside of the window */
+            stm32f4xx_wwdg_expire(s);
+            return;
+        }
+        /* WDGA is cleared by reset only */
+        s->wwdg_cr = (s->wwdg_cr & WWDG_CR_WDGA) |
+                     (value & (WWDG_CR_WDGA | WWDG_CR_T_MASK));
+        s->load_value = value & WWDG_CR_T_MASK;
+        s->load_time = now;
+        if ((s->wwdg_cr & WWDG_CR_WDGA) && !(value & WWDG_CR_T6))
+        {
+            /* Clearing T6 generates an immediate reset */
+            stm32f4xx_wwdg_expire(s);
+            return;
+        }
+        stm32f4xx_wwdg_schedule(s);
+        return;
+    case WWDG_CFR:
+        stm32f4xx_wwdg_hold(s, now);
+        /* EWI is cleared by reset only */
+        s->wwdg_cfr = (s->wwdg_cfr & WWDG_CFR_EWI) |
+                      (value & (WWDG_CFR_EWI | WWDG_CFR_WDGTB_MASK |
+                                WWDG_CFR_W_MASK));
+        stm32f4xx_wwdg_schedule(s);
+        return;
+    case WWDG_SR:
+        /* EWIF is cleared by writing 0 */
+        s->wwdg_sr &= value;
+        stm32f4xx_wwdg_update_irq(s);
+        return;
+    default:
+        qemu_log_mask(LOG_GUEST_ERROR,
+                      "STM32F4XX_wwdg_write: Bad offset %x\n", (int)addr);
+    }
+}
+
+static const MemoryRegionOps stm32f4xx_wwdg_ops = {
+    .read = stm32f4xx_wwdg_read,
+    .write = stm32f4xx_wwdg_write,
+    .endianness = DEVICE_NATIVE_ENDIAN,
+};
+
+static void stm32f4xx_wwdg_init(Object *obj)
+{
+    STM32F4xxWwdgState *s = STM32F4XX_WWDG(obj);
+
+    sysbus_init_irq(SYS_BUS_DEVICE(obj), &s->irq);
+
+    memory_region_init_io(&s->mmio, obj, &stm32f4xx_wwdg_ops, s,
+                          TYPE_STM32F4XX_WWDG, 0x400);
+    sysbus_init_mmio(SYS_BUS_DEVICE(obj), &s->mmio);
+
+    qdev_init_gpio_out_named(DEVICE(obj), &s->timeout, "timeout", 1);
+
+    s->clk = qdev_init_clock_in(DEVICE(obj), "clk", stm32f4xx_wwdg_clk_update,
+                                s, ClockPreUpdate | ClockUpdate);
+}
+
+static void stm32f4xx_wwdg_realize(DeviceState *dev, Error **errp)
+{
+    STM32F4xxWwdgState *s = STM32F4XX_WWDG(dev);
+
+    if (!clock_has_source(s->clk))
+    {
+        error_setg(errp, "WWDG clock must be connected");
+        return;
+    }
+
+    s->timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, stm32f4xx_wwdg_tick, s);
+}
+
+static const VMStateDescription vmstate_stm32f4xx_wwdg = {
+    .name = TYPE_STM32F4XX_WWDG,
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]){
+        VMSTATE_UINT32(wwdg_cr, STM32F4xxWwdgState),
+        VMSTATE_UINT32(wwdg_cfr, STM32F4xxWwdgState),
+        VMSTATE_UINT32(wwdg_sr, STM32F4xxWwdgState),
+        VMSTATE_INT64(load_time, STM32F4xxWwdgState),
+        VMSTATE_UINT32(load_value, STM32F4xxWwdgState),
+        VMSTATE_TIMER_PTR(timer, STM32F4xxWwdgState),
+        VMSTATE_CLOCK(clk, STM32F4xxWwdgState),
+        VMSTATE_END_OF_LIST()}};
+
+static void stm32f4xx_wwdg_class_init(ObjectClass *klass, void *data)
+{
+    DeviceClass *dc = DEVICE_CLASS(klass);
+
+    dc->reset = stm32f4xx_wwdg_reset;
+    dc->realize = stm32f4xx_wwdg_realize;
+    dc->vmsd = &vmstate_stm32f4xx_wwdg;
+    set_bit(DEVICE_CATEGORY_WATCHDOG, dc->categories);
+}
+
+static const TypeInfo stm32f4xx_wwdg_info = {
+    .name = TYPE_STM32F4XX_WWDG,
+    .parent = TYPE_SYS_BUS_DEVICE,
+    .instance_size = sizeof(STM32F4xxWwdgState),
+    .instance_init = stm32f4xx_wwdg_init,
+    .class_init = stm32f4xx_wwdg_class_init,
+};
+
+static void stm32f4xx_wwdg_register_types(void)
+{
+    type_register_static(&stm32f4xx_wwdg_info);
+}
+
+type_init(stm32f4xx_wwdg_register_types)
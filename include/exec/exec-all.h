@@ -556,6 +556,18 @@ struct TranslationBlock {
     /* size of target code for this block (1 <= size <= TARGET_PAGE_SIZE) */
     uint16_t size;
     uint16_t icount;
+    /*
+     * icount units charged for running the TB: icount, or the approximate
+     * cycle count of its instructions with -icount cycles=on.
+     */
+    uint16_t cycles;
+
+    /*
+     * Code read from ROM. Such a TB is not in the page lists and does not
+     * write protect its pages, it must be invalidated explicitly with
+     * tb_invalidate_rom_range() when the host changes the ROM contents.
+     */
+    bool rom;
 
     struct tb_tc tc;
 
@@ -651,6 +663,9 @@ void tb_invalidate_phys_addr(AddressSpace *as, hwaddr addr, MemTxAttrs attrs);
 void tb_flush(CPUState *cpu);
 void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr);
 void tb_invalidate_phys_range(tb_page_addr_t start, tb_page_addr_t end);
+#if !defined(CONFIG_USER_ONLY)
+void tb_invalidate_rom_range(tb_page_addr_t start, tb_page_addr_t end);
+#endif
 void tb_set_jmp_target(TranslationBlock *tb, int n, uintptr_t addr);
 
 /* GETPC is the true target of the return instruction that we'll execute.  */
@@ -35,7 +35,7 @@ static inline void gen_tb_start(const TranslationBlock *tb)
         /*
          * We emit a sub with a dummy immediate argument. Keep the insn index
          * of the sub so that we later (when we know the actual insn count)
-         * can update the argument with the actual insn count.
+         * can update the argument with the actual cost of the TB.
          */
         tcg_gen_sub_i32(count, count, tcg_constant_i32(0));
         icount_start_insn = tcg_last_op();
@@ -74,15 +74,15 @@ static inline void gen_tb_start(const TranslationBlock *tb)
     tcg_temp_free_i32(count);
 }
 
-static inline void gen_tb_end(const TranslationBlock *tb, int num_insns)
+static inline void gen_tb_end(const TranslationBlock *tb, int num_cycles)
 {
     if (tb_cflags(tb) & CF_USE_ICOUNT) {
         /*
-         * Update the num_insn immediate parameter now that we know
-         * the actual insn count.
+         * Update the num_cycles immediate parameter now that we know
+         * the actual cost of the TB.
          */
         tcg_set_insn_param(icount_start_insn, 2,
-                           tcgv_i32_arg(tcg_constant_i32(num_insns)));
+                           tcgv_i32_arg(tcg_constant_i32(num_cycles)));
     }
 
     if (tcg_ctx->exitreq_label) {
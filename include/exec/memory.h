@@ -281,6 +281,22 @@ struct MemoryRegionOps {
          */
         bool unaligned;
     } impl;
+
+    /*
+     * If present, and returns #true, reading @addr has no side effect. A
+     * vCPU repeatedly reading the same value from there is busy waiting on
+     * the device, and TCG may suspend it until something can change the
+     * device state (see tcg,mmio-poll-suspend=on).
+     */
+    bool (*read_is_idempotent)(void *opaque, hwaddr addr, unsigned size);
+
+    /*
+     * If present, and returns #true, the value read from @addr only changes
+     * on a write or on the expiry of a QEMU_CLOCK_VIRTUAL timer, not on
+     * external events such as chardev input. While a vCPU is suspended
+     * polling it, idle-warp may still skip to the next timer deadline.
+     */
+    bool (*read_is_timed)(void *opaque, hwaddr addr, unsigned size);
 };
 
 typedef struct MemoryRegionClass {
@@ -2042,6 +2058,21 @@ void memory_region_reset_dirty(MemoryRegion *mr, hwaddr addr,
  */
 void memory_region_flush_rom_device(MemoryRegion *mr, hwaddr addr, hwaddr size);
 
+/**
+ * memory_region_flush_ram: Mark a range of RAM pages dirty and invalidate
+ *                          TBs after writing it through its host pointer.
+ *
+ * Like memory_region_flush_rom_device(), for RAM regions whose content is
+ * replaced wholesale, e.g. when restoring a snapshot, without going through
+ * address_space_write().
+ *
+ * @mr: the region being flushed.
+ * @addr: the start, relative to the start of the region, of the range being
+ *        flushed.
+ * @size: the size, in bytes, of the range being flushed.
+ */
+void memory_region_flush_ram(MemoryRegion *mr, hwaddr addr, hwaddr size);
+
 /**
  * memory_region_set_readonly: Turn a memory region read-only (or read-write)
  *
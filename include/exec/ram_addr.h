@@ -139,6 +139,25 @@ int qemu_ram_resize(RAMBlock *block, ram_addr_t newsize, Error **errp);
 
 void qemu_ram_msync(RAMBlock *block, ram_addr_t start, ram_addr_t length);
 
+/*
+ * Return true if @addr belongs to a RAM block that the guest can only read,
+ * so that its contents only change from the host side.
+ */
+bool qemu_ram_addr_is_rom(ram_addr_t addr);
+
+/*
+ * Record that a TB translated from ROM has code in the target page of
+ * @addr, see tb_invalidate_rom_range().
+ */
+void qemu_ram_mark_rom_tb(ram_addr_t addr);
+
+/*
+ * Return true if TBs translated from ROM may have code in [@start;@end[,
+ * and forget about the pages fully inside that range, which the caller is
+ * about to invalidate.
+ */
+bool qemu_ram_test_and_clear_rom_tbs(ram_addr_t start, ram_addr_t end);
+
 /* Clear whole block of mem */
 static inline void qemu_ram_block_writeback(RAMBlock *block)
 {
@@ -74,6 +74,13 @@ struct RAMBlock {
      * could not have been valid on the source.
      */
     ram_addr_t postcopy_length;
+
+    /*
+     * Target pages holding code of TBs translated from ROM, which are not
+     * in the page lists. Allocated with the first such TB, set bits may be
+     * stale. See qemu_ram_mark_rom_tb().
+     */
+    unsigned long *rom_tb_pages;
 };
 #endif
 #endif
@@ -75,6 +75,9 @@ typedef enum DisasJumpType {
  *           disassembly).
  * @is_jmp: What instruction to disassemble next.
  * @num_insns: Number of translated instructions (including current).
+ * @num_stalls: Stall cycles the target charges with -icount cycles=on, on
+ *              top of the one icount unit of every instruction. They are
+ *              kept apart from @num_insns, which targets may roll back.
  * @max_insns: Maximum number of instructions to be translated in this TB.
  * @singlestep_enabled: "Hardware" single stepping enabled.
  *
@@ -86,6 +89,7 @@ typedef struct DisasContextBase {
     target_ulong pc_next;
     DisasJumpType is_jmp;
     int num_insns;
+    int num_stalls;
     int max_insns;
     bool singlestep_enabled;
     void *host_addr[2];
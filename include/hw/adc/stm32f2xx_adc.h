@@ -51,6 +51,7 @@
 
 #define ADC_CR2_ADON    0x01
 #define ADC_CR2_CONT    0x02
+#define ADC_CR2_DMA     0x100
 #define ADC_CR2_ALIGN   0x800
 #define ADC_CR2_SWSTART 0x40000000
 
@@ -84,6 +85,8 @@ struct STM32F2XXADCState {
     uint32_t adc_dr;
 
     qemu_irq irq;
+    /* Raised while a conversion started in DMA mode waits to be read */
+    qemu_irq dma_request;
 };
 
 #endif /* HW_STM32F2XX_ADC_H */
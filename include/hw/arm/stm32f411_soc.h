@@ -30,10 +30,15 @@
 #include "hw/char/stm32f2xx_usart.h"
 #include "hw/adc/stm32f2xx_adc.h"
 #include "hw/block/stm32f4xx_flash.h"
+#include "hw/dma/stm32f4xx_dma.h"
+#include "hw/gpio/stm32f4xx_gpio.h"
+#include "hw/gpio/stm32f4xx_gpio_link.h"
 #include "hw/misc/stm32f4xx_exti.h"
 #include "hw/misc/stm32f4xx_rcc.h"
 #include "hw/or-irq.h"
 #include "hw/ssi/stm32f2xx_spi.h"
+#include "hw/watchdog/stm32f4xx_iwdg.h"
+#include "hw/watchdog/stm32f4xx_wwdg.h"
 #include "hw/arm/armv7m.h"
 #include "qom/object.h"
 
@@ -44,12 +49,46 @@ OBJECT_DECLARE_SIMPLE_TYPE(STM32F411State, STM32F411_SOC)
 #define STM_NUM_TIMERS 4 // max 8
 #define STM_NUM_ADCS 1
 #define STM_NUM_SPIS 5
+#define STM_NUM_DMAS 2
+#define STM_NUM_GPIOS 8 // GPIOA to GPIOH
 
 #define FLASH_BASE_ADDRESS 0x08000000
 #define FLASH_SIZE (512 * 1024)
 #define SRAM_BASE_ADDRESS 0x20000000
 #define SRAM_SIZE (128 * 1024)
 
+/*
+ * DMA request sources, elements of the "dma-request" GPIO input array of the
+ * SoC, each routed to up to two DMA streams.
+ */
+typedef enum
+{
+    STM32F411_DMA_USART1_RX,
+    STM32F411_DMA_USART1_TX,
+    STM32F411_DMA_USART2_RX,
+    STM32F411_DMA_USART2_TX,
+    STM32F411_DMA_USART6_RX,
+    STM32F411_DMA_USART6_TX,
+    STM32F411_DMA_SPI1_RX,
+    STM32F411_DMA_SPI1_TX,
+    STM32F411_DMA_SPI2_RX,
+    STM32F411_DMA_SPI2_TX,
+    STM32F411_DMA_SPI3_RX,
+    STM32F411_DMA_SPI3_TX,
+    STM32F411_DMA_SPI4_RX,
+    STM32F411_DMA_SPI4_TX,
+    STM32F411_DMA_SPI5_RX,
+    STM32F411_DMA_SPI5_TX,
+    STM32F411_DMA_ADC1,
+    STM32F411_DMA_TIM2_UP,
+    STM32F411_DMA_TIM3_UP,
+    STM32F411_DMA_TIM4_UP,
+    STM32F411_DMA_TIM5_UP,
+    STM32F411_DMA_REQUEST_COUNT
+} STM32F411DmaRequest;
+
+#define STM32F411_DMA_MAX_ROUTES 2
+
 struct STM32F411State
 {
     /*< private >*/
@@ -57,24 +96,44 @@ struct STM32F411State
     /*< public >*/
 
     char *cpu_type;
+    char *flash_file;
+    char *sram_file;
+    uint32_t index;
+    MemoryRegion *memory;
+    MemoryRegion *flash_source;
+    /* Exit status on watchdog reset, or -1 to perform the -action watchdog */
+    int32_t watchdog_exit_code;
 
     ARMv7MState armv7m;
 
     STM32F4xxRccState rcc;
     STM32F4xxSyscfgState syscfg;
     STM32F4xxFlashState flash_r;
+    Notifier flash_acr_notifier;
     STM32F4xxExtiState exti;
     STM32F2XXUsartState usart[STM_NUM_USARTS];
     STM32F2XXTimerState timer[STM_NUM_TIMERS];
     qemu_or_irq adc_irqs;
     STM32F2XXADCState adc[STM_NUM_ADCS];
     STM32F2XXSPIState spi[STM_NUM_SPIS];
+    STM32F4xxIwdgState iwdg;
+    STM32F4xxWwdgState wwdg;
+    STM32F4xxDmaState dma[STM_NUM_DMAS];
+    /* DMA stream inputs each request source is forwarded to, or NULL */
+    qemu_irq dma_route[STM32F411_DMA_REQUEST_COUNT][STM32F411_DMA_MAX_ROUTES];
+    /* Peripheral inputs the DMA acknowledgements are forwarded to, or NULL */
+    qemu_irq dma_ack[STM32F411_DMA_REQUEST_COUNT];
+    STM32F4xxGpioState gpio[STM_NUM_GPIOS];
+    STM32F4xxGpioLinkState gpio_link;
 
     MemoryRegion sram;
     MemoryRegion flash;
     MemoryRegion flash_alias;
 
-    Clock *sysclk;
+    /* Peripherals held in reset by the RCC, indexed by STM32F4xxRccPeriph */
+    DeviceState *rcc_periph[STM32F4XX_RCC_PERIPH_COUNT];
+
+    Clock *hse;
     Clock *refclk;
 };
 
@@ -26,6 +26,7 @@
 #define HW_STM32F4XX_FLASH_H
 
 #include "hw/sysbus.h"
+#include "qemu/notify.h"
 #include "qom/object.h"
 
 #define TYPE_STM32F4XX_FLASH "stm32f4xx-flash-r"
@@ -39,6 +40,11 @@ OBJECT_DECLARE_SIMPLE_TYPE(STM32F4xxFlashState, STM32F4XX_FLASH)
 #define FLASH_OPTCR 0x14
 #define FLASH_OPTCR1 0x18
 
+#define FLASH_ACR_LATENCY_MASK 0xF
+#define FLASH_ACR_PRFTEN BIT(8)
+#define FLASH_ACR_ICEN BIT(9)
+#define FLASH_ACR_DCEN BIT(10)
+
 struct STM32F4xxFlashState
 {
     SysBusDevice parent_obj;
@@ -54,6 +60,20 @@ struct STM32F4xxFlashState
     uint32_t flash_optcr1;   /*!< FLASH option control register 1, Address offset: 0x18 */
 
     qemu_irq irq;
+
+    /* Notified with the device whenever flash_acr changes */
+    NotifierList acr_notifiers;
 };
 
+/**
+ * stm32f4xx_flash_add_acr_notifier:
+ * @s: flash interface
+ * @notifier: notifier called with @s when the access control register changes
+ *
+ * Let the SoC track the wait states, prefetch and caches configured by the
+ * firmware, e.g. to feed them to the CPU cycle model.
+ */
+void stm32f4xx_flash_add_acr_notifier(STM32F4xxFlashState *s,
+                                      Notifier *notifier);
+
 #endif
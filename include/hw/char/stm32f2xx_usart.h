@@ -26,7 +26,10 @@
 #define HW_STM32F2XX_USART_H
 
 #include "hw/sysbus.h"
+#include "hw/clock.h"
 #include "chardev/char-fe.h"
+#include "qemu/fifo8.h"
+#include "qemu/timer.h"
 #include "qom/object.h"
 
 #define USART_SR   0x00
@@ -44,15 +47,42 @@
  */
 #define USART_SR_RESET (USART_SR_TXE | USART_SR_TC)
 
+#define USART_SR_CTS  (1 << 9)
+#define USART_SR_LBD  (1 << 8)
 #define USART_SR_TXE  (1 << 7)
 #define USART_SR_TC   (1 << 6)
 #define USART_SR_RXNE (1 << 5)
+#define USART_SR_IDLE (1 << 4)
+#define USART_SR_ORE  (1 << 3)
+/* Bits cleared by writing 0 to them, writing 1 has no effect */
+#define USART_SR_RC_W0 (USART_SR_CTS | USART_SR_LBD | USART_SR_TC | \
+                        USART_SR_RXNE)
 
+#define USART_CR1_OVER8  (1 << 15)
 #define USART_CR1_UE  (1 << 13)
+#define USART_CR1_M   (1 << 12)
+#define USART_CR1_TXEIE  (1 << 7)
+#define USART_CR1_TCIE  (1 << 6)
 #define USART_CR1_RXNEIE  (1 << 5)
+#define USART_CR1_IDLEIE  (1 << 4)
 #define USART_CR1_TE  (1 << 3)
 #define USART_CR1_RE  (1 << 2)
 
+#define USART_CR2_STOP_SHIFT 12
+#define USART_CR2_STOP_MASK  (3 << USART_CR2_STOP_SHIFT)
+
+#define USART_CR3_DMAT (1 << 7)
+#define USART_CR3_DMAR (1 << 6)
+
+/* Elements of the "dma-request" GPIO output array */
+#define STM32F2XX_USART_DMA_RX 0
+#define STM32F2XX_USART_DMA_TX 1
+
+/* Bytes buffered on the way to the chardev */
+#define STM32F2XX_USART_TX_FIFO_SIZE 256
+/* Bytes accepted from the chardev and not yet shifted in */
+#define STM32F2XX_USART_RX_FIFO_SIZE 256
+
 #define TYPE_STM32F2XX_USART "stm32f2xx-usart"
 OBJECT_DECLARE_SIMPLE_TYPE(STM32F2XXUsartState, STM32F2XX_USART)
 
@@ -73,5 +103,26 @@ struct STM32F2XXUsartState {
 
     CharBackend chr;
     qemu_irq irq;
+    qemu_irq dma_request[2];
+    Clock *clk;
+
+    /*
+     * Frame written to DR, waiting for the FIFO or the shifter while !TXE.
+     * It holds 9 data bits when CR1.M is set.
+     */
+    uint16_t tx_dr;
+    Fifo8 tx_fifo;
+    /* Drains tx_fifo from the main loop */
+    QEMUBH *tx_bh;
+    guint tx_watch_tag;
+    /* Paced transmission: expires once the current character is sent */
+    QEMUTimer *tx_timer;
+    bool tx_pacing;
+
+    Fifo8 rx_fifo;
+    /* Expires when the next character, or an idle frame, has been received */
+    QEMUTimer *rx_timer;
+    /* A character was received since IDLE was last set */
+    bool rx_idle_armed;
 };
 #endif /* HW_STM32F2XX_USART_H */
@@ -303,6 +303,7 @@ struct qemu_work_item;
  * @next_cpu: Next CPU sharing TB cache.
  * @opaque: User data.
  * @mem_io_pc: Host Program Counter at which the memory was accessed.
+ * @mmio_poll: TCG state to detect busy waiting on a device register.
  * @kvm_fd: vCPU file descriptor for KVM.
  * @work_mutex: Lock to prevent multiple access to @work_list.
  * @work_list: List of pending asynchronous work.
@@ -320,6 +321,29 @@ struct qemu_work_item;
  *
  * State of one CPU core or thread.
  */
+/*
+ * MMIOPoll: last side-effect free MMIO read of a vCPU, and how many times
+ * in a row the same instruction read the same value from it. @regs and
+ * @prev_regs hold the core registers at the last two checked reads, to
+ * tell loops counting a timeout from loops making no progress. Between
+ * these reads, @watch_stores makes all stores of the vCPU take the slow
+ * path, which sets @stored. @timed tells whether the register of a
+ * suspended vCPU only changes on timers, see MemoryRegionOps.
+ */
+typedef struct MMIOPoll {
+    MemoryRegion *mr;
+    hwaddr addr;
+    uint64_t val;
+    uintptr_t retaddr;
+    unsigned int count;
+    bool suspended;
+    bool timed;
+    bool watch_stores;
+    bool stored;
+    GByteArray *regs;
+    GByteArray *prev_regs;
+} MMIOPoll;
+
 struct CPUState {
     /*< private >*/
     DeviceState parent_obj;
@@ -389,6 +413,7 @@ struct CPUState {
      * we store some rarely used information in the CPU context.
      */
     uintptr_t mem_io_pc;
+    MMIOPoll mmio_poll;
 
     /* Only used in KVM */
     int kvm_fd;
@@ -0,0 +1,116 @@
+/*
+ * STM32F4XX DMA controller
+ *
+ * Copyright (c) 2023 Julien Combattelli <julien.combattelli@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * DMA controller with 8 streams, each selecting one of 8 request channels.
+ * Sysbus IRQ n is the interrupt of stream n. Peripherals drive the "request"
+ * GPIO input array, element (stream * 8 + channel), as a level: they raise
+ * it while they need data moved and drop it once the DMA access they asked
+ * for has been performed, e.g. when the DMA reads a data register.
+ * Transfers are performed through the "memory" link.
+ *
+ * After each data item moved for a request, the DMA sets the matching
+ * element of its "ack" GPIO output array to the number of items the stream
+ * still has to move, 0 once it stopped. Peripherals whose request is not
+ * lowered by the access itself, like timer update events, lower it there.
+ * A circular stream reports its reload value once it wrapped around.
+ */
+
+#ifndef HW_STM32F4XX_DMA_H
+#define HW_STM32F4XX_DMA_H
+
+#include "hw/sysbus.h"
+#include "exec/memory.h"
+#include "qom/object.h"
+
+#define DMA_LISR 0x00
+#define DMA_HISR 0x04
+#define DMA_LIFCR 0x08
+#define DMA_HIFCR 0x0C
+/* Stream registers, at DMA_STREAM_BASE + n * DMA_STREAM_SIZE for stream n */
+#define DMA_STREAM_BASE 0x10
+#define DMA_STREAM_SIZE 0x18
+#define DMA_SxCR 0x00
+#define DMA_SxNDTR 0x04
+#define DMA_SxPAR 0x08
+#define DMA_SxM0AR 0x0C
+#define DMA_SxM1AR 0x10
+#define DMA_SxFCR 0x14
+
+#define STM32F4XX_DMA_NUM_STREAMS 8
+#define STM32F4XX_DMA_NUM_CHANNELS 8
+#define STM32F4XX_DMA_FIFO_SIZE 16
+
+#define TYPE_STM32F4XX_DMA "stm32f4xx-dma"
+OBJECT_DECLARE_SIMPLE_TYPE(STM32F4xxDmaState, STM32F4XX_DMA)
+
+typedef struct STM32F4xxDmaStream
+{
+    uint32_t cr;   /*!< DMA stream x configuration register   */
+    uint32_t ndtr; /*!< DMA stream x number of data register  */
+    uint32_t par;  /*!< DMA stream x peripheral address       */
+    uint32_t m0ar; /*!< DMA stream x memory 0 address         */
+    uint32_t m1ar; /*!< DMA stream x memory 1 address         */
+    uint32_t fcr;  /*!< DMA stream x FIFO control register    */
+
+    /* Event flags, at their position for stream 0 in DMA_LISR */
+    uint32_t isr;
+    /* NDTR as programmed, reloaded in circular and double-buffer modes */
+    uint32_t ndtr_reload;
+    /* Offsets of the next peripheral and memory accesses from the bases */
+    uint32_t periph_pos;
+    uint32_t mem_pos;
+    uint8_t fifo[STM32F4XX_DMA_FIFO_SIZE];
+    uint32_t fifo_len;
+    /* Request channels currently raised */
+    uint8_t request;
+
+    /* Memory mapped while the stream runs, never across main loop turns */
+    void *map;
+    hwaddr map_addr;
+    hwaddr map_len;
+    hwaddr map_used;
+    bool map_is_write;
+} STM32F4xxDmaStream;
+
+struct STM32F4xxDmaState
+{
+    SysBusDevice parent_obj;
+
+    MemoryRegion mmio;
+    MemoryRegion *memory;
+    AddressSpace as;
+    /* Only DMA2 can perform memory-to-memory transfers */
+    bool mem_to_mem;
+
+    STM32F4xxDmaStream stream[STM32F4XX_DMA_NUM_STREAMS];
+    qemu_irq irq[STM32F4XX_DMA_NUM_STREAMS];
+    qemu_irq ack[STM32F4XX_DMA_NUM_STREAMS * STM32F4XX_DMA_NUM_CHANNELS];
+
+    /* Resumes streams which stopped with requests still pending */
+    QEMUBH *bh;
+    bool running;
+};
+
+#endif
@@ -0,0 +1,125 @@
+/*
+ * STM32F4XX GPIO
+ *
+ * Copyright (c) 2023 Julien Combattelli <julien.combattelli@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * GPIO port with 16 pins. Pins are driven from outside the chip through the
+ * "input" GPIO input array or stm32f4xx_gpio_drive(); undriven pins follow
+ * their pull-up or pull-down. The 16 unnamed GPIO outputs reflect IDR, for
+ * SYSCFG to route them to the EXTI.
+ */
+
+#ifndef HW_STM32F4XX_GPIO_H
+#define HW_STM32F4XX_GPIO_H
+
+#include "hw/sysbus.h"
+#include "qemu/notify.h"
+#include "qom/object.h"
+
+#define GPIO_MODER 0x00
+#define GPIO_OTYPER 0x04
+#define GPIO_OSPEEDR 0x08
+#define GPIO_PUPDR 0x0C
+#define GPIO_IDR 0x10
+#define GPIO_ODR 0x14
+#define GPIO_BSRR 0x18
+#define GPIO_LCKR 0x1C
+#define GPIO_AFRL 0x20
+#define GPIO_AFRH 0x24
+
+#define STM32F4XX_GPIO_NUM_PINS 16
+
+#define TYPE_STM32F4XX_GPIO "stm32f4xx-gpio"
+OBJECT_DECLARE_SIMPLE_TYPE(STM32F4xxGpioState, STM32F4XX_GPIO)
+
+struct STM32F4xxGpioState
+{
+    SysBusDevice parent_obj;
+
+    MemoryRegion mmio;
+
+    uint32_t gpio_moder;   /*!< GPIO port mode register,               0x00 */
+    uint32_t gpio_otyper;  /*!< GPIO port output type register,        0x04 */
+    uint32_t gpio_ospeedr; /*!< GPIO port output speed register,       0x08 */
+    uint32_t gpio_pupdr;   /*!< GPIO port pull-up/pull-down register,  0x0C */
+    uint32_t gpio_idr;     /*!< GPIO port input data register,         0x10 */
+    uint32_t gpio_odr;     /*!< GPIO port output data register,        0x14 */
+    uint32_t gpio_lckr;    /*!< GPIO port configuration lock register, 0x1C */
+    uint32_t gpio_afr[2];  /*!< GPIO alternate function registers,     0x20 */
+
+    /* Position in the LCKK write-write-write-read lock sequence */
+    uint32_t lock_step;
+
+    /* Pins driven from outside the chip, and the levels they are driven to */
+    uint32_t ext_mask;
+    uint32_t ext_level;
+
+    /* Reset values, which differ between ports */
+    uint32_t moder_reset;
+    uint32_t ospeedr_reset;
+    uint32_t pupdr_reset;
+
+    qemu_irq pin[STM32F4XX_GPIO_NUM_PINS];
+    NotifierList output_notifiers;
+};
+
+/**
+ * stm32f4xx_gpio_drive:
+ * @s: GPIO port
+ * @mask: pins to change
+ * @level: levels to drive the pins in @mask to
+ *
+ * Drive pins from outside the chip. All of them change at once.
+ */
+void stm32f4xx_gpio_drive(STM32F4xxGpioState *s, uint16_t mask,
+                          uint16_t level);
+
+/**
+ * stm32f4xx_gpio_release:
+ * @s: GPIO port
+ * @mask: pins to release
+ *
+ * Stop driving pins from outside the chip, letting them follow their
+ * pull-up or pull-down.
+ */
+void stm32f4xx_gpio_release(STM32F4xxGpioState *s, uint16_t mask);
+
+/**
+ * stm32f4xx_gpio_output_mask:
+ * @s: GPIO port
+ *
+ * Returns: the pins configured as general purpose outputs.
+ */
+uint16_t stm32f4xx_gpio_output_mask(STM32F4xxGpioState *s);
+
+/**
+ * stm32f4xx_gpio_add_output_notifier:
+ * @s: GPIO port
+ * @notifier: notifier called with @s as data
+ *
+ * Be notified when ODR or the set of output pins changes.
+ */
+void stm32f4xx_gpio_add_output_notifier(STM32F4xxGpioState *s,
+                                        Notifier *notifier);
+
+#endif
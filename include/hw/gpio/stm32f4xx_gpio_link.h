@@ -0,0 +1,100 @@
+/*
+ * STM32F4XX GPIO host link
+ *
+ * Copyright (c) 2023 Julien Combattelli <julien.combattelli@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * Connects the GPIO ports to a program on the host through a chardev, set
+ * with -global stm32f4xx-gpio-link.chardev=<id>. All fields are little
+ * endian.
+ *
+ * The host sends 8-byte commands. All the commands received at once are
+ * applied at the same virtual time, so pins changed together are seen
+ * together by the guest:
+ *   u8 command, u8 port (0 for GPIOA), u16 mask, u16 level, u16 reserved
+ *   command 0x01 drives the pins in mask to the bits of level,
+ *   command 0x02 releases the pins in mask, level is ignored.
+ *
+ * QEMU sends a 16-byte event for every port when the host connects, then
+ * whenever ODR or the set of output pins of a port changes:
+ *   u8 0x81, u8 port, u16 ODR, u16 output pins, u16 reserved,
+ *   u64 virtual time of the change in nanoseconds
+ * If the host falls behind, the changes of a port are coalesced and only
+ * its latest state is sent once the host reads again.
+ */
+
+#ifndef HW_STM32F4XX_GPIO_LINK_H
+#define HW_STM32F4XX_GPIO_LINK_H
+
+#include "hw/qdev-core.h"
+#include "hw/gpio/stm32f4xx_gpio.h"
+#include "chardev/char-fe.h"
+#include "qemu/fifo8.h"
+#include "qom/object.h"
+
+#define STM32F4XX_GPIO_LINK_MAX_PORTS 9
+
+#define STM32F4XX_GPIO_LINK_CMD_SIZE 8
+#define STM32F4XX_GPIO_LINK_CMD_DRIVE 0x01
+#define STM32F4XX_GPIO_LINK_CMD_RELEASE 0x02
+
+#define STM32F4XX_GPIO_LINK_EVENT_SIZE 16
+#define STM32F4XX_GPIO_LINK_EVENT_OUTPUT 0x81
+
+/*
+ * Events queued while the host does not keep up. Beyond that, only the
+ * latest state of each port is kept.
+ */
+#define STM32F4XX_GPIO_LINK_TX_FIFO_SIZE (4096 * STM32F4XX_GPIO_LINK_EVENT_SIZE)
+
+#define TYPE_STM32F4XX_GPIO_LINK "stm32f4xx-gpio-link"
+OBJECT_DECLARE_SIMPLE_TYPE(STM32F4xxGpioLinkState, STM32F4XX_GPIO_LINK)
+
+typedef struct STM32F4xxGpioLinkPort
+{
+    STM32F4xxGpioLinkState *link;
+    unsigned int index;
+    Notifier output_notifier;
+    /* Changed while the FIFO was full, its state is still to be sent */
+    bool dirty;
+    /* Virtual time of the last change */
+    int64_t changed_ns;
+} STM32F4xxGpioLinkPort;
+
+struct STM32F4xxGpioLinkState
+{
+    DeviceState parent_obj;
+
+    CharBackend chr;
+    STM32F4xxGpioState *port[STM32F4XX_GPIO_LINK_MAX_PORTS];
+    STM32F4xxGpioLinkPort port_link[STM32F4XX_GPIO_LINK_MAX_PORTS];
+
+    /* Start of a command split across reads */
+    uint8_t rx_buf[STM32F4XX_GPIO_LINK_CMD_SIZE];
+    uint32_t rx_len;
+
+    Fifo8 tx_fifo;
+    QEMUBH *tx_bh;
+    guint tx_watch_tag;
+};
+
+#endif
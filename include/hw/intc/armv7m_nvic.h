@@ -13,6 +13,7 @@
 #include "target/arm/cpu.h"
 #include "hw/sysbus.h"
 #include "hw/timer/armv7m_systick.h"
+#include "qemu/bitmap.h"
 #include "qom/object.h"
 
 #define TYPE_NVIC "armv7m_nvic"
@@ -25,6 +26,10 @@ DECLARE_INSTANCE_CHECKER(NVICState, NVIC,
 #define NVIC_MAX_VECTORS 512
 /* Number of internal exceptions */
 #define NVIC_INTERNAL_VECTORS 16
+/* Lowest raw exception priority (the v8M reset priority) */
+#define NVIC_MIN_PRIO -4
+/* Number of distinct raw exception priorities, from -4 to 255 */
+#define NVIC_PRIO_BUCKETS (256 - NVIC_MIN_PRIO)
 
 typedef struct VecInfo {
     /* Exception priorities can range from -3 to 255; only the unmodifiable
@@ -37,6 +42,15 @@ typedef struct VecInfo {
     uint8_t level; /* exceptions <=15 never set level */
 } VecInfo;
 
+/* A set of vectors[] entries, bucketed by raw priority */
+typedef struct NVICPrioMap {
+    /* bit (prio - NVIC_MIN_PRIO) is set if that bucket is not empty */
+    DECLARE_BITMAP(prios, NVIC_PRIO_BUCKETS);
+    DECLARE_BITMAP(vectors[NVIC_PRIO_BUCKETS], NVIC_MAX_VECTORS);
+    /* bucket each vector is in, or -1 if it is not in the set */
+    int16_t bucket[NVIC_MAX_VECTORS];
+} NVICPrioMap;
+
 struct NVICState {
     /*< private >*/
     SysBusDevice parent_obj;
@@ -78,6 +92,12 @@ struct NVICState {
     bool vectpending_is_s_banked;
     int exception_prio; /* group prio of the highest prio active exception */
     int vectpending_prio; /* group prio of the exeception in vectpending */
+    /* The enabled and pending, and the active, vectors[] entries. These
+     * are only used to recompute the cached state above without scanning
+     * every vector when the security extension is not implemented.
+     */
+    NVICPrioMap pending_map;
+    NVICPrioMap active_map;
 
     MemoryRegion sysregmem;
 
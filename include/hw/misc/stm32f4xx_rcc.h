@@ -28,6 +28,7 @@
 #define HW_STM32F4XX_RCC_H
 
 #include "hw/sysbus.h"
+#include "hw/clock.h"
 #include "qom/object.h"
 
 #define RCC_CR 0x00
@@ -52,6 +53,36 @@
 #define RCC_PLLI2SCFGR 0x84
 #define RCC_DCKCFGR 0x8C
 
+/* Frequency of the internal high-speed RC oscillator */
+#define RCC_HSI_FREQ 16000000
+/* Frequency of the internal low-speed RC oscillator */
+#define RCC_LSI_FREQ 32000
+
+/*
+ * Peripherals with a gated clock output ("<name>-clk") and a reset line
+ * (element of the "periph-reset" GPIO output array) driven by the
+ * RCC_APBxENR and RCC_APBxRSTR registers.
+ */
+typedef enum
+{
+    STM32F4XX_RCC_TIM2,
+    STM32F4XX_RCC_TIM3,
+    STM32F4XX_RCC_TIM4,
+    STM32F4XX_RCC_TIM5,
+    STM32F4XX_RCC_WWDG,
+    STM32F4XX_RCC_SPI2,
+    STM32F4XX_RCC_SPI3,
+    STM32F4XX_RCC_USART2,
+    STM32F4XX_RCC_USART1,
+    STM32F4XX_RCC_USART6,
+    STM32F4XX_RCC_ADC1,
+    STM32F4XX_RCC_SPI1,
+    STM32F4XX_RCC_SPI4,
+    STM32F4XX_RCC_SYSCFG,
+    STM32F4XX_RCC_SPI5,
+    STM32F4XX_RCC_PERIPH_COUNT
+} STM32F4xxRccPeriph;
+
 #define TYPE_STM32F4XX_RCC "stm32f4xx-rcc"
 OBJECT_DECLARE_SIMPLE_TYPE(STM32F4xxRccState, STM32F4XX_RCC)
 
@@ -92,6 +123,26 @@ struct STM32F4xxRccState
     uint32_t rcc_dckcfgr;      /*!< RCC Dedicated Clocks configuration register,                 Address offset: 0x8C */
 
     qemu_irq irq;
+
+    /* HSE oscillator or external clock, 0 Hz if not fitted */
+    Clock *hse;
+    Clock *sysclk;
+    /* AHB clock, also clocking the Cortex-M core */
+    Clock *hclk;
+    Clock *pclk1;
+    Clock *pclk2;
+    /* Clocks of the timers on APB1 and APB2 */
+    Clock *apb1_timclk;
+    Clock *apb2_timclk;
+    /* LSI oscillator, always running as it is forced on by the IWDG */
+    Clock *lsi;
+
+    Clock *periph_clk[STM32F4XX_RCC_PERIPH_COUNT];
+    qemu_irq periph_reset[STM32F4XX_RCC_PERIPH_COUNT];
+    /* Bitmap of the reset lines currently asserted */
+    uint32_t periph_reset_state;
+    /* periph_reset_state before an incoming migration, to apply the diff */
+    uint32_t periph_reset_live;
 };
 
 #endif
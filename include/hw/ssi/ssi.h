@@ -54,6 +54,14 @@ struct SSIPeripheralClass {
      * always be called for the device for every txrx access to the parent bus
      */
     uint32_t (*transfer_raw)(SSIPeripheral *dev, uint32_t val);
+
+    /* Optional, transfer @len 8-bit words at once with standard CS
+     * behaviour, instead of one transfer call per word. @tx is NULL to
+     * shift out zeros, @rx is NULL when what comes back is not wanted.
+     * Only called while the device cs is active.
+     */
+    void (*transfer_buf)(SSIPeripheral *dev, const uint8_t *tx, uint8_t *rx,
+                         size_t len);
 };
 
 struct SSIPeripheral {
@@ -109,4 +117,17 @@ SSIBus *ssi_create_bus(DeviceState *parent, const char *name);
 
 uint32_t ssi_transfer(SSIBus *bus, uint32_t val);
 
+/**
+ * ssi_transfer_buf: transfer a buffer of 8-bit words
+ * @bus: SSI bus
+ * @tx: words to shift out, or NULL to shift out zeros
+ * @rx: where to store the words shifted in, or NULL to drop them
+ * @len: number of words
+ *
+ * Equivalent to calling ssi_transfer() for each word, but peripherals
+ * implementing transfer_buf handle the whole buffer in one call.
+ */
+void ssi_transfer_buf(SSIBus *bus, const uint8_t *tx, uint8_t *rx,
+                      size_t len);
+
 #endif
@@ -26,6 +26,7 @@
 #define HW_STM32F2XX_SPI_H
 
 #include "hw/sysbus.h"
+#include "hw/clock.h"
 #include "hw/ssi/ssi.h"
 #include "qom/object.h"
 
@@ -39,11 +40,34 @@
 #define STM_SPI_I2SCFGR 0x1C
 #define STM_SPI_I2SPR   0x20
 
-#define STM_SPI_CR1_SPE  (1 << 6)
-#define STM_SPI_CR1_MSTR (1 << 2)
+#define STM_SPI_CR1_DFF    (1 << 11)
+#define STM_SPI_CR1_RXONLY (1 << 10)
+#define STM_SPI_CR1_SPE    (1 << 6)
+#define STM_SPI_CR1_MSTR   (1 << 2)
 
+#define STM_SPI_CR2_TXEIE   (1 << 7)
+#define STM_SPI_CR2_RXNEIE  (1 << 6)
+#define STM_SPI_CR2_ERRIE   (1 << 5)
+#define STM_SPI_CR2_TXDMAEN (1 << 1)
+#define STM_SPI_CR2_RXDMAEN (1 << 0)
+
+#define STM_SPI_SR_OVR    (1 << 6)
+#define STM_SPI_SR_TXE    (1 << 1)
 #define STM_SPI_SR_RXNE   1
 
+/*
+ * Received frames queued for the DMA, or clocked in ahead in receive-only
+ * mode. Without them, a single frame is held like in the hardware.
+ */
+#define STM_SPI_RX_FIFO_SIZE 64
+
+/* 8-bit frames written by the TX DMA, sent at once through the SSI bus */
+#define STM_SPI_TX_BURST_SIZE 64
+
+/* Elements of the "dma-request" GPIO output and "dma-ack" input arrays */
+#define STM32F2XX_SPI_DMA_RX 0
+#define STM32F2XX_SPI_DMA_TX 1
+
 #define TYPE_STM32F2XX_SPI "stm32f2xx-spi"
 OBJECT_DECLARE_SIMPLE_TYPE(STM32F2XXSPIState, STM32F2XX_SPI)
 
@@ -64,8 +88,19 @@ struct STM32F2XXSPIState {
     uint32_t spi_i2scfgr;
     uint32_t spi_i2spr;
 
+    uint16_t rx_fifo[STM_SPI_RX_FIFO_SIZE];
+    uint32_t rx_head;
+    uint32_t rx_count;
+    /* DR was read with OVR set, the next SR read clears it */
+    bool ovr_dr_read;
+    uint8_t tx_burst[STM_SPI_TX_BURST_SIZE];
+    uint32_t tx_len;
+    QEMUBH *tx_bh;
+
     qemu_irq irq;
+    qemu_irq dma_request[2];
     SSIBus *ssi;
+    Clock *clk;
 };
 
 #endif /* HW_STM32F2XX_SPI_H */
@@ -26,6 +26,7 @@
 #define HW_STM32F2XX_TIMER_H
 
 #include "hw/sysbus.h"
+#include "hw/clock.h"
 #include "qemu/timer.h"
 #include "qom/object.h"
 
@@ -60,6 +61,7 @@
 #define TIM_CCMR1_OC2PE (1 << 11)
 
 #define TIM_DIER_UIE  1
+#define TIM_DIER_UDE  (1 << 8)
 
 #define TYPE_STM32F2XX_TIMER "stm32f2xx-timer"
 typedef struct STM32F2XXTimerState STM32F2XXTimerState;
@@ -74,10 +76,13 @@ struct STM32F2XXTimerState {
     MemoryRegion iomem;
     QEMUTimer *timer;
     qemu_irq irq;
+    /* Raised on update events, until the DMA acknowledges one item */
+    qemu_irq dma_request;
 
     int64_t tick_offset;
     uint64_t hit_time;
     uint64_t freq_hz;
+    Clock *clk;
 
     uint32_t tim_cr1;
     uint32_t tim_cr2;
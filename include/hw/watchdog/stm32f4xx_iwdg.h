@@ -0,0 +1,66 @@
+/*
+ * STM32F4XX IWDG
+ *
+ * Copyright (c) 2023 Julien Combattelli <julien.combattelli@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * Independent watchdog, counting down from the LSI clock connected to the
+ * "clk" input. On expiry, the "timeout" GPIO output is pulsed: the SoC
+ * decides what a watchdog reset does.
+ */
+
+#ifndef HW_STM32F4XX_IWDG_H
+#define HW_STM32F4XX_IWDG_H
+
+#include "hw/sysbus.h"
+#include "hw/clock.h"
+#include "qemu/timer.h"
+#include "qom/object.h"
+
+#define IWDG_KR 0x00
+#define IWDG_PR 0x04
+#define IWDG_RLR 0x08
+#define IWDG_SR 0x0C
+
+#define TYPE_STM32F4XX_IWDG "stm32f4xx-iwdg"
+OBJECT_DECLARE_SIMPLE_TYPE(STM32F4xxIwdgState, STM32F4XX_IWDG)
+
+struct STM32F4xxIwdgState
+{
+    SysBusDevice parent_obj;
+
+    MemoryRegion mmio;
+
+    uint32_t iwdg_pr;  /*!< IWDG prescaler register,     Address offset: 0x04 */
+    uint32_t iwdg_rlr; /*!< IWDG reload register,        Address offset: 0x08 */
+
+    /* PR and RLR are writable, after 0x5555 has been written to KR */
+    bool unlocked;
+    /* Started by writing 0xCCCC to KR, only a reset stops it */
+    bool running;
+
+    QEMUTimer *timer;
+    Clock *clk;
+    qemu_irq timeout;
+};
+
+#endif
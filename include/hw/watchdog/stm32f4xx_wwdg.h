@@ -0,0 +1,69 @@
+/*
+ * STM32F4XX WWDG
+ *
+ * Copyright (c) 2023 Julien Combattelli <julien.combattelli@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * Window watchdog, counting down from PCLK1 connected to the "clk" input.
+ * The early wakeup interrupt is sysbus IRQ 0. On expiry, the "timeout"
+ * GPIO output is pulsed: the SoC decides what a watchdog reset does.
+ */
+
+#ifndef HW_STM32F4XX_WWDG_H
+#define HW_STM32F4XX_WWDG_H
+
+#include "hw/sysbus.h"
+#include "hw/clock.h"
+#include "qemu/timer.h"
+#include "qom/object.h"
+
+#define WWDG_CR 0x00
+#define WWDG_CFR 0x04
+#define WWDG_SR 0x08
+
+#define TYPE_STM32F4XX_WWDG "stm32f4xx-wwdg"
+OBJECT_DECLARE_SIMPLE_TYPE(STM32F4xxWwdgState, STM32F4XX_WWDG)
+
+struct STM32F4xxWwdgState
+{
+    SysBusDevice parent_obj;
+
+    MemoryRegion mmio;
+
+    uint32_t wwdg_cr;  /*!< WWDG control register,       Address offset: 0x00 */
+    uint32_t wwdg_cfr; /*!< WWDG configuration register, Address offset: 0x04 */
+    uint32_t wwdg_sr;  /*!< WWDG status register,        Address offset: 0x08 */
+
+    /*
+     * The counter in WWDG_CR.T is computed from the virtual time elapsed
+     * since it was last loaded with load_value.
+     */
+    int64_t load_time;
+    uint32_t load_value;
+
+    QEMUTimer *timer;
+    Clock *clk;
+    qemu_irq irq;
+    qemu_irq timeout;
+};
+
+#endif
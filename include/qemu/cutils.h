@@ -219,6 +219,19 @@ void qemu_init_exec_dir(const char *argv0);
 /* Get the saved exec dir.  */
 const char *qemu_get_exec_dir(void);
 
+/**
+ * qemu_get_build_id:
+ *
+ * Identify the running QEMU executable, for caches of data derived from
+ * the emulation that must not outlive a rebuild. Besides the version, the
+ * result includes the size, modification time and inode of the executable
+ * saved by qemu_init_exec_dir(), so it changes whenever QEMU is rebuilt.
+ * Hashing the whole binary would be exact but too slow for startup.
+ *
+ * Returns: a newly allocated string.
+ */
+char *qemu_get_build_id(void);
+
 /**
  * get_relocated_path:
  * @dir: the directory (typically a `CONFIG_*DIR` variable) to be relocated.
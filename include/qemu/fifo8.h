@@ -93,6 +93,20 @@ uint8_t fifo8_pop(Fifo8 *fifo);
  */
 const uint8_t *fifo8_pop_buf(Fifo8 *fifo, uint32_t max, uint32_t *num);
 
+/**
+ * fifo8_peek_buf:
+ * @fifo: FIFO to read from
+ * @max: maximum number of bytes to peek
+ * @num: actual number of returned bytes
+ *
+ * Like fifo8_pop_buf(), but leave the data in the FIFO. This lets callers
+ * pop only the part of the data they managed to consume, e.g. after a short
+ * write.
+ *
+ * Returns: A pointer to the peeked data.
+ */
+const uint8_t *fifo8_peek_buf(Fifo8 *fifo, uint32_t max, uint32_t *num);
+
 /**
  * fifo8_reset:
  * @fifo: FIFO to reset
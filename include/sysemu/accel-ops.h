@@ -34,6 +34,11 @@ struct AccelOpsClass {
     void (*create_vcpu_thread)(CPUState *cpu); /* MANDATORY NON-NULL */
     void (*kick_vcpu_thread)(CPUState *cpu);
     bool (*cpu_thread_is_idle)(CPUState *cpu);
+    /*
+     * Re-create the vCPU threads in a child process after fork(), with all
+     * vCPUs stopped. Optional: without it the accelerator cannot be forked.
+     */
+    void (*restart_vcpu_threads)(void);
 
     void (*synchronize_post_reset)(CPUState *cpu);
     void (*synchronize_post_init)(CPUState *cpu);
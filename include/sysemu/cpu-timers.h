@@ -31,6 +31,12 @@ extern int use_icount;
 #define icount_enabled() 0
 #endif
 
+/*
+ * With "cycles=on", icount units are the approximate CPU cycles that targets
+ * with a cycle model charge for each instruction, instead of instructions.
+ */
+extern bool icount_cycles;
+
 /*
  * Update the icount with the executed instructions. Called by
  * cpus-tcg vCPU thread so the main-loop can see time has moved forward.
@@ -50,6 +56,12 @@ int64_t icount_get(void);
  */
 int64_t icount_to_ns(int64_t icount);
 
+/*
+ * With "cycles=on" and a fixed shift, convert icount at the CPU clock
+ * rate @hz from now on instead of the shift, without a jump in time.
+ */
+void icount_set_cycle_hz(uint64_t hz);
+
 /* configure the icount options, including "shift" */
 void icount_configure(QemuOpts *opts, Error **errp);
 
@@ -84,6 +96,16 @@ int64_t cpu_get_clock(void);
 
 void qemu_timer_notify_cb(void *opaque, QEMUClockType type);
 
+/*
+ * Idle warp: without icount, make QEMU_CLOCK_VIRTUAL jump to its next
+ * deadline whenever all the vCPUs are idle, instead of waiting for it in
+ * real time.
+ */
+void cpu_idle_warp_enable(void);
+bool cpu_idle_warp_enabled(void);
+/* Called by the main loop before it waits. Caller must hold BQL */
+void cpu_idle_warp(void);
+
 /* get the VIRTUAL clock and VM elapsed ticks via the cpus accel interface */
 int64_t cpus_get_virtual_clock(void);
 int64_t cpus_get_elapsed_ticks(void);
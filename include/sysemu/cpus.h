@@ -38,6 +38,7 @@ void qemu_init_cpu_loop(void);
 void resume_all_vcpus(void);
 void pause_all_vcpus(void);
 void cpu_stop_current(void);
+bool cpus_restart_after_fork(Error **errp);
 
 extern int icount_align_option;
 
@@ -0,0 +1,58 @@
+/*
+ * Fork server execution mode
+ *
+ * Copyright (c) 2023 Julien Combattelli <julien.combattelli@gmail.com>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef SYSEMU_FORK_SERVER_H
+#define SYSEMU_FORK_SERVER_H
+
+#include "exec/cpu-common.h"
+
+/*
+ * The machine runs normally until it first stops, either because a vCPU
+ * reached the fork point PC or because a "stop" command was issued on the
+ * monitor. From then on QEMU serves requests on the control file descriptor
+ * and no longer runs the guest itself. All words exchanged are 32-bit in
+ * host byte order:
+ *
+ *  - once the fork point is reached, QEMU writes 0;
+ *  - for every word read from the fd (the value is reserved, send 0), QEMU
+ *    forks a child that resumes the guest from the fork point with a
+ *    copy-on-write view of its memory, writes the child's pid, waits for
+ *    the child to exit and writes its wait status;
+ *  - QEMU exits when the other end of the fd is closed.
+ *
+ * Requests and child exits are handled from the main loop, so the parent's
+ * monitor remains usable while it serves. Only one child runs at a time.
+ * Restarting the vCPUs in the child is only supported by the
+ * single-threaded TCG accelerator (-accel tcg,thread=single).
+ */
+
+/**
+ * fork_server_init:
+ * @fd: connected control file descriptor, owned by the fork server. The
+ *      machine option takes it as a number inherited from the parent
+ *      process; monitor fd names are not accepted.
+ * @has_pc: whether @pc is a fork point
+ * @pc: guest address at which to stop and start serving
+ * @errp: pointer to a NULL-initialized error object
+ *
+ * Arm the fork server. Must be called once the vCPUs have been created.
+ *
+ * Returns: true on success, false otherwise with @errp set.
+ */
+bool fork_server_init(int fd, bool has_pc, vaddr pc, Error **errp);
+
+/**
+ * fork_server_enabled:
+ *
+ * Returns: true if this process is an armed fork server, that is neither
+ * a child it forked nor a QEMU run without the fork server.
+ */
+bool fork_server_enabled(void);
+
+#endif /* SYSEMU_FORK_SERVER_H */
@@ -621,6 +621,8 @@ struct TCGContext {
 
     uint16_t gen_insn_end_off[TCG_MAX_INSNS];
     target_ulong gen_insn_data[TCG_MAX_INSNS][TARGET_INSN_START_WORDS];
+    /* Stall cycles charged before each insn, see DisasContextBase */
+    uint16_t gen_insn_stalls[TCG_MAX_INSNS];
 
     /* Exit to translator on overflow. */
     sigjmp_buf jmp_trans;
@@ -0,0 +1,254 @@
+/*
+ * In-memory VM checkpoints
+ *
+ * Copyright (c) 2023 Julien Combattelli <julien.combattelli@gmail.com>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "qapi/qapi-commands-migration.h"
+#include "exec/memory.h"
+#include "exec/ramblock.h"
+#include "exec/target_page.h"
+#include "io/channel-buffer.h"
+#include "migration/misc.h"
+#include "sysemu/runstate.h"
+#include "qemu-file.h"
+#include "savevm.h"
+
+typedef struct CheckpointRAM {
+    char *idstr;
+    uint8_t *data;
+    size_t size;
+    /* whether guest writes are tracked with the region's VGA dirty log */
+    bool tracked;
+} CheckpointRAM;
+
+typedef struct Checkpoint {
+    uint8_t *device_state;
+    size_t device_state_size;
+    GArray *ram;
+} Checkpoint;
+
+static Checkpoint *checkpoint;
+
+/*
+ * Memory regions whose dirty log has been enabled for checkpoints. Logging
+ * stays on once enabled, so that saving again does not need to touch the
+ * memory map.
+ */
+static GHashTable *checkpoint_logged_regions;
+
+static void checkpoint_ram_clear(gpointer data)
+{
+    CheckpointRAM *ram = data;
+
+    g_free(ram->idstr);
+    g_free(ram->data);
+}
+
+static void checkpoint_free(Checkpoint *cp)
+{
+    g_array_unref(cp->ram);
+    g_free(cp->device_state);
+    g_free(cp);
+}
+
+static int checkpoint_save_ram_block(RAMBlock *rb, void *opaque)
+{
+    Checkpoint *cp = opaque;
+    MemoryRegion *mr = rb->mr;
+    CheckpointRAM ram;
+
+    if (!qemu_ram_is_migratable(rb)) {
+        return 0;
+    }
+
+    ram.idstr = g_strdup(qemu_ram_get_idstr(rb));
+    ram.size = qemu_ram_get_used_length(rb);
+    ram.data = g_memdup2(qemu_ram_get_host_addr(rb), ram.size);
+
+    /*
+     * The VGA client is the only one that can be enabled per region. Leave
+     * regions alone if someone else, typically a display, already logs
+     * them: those are copied back in full.
+     */
+    if (!g_hash_table_contains(checkpoint_logged_regions, mr) &&
+        !(memory_region_get_dirty_log_mask(mr) & (1 << DIRTY_MEMORY_VGA))) {
+        memory_region_set_log(mr, true, DIRTY_MEMORY_VGA);
+        g_hash_table_add(checkpoint_logged_regions, mr);
+    }
+    ram.tracked = g_hash_table_contains(checkpoint_logged_regions, mr);
+    if (ram.tracked) {
+        memory_region_reset_dirty(mr, 0, ram.size, DIRTY_MEMORY_VGA);
+    }
+
+    g_array_append_val(cp->ram, ram);
+    return 0;
+}
+
+static bool checkpoint_restore_ram(CheckpointRAM *ram, Error **errp)
+{
+    RAMBlock *rb = qemu_ram_block_by_name(ram->idstr);
+    hwaddr page_size = qemu_target_page_size();
+    g_autofree DirtyBitmapSnapshot *snap = NULL;
+    MemoryRegion *mr;
+    uint8_t *host;
+    hwaddr addr, start;
+
+    if (!rb || qemu_ram_get_used_length(rb) != ram->size) {
+        error_setg(errp, "RAM block '%s' changed since the checkpoint",
+                   ram->idstr);
+        return false;
+    }
+    mr = rb->mr;
+    host = qemu_ram_get_host_addr(rb);
+
+    if (!ram->tracked) {
+        memcpy(host, ram->data, ram->size);
+        memory_region_flush_ram(mr, 0, ram->size);
+        return true;
+    }
+
+    snap = memory_region_snapshot_and_clear_dirty(mr, 0, ram->size,
+                                                  DIRTY_MEMORY_VGA);
+
+    /* Copy back runs of dirty pages */
+    for (addr = 0; addr < ram->size; ) {
+        if (!memory_region_snapshot_get_dirty(mr, snap, addr, page_size)) {
+            addr += page_size;
+            continue;
+        }
+        start = addr;
+        do {
+            addr += page_size;
+        } while (addr < ram->size &&
+                 memory_region_snapshot_get_dirty(mr, snap, addr, page_size));
+        addr = MIN(addr, ram->size);
+
+        memcpy(host + start, ram->data + start, addr - start);
+        memory_region_flush_ram(mr, start, addr - start);
+    }
+
+    /* Flushing marked the pages dirty again, they now match the checkpoint */
+    memory_region_reset_dirty(mr, 0, ram->size, DIRTY_MEMORY_VGA);
+    return true;
+}
+
+static bool checkpoint_check_idle(Error **errp)
+{
+    if (!migration_is_idle()) {
+        error_setg(errp, "Checkpoints cannot be used during migration");
+        return false;
+    }
+    return true;
+}
+
+void qmp_checkpoint_save(Error **errp)
+{
+    Checkpoint *cp;
+    QIOChannelBuffer *bioc;
+    QEMUFile *f;
+    bool saved_vm_running;
+    int ret;
+
+    if (!checkpoint_check_idle(errp)) {
+        return;
+    }
+
+    if (!checkpoint_logged_regions) {
+        checkpoint_logged_regions = g_hash_table_new(NULL, NULL);
+    }
+
+    saved_vm_running = runstate_is_running();
+    vm_stop(RUN_STATE_SAVE_VM);
+
+    cp = g_new0(Checkpoint, 1);
+    cp->ram = g_array_new(false, false, sizeof(CheckpointRAM));
+    g_array_set_clear_func(cp->ram, checkpoint_ram_clear);
+
+    bioc = qio_channel_buffer_new(4096);
+    qio_channel_set_name(QIO_CHANNEL(bioc), "checkpoint-save");
+    f = qemu_file_new_output(QIO_CHANNEL(bioc));
+    ret = qemu_save_device_state(f);
+    qemu_fflush(f);
+    if (ret < 0) {
+        error_setg(errp, "Failed to save device state: %d", ret);
+        checkpoint_free(cp);
+        goto out;
+    }
+    cp->device_state = g_memdup2(bioc->data, bioc->usage);
+    cp->device_state_size = bioc->usage;
+
+    qemu_ram_foreach_block(checkpoint_save_ram_block, cp);
+
+    if (checkpoint) {
+        checkpoint_free(checkpoint);
+    }
+    checkpoint = cp;
+
+out:
+    qemu_fclose(f);
+    object_unref(OBJECT(bioc));
+    if (saved_vm_running) {
+        vm_start();
+    }
+}
+
+void qmp_checkpoint_restore(Error **errp)
+{
+    QIOChannelBuffer *bioc;
+    QEMUFile *f;
+    bool saved_vm_running;
+    unsigned int i;
+    int ret;
+
+    if (!checkpoint) {
+        error_setg(errp, "No checkpoint has been saved");
+        return;
+    }
+    if (!checkpoint_check_idle(errp)) {
+        return;
+    }
+
+    saved_vm_running = runstate_is_running();
+    vm_stop(RUN_STATE_RESTORE_VM);
+
+    for (i = 0; i < checkpoint->ram->len; i++) {
+        CheckpointRAM *ram = &g_array_index(checkpoint->ram, CheckpointRAM, i);
+
+        if (!checkpoint_restore_ram(ram, errp)) {
+            /* RAM is partially restored, don't let the guest run on it */
+            return;
+        }
+    }
+
+    bioc = qio_channel_buffer_new(checkpoint->device_state_size);
+    qio_channel_set_name(QIO_CHANNEL(bioc), "checkpoint-restore");
+    memcpy(bioc->data, checkpoint->device_state,
+           checkpoint->device_state_size);
+    bioc->usage = checkpoint->device_state_size;
+    f = qemu_file_new_input(QIO_CHANNEL(bioc));
+    object_unref(OBJECT(bioc));
+
+    /* qemu_load_device_state() expects the stream past its header */
+    if (qemu_get_be32(f) != QEMU_VM_FILE_MAGIC ||
+        qemu_get_be32(f) != QEMU_VM_FILE_VERSION) {
+        error_setg(errp, "Corrupted checkpoint device state");
+        qemu_fclose(f);
+        return;
+    }
+    ret = qemu_load_device_state(f);
+    qemu_fclose(f);
+    if (ret < 0) {
+        error_setg(errp, "Failed to load device state: %d", ret);
+        return;
+    }
+
+    if (saved_vm_running) {
+        vm_start();
+    }
+}
@@ -179,10 +179,13 @@ ERST
 DEF("accel", HAS_ARG, QEMU_OPTION_accel,
     "-accel [accel=]accelerator[,prop[=value][,...]]\n"
     "                select accelerator (kvm, xen, hax, hvf, nvmm, whpx or tcg; use 'help' for a list)\n"
+    "                idle-warp=on|off (TCG skips virtual time while vCPUs are idle, default=off)\n"
     "                igd-passthru=on|off (enable Xen integrated Intel graphics passthrough, default=off)\n"
     "                kernel-irqchip=on|off|split controls accelerated irqchip support (default=on)\n"
     "                kvm-shadow-mem=size of KVM shadow MMU in bytes\n"
+    "                mmio-poll-suspend=on|off (TCG suspends vCPUs polling device registers, default=off)\n"
     "                split-wx=on|off (enable TCG split w^x mapping)\n"
+    "                tb-manifest=file (TCG translates blocks recorded in file ahead of time)\n"
     "                tb-size=n (TCG translation block cache size)\n"
     "                dirty-ring-size=n (KVM dirty ring GFN count, default 0)\n"
     "                notify-vmexit=run|internal-error|disable,notify-window=n (enable notify VM exit and set notify window, x86 only)\n"
@@ -195,6 +198,13 @@ SRST
     specified, the next one is used if the previous one fails to
     initialize.
 
+    ``idle-warp=on|off``
+        When TCG is in use and all the vCPUs are idle (e.g. waiting for an
+        interrupt with WFI), make the virtual clock jump to the next timer
+        deadline instead of waiting for it in real time (default=off). This
+        is similar to ``-icount sleep=off`` without instruction counting,
+        and cannot be combined with ``-icount``.
+
     ``igd-passthru=on|off``
         When Xen is in use, this option controls whether Intel
         integrated graphics devices can be passed through to the guest
@@ -210,12 +220,40 @@ SRST
     ``kvm-shadow-mem=size``
         Defines the size of the KVM shadow MMU.
 
+    ``mmio-poll-suspend=on|off``
+        When TCG is in use, detect vCPUs busy waiting on a device register,
+        i.e. reading the same value from it again and again without any
+        change to their registers, and suspend them until an interrupt, a
+        device write from any vCPU, or an event processed by the main loop
+        (default=off). Loops that change a register or store to memory
+        between two reads, such as loops counting down a timeout, are left
+        running. Only registers of devices that declare their reads free of
+        side effects are considered. This is a heuristic: a loop whose only
+        progress is in state other than the core registers and memory, or
+        that does not change them on every iteration, is suspended too.
+        Combined with ``idle-warp=on``, polling a timer flag fast-forwards
+        to the timer deadline, but polling a register that external events
+        change, like the status of a serial port waiting for input, does
+        not.
+
     ``split-wx=on|off``
         Controls the use of split w^x mapping for the TCG code generation
         buffer. Some operating systems require this to be enabled, and in
         such a case this will default on. On other operating systems, this
         will default off, but one may enable this for testing or debugging.
 
+    ``tb-manifest=file``
+        When TCG is in use, record on exit which blocks of read-only memory
+        (ROM, flash) were translated, together with the guest code they
+        were translated from, in ``file``. The file is tied to the QEMU
+        build, and instances sharing it merge their blocks into it. When
+        QEMU runs as a fork server (``fork-server-fd`` machine property)
+        and the file exists at startup, the server translates the recorded
+        blocks before the guest starts, skipping those whose guest code
+        changed, so that its children don't each translate them again.
+        This only prefetches the translation work: host code itself is not
+        saved, and other runs only record blocks.
+
     ``tb-size=n``
         Controls the size (in MiB) of the TCG translation block cache.
 
@@ -4446,13 +4484,14 @@ SRST
 ERST
 
 DEF("icount", HAS_ARG, QEMU_OPTION_icount, \
-    "-icount [shift=N|auto][,align=on|off][,sleep=on|off][,rr=record|replay,rrfile=<filename>[,rrsnapshot=<snapshot>]]\n" \
+    "-icount [shift=N|auto][,align=on|off][,sleep=on|off][,cycles=on|off][,rr=record|replay,rrfile=<filename>[,rrsnapshot=<snapshot>]]\n" \
     "                enable virtual instruction counter with 2^N clock ticks per\n" \
     "                instruction, enable aligning the host and virtual clocks\n" \
-    "                or disable real time cpu sleeping, and optionally enable\n" \
+    "                or disable real time cpu sleeping, count approximate cpu\n" \
+    "                cycles instead of instructions, and optionally enable\n" \
     "                record-and-replay mode\n", QEMU_ARCH_ALL)
 SRST
-``-icount [shift=N|auto][,align=on|off][,sleep=on|off][,rr=record|replay,rrfile=filename[,rrsnapshot=snapshot]]``
+``-icount [shift=N|auto][,align=on|off][,sleep=on|off][,cycles=on|off][,rr=record|replay,rrfile=filename[,rrsnapshot=snapshot]]``
     Enable virtual instruction counter. The virtual cpu will execute one
     instruction every 2^N ns of virtual time. If ``auto`` is specified
     then the virtual cpu speed will be automatically adjusted to keep
@@ -4486,6 +4525,16 @@ SRST
     depends on the host machine). The default if icount is enabled
     is ``align=off``.
 
+    ``cycles=on`` makes the counter advance by an approximation of the
+    CPU cycles each instruction takes rather than by one per instruction,
+    so that one cycle takes 2^N ns. With a fixed shift, once a Cortex-M
+    CPU has its clock frequency set the cycle period follows that clock
+    instead. Cycle costs are computed once per translation block; only
+    Cortex-M CPUs have a cycle model (Cortex-M4 instruction timings, plus
+    the flash wait states, prefetch and caches configured by the SoC),
+    other CPUs still count one cycle per instruction. The default is
+    ``cycles=off``.
+
     When the ``rr`` option is specified deterministic record/replay is
     enabled. The ``rrfile=`` option must also be provided to
     specify the path to the replay log. In record mode data is written
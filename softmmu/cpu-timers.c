@@ -135,6 +135,64 @@ void cpu_disable_ticks(void)
                          &timers_state.vm_clock_lock);
 }
 
+static bool idle_warp;
+
+void cpu_idle_warp_enable(void)
+{
+    assert(!icount_enabled());
+    idle_warp = true;
+}
+
+bool cpu_idle_warp_enabled(void)
+{
+    return idle_warp;
+}
+
+/*
+ * A vCPU suspended polling a device register counts as idle, but unless
+ * the register only changes on timers it may be waiting for an external
+ * event (chardev input, host I/O) that has no deadline to skip to.
+ */
+static bool cpu_idle_warp_polling_untimed(void)
+{
+    CPUState *cpu;
+
+    CPU_FOREACH(cpu) {
+        if (qatomic_read(&cpu->mmio_poll.suspended) &&
+            !cpu->mmio_poll.timed) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void cpu_idle_warp(void)
+{
+    int64_t deadline;
+
+    if (!idle_warp || !runstate_is_running() || !all_cpu_threads_idle() ||
+        cpu_idle_warp_polling_untimed()) {
+        return;
+    }
+
+    deadline = qemu_clock_deadline_ns_all(QEMU_CLOCK_VIRTUAL,
+                                          ~QEMU_TIMER_ATTR_EXTERNAL);
+    if (deadline <= 0) {
+        /* Either nothing to wait for, or timers about to run anyway */
+        return;
+    }
+
+    /*
+     * Nothing can happen in the VM until the deadline, skip straight to it.
+     * The main loop then runs the expired timers without sleeping.
+     */
+    seqlock_write_lock(&timers_state.vm_clock_seqlock,
+                       &timers_state.vm_clock_lock);
+    timers_state.cpu_clock_offset += deadline;
+    seqlock_write_unlock(&timers_state.vm_clock_seqlock,
+                         &timers_state.vm_clock_lock);
+}
+
 static bool icount_state_needed(void *opaque)
 {
     return icount_enabled();
@@ -157,6 +215,12 @@ static bool icount_shift_state_needed(void *opaque)
     return icount_enabled() == 2;
 }
 
+static bool icount_cycle_hz_state_needed(void *opaque)
+{
+    TimersState *s = opaque;
+    return s->icount_cycle_hz != 0;
+}
+
 /*
  * Subsection for warp timer migration is optional, because may not be created
  */
@@ -196,6 +260,17 @@ static const VMStateDescription icount_vmstate_shift = {
     }
 };
 
+static const VMStateDescription icount_vmstate_cycle_hz = {
+    .name = "timer/icount/cycle_hz",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .needed = icount_cycle_hz_state_needed,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT64(icount_cycle_hz, TimersState),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 /*
  * This is a subsection for icount migration.
  */
@@ -213,6 +288,7 @@ static const VMStateDescription icount_vmstate_timers = {
         &icount_vmstate_warp_timer,
         &icount_vmstate_adjust_timers,
         &icount_vmstate_shift,
+        &icount_vmstate_cycle_hz,
         NULL
     }
 };
@@ -419,6 +419,10 @@ void qemu_wait_io_event(CPUState *cpu)
         if (!slept) {
             slept = true;
             qemu_plugin_vcpu_idle_cb(cpu);
+            if (cpu_idle_warp_enabled()) {
+                /* Let the main loop move the virtual clock forward */
+                qemu_notify_event();
+            }
         }
         qemu_cond_wait(cpu->halt_cond, &qemu_global_mutex);
     }
@@ -651,6 +655,30 @@ void qemu_init_vcpu(CPUState *cpu)
     }
 }
 
+bool cpus_restart_after_fork(Error **errp)
+{
+    CPUState *cpu;
+
+    if (!cpus_accel->restart_vcpu_threads) {
+        error_setg(errp, "accelerator does not support restarting vCPU "
+                   "threads after fork");
+        return false;
+    }
+
+    CPU_FOREACH(cpu) {
+        assert(cpu->stopped);
+        cpu->created = false;
+    }
+    cpus_accel->restart_vcpu_threads();
+
+    CPU_FOREACH(cpu) {
+        while (!cpu->created) {
+            qemu_cond_wait(&qemu_cpu_cond, &qemu_global_mutex);
+        }
+    }
+    return true;
+}
+
 void cpu_stop_current(void)
 {
     if (current_cpu) {
@@ -0,0 +1,251 @@
+/*
+ * Fork server execution mode
+ *
+ * Copyright (c) 2023 Julien Combattelli <julien.combattelli@gmail.com>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "qemu/error-report.h"
+#include "qemu/main-loop.h"
+#include "qemu/rcu.h"
+#include "hw/core/cpu.h"
+#include "sysemu/cpus.h"
+#include "sysemu/runstate.h"
+#include "sysemu/fork-server.h"
+
+#ifdef CONFIG_POSIX
+
+typedef struct ForkServer {
+    int fd;
+    bool has_pc;
+    vaddr pc;
+    VMChangeStateEntry *vmse;
+    uint32_t request;           /* request word being received */
+    size_t request_len;         /* bytes of it received so far */
+    pid_t child;                /* running child, or 0 */
+    int child_fd;               /* read end of the child's exit pipe */
+} ForkServer;
+
+static ForkServer fork_server = {
+    .fd = -1,
+    .child_fd = -1,
+};
+
+static void fork_server_read(void *opaque);
+
+static void fork_server_write_word(uint32_t word)
+{
+    if (qemu_write_full(fork_server.fd, &word, sizeof(word)) != sizeof(word)) {
+        error_report("fork-server: write failed: %s", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void fork_server_resume_child(void)
+{
+    Error *err = NULL;
+    CPUState *cpu;
+
+    /*
+     * Keep the write end of the exit pipe open until the child terminates,
+     * this is how the parent notices it.
+     */
+    qemu_set_fd_handler(fork_server.fd, NULL, NULL, NULL);
+    close(fork_server.fd);
+    fork_server.fd = -1;
+    close(fork_server.child_fd);
+    fork_server.child_fd = -1;
+
+    if (fork_server.has_pc) {
+        CPU_FOREACH(cpu) {
+            cpu_breakpoint_remove(cpu, fork_server.pc, BP_GDB);
+        }
+    }
+
+    if (!cpus_restart_after_fork(&err)) {
+        error_report_err(err);
+        exit(EXIT_FAILURE);
+    }
+    vm_start();
+}
+
+/* The child closed its end of the exit pipe, i.e. it terminated */
+static void fork_server_child_exited(void *opaque)
+{
+    int status;
+
+    qemu_set_fd_handler(fork_server.child_fd, NULL, NULL, NULL);
+    close(fork_server.child_fd);
+    fork_server.child_fd = -1;
+
+    while (waitpid(fork_server.child, &status, 0) < 0) {
+        if (errno != EINTR) {
+            error_report("fork-server: waitpid failed: %s", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+    }
+    fork_server.child = 0;
+    fork_server_write_word(status);
+
+    /* Ready for the next request */
+    qemu_set_fd_handler(fork_server.fd, fork_server_read, NULL, NULL);
+}
+
+static void fork_server_fork(void)
+{
+    int exit_pipe[2];
+    pid_t pid;
+
+    if (!g_unix_open_pipe(exit_pipe, FD_CLOEXEC, NULL)) {
+        error_report("fork-server: pipe failed: %s", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    fork_server.child_fd = exit_pipe[0];
+
+    /* Don't let the children replay output buffered so far */
+    fflush(NULL);
+
+    rcu_enable_atfork();
+    pid = fork();
+    rcu_disable_atfork();
+
+    if (pid < 0) {
+        error_report("fork-server: fork failed: %s", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    if (pid == 0) {
+        fork_server_resume_child();
+        return;
+    }
+
+    close(exit_pipe[1]);
+    fork_server.child = pid;
+    fork_server_write_word(pid);
+
+    /* Serve one child at a time, until it exits */
+    qemu_set_fd_handler(fork_server.fd, NULL, NULL, NULL);
+    qemu_set_fd_handler(fork_server.child_fd, fork_server_child_exited,
+                        NULL, NULL);
+}
+
+/*
+ * Called from the main loop when the control fd is readable, so a single
+ * read() does not block. Requests may arrive in several pieces.
+ */
+static void fork_server_read(void *opaque)
+{
+    ssize_t ret;
+
+    ret = read(fork_server.fd, (uint8_t *)&fork_server.request +
+               fork_server.request_len,
+               sizeof(fork_server.request) - fork_server.request_len);
+    if (ret < 0) {
+        if (errno == EINTR || errno == EAGAIN) {
+            return;
+        }
+        error_report("fork-server: read failed: %s", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    if (ret == 0) {
+        if (fork_server.request_len) {
+            error_report("fork-server: truncated request");
+            exit(EXIT_FAILURE);
+        }
+        exit(EXIT_SUCCESS);
+    }
+
+    fork_server.request_len += ret;
+    if (fork_server.request_len == sizeof(fork_server.request)) {
+        fork_server.request_len = 0;
+        fork_server_fork();
+    }
+}
+
+static void fork_server_serve(void *opaque)
+{
+    /*
+     * The parent keeps running its main loop with the VM stopped, waiting
+     * for requests and children from fd handlers, so the monitor stays
+     * responsive.
+     */
+    fork_server_write_word(0);
+    qemu_set_fd_handler(fork_server.fd, fork_server_read, NULL, NULL);
+}
+
+static void fork_server_vm_state_change(void *opaque, bool running,
+                                        RunState state)
+{
+    if (running ||
+        (state != RUN_STATE_DEBUG && state != RUN_STATE_PAUSED)) {
+        return;
+    }
+
+    qemu_del_vm_change_state_handler(fork_server.vmse);
+    fork_server.vmse = NULL;
+
+    /*
+     * Fork from the main loop rather than from within vm_stop(), so that
+     * the children resume with the stop (and any monitor command causing
+     * it) fully processed.
+     */
+    aio_bh_schedule_oneshot(qemu_get_aio_context(), fork_server_serve, NULL);
+}
+
+bool fork_server_init(int fd, bool has_pc, vaddr pc, Error **errp)
+{
+    ERRP_GUARD();
+    CPUState *cpu;
+
+    assert(fork_server.fd < 0);
+
+    if (!cpus_get_accel()->restart_vcpu_threads) {
+        error_setg(errp, "fork server requires single-threaded TCG");
+        error_append_hint(errp, "Use -accel tcg,thread=single\n");
+        return false;
+    }
+
+    if (fcntl(fd, F_GETFD) < 0) {
+        error_setg_errno(errp, errno, "invalid fork server fd %d", fd);
+        return false;
+    }
+
+    if (has_pc) {
+        CPU_FOREACH(cpu) {
+            if (cpu_breakpoint_insert(cpu, pc, BP_GDB, NULL)) {
+                error_setg(errp, "cannot set fork point at 0x%" PRIx64, pc);
+                return false;
+            }
+        }
+    }
+
+    fork_server.fd = fd;
+    fork_server.has_pc = has_pc;
+    fork_server.pc = pc;
+    fork_server.vmse =
+        qemu_add_vm_change_state_handler(fork_server_vm_state_change, NULL);
+    return true;
+}
+
+bool fork_server_enabled(void)
+{
+    return fork_server.fd >= 0;
+}
+
+#else
+
+bool fork_server_init(int fd, bool has_pc, vaddr pc, Error **errp)
+{
+    error_setg(errp, "fork server is not supported on this host");
+    return false;
+}
+
+bool fork_server_enabled(void)
+{
+    return false;
+}
+
+#endif /* CONFIG_POSIX */
@@ -24,6 +24,7 @@
 
 #include "qemu/osdep.h"
 #include "qemu/cutils.h"
+#include "qemu/host-utils.h"
 #include "migration/vmstate.h"
 #include "qapi/error.h"
 #include "qemu/error-report.h"
@@ -57,6 +58,9 @@ static bool icount_sleep = true;
  */
 int use_icount;
 
+/* Count CPU cycles rather than instructions, see cpu-timers.h */
+bool icount_cycles;
+
 static void icount_enable_precise(void)
 {
     use_icount = 1;
@@ -158,9 +162,35 @@ int64_t icount_get(void)
 
 int64_t icount_to_ns(int64_t icount)
 {
+    uint64_t hz = qatomic_read(&timers_state.icount_cycle_hz);
+
+    if (hz) {
+        return muldiv64(icount, NANOSECONDS_PER_SECOND, hz);
+    }
     return icount << qatomic_read(&timers_state.icount_time_shift);
 }
 
+void icount_set_cycle_hz(uint64_t hz)
+{
+    int64_t cur_icount;
+
+    /* Only a fixed rate is followed, shift=auto keeps adjusting the shift */
+    if (!icount_cycles || use_icount != 1 || hz > UINT32_MAX ||
+        hz == timers_state.icount_cycle_hz) {
+        return;
+    }
+
+    /* Rebase so that the virtual clock does not jump at the change */
+    seqlock_write_lock(&timers_state.vm_clock_seqlock,
+                       &timers_state.vm_clock_lock);
+    cur_icount = icount_get_locked();
+    qatomic_set(&timers_state.icount_cycle_hz, hz);
+    qatomic_set_i64(&timers_state.qemu_icount_bias,
+                    cur_icount - icount_to_ns(timers_state.qemu_icount));
+    seqlock_write_unlock(&timers_state.vm_clock_seqlock,
+                         &timers_state.vm_clock_lock);
+}
+
 /*
  * Correlation between real and virtual time is always going to be
  * fairly approximate, so ignore small variation.
@@ -227,7 +257,15 @@ static void icount_adjust_vm(void *opaque)
 
 int64_t icount_round(int64_t count)
 {
-    int shift = qatomic_read(&timers_state.icount_time_shift);
+    uint64_t hz = qatomic_read(&timers_state.icount_cycle_hz);
+    int shift;
+
+    if (hz) {
+        int64_t cycles = muldiv64(count, hz, NANOSECONDS_PER_SECOND);
+
+        return icount_to_ns(cycles) < count ? cycles + 1 : cycles;
+    }
+    shift = qatomic_read(&timers_state.icount_time_shift);
     return (count + (1 << shift) - 1) >> shift;
 }
 
@@ -420,11 +458,14 @@ void icount_configure(QemuOpts *opts, Error **errp)
     const char *option = qemu_opt_get(opts, "shift");
     bool sleep = qemu_opt_get_bool(opts, "sleep", true);
     bool align = qemu_opt_get_bool(opts, "align", false);
+    bool cycles = qemu_opt_get_bool(opts, "cycles", false);
     long time_shift = -1;
 
     if (!option) {
         if (qemu_opt_get(opts, "align") != NULL) {
             error_setg(errp, "Please specify shift option when using align");
+        } else if (cycles) {
+            error_setg(errp, "Please specify shift option when using cycles");
         }
         return;
     }
@@ -455,6 +496,7 @@ void icount_configure(QemuOpts *opts, Error **errp)
     }
 
     icount_align_option = align;
+    icount_cycles = cycles;
 
     if (time_shift >= 0) {
         timers_state.icount_time_shift = time_shift;
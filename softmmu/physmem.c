@@ -1748,6 +1748,68 @@ void qemu_ram_unset_migratable(RAMBlock *rb)
     rb->flags &= ~RAM_MIGRATABLE;
 }
 
+bool qemu_ram_addr_is_rom(ram_addr_t addr)
+{
+    RAMBlock *block;
+
+    RCU_READ_LOCK_GUARD();
+    block = qemu_get_ram_block(addr);
+    return memory_region_is_rom(block->mr);
+}
+
+void qemu_ram_mark_rom_tb(ram_addr_t addr)
+{
+    RAMBlock *block;
+    unsigned long *pages;
+
+    RCU_READ_LOCK_GUARD();
+    block = qemu_get_ram_block(addr);
+    pages = qatomic_rcu_read(&block->rom_tb_pages);
+    if (!pages) {
+        unsigned long *new = bitmap_new(block->max_length >> TARGET_PAGE_BITS);
+
+        /* vCPUs may translate concurrently */
+        pages = qatomic_cmpxchg(&block->rom_tb_pages, NULL, new);
+        if (pages) {
+            g_free(new);
+        } else {
+            pages = new;
+        }
+    }
+    set_bit_atomic((addr - block->offset) >> TARGET_PAGE_BITS, pages);
+}
+
+bool qemu_ram_test_and_clear_rom_tbs(ram_addr_t start, ram_addr_t end)
+{
+    RAMBlock *block;
+    unsigned long *pages;
+    unsigned long first, last, page;
+    bool found = false;
+
+    RCU_READ_LOCK_GUARD();
+    block = qemu_get_ram_block(start);
+    pages = qatomic_rcu_read(&block->rom_tb_pages);
+    if (!pages || end <= start) {
+        return false;
+    }
+
+    end = MIN(end, block->offset + block->max_length);
+    first = (start - block->offset) >> TARGET_PAGE_BITS;
+    last = (end - 1 - block->offset) >> TARGET_PAGE_BITS;
+    for (page = find_next_bit(pages, last + 1, first); page <= last;
+         page = find_next_bit(pages, last + 1, page + 1)) {
+        ram_addr_t page_start = block->offset +
+                                ((ram_addr_t)page << TARGET_PAGE_BITS);
+
+        found = true;
+        /* Pages partially in the range may keep TBs outside of it */
+        if (page_start >= start && page_start + TARGET_PAGE_SIZE <= end) {
+            qatomic_and(&pages[BIT_WORD(page)], ~BIT_MASK(page));
+        }
+    }
+    return found;
+}
+
 int qemu_ram_get_fd(RAMBlock *rb)
 {
     return rb->fd;
@@ -2212,6 +2274,7 @@ static void reclaim_ramblock(RAMBlock *block)
     } else {
         qemu_anon_ram_free(block->host, block->max_length);
     }
+    g_free(block->rom_tb_pages);
     g_free(block);
 }
 
@@ -2714,6 +2777,10 @@ static void invalidate_and_set_dirty(MemoryRegion *mr, hwaddr addr,
         tb_invalidate_phys_range(addr, addr + length);
         dirty_log_mask &= ~(1 << DIRTY_MEMORY_CODE);
     }
+    if (memory_region_is_rom(mr) && tcg_enabled()) {
+        /* TBs from ROM are not write protected, see tb_link_page() */
+        tb_invalidate_rom_range(addr, addr + length);
+    }
     cpu_physical_memory_set_dirty_range(addr, length, dirty_log_mask);
 }
 
@@ -2730,6 +2797,13 @@ void memory_region_flush_rom_device(MemoryRegion *mr, hwaddr addr, hwaddr size)
     invalidate_and_set_dirty(mr, addr, size);
 }
 
+void memory_region_flush_ram(MemoryRegion *mr, hwaddr addr, hwaddr size)
+{
+    assert(memory_region_is_ram(mr));
+
+    invalidate_and_set_dirty(mr, addr, size);
+}
+
 int memory_access_size(MemoryRegion *mr, unsigned l, hwaddr addr)
 {
     unsigned access_size_max = mr->ops->valid.max_access_size;
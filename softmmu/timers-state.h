@@ -43,6 +43,8 @@ typedef struct TimersState {
 
     /* Conversion factor from emulated instructions to virtual clock ticks.  */
     int16_t icount_time_shift;
+    /* With -icount cycles=on, the CPU clock rate replacing the shift.  */
+    uint64_t icount_cycle_hz;
     /* Icount delta used for shift auto adjust. */
     int64_t last_delta;
 
@@ -6,3 +6,7 @@ int64_t cpu_get_clock(void)
 {
     return get_clock_realtime();
 }
+
+void cpu_idle_warp(void)
+{
+}
@@ -5,6 +5,7 @@
 /* icount - Instruction Counter API */
 
 int use_icount;
+bool icount_cycles;
 
 void icount_update(CPUState *cpu)
 {
@@ -30,6 +31,9 @@ int64_t icount_to_ns(int64_t icount)
     abort();
     return 0;
 }
+void icount_set_cycle_hz(uint64_t hz)
+{
+}
 int64_t icount_round(int64_t count)
 {
     abort();
@@ -39,6 +39,7 @@
 #include "hw/boards.h"
 #endif
 #include "sysemu/tcg.h"
+#include "sysemu/cpu-timers.h"
 #include "sysemu/qtest.h"
 #include "sysemu/hw_accel.h"
 #include "kvm_arm.h"
@@ -483,6 +484,7 @@ static void arm_cpu_reset(DeviceState *dev)
                        sizeof(*env->pmsav7.drsr) * cpu->pmsav7_dregion);
                 memset(env->pmsav7.dracr, 0,
                        sizeof(*env->pmsav7.dracr) * cpu->pmsav7_dregion);
+                pmsav7_map_invalidate(cpu);
             }
         }
         env->pmsav7.rnr[M_REG_NS] = 0;
@@ -1486,6 +1488,27 @@ static void arm_cpu_finalizefn(Object *obj)
 #endif
 }
 
+void arm_cpu_set_flash_timing(ARMCPU *cpu, unsigned wait_states,
+                              bool prefetch, bool icache, bool dcache)
+{
+    if (cpu->flash_wait_states == wait_states &&
+        cpu->flash_prefetch == prefetch &&
+        cpu->flash_icache == icache &&
+        cpu->flash_dcache == dcache) {
+        return;
+    }
+
+    cpu->flash_wait_states = wait_states;
+    cpu->flash_prefetch = prefetch;
+    cpu->flash_icache = icache;
+    cpu->flash_dcache = dcache;
+
+    /* The cycle costs are computed at translation time */
+    if (tcg_enabled() && icount_cycles) {
+        tb_flush(CPU(cpu));
+    }
+}
+
 void arm_cpu_finalize_features(ARMCPU *cpu, Error **errp)
 {
     Error *local_err = NULL;
@@ -2026,6 +2049,11 @@ static void arm_cpu_realizefn(DeviceState *dev, Error **errp)
                 env->pmsav7.dracr = g_new0(uint32_t, nr);
             }
         }
+        if (!arm_feature(env, ARM_FEATURE_V8)) {
+            /* Each region splits the map at most at 9 addresses */
+            cpu->pmsav7_map_start = g_new0(uint32_t, nr * 9 + 1);
+            cpu->pmsav7_map_region = g_new0(int16_t, nr * 9 + 1);
+        }
     }
 
     if (arm_feature(env, ARM_FEATURE_M_SECURITY)) {
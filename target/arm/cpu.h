@@ -906,6 +906,16 @@ struct ArchCPU {
     bool has_mpu;
     /* PMSAv7 MPU number of supported regions */
     uint32_t pmsav7_dregion;
+    /*
+     * PMSAv7 MPU regions flattened into sorted, non-overlapping address
+     * intervals: pmsav7_map_start[i] is the first address of interval i
+     * and pmsav7_map_region[i] the region it hits, or -1 for none. Only
+     * valid while pmsav7_map_valid is set, see pmsav7_map_invalidate().
+     */
+    uint32_t *pmsav7_map_start;
+    int16_t *pmsav7_map_region;
+    uint32_t pmsav7_map_len;
+    bool pmsav7_map_valid;
     /* v8M SAU number of supported regions */
     uint32_t sau_sregion;
 
@@ -919,6 +929,15 @@ struct ArchCPU {
     /* For v8M, initial value of the Non-secure VTOR */
     uint32_t init_nsvtor;
 
+    /*
+     * Timing of the code fetched from ROM (flash), used by the M-profile
+     * cycle model of -icount cycles=on. See arm_cpu_set_flash_timing().
+     */
+    uint8_t flash_wait_states;
+    bool flash_prefetch;
+    bool flash_icache;
+    bool flash_dcache;
+
     /* [QEMU_]KVM_ARM_TARGET_* constant for this CPU, or
      * QEMU_KVM_ARM_TARGET_NONE if the kernel doesn't support this CPU type.
      */
@@ -2367,8 +2386,35 @@ static inline int arm_feature(CPUARMState *env, int feature)
     return (env->features & (1ULL << feature)) != 0;
 }
 
+/**
+ * pmsav7_map_invalidate:
+ * @cpu: ARMCPU
+ *
+ * Discard the flattened PMSAv7 region map, so that it is rebuilt on the
+ * next MPU lookup. Must be called whenever DRBAR, DRSR or DRACR change.
+ */
+static inline void pmsav7_map_invalidate(ARMCPU *cpu)
+{
+    cpu->pmsav7_map_valid = false;
+}
+
 void arm_cpu_finalize_features(ARMCPU *cpu, Error **errp);
 
+/**
+ * arm_cpu_set_flash_timing:
+ * @cpu: ARM CPU
+ * @wait_states: wait states of an access to a flash line
+ * @prefetch: whether sequential code lines are prefetched
+ * @icache: whether branch targets hit an instruction cache
+ * @dcache: whether literal pool loads hit a data cache
+ *
+ * Describe the flash that ROM code is fetched from, for the M-profile cycle
+ * model of -icount cycles=on. Called by the SoC whenever its flash
+ * interface is reconfigured.
+ */
+void arm_cpu_set_flash_timing(ARMCPU *cpu, unsigned wait_states,
+                              bool prefetch, bool icache, bool dcache);
+
 #if !defined(CONFIG_USER_ONLY)
 /* Return true if exception levels below EL3 are in secure state,
  * or would be following an exception return to that level.
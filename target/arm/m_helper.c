@@ -20,6 +20,7 @@
 #include "qemu/crc32c.h"
 #include "qemu/qemu-print.h"
 #include "qemu/log.h"
+#include "qemu/rcu.h"
 #include "exec/exec-all.h"
 #include <zlib.h> /* For crc32 */
 #include "semihosting/semihost.h"
@@ -324,6 +325,101 @@ pend_fault:
     return false;
 }
 
+/*
+ * Return a host pointer to the @len bytes of stack at @addr if they all
+ * sit in one page of RAM that @mmu_idx may access, or NULL. Must be called
+ * within an RCU critical section.
+ */
+static void *v7m_stack_frame_host(ARMCPU *cpu, uint32_t addr, uint32_t len,
+                                  MMUAccessType access_type, ARMMMUIdx mmu_idx,
+                                  MemoryRegion **mr, hwaddr *xlat)
+{
+    CPUARMState *env = &cpu->env;
+    GetPhysAddrResult res = {};
+    ARMMMUFaultInfo fi = {};
+    bool is_write = access_type == MMU_DATA_STORE;
+    hwaddr plen = len;
+
+    if ((addr & TARGET_PAGE_MASK) != ((addr + len - 1) & TARGET_PAGE_MASK)) {
+        return NULL;
+    }
+    /* Permissions are uniform across the page unless lg_page_size says so */
+    if (get_phys_addr(env, addr, access_type, mmu_idx, &res, &fi) ||
+        res.f.lg_page_size < TARGET_PAGE_BITS) {
+        return NULL;
+    }
+    *mr = address_space_translate(arm_addressspace(CPU(cpu), res.f.attrs),
+                                  res.f.phys_addr, xlat, &plen, is_write,
+                                  res.f.attrs);
+    if (plen < len || !memory_access_is_direct(*mr, is_write)) {
+        return NULL;
+    }
+    return qemu_map_ram_ptr((*mr)->ram_block, *xlat);
+}
+
+/*
+ * Push @n words of an exception stack frame at @addr. The common case of
+ * a frame in RAM is translated once and stored in bulk; anything else goes
+ * word by word through v7m_stack_write(), which also reports the faults.
+ */
+static bool v7m_stack_write_frame(ARMCPU *cpu, uint32_t addr,
+                                  const uint32_t *words, int n,
+                                  ARMMMUIdx mmu_idx)
+{
+    MemoryRegion *mr;
+    hwaddr xlat;
+    uint8_t *host;
+    int i;
+
+    WITH_RCU_READ_LOCK_GUARD() {
+        host = v7m_stack_frame_host(cpu, addr, n * 4, MMU_DATA_STORE,
+                                    mmu_idx, &mr, &xlat);
+        if (host) {
+            for (i = 0; i < n; i++) {
+                stl_le_p(host + i * 4, words[i]);
+            }
+            memory_region_flush_ram(mr, xlat, n * 4);
+            return true;
+        }
+    }
+
+    for (i = 0; i < n; i++) {
+        if (!v7m_stack_write(cpu, addr + i * 4, words[i], mmu_idx,
+                             STACK_NORMAL)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Pop @n words of an exception stack frame, see v7m_stack_write_frame(). */
+static bool v7m_stack_read_frame(ARMCPU *cpu, uint32_t *words, uint32_t addr,
+                                 int n, ARMMMUIdx mmu_idx)
+{
+    MemoryRegion *mr;
+    hwaddr xlat;
+    uint8_t *host;
+    int i;
+
+    WITH_RCU_READ_LOCK_GUARD() {
+        host = v7m_stack_frame_host(cpu, addr, n * 4, MMU_DATA_LOAD,
+                                    mmu_idx, &mr, &xlat);
+        if (host) {
+            for (i = 0; i < n; i++) {
+                words[i] = ldl_le_p(host + i * 4);
+            }
+            return true;
+        }
+    }
+
+    for (i = 0; i < n; i++) {
+        if (!v7m_stack_read(cpu, &words[i], addr + i * 4, mmu_idx)) {
+            return false;
+        }
+    }
+    return true;
+}
+
 void HELPER(v7m_preserve_fp_state)(CPUARMState *env)
 {
     /*
@@ -1176,6 +1272,61 @@ void HELPER(v7m_vlldm)(CPUARMState *env, uint32_t fptr)
     env->v7m.control[M_REG_S] |= R_V7M_CONTROL_FPCA_MASK;
 }
 
+/*
+ * v7M cores without the Security Extension (Cortex-M3, M4, M7) have a
+ * much simpler exception model than v8M: no secure state, no stack limit
+ * checks, no integrity signature and no callee-saves stacking. For those,
+ * exception entry and return with no FP context, or with one that is
+ * stacked lazily, take the specialised paths below, which skip the feature
+ * tests of the general code. Anything else goes through the general code.
+ */
+static bool v7m_is_basic_exception_model(CPUARMState *env)
+{
+    return !arm_feature(env, ARM_FEATURE_V8) &&
+           !arm_feature(env, ARM_FEATURE_M_SECURITY);
+}
+
+/*
+ * PushStack() for v7M with no active FP context, or with lazy stacking
+ * enabled, see v7m_push_stack()
+ */
+static bool v7m_push_stack_basic(ARMCPU *cpu)
+{
+    CPUARMState *env = &cpu->env;
+    uint32_t xpsr = xpsr_read(env) & ~XPSR_SFPA;
+    uint32_t frameptr = env->regs[13];
+    bool fpca = env->v7m.control[M_REG_S] & R_V7M_CONTROL_FPCA_MASK;
+    uint32_t frame[8];
+    bool stacked_ok;
+
+    if ((frameptr & 4) &&
+        (env->v7m.ccr[M_REG_NS] & R_V7M_CCR_STKALIGN_MASK)) {
+        frameptr -= 4;
+        xpsr |= XPSR_SPREALIGN;
+    }
+    frameptr -= fpca ? 0x68 : 0x20;
+
+    frame[0] = env->regs[0];
+    frame[1] = env->regs[1];
+    frame[2] = env->regs[2];
+    frame[3] = env->regs[3];
+    frame[4] = env->regs[12];
+    frame[5] = env->regs[14];
+    frame[6] = env->regs[15];
+    frame[7] = xpsr;
+    stacked_ok = v7m_stack_write_frame(cpu, frameptr, frame, ARRAY_SIZE(frame),
+                                       arm_mmu_idx(env));
+
+    if (fpca) {
+        /* Only reserve space, the FP registers are saved on first use */
+        v7m_update_fpccr(env, frameptr + 0x20, true);
+    }
+
+    /* SP is updated even if the stacking faulted */
+    env->regs[13] = frameptr;
+    return !stacked_ok;
+}
+
 static bool v7m_push_stack(ARMCPU *cpu)
 {
     /*
@@ -1191,8 +1342,16 @@ static bool v7m_push_stack(ARMCPU *cpu)
     uint32_t frameptr = env->regs[13];
     ARMMMUIdx mmu_idx = arm_mmu_idx(env);
     uint32_t framesize;
+    uint32_t frame[8];
     bool nsacr_cp10 = extract32(env->v7m.nsacr, 10, 1);
 
+    if (v7m_is_basic_exception_model(env) &&
+        (!(env->v7m.control[M_REG_S] & R_V7M_CONTROL_FPCA_MASK) ||
+         (nsacr_cp10 &&
+          (env->v7m.fpccr[M_REG_S] & R_V7M_FPCCR_LSPEN_MASK)))) {
+        return v7m_push_stack_basic(cpu);
+    }
+
     if ((env->v7m.control[M_REG_S] & R_V7M_CONTROL_FPCA_MASK) &&
         (env->v7m.secure || nsacr_cp10)) {
         if (env->v7m.secure &&
@@ -1253,21 +1412,17 @@ static bool v7m_push_stack(ARMCPU *cpu)
      * (which may be taken in preference to the one we started with
      * if it has higher priority).
      */
+    frame[0] = env->regs[0];
+    frame[1] = env->regs[1];
+    frame[2] = env->regs[2];
+    frame[3] = env->regs[3];
+    frame[4] = env->regs[12];
+    frame[5] = env->regs[14];
+    frame[6] = env->regs[15];
+    frame[7] = xpsr;
     stacked_ok = stacked_ok &&
-        v7m_stack_write(cpu, frameptr, env->regs[0], mmu_idx, STACK_NORMAL) &&
-        v7m_stack_write(cpu, frameptr + 4, env->regs[1],
-                        mmu_idx, STACK_NORMAL) &&
-        v7m_stack_write(cpu, frameptr + 8, env->regs[2],
-                        mmu_idx, STACK_NORMAL) &&
-        v7m_stack_write(cpu, frameptr + 12, env->regs[3],
-                        mmu_idx, STACK_NORMAL) &&
-        v7m_stack_write(cpu, frameptr + 16, env->regs[12],
-                        mmu_idx, STACK_NORMAL) &&
-        v7m_stack_write(cpu, frameptr + 20, env->regs[14],
-                        mmu_idx, STACK_NORMAL) &&
-        v7m_stack_write(cpu, frameptr + 24, env->regs[15],
-                        mmu_idx, STACK_NORMAL) &&
-        v7m_stack_write(cpu, frameptr + 28, xpsr, mmu_idx, STACK_NORMAL);
+        v7m_stack_write_frame(cpu, frameptr, frame, ARRAY_SIZE(frame),
+                              mmu_idx);
 
     if (env->v7m.control[M_REG_S] & R_V7M_CONTROL_FPCA_MASK) {
         /* FPU is active, try to save its registers */
@@ -1358,11 +1513,363 @@ static bool v7m_push_stack(ARMCPU *cpu)
     return !stacked_ok;
 }
 
+/*
+ * Auto-clear FAULTMASK and deactivate the exception we are returning
+ * from, see do_v7m_exception_exit(). Sets *rettobase if no other
+ * exception remains active. Returns false if the exception was not
+ * active, which is a failed integrity check.
+ */
+static bool v7m_exception_exit_deactivate(CPUARMState *env, bool exc_secure,
+                                          bool *rettobase)
+{
+    if (env->v7m.exception != ARMV7M_EXCP_NMI) {
+        /*
+         * Auto-clear FAULTMASK on return from other than NMI.
+         * If the security extension is implemented then this only
+         * happens if the raw execution priority is >= 0; the
+         * value of the ES bit in the exception return value indicates
+         * which security state's faultmask to clear. (v8M ARM ARM R_KBNF.)
+         */
+        if (arm_feature(env, ARM_FEATURE_M_SECURITY)) {
+            if (armv7m_nvic_raw_execution_priority(env->nvic) >= 0) {
+                env->v7m.faultmask[exc_secure] = 0;
+            }
+        } else {
+            env->v7m.faultmask[M_REG_NS] = 0;
+        }
+    }
+
+    *rettobase = false;
+    switch (armv7m_nvic_complete_irq(env->nvic, env->v7m.exception,
+                                     exc_secure)) {
+    case -1:
+        /* attempt to exit an exception that isn't active */
+        return false;
+    case 0:
+        /* still an irq active now */
+        break;
+    case 1:
+        /*
+         * We returned to base exception level, no nesting.
+         * (In the pseudocode this is written using "NestedActivation != 1"
+         * where we have 'rettobase == false'.)
+         */
+        *rettobase = true;
+        break;
+    default:
+        g_assert_not_reached();
+    }
+    return true;
+}
+
+/*
+ * Bad exception return: instead of popping the exception stack, directly
+ * take a usage fault on the current stack.
+ */
+static void v7m_exception_exit_invpc(ARMCPU *cpu, uint32_t excret)
+{
+    CPUARMState *env = &cpu->env;
+
+    env->v7m.cfsr[env->v7m.secure] |= R_V7M_CFSR_INVPC_MASK;
+    armv7m_nvic_set_pending(env->nvic, ARMV7M_EXCP_USAGE, env->v7m.secure);
+    qemu_log_mask(CPU_LOG_INT, "...taking UsageFault on existing "
+                  "stackframe: failed exception return integrity check\n");
+    v7m_exception_taken(cpu, excret, true, false);
+}
+
+/* Restore the integer registers from the 8 words of a basic frame */
+static void v7m_exception_exit_pop_regs(CPUARMState *env,
+                                        const uint32_t *frame)
+{
+    env->regs[0] = frame[0];
+    env->regs[1] = frame[1];
+    env->regs[2] = frame[2];
+    env->regs[3] = frame[3];
+    env->regs[12] = frame[4];
+    env->regs[14] = frame[5];
+    env->regs[15] = frame[6];
+
+    /*
+     * Returning from an exception with a PC with bit 0 set is defined
+     * behaviour on v8M (bit 0 is ignored), but for v7M it was specified
+     * to be UNPREDICTABLE. In practice actual v7M hardware seems to ignore
+     * the lsbit, and there are several RTOSes out there which incorrectly
+     * assume the r15 in the stack frame should be a Thumb-style "lsbit
+     * indicates ARM/Thumb" value, so ignore the bit on v7M as well, but
+     * complain about the badly behaved guest.
+     */
+    if (env->regs[15] & 1) {
+        env->regs[15] &= ~1U;
+        if (!arm_feature(env, ARM_FEATURE_V8)) {
+            qemu_log_mask(LOG_GUEST_ERROR,
+                          "M profile return from interrupt with misaligned "
+                          "PC is UNPREDICTABLE on v7M\n");
+        }
+    }
+}
+
+/*
+ * Restore the FP context of an extended frame (EXC_RETURN.FTYPE clear)
+ * whose basic part starts at frameptr. If lazy stacking never saved it,
+ * the FP registers still hold it and only FPCCR.LSPACT is cleared.
+ * Sets *restore_s16_s31 if the frame holds s16-s31 too. Returns false
+ * if a fault was taken on the existing stack frame.
+ */
+static bool v7m_exception_exit_pop_fp(ARMCPU *cpu, uint32_t excret,
+                                      uint32_t frameptr, ARMMMUIdx mmu_idx,
+                                      bool return_to_secure,
+                                      bool return_to_priv,
+                                      bool *restore_s16_s31)
+{
+    CPUARMState *env = &cpu->env;
+    bool pop_ok = true;
+    uint32_t fpscr;
+    bool cpacr_pass, nsacr_pass;
+    int i;
+
+    if (!return_to_secure &&
+        (env->v7m.fpccr[M_REG_S] & R_V7M_FPCCR_LSPACT_MASK)) {
+        armv7m_nvic_set_pending(env->nvic, ARMV7M_EXCP_SECURE, false);
+        env->v7m.sfsr |= R_V7M_SFSR_LSERR_MASK;
+        qemu_log_mask(CPU_LOG_INT,
+                      "...taking SecureFault on existing stackframe: "
+                      "Secure LSPACT set but exception return is "
+                      "not to secure state\n");
+        v7m_exception_taken(cpu, excret, true, false);
+        return false;
+    }
+
+    *restore_s16_s31 = return_to_secure &&
+        (env->v7m.fpccr[M_REG_S] & R_V7M_FPCCR_TS_MASK);
+
+    if (env->v7m.fpccr[return_to_secure] & R_V7M_FPCCR_LSPACT_MASK) {
+        /* State in FPU is still valid, just clear LSPACT */
+        env->v7m.fpccr[return_to_secure] &= ~R_V7M_FPCCR_LSPACT_MASK;
+        return true;
+    }
+
+    cpacr_pass = v7m_cpacr_pass(env, return_to_secure, return_to_priv);
+    nsacr_pass = return_to_secure || extract32(env->v7m.nsacr, 10, 1);
+
+    if (!cpacr_pass) {
+        armv7m_nvic_set_pending(env->nvic, ARMV7M_EXCP_USAGE,
+                                return_to_secure);
+        env->v7m.cfsr[return_to_secure] |= R_V7M_CFSR_NOCP_MASK;
+        qemu_log_mask(CPU_LOG_INT,
+                      "...taking UsageFault on existing "
+                      "stackframe: CPACR.CP10 prevents unstacking "
+                      "FP regs\n");
+        v7m_exception_taken(cpu, excret, true, false);
+        return false;
+    } else if (!nsacr_pass) {
+        armv7m_nvic_set_pending(env->nvic, ARMV7M_EXCP_USAGE, true);
+        env->v7m.cfsr[M_REG_S] |= R_V7M_CFSR_INVPC_MASK;
+        qemu_log_mask(CPU_LOG_INT,
+                      "...taking Secure UsageFault on existing "
+                      "stackframe: NSACR.CP10 prevents unstacking "
+                      "FP regs\n");
+        v7m_exception_taken(cpu, excret, true, false);
+        return false;
+    }
+
+    for (i = 0; i < (*restore_s16_s31 ? 32 : 16); i += 2) {
+        uint32_t slo, shi;
+        uint64_t dn;
+        uint32_t faddr = frameptr + 0x20 + 4 * i;
+
+        if (i >= 16) {
+            faddr += 8; /* Skip the slot for the FPSCR and VPR */
+        }
+
+        pop_ok = pop_ok &&
+            v7m_stack_read(cpu, &slo, faddr, mmu_idx) &&
+            v7m_stack_read(cpu, &shi, faddr + 4, mmu_idx);
+
+        if (!pop_ok) {
+            break;
+        }
+
+        dn = (uint64_t)shi << 32 | slo;
+        *aa32_vfp_dreg(env, i / 2) = dn;
+    }
+    pop_ok = pop_ok &&
+        v7m_stack_read(cpu, &fpscr, frameptr + 0x60, mmu_idx);
+    if (pop_ok) {
+        vfp_set_fpscr(env, fpscr);
+    }
+    if (cpu_isar_feature(aa32_mve, cpu)) {
+        pop_ok = pop_ok &&
+            v7m_stack_read(cpu, &env->v7m.vpr, frameptr + 0x64, mmu_idx);
+    }
+    if (!pop_ok) {
+        /*
+         * These regs are 0 if security extension present;
+         * otherwise merely UNKNOWN. We zero always.
+         */
+        for (i = 0; i < (*restore_s16_s31 ? 32 : 16); i += 2) {
+            *aa32_vfp_dreg(env, i / 2) = 0;
+        }
+        vfp_set_fpscr(env, 0);
+        if (cpu_isar_feature(aa32_mve, cpu)) {
+            env->v7m.vpr = 0;
+        }
+    }
+    return true;
+}
+
+/*
+ * Return the stack pointer value once the exception frame at frameptr,
+ * with the given restored xPSR, is consumed.
+ */
+static uint32_t v7m_exception_exit_frame_end(uint32_t frameptr, uint32_t xpsr,
+                                             bool ftype, bool restore_s16_s31)
+{
+    frameptr += 0x20;
+    if (!ftype) {
+        frameptr += 0x48;
+        if (restore_s16_s31) {
+            frameptr += 0x40;
+        }
+    }
+    /*
+     * Undo stack alignment (the SPREALIGN bit indicates that the original
+     * pre-exception SP was not 8-aligned and we added a padding word to
+     * align it, so we undo this by ORing in the bit that increases it
+     * from the current 8-aligned value to the 8-unaligned value. (Adding 4
+     * would work too but a logical OR is how the pseudocode specifies it.)
+     */
+    if (xpsr & XPSR_SPREALIGN) {
+        frameptr |= 4;
+    }
+    return frameptr;
+}
+
+/*
+ * Write the restored xPSR, which may switch stack, and complete the
+ * exception return, or take the UsageFault v7M requires if the xPSR
+ * exception field doesn't match the EXC_RETURN mode.
+ */
+static void v7m_exception_exit_finish(ARMCPU *cpu, uint32_t excret,
+                                      uint32_t xpsr, bool return_to_handler)
+{
+    CPUARMState *env = &cpu->env;
+    uint32_t xpsr_mask;
+
+    xpsr_mask = ~(XPSR_SPREALIGN | XPSR_SFPA);
+    if (!arm_feature(env, ARM_FEATURE_THUMB_DSP)) {
+        xpsr_mask &= ~XPSR_GE;
+    }
+    xpsr_write(env, xpsr, xpsr_mask);
+
+    if (env->v7m.secure) {
+        bool sfpa = xpsr & XPSR_SFPA;
+
+        env->v7m.control[M_REG_S] = FIELD_DP32(env->v7m.control[M_REG_S],
+                                               V7M_CONTROL, SFPA, sfpa);
+    }
+
+    /*
+     * The restored xPSR exception field will be zero if we're
+     * resuming in Thread mode. If that doesn't match what the
+     * exception return excret specified then this is a UsageFault.
+     * v7M requires we make this check here; v8M did it earlier.
+     */
+    if (return_to_handler != arm_v7m_is_handler_mode(env)) {
+        /*
+         * Take an INVPC UsageFault by pushing the stack again;
+         * we know we're v7M so this is never a Secure UsageFault.
+         */
+        bool ignore_stackfaults;
+
+        assert(!arm_feature(env, ARM_FEATURE_V8));
+        armv7m_nvic_set_pending(env->nvic, ARMV7M_EXCP_USAGE, false);
+        env->v7m.cfsr[env->v7m.secure] |= R_V7M_CFSR_INVPC_MASK;
+        ignore_stackfaults = v7m_push_stack(cpu);
+        qemu_log_mask(CPU_LOG_INT, "...taking UsageFault on new stackframe: "
+                      "failed exception return integrity check\n");
+        v7m_exception_taken(cpu, excret, false, ignore_stackfaults);
+        return;
+    }
+
+    /* Otherwise, we have a successful exception exit. */
+    arm_clear_exclusive(env);
+    arm_rebuild_hflags(env);
+    qemu_log_mask(CPU_LOG_INT, "...successful exception return\n");
+}
+
+/*
+ * ExceptionReturn() for v7M without the Security Extension, returning to
+ * one of the three v7M return types with no FP registers to clear on
+ * return, see do_v7m_exception_exit(). The caller checks all of this.
+ */
+static void v7m_exception_exit_basic(ARMCPU *cpu, uint32_t excret)
+{
+    CPUARMState *env = &cpu->env;
+    bool return_to_handler = !(excret & R_V7M_EXCRET_MODE_MASK);
+    bool return_to_sp_process = excret & R_V7M_EXCRET_SPSEL_MASK;
+    bool ftype = excret & R_V7M_EXCRET_FTYPE_MASK;
+    bool restore_s16_s31 = false;
+    bool return_to_priv;
+    bool rettobase;
+    bool ufault;
+    uint32_t frame[8];
+    uint32_t *frame_sp_p;
+    uint32_t frameptr;
+    ARMMMUIdx mmu_idx;
+
+    ufault = !v7m_exception_exit_deactivate(env, false, &rettobase);
+    if (!return_to_handler && !rettobase &&
+        !(env->v7m.ccr[M_REG_NS] & R_V7M_CCR_NONBASETHRDENA_MASK)) {
+        ufault = true;
+    }
+
+    write_v7m_control_spsel_for_secstate(env, return_to_sp_process, false);
+
+    if (ufault) {
+        v7m_exception_exit_invpc(cpu, excret);
+        return;
+    }
+
+    if (armv7m_nvic_can_take_pending_exception(env->nvic)) {
+        qemu_log_mask(CPU_LOG_INT, "...tailchaining to pending exception\n");
+        v7m_exception_taken(cpu, excret, true, false);
+        return;
+    }
+
+    frame_sp_p = get_v7m_sp_ptr(env, false, !return_to_handler,
+                                return_to_sp_process);
+    frameptr = *frame_sp_p;
+    return_to_priv = return_to_handler ||
+        !(env->v7m.control[M_REG_NS] & R_V7M_CONTROL_NPRIV_MASK);
+    mmu_idx = arm_v7m_mmu_idx_for_secstate_and_priv(env, false,
+                                                    return_to_priv);
+
+    if (!v7m_stack_read_frame(cpu, frame, frameptr, ARRAY_SIZE(frame),
+                              mmu_idx)) {
+        qemu_log_mask(CPU_LOG_INT, "...derived exception on unstacking\n");
+        v7m_exception_taken(cpu, excret, true, false);
+        return;
+    }
+    v7m_exception_exit_pop_regs(env, frame);
+
+    if (!ftype &&
+        !v7m_exception_exit_pop_fp(cpu, excret, frameptr, mmu_idx, false,
+                                   return_to_priv, &restore_s16_s31)) {
+        return;
+    }
+    env->v7m.control[M_REG_S] = FIELD_DP32(env->v7m.control[M_REG_S],
+                                           V7M_CONTROL, FPCA, !ftype);
+
+    *frame_sp_p = v7m_exception_exit_frame_end(frameptr, frame[7], ftype,
+                                               restore_s16_s31);
+    v7m_exception_exit_finish(cpu, excret, frame[7], return_to_handler);
+}
+
 static void do_v7m_exception_exit(ARMCPU *cpu)
 {
     CPUARMState *env = &cpu->env;
     uint32_t excret;
-    uint32_t xpsr, xpsr_mask;
+    uint32_t xpsr;
     bool ufault = false;
     bool sfault = false;
     bool return_to_sp_process;
@@ -1413,6 +1920,20 @@ static void do_v7m_exception_exit(ARMCPU *cpu)
 
     ftype = excret & R_V7M_EXCRET_FTYPE_MASK;
 
+    /*
+     * Return to Handler, or to Thread on the Main or Process stack, with
+     * no FP registers to clear on return.
+     */
+    if (v7m_is_basic_exception_model(env) &&
+        (ftype || cpu_isar_feature(aa32_vfp_simd, cpu)) &&
+        ((excret & 0xf) == 1 || (excret & 0xf) == 9 ||
+         (excret & 0xf) == 13) &&
+        !((env->v7m.fpccr[M_REG_S] & R_V7M_FPCCR_CLRONRET_MASK) &&
+          (env->v7m.control[M_REG_S] & R_V7M_CONTROL_FPCA_MASK))) {
+        v7m_exception_exit_basic(cpu, excret);
+        return;
+    }
+
     if (!ftype && !cpu_isar_feature(aa32_vfp_simd, cpu)) {
         qemu_log_mask(LOG_GUEST_ERROR, "M profile: zero FTYPE in exception "
                       "exit PC value 0x%" PRIx32 " is UNPREDICTABLE "
@@ -1436,42 +1957,8 @@ static void do_v7m_exception_exit(ARMCPU *cpu)
         exc_secure = excret & R_V7M_EXCRET_ES_MASK;
     }
 
-    if (env->v7m.exception != ARMV7M_EXCP_NMI) {
-        /*
-         * Auto-clear FAULTMASK on return from other than NMI.
-         * If the security extension is implemented then this only
-         * happens if the raw execution priority is >= 0; the
-         * value of the ES bit in the exception return value indicates
-         * which security state's faultmask to clear. (v8M ARM ARM R_KBNF.)
-         */
-        if (arm_feature(env, ARM_FEATURE_M_SECURITY)) {
-            if (armv7m_nvic_raw_execution_priority(env->nvic) >= 0) {
-                env->v7m.faultmask[exc_secure] = 0;
-            }
-        } else {
-            env->v7m.faultmask[M_REG_NS] = 0;
-        }
-    }
-
-    switch (armv7m_nvic_complete_irq(env->nvic, env->v7m.exception,
-                                     exc_secure)) {
-    case -1:
-        /* attempt to exit an exception that isn't active */
+    if (!v7m_exception_exit_deactivate(env, exc_secure, &rettobase)) {
         ufault = true;
-        break;
-    case 0:
-        /* still an irq active now */
-        break;
-    case 1:
-        /*
-         * We returned to base exception level, no nesting.
-         * (In the pseudocode this is written using "NestedActivation != 1"
-         * where we have 'rettobase == false'.)
-         */
-        rettobase = true;
-        break;
-    default:
-        g_assert_not_reached();
     }
 
     return_to_handler = !(excret & R_V7M_EXCRET_MODE_MASK);
@@ -1585,15 +2072,7 @@ static void do_v7m_exception_exit(ARMCPU *cpu)
     }
 
     if (ufault) {
-        /*
-         * Bad exception return: instead of popping the exception
-         * stack, directly take a usage fault on the current stack.
-         */
-        env->v7m.cfsr[env->v7m.secure] |= R_V7M_CFSR_INVPC_MASK;
-        armv7m_nvic_set_pending(env->nvic, ARMV7M_EXCP_USAGE, env->v7m.secure);
-        qemu_log_mask(CPU_LOG_INT, "...taking UsageFault on existing "
-                      "stackframe: failed exception return integrity check\n");
-        v7m_exception_taken(cpu, excret, true, false);
+        v7m_exception_exit_invpc(cpu, excret);
         return;
     }
 
@@ -1632,6 +2111,7 @@ static void do_v7m_exception_exit(ARMCPU *cpu)
                                               !return_to_handler,
                                               spsel);
         uint32_t frameptr = *frame_sp_p;
+        uint32_t frame[8];
         bool pop_ok = true;
         ARMMMUIdx mmu_idx;
         bool return_to_priv = return_to_handler ||
@@ -1681,15 +2161,8 @@ static void do_v7m_exception_exit(ARMCPU *cpu)
 
         /* Pop registers */
         pop_ok = pop_ok &&
-            v7m_stack_read(cpu, &env->regs[0], frameptr, mmu_idx) &&
-            v7m_stack_read(cpu, &env->regs[1], frameptr + 0x4, mmu_idx) &&
-            v7m_stack_read(cpu, &env->regs[2], frameptr + 0x8, mmu_idx) &&
-            v7m_stack_read(cpu, &env->regs[3], frameptr + 0xc, mmu_idx) &&
-            v7m_stack_read(cpu, &env->regs[12], frameptr + 0x10, mmu_idx) &&
-            v7m_stack_read(cpu, &env->regs[14], frameptr + 0x14, mmu_idx) &&
-            v7m_stack_read(cpu, &env->regs[15], frameptr + 0x18, mmu_idx) &&
-            v7m_stack_read(cpu, &xpsr, frameptr + 0x1c, mmu_idx);
-
+            v7m_stack_read_frame(cpu, frame, frameptr, ARRAY_SIZE(frame),
+                                 mmu_idx);
         if (!pop_ok) {
             /*
              * v7m_stack_read() pended a fault, so take it (as a tail
@@ -1699,24 +2172,8 @@ static void do_v7m_exception_exit(ARMCPU *cpu)
             v7m_exception_taken(cpu, excret, true, false);
             return;
         }
-
-        /*
-         * Returning from an exception with a PC with bit 0 set is defined
-         * behaviour on v8M (bit 0 is ignored), but for v7M it was specified
-         * to be UNPREDICTABLE. In practice actual v7M hardware seems to ignore
-         * the lsbit, and there are several RTOSes out there which incorrectly
-         * assume the r15 in the stack frame should be a Thumb-style "lsbit
-         * indicates ARM/Thumb" value, so ignore the bit on v7M as well, but
-         * complain about the badly behaved guest.
-         */
-        if (env->regs[15] & 1) {
-            env->regs[15] &= ~1U;
-            if (!arm_feature(env, ARM_FEATURE_V8)) {
-                qemu_log_mask(LOG_GUEST_ERROR,
-                              "M profile return from interrupt with misaligned "
-                              "PC is UNPREDICTABLE on v7M\n");
-            }
-        }
+        v7m_exception_exit_pop_regs(env, frame);
+        xpsr = frame[7];
 
         if (arm_feature(env, ARM_FEATURE_V8)) {
             /*
@@ -1732,178 +2189,27 @@ static void do_v7m_exception_exit(ARMCPU *cpu)
                  * for the background state, so this UsageFault will target
                  * that state.
                  */
-                armv7m_nvic_set_pending(env->nvic, ARMV7M_EXCP_USAGE,
-                                        env->v7m.secure);
-                env->v7m.cfsr[env->v7m.secure] |= R_V7M_CFSR_INVPC_MASK;
-                qemu_log_mask(CPU_LOG_INT, "...taking UsageFault on existing "
-                              "stackframe: failed exception return integrity "
-                              "check\n");
-                v7m_exception_taken(cpu, excret, true, false);
+                v7m_exception_exit_invpc(cpu, excret);
                 return;
             }
         }
 
-        if (!ftype) {
-            /* FP present and we need to handle it */
-            if (!return_to_secure &&
-                (env->v7m.fpccr[M_REG_S] & R_V7M_FPCCR_LSPACT_MASK)) {
-                armv7m_nvic_set_pending(env->nvic, ARMV7M_EXCP_SECURE, false);
-                env->v7m.sfsr |= R_V7M_SFSR_LSERR_MASK;
-                qemu_log_mask(CPU_LOG_INT,
-                              "...taking SecureFault on existing stackframe: "
-                              "Secure LSPACT set but exception return is "
-                              "not to secure state\n");
-                v7m_exception_taken(cpu, excret, true, false);
-                return;
-            }
-
-            restore_s16_s31 = return_to_secure &&
-                (env->v7m.fpccr[M_REG_S] & R_V7M_FPCCR_TS_MASK);
-
-            if (env->v7m.fpccr[return_to_secure] & R_V7M_FPCCR_LSPACT_MASK) {
-                /* State in FPU is still valid, just clear LSPACT */
-                env->v7m.fpccr[return_to_secure] &= ~R_V7M_FPCCR_LSPACT_MASK;
-            } else {
-                int i;
-                uint32_t fpscr;
-                bool cpacr_pass, nsacr_pass;
-
-                cpacr_pass = v7m_cpacr_pass(env, return_to_secure,
-                                            return_to_priv);
-                nsacr_pass = return_to_secure ||
-                    extract32(env->v7m.nsacr, 10, 1);
-
-                if (!cpacr_pass) {
-                    armv7m_nvic_set_pending(env->nvic, ARMV7M_EXCP_USAGE,
-                                            return_to_secure);
-                    env->v7m.cfsr[return_to_secure] |= R_V7M_CFSR_NOCP_MASK;
-                    qemu_log_mask(CPU_LOG_INT,
-                                  "...taking UsageFault on existing "
-                                  "stackframe: CPACR.CP10 prevents unstacking "
-                                  "FP regs\n");
-                    v7m_exception_taken(cpu, excret, true, false);
-                    return;
-                } else if (!nsacr_pass) {
-                    armv7m_nvic_set_pending(env->nvic, ARMV7M_EXCP_USAGE, true);
-                    env->v7m.cfsr[M_REG_S] |= R_V7M_CFSR_INVPC_MASK;
-                    qemu_log_mask(CPU_LOG_INT,
-                                  "...taking Secure UsageFault on existing "
-                                  "stackframe: NSACR.CP10 prevents unstacking "
-                                  "FP regs\n");
-                    v7m_exception_taken(cpu, excret, true, false);
-                    return;
-                }
-
-                for (i = 0; i < (restore_s16_s31 ? 32 : 16); i += 2) {
-                    uint32_t slo, shi;
-                    uint64_t dn;
-                    uint32_t faddr = frameptr + 0x20 + 4 * i;
-
-                    if (i >= 16) {
-                        faddr += 8; /* Skip the slot for the FPSCR and VPR */
-                    }
-
-                    pop_ok = pop_ok &&
-                        v7m_stack_read(cpu, &slo, faddr, mmu_idx) &&
-                        v7m_stack_read(cpu, &shi, faddr + 4, mmu_idx);
-
-                    if (!pop_ok) {
-                        break;
-                    }
-
-                    dn = (uint64_t)shi << 32 | slo;
-                    *aa32_vfp_dreg(env, i / 2) = dn;
-                }
-                pop_ok = pop_ok &&
-                    v7m_stack_read(cpu, &fpscr, frameptr + 0x60, mmu_idx);
-                if (pop_ok) {
-                    vfp_set_fpscr(env, fpscr);
-                }
-                if (cpu_isar_feature(aa32_mve, cpu)) {
-                    pop_ok = pop_ok &&
-                        v7m_stack_read(cpu, &env->v7m.vpr,
-                                       frameptr + 0x64, mmu_idx);
-                }
-                if (!pop_ok) {
-                    /*
-                     * These regs are 0 if security extension present;
-                     * otherwise merely UNKNOWN. We zero always.
-                     */
-                    for (i = 0; i < (restore_s16_s31 ? 32 : 16); i += 2) {
-                        *aa32_vfp_dreg(env, i / 2) = 0;
-                    }
-                    vfp_set_fpscr(env, 0);
-                    if (cpu_isar_feature(aa32_mve, cpu)) {
-                        env->v7m.vpr = 0;
-                    }
-                }
-            }
+        if (!ftype &&
+            !v7m_exception_exit_pop_fp(cpu, excret, frameptr, mmu_idx,
+                                       return_to_secure, return_to_priv,
+                                       &restore_s16_s31)) {
+            return;
         }
         env->v7m.control[M_REG_S] = FIELD_DP32(env->v7m.control[M_REG_S],
                                                V7M_CONTROL, FPCA, !ftype);
 
         /* Commit to consuming the stack frame */
-        frameptr += 0x20;
-        if (!ftype) {
-            frameptr += 0x48;
-            if (restore_s16_s31) {
-                frameptr += 0x40;
-            }
-        }
-        /*
-         * Undo stack alignment (the SPREALIGN bit indicates that the original
-         * pre-exception SP was not 8-aligned and we added a padding word to
-         * align it, so we undo this by ORing in the bit that increases it
-         * from the current 8-aligned value to the 8-unaligned value. (Adding 4
-         * would work too but a logical OR is how the pseudocode specifies it.)
-         */
-        if (xpsr & XPSR_SPREALIGN) {
-            frameptr |= 4;
-        }
-        *frame_sp_p = frameptr;
-    }
-
-    xpsr_mask = ~(XPSR_SPREALIGN | XPSR_SFPA);
-    if (!arm_feature(env, ARM_FEATURE_THUMB_DSP)) {
-        xpsr_mask &= ~XPSR_GE;
-    }
-    /* This xpsr_write() will invalidate frame_sp_p as it may switch stack */
-    xpsr_write(env, xpsr, xpsr_mask);
-
-    if (env->v7m.secure) {
-        bool sfpa = xpsr & XPSR_SFPA;
-
-        env->v7m.control[M_REG_S] = FIELD_DP32(env->v7m.control[M_REG_S],
-                                               V7M_CONTROL, SFPA, sfpa);
-    }
-
-    /*
-     * The restored xPSR exception field will be zero if we're
-     * resuming in Thread mode. If that doesn't match what the
-     * exception return excret specified then this is a UsageFault.
-     * v7M requires we make this check here; v8M did it earlier.
-     */
-    if (return_to_handler != arm_v7m_is_handler_mode(env)) {
-        /*
-         * Take an INVPC UsageFault by pushing the stack again;
-         * we know we're v7M so this is never a Secure UsageFault.
-         */
-        bool ignore_stackfaults;
-
-        assert(!arm_feature(env, ARM_FEATURE_V8));
-        armv7m_nvic_set_pending(env->nvic, ARMV7M_EXCP_USAGE, false);
-        env->v7m.cfsr[env->v7m.secure] |= R_V7M_CFSR_INVPC_MASK;
-        ignore_stackfaults = v7m_push_stack(cpu);
-        qemu_log_mask(CPU_LOG_INT, "...taking UsageFault on new stackframe: "
-                      "failed exception return integrity check\n");
-        v7m_exception_taken(cpu, excret, false, ignore_stackfaults);
-        return;
+        *frame_sp_p = v7m_exception_exit_frame_end(frameptr, xpsr, ftype,
+                                                   restore_s16_s31);
     }
 
-    /* Otherwise, we have a successful exception exit. */
-    arm_clear_exclusive(env);
-    arm_rebuild_hflags(env);
-    qemu_log_mask(CPU_LOG_INT, "...successful exception return\n");
+    /* This invalidates frame_sp_p as it may switch stack */
+    v7m_exception_exit_finish(cpu, excret, xpsr, return_to_handler);
 }
 
 static bool do_v7m_function_return(ARMCPU *cpu)
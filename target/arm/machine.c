@@ -813,6 +813,7 @@ static int cpu_post_load(void *opaque, int version_id)
 
     hw_breakpoint_update_all(cpu);
     hw_watchpoint_update_all(cpu);
+    pmsav7_map_invalidate(cpu);
 
     /*
      * TCG gen_update_fp_context() relies on the invariant that
@@ -1763,13 +1763,238 @@ static bool pmsav7_use_background_region(ARMCPU *cpu, ARMMMUIdx mmu_idx,
     }
 }
 
+/*
+ * Return the log2 size of PMSAv7 region @n, or 0 if it is disabled or
+ * invalid, in which case it never matches.
+ */
+static uint32_t pmsav7_region_size(CPUARMState *env, int n)
+{
+    uint32_t base = env->pmsav7.drbar[n];
+    uint32_t rsize = extract32(env->pmsav7.drsr[n], 1, 5);
+    uint32_t rmask;
+
+    if (!(env->pmsav7.drsr[n] & 0x1)) {
+        return 0;
+    }
+
+    if (!rsize) {
+        qemu_log_mask(LOG_GUEST_ERROR,
+                      "DRSR[%d]: Rsize field cannot be 0\n", n);
+        return 0;
+    }
+    rsize++;
+    rmask = (1ull << rsize) - 1;
+
+    if (base & rmask) {
+        qemu_log_mask(LOG_GUEST_ERROR,
+                      "DRBAR[%d]: 0x%" PRIx32 " misaligned "
+                      "to DRSR region size, mask = 0x%" PRIx32 "\n",
+                      n, base, rmask);
+        return 0;
+    }
+    return rsize;
+}
+
+/*
+ * Return true if @address hits valid PMSAv7 region @n of log2 size @rsize,
+ * taking its disabled subregions into account.
+ */
+static bool pmsav7_region_hit(CPUARMState *env, int n, uint32_t rsize,
+                              uint32_t address)
+{
+    uint32_t base = env->pmsav7.drbar[n];
+
+    if (address < base || address - base > (1ull << rsize) - 1) {
+        return false;
+    }
+    if (rsize >= 8) { /* no subregions for regions < 256 bytes */
+        int snd = (address - base) >> (rsize - 3);
+
+        if (extract32(env->pmsav7.drsr[n], snd + 8, 1)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static int pmsav7_map_cmp(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * Flatten the MPU regions into the intervals of cpu->pmsav7_map_start.
+ * Region and subregion boundaries are the only addresses at which the
+ * matching region can change, so each interval between two of them hits
+ * the same region throughout.
+ */
+static void pmsav7_map_rebuild(ARMCPU *cpu)
+{
+    CPUARMState *env = &cpu->env;
+    uint32_t nr = cpu->pmsav7_dregion;
+    g_autofree uint32_t *rsize = g_new(uint32_t, nr);
+    g_autofree uint64_t *bounds = g_new(uint64_t, nr * 9 + 1);
+    uint32_t nb = 0, i, len;
+    int n;
+
+    bounds[nb++] = 0;
+    for (n = 0; n < nr; n++) {
+        uint64_t base = env->pmsav7.drbar[n];
+        int k, nsub;
+
+        rsize[n] = pmsav7_region_size(env, n);
+        if (!rsize[n]) {
+            continue;
+        }
+        nsub = rsize[n] >= 8 ? 8 : 1;
+        for (k = 0; k <= nsub; k++) {
+            bounds[nb++] = base + k * ((1ull << rsize[n]) / nsub);
+        }
+    }
+    qsort(bounds, nb, sizeof(*bounds), pmsav7_map_cmp);
+
+    for (i = 0, len = 0; i < nb && bounds[i] <= UINT32_MAX; i++) {
+        int16_t region = -1;
+
+        if (i && bounds[i] == bounds[i - 1]) {
+            continue;
+        }
+        /* Highest numbered matching region wins */
+        for (n = nr - 1; n >= 0; n--) {
+            if (rsize[n] && pmsav7_region_hit(env, n, rsize[n], bounds[i])) {
+                region = n;
+                break;
+            }
+        }
+        /* Merge with the previous interval if it hits the same region */
+        if (len && cpu->pmsav7_map_region[len - 1] == region) {
+            continue;
+        }
+        cpu->pmsav7_map_start[len] = bounds[i];
+        cpu->pmsav7_map_region[len] = region;
+        len++;
+    }
+    cpu->pmsav7_map_len = len;
+    cpu->pmsav7_map_valid = true;
+}
+
+/* Return the index of the map interval containing @address. */
+static uint32_t pmsav7_map_find(ARMCPU *cpu, uint32_t address)
+{
+    uint32_t lo = 0, hi = cpu->pmsav7_map_len;
+
+    /* The first interval always starts at 0 */
+    while (hi - lo > 1) {
+        uint32_t mid = (lo + hi) / 2;
+
+        if (cpu->pmsav7_map_start[mid] <= address) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/*
+ * Compute the access permissions for @address, which hits region @n or
+ * no region if @n is negative. Return false on a background fault.
+ */
+static bool pmsav7_region_prot(CPUARMState *env, ARMMMUIdx mmu_idx,
+                               bool secure, bool is_user, uint32_t address,
+                               int n, uint8_t *prot)
+{
+    ARMCPU *cpu = env_archcpu(env);
+    uint32_t ap, xn;
+
+    *prot = 0;
+
+    if (n < 0) { /* no hits */
+        if (!pmsav7_use_background_region(cpu, mmu_idx, secure, is_user)) {
+            /* background fault */
+            return false;
+        }
+        get_phys_addr_pmsav7_default(env, mmu_idx, address, prot);
+        return true;
+    }
+
+    /* a MPU hit! */
+    ap = extract32(env->pmsav7.dracr[n], 8, 3);
+    xn = extract32(env->pmsav7.dracr[n], 12, 1);
+
+    if (m_is_system_region(env, address)) {
+        /* System space is always execute never */
+        xn = 1;
+    }
+
+    if (is_user) { /* User mode AP bit decoding */
+        switch (ap) {
+        case 0:
+        case 1:
+        case 5:
+            break; /* no access */
+        case 3:
+            *prot |= PAGE_WRITE;
+            /* fall through */
+        case 2:
+        case 6:
+            *prot |= PAGE_READ | PAGE_EXEC;
+            break;
+        case 7:
+            /* for v7M, same as 6; for R profile a reserved value */
+            if (arm_feature(env, ARM_FEATURE_M)) {
+                *prot |= PAGE_READ | PAGE_EXEC;
+                break;
+            }
+            /* fall through */
+        default:
+            qemu_log_mask(LOG_GUEST_ERROR,
+                          "DRACR[%d]: Bad value for AP bits: 0x%"
+                          PRIx32 "\n", n, ap);
+        }
+    } else { /* Priv. mode AP bits decoding */
+        switch (ap) {
+        case 0:
+            break; /* no access */
+        case 1:
+        case 2:
+        case 3:
+            *prot |= PAGE_WRITE;
+            /* fall through */
+        case 5:
+        case 6:
+            *prot |= PAGE_READ | PAGE_EXEC;
+            break;
+        case 7:
+            /* for v7M, same as 6; for R profile a reserved value */
+            if (arm_feature(env, ARM_FEATURE_M)) {
+                *prot |= PAGE_READ | PAGE_EXEC;
+                break;
+            }
+            /* fall through */
+        default:
+            qemu_log_mask(LOG_GUEST_ERROR,
+                          "DRACR[%d]: Bad value for AP bits: 0x%"
+                          PRIx32 "\n", n, ap);
+        }
+    }
+
+    /* execute never */
+    if (xn) {
+        *prot &= ~PAGE_EXEC;
+    }
+    return true;
+}
+
 static bool get_phys_addr_pmsav7(CPUARMState *env, uint32_t address,
                                  MMUAccessType access_type, ARMMMUIdx mmu_idx,
                                  bool secure, GetPhysAddrResult *result,
                                  ARMMMUFaultInfo *fi)
 {
     ARMCPU *cpu = env_archcpu(env);
-    int n;
     bool is_user = regime_is_user(env, mmu_idx);
 
     result->f.phys_addr = address;
@@ -1788,161 +2013,43 @@ static bool get_phys_addr_pmsav7(CPUARMState *env, uint32_t address,
          */
         get_phys_addr_pmsav7_default(env, mmu_idx, address, &result->f.prot);
     } else { /* MPU enabled */
-        for (n = (int)cpu->pmsav7_dregion - 1; n >= 0; n--) {
-            /* region search */
-            uint32_t base = env->pmsav7.drbar[n];
-            uint32_t rsize = extract32(env->pmsav7.drsr[n], 1, 5);
-            uint32_t rmask;
-            bool srdis = false;
+        uint32_t page = address & TARGET_PAGE_MASK;
+        uint32_t i;
+        int n;
 
-            if (!(env->pmsav7.drsr[n] & 0x1)) {
-                continue;
-            }
-
-            if (!rsize) {
-                qemu_log_mask(LOG_GUEST_ERROR,
-                              "DRSR[%d]: Rsize field cannot be 0\n", n);
-                continue;
-            }
-            rsize++;
-            rmask = (1ull << rsize) - 1;
-
-            if (base & rmask) {
-                qemu_log_mask(LOG_GUEST_ERROR,
-                              "DRBAR[%d]: 0x%" PRIx32 " misaligned "
-                              "to DRSR region size, mask = 0x%" PRIx32 "\n",
-                              n, base, rmask);
-                continue;
-            }
-
-            if (address < base || address > base + rmask) {
-                /*
-                 * Address not in this region. We must check whether the
-                 * region covers addresses in the same page as our address.
-                 * In that case we must not report a size that covers the
-                 * whole page for a subsequent hit against a different MPU
-                 * region or the background region, because it would result in
-                 * incorrect TLB hits for subsequent accesses to addresses that
-                 * are in this MPU region.
-                 */
-                if (ranges_overlap(base, rmask,
-                                   address & TARGET_PAGE_MASK,
-                                   TARGET_PAGE_SIZE)) {
-                    result->f.lg_page_size = 0;
-                }
-                continue;
-            }
-
-            /* Region matched */
-
-            if (rsize >= 8) { /* no subregions for regions < 256 bytes */
-                int i, snd;
-                uint32_t srdis_mask;
-
-                rsize -= 3; /* sub region size (power of 2) */
-                snd = ((address - base) >> rsize) & 0x7;
-                srdis = extract32(env->pmsav7.drsr[n], snd + 8, 1);
-
-                srdis_mask = srdis ? 0x3 : 0x0;
-                for (i = 2; i <= 8 && rsize < TARGET_PAGE_BITS; i *= 2) {
-                    /*
-                     * This will check in groups of 2, 4 and then 8, whether
-                     * the subregion bits are consistent. rsize is incremented
-                     * back up to give the region size, considering consistent
-                     * adjacent subregions as one region. Stop testing if rsize
-                     * is already big enough for an entire QEMU page.
-                     */
-                    int snd_rounded = snd & ~(i - 1);
-                    uint32_t srdis_multi = extract32(env->pmsav7.drsr[n],
-                                                     snd_rounded + 8, i);
-                    if (srdis_mask ^ srdis_multi) {
-                        break;
-                    }
-                    srdis_mask = (srdis_mask << i) | srdis_mask;
-                    rsize++;
-                }
-            }
-            if (srdis) {
-                continue;
-            }
-            if (rsize < TARGET_PAGE_BITS) {
-                result->f.lg_page_size = rsize;
-            }
-            break;
+        if (!cpu->pmsav7_map_valid) {
+            pmsav7_map_rebuild(cpu);
         }
+        i = pmsav7_map_find(cpu, address);
+        n = cpu->pmsav7_map_region[i];
 
-        if (n == -1) { /* no hits */
-            if (!pmsav7_use_background_region(cpu, mmu_idx, secure, is_user)) {
-                /* background fault */
-                fi->type = ARMFault_Background;
-                return true;
-            }
-            get_phys_addr_pmsav7_default(env, mmu_idx, address,
-                                         &result->f.prot);
-        } else { /* a MPU hit! */
-            uint32_t ap = extract32(env->pmsav7.dracr[n], 8, 3);
-            uint32_t xn = extract32(env->pmsav7.dracr[n], 12, 1);
-
-            if (m_is_system_region(env, address)) {
-                /* System space is always execute never */
-                xn = 1;
-            }
+        if (!pmsav7_region_prot(env, mmu_idx, secure, is_user, address, n,
+                                &result->f.prot)) {
+            fi->type = ARMFault_Background;
+            return true;
+        }
 
-            if (is_user) { /* User mode AP bit decoding */
-                switch (ap) {
-                case 0:
-                case 1:
-                case 5:
-                    break; /* no access */
-                case 3:
-                    result->f.prot |= PAGE_WRITE;
-                    /* fall through */
-                case 2:
-                case 6:
-                    result->f.prot |= PAGE_READ | PAGE_EXEC;
-                    break;
-                case 7:
-                    /* for v7M, same as 6; for R profile a reserved value */
-                    if (arm_feature(env, ARM_FEATURE_M)) {
-                        result->f.prot |= PAGE_READ | PAGE_EXEC;
-                        break;
-                    }
-                    /* fall through */
-                default:
-                    qemu_log_mask(LOG_GUEST_ERROR,
-                                  "DRACR[%d]: Bad value for AP bits: 0x%"
-                                  PRIx32 "\n", n, ap);
-                }
-            } else { /* Priv. mode AP bits decoding */
-                switch (ap) {
-                case 0:
-                    break; /* no access */
-                case 1:
-                case 2:
-                case 3:
-                    result->f.prot |= PAGE_WRITE;
-                    /* fall through */
-                case 5:
-                case 6:
-                    result->f.prot |= PAGE_READ | PAGE_EXEC;
-                    break;
-                case 7:
-                    /* for v7M, same as 6; for R profile a reserved value */
-                    if (arm_feature(env, ARM_FEATURE_M)) {
-                        result->f.prot |= PAGE_READ | PAGE_EXEC;
-                        break;
-                    }
-                    /* fall through */
-                default:
-                    qemu_log_mask(LOG_GUEST_ERROR,
-                                  "DRACR[%d]: Bad value for AP bits: 0x%"
-                                  PRIx32 "\n", n, ap);
-                }
+        /*
+         * The TLB entry may only cover the whole page if all of it has the
+         * same permissions as @address, whether or not it hits the same
+         * region. Otherwise report a size smaller than the page, so that
+         * every access to it goes through this function again.
+         */
+        for (i = pmsav7_map_find(cpu, page);
+             i < cpu->pmsav7_map_len &&
+             cpu->pmsav7_map_start[i] <= page + TARGET_PAGE_SIZE - 1;
+             i++) {
+            uint32_t start = MAX(cpu->pmsav7_map_start[i], page);
+            uint8_t prot;
+
+            if (cpu->pmsav7_map_region[i] == n) {
+                continue;
             }
-
-            /* execute never */
-            if (xn) {
-                result->f.prot &= ~PAGE_EXEC;
+            if (!pmsav7_region_prot(env, mmu_idx, secure, is_user, start,
+                                    cpu->pmsav7_map_region[i], &prot) ||
+                prot != result->f.prot) {
+                result->f.lg_page_size = 0;
+                break;
             }
         }
     }
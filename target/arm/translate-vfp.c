@@ -2109,6 +2109,8 @@ static bool trans_VDIV_hp(DisasContext *s, arg_VDIV_sp *a)
 
 static bool trans_VDIV_sp(DisasContext *s, arg_VDIV_sp *a)
 {
+    /* 14 cycles on the Cortex-M4 FPU */
+    arm_add_cycles(s, 13);
     return do_vfp_3op_sp(s, gen_helper_vfp_divs, a->vd, a->vn, a->vm, false);
 }
 
@@ -2556,7 +2558,17 @@ static void gen_VSQRT_dp(TCGv_i64 vd, TCGv_i64 vm)
 }
 
 DO_VFP_2OP(VSQRT, hp, gen_VSQRT_hp, aa32_fp16_arith)
-DO_VFP_2OP(VSQRT, sp, gen_VSQRT_sp, aa32_fpsp_v2)
+
+static bool trans_VSQRT_sp(DisasContext *s, arg_VSQRT_sp *a)
+{
+    if (!dc_isar_feature(aa32_fpsp_v2, s)) {
+        return false;
+    }
+    /* 14 cycles on the Cortex-M4 FPU */
+    arm_add_cycles(s, 13);
+    return do_vfp_2op_sp(s, gen_VSQRT_sp, a->vd, a->vm);
+}
+
 DO_VFP_2OP(VSQRT, dp, gen_VSQRT_dp, aa32_fpdp_v2)
 
 static bool trans_VCMP_hp(DisasContext *s, arg_VCMP_sp *a)
@@ -34,6 +34,10 @@
 #include "exec/helper-gen.h"
 #include "exec/log.h"
 #include "cpregs.h"
+#include "sysemu/cpu-timers.h"
+#if !defined(CONFIG_USER_ONLY)
+#include "exec/ram_addr.h"
+#endif
 
 
 #define ENABLE_ARCH_4T    arm_dc_feature(s, ARM_FEATURE_V4T)
@@ -320,6 +324,7 @@ void store_reg(DisasContext *s, int reg, TCGv_i32 var)
         tcg_gen_andi_i32(var, var, s->thumb ? ~1 : ~3);
         s->base.is_jmp = DISAS_JUMP;
         s->pc_save = -1;
+        arm_add_cycles(s, M_BRANCH_REFILL_CYCLES);
     } else if (reg == 13 && arm_dc_feature(s, ARM_FEATURE_M)) {
         /* For M-profile SP bits [1:0] are always zero */
         tcg_gen_andi_i32(var, var, ~3);
@@ -793,6 +798,7 @@ void gen_update_pc(DisasContext *s, target_long diff)
 static inline void gen_bx(DisasContext *s, TCGv_i32 var)
 {
     s->base.is_jmp = DISAS_JUMP;
+    arm_add_cycles(s, M_BRANCH_REFILL_CYCLES);
     tcg_gen_andi_i32(cpu_R[15], var, ~1);
     tcg_gen_andi_i32(var, var, 1);
     store_cpu_field(var, thumb);
@@ -2611,7 +2617,16 @@ static void gen_goto_ptr(void)
  */
 static void gen_goto_tb(DisasContext *s, int n, target_long diff)
 {
-    if (translator_use_goto_tb(&s->base, s->pc_curr + diff)) {
+    /*
+     * A side exit in the middle of the TB may have taken exit n already:
+     * use the other one, or look the next TB up when both are taken.
+     */
+    if (s->goto_tb_used & (1 << n)) {
+        n ^= 1;
+    }
+    if (!(s->goto_tb_used & (1 << n)) &&
+        translator_use_goto_tb(&s->base, s->pc_curr + diff)) {
+        s->goto_tb_used |= 1 << n;
         /*
          * For pcrel, the pc must always be up-to-date on entry to
          * the linked TB, so that it can use simple additions for all
@@ -2681,6 +2696,8 @@ static void gen_jmp_tb(DisasContext *s, target_long diff, int tbno)
 
 static inline void gen_jmp(DisasContext *s, target_long diff)
 {
+    /* Conditional branches are charged as taken, like loop back edges */
+    arm_add_cycles(s, M_BRANCH_REFILL_CYCLES);
     gen_jmp_tb(s, diff, 0);
 }
 
@@ -5979,6 +5996,7 @@ static bool op_mla(DisasContext *s, arg_s_rrrr *a, bool add)
         t2 = load_reg(s, a->ra);
         tcg_gen_add_i32(t1, t1, t2);
         tcg_temp_free_i32(t2);
+        arm_add_cycles(s, 1);
     }
     if (a->s) {
         gen_logic_CC(t1);
@@ -6690,10 +6708,23 @@ static ISSInfo make_issinfo(DisasContext *s, int rd, bool p, bool w)
     return ret;
 }
 
+/*
+ * Charge a single load or store, which takes 2 cycles unless its address
+ * phase overlaps the data phase of a load or store right before it.
+ */
+static void add_ldst_cycles(DisasContext *s)
+{
+    if (!s->ldst_prev) {
+        arm_add_cycles(s, 1);
+    }
+    s->ldst_curr = true;
+}
+
 static TCGv_i32 op_addr_rr_pre(DisasContext *s, arg_ldst_rr *a)
 {
     TCGv_i32 addr = load_reg(s, a->rn);
 
+    add_ldst_cycles(s);
     if (s->v8m_stackcheck && a->rn == 13 && a->w) {
         gen_helper_v8m_stackcheck(cpu_env, addr);
     }
@@ -6790,6 +6821,7 @@ static bool trans_LDRD_rr(DisasContext *s, arg_ldst_rr *a)
         return true;
     }
     addr = op_addr_rr_pre(s, a);
+    arm_add_cycles(s, 1);
 
     tmp = tcg_temp_new_i32();
     gen_aa32_ld_i32(s, tmp, addr, mem_idx, MO_UL | MO_ALIGN);
@@ -6819,6 +6851,7 @@ static bool trans_STRD_rr(DisasContext *s, arg_ldst_rr *a)
         return true;
     }
     addr = op_addr_rr_pre(s, a);
+    arm_add_cycles(s, 1);
 
     tmp = load_reg(s, a->rt);
     gen_aa32_st_i32(s, tmp, addr, mem_idx, MO_UL | MO_ALIGN);
@@ -6846,6 +6879,11 @@ static TCGv_i32 op_addr_ri_pre(DisasContext *s, arg_ldst_ri *a)
         ofs = -ofs;
     }
 
+    add_ldst_cycles(s);
+    if (a->rn == 15) {
+        arm_add_cycles(s, s->literal_wait_states);
+    }
+
     if (s->v8m_stackcheck && a->rn == 13 && a->w) {
         /*
          * Stackcheck. Here we know 'addr' is the current SP;
@@ -6935,6 +6973,7 @@ static bool op_ldrd_ri(DisasContext *s, arg_ldst_ri *a, int rt2)
     TCGv_i32 addr, tmp;
 
     addr = op_addr_ri_pre(s, a);
+    arm_add_cycles(s, 1);
 
     tmp = tcg_temp_new_i32();
     gen_aa32_ld_i32(s, tmp, addr, mem_idx, MO_UL | MO_ALIGN);
@@ -6974,6 +7013,7 @@ static bool op_strd_ri(DisasContext *s, arg_ldst_ri *a, int rt2)
     TCGv_i32 addr, tmp;
 
     addr = op_addr_ri_pre(s, a);
+    arm_add_cycles(s, 1);
 
     tmp = load_reg(s, a->rt);
     gen_aa32_st_i32(s, tmp, addr, mem_idx, MO_UL | MO_ALIGN);
@@ -7392,6 +7432,32 @@ static bool trans_LDAH(DisasContext *s, arg_LDA *a)
  * Media instructions
  */
 
+/* Unsigned sum of absolute byte differences */
+static void gen_usad8(TCGv_i32 dest, TCGv_i32 a, TCGv_i32 b)
+{
+    TCGv_i32 sum = tcg_temp_new_i32();
+    TCGv_i32 x = tcg_temp_new_i32();
+    TCGv_i32 y = tcg_temp_new_i32();
+    int i;
+
+    for (i = 0; i < 4; i++) {
+        tcg_gen_extract_i32(x, a, i * 8, 8);
+        tcg_gen_extract_i32(y, b, i * 8, 8);
+        tcg_gen_sub_i32(x, x, y);
+        tcg_gen_abs_i32(x, x);
+        if (i == 0) {
+            tcg_gen_mov_i32(sum, x);
+        } else {
+            tcg_gen_add_i32(sum, sum, x);
+        }
+    }
+    tcg_gen_mov_i32(dest, sum);
+
+    tcg_temp_free_i32(y);
+    tcg_temp_free_i32(x);
+    tcg_temp_free_i32(sum);
+}
+
 static bool trans_USADA8(DisasContext *s, arg_USADA8 *a)
 {
     TCGv_i32 t1, t2;
@@ -7402,7 +7468,7 @@ static bool trans_USADA8(DisasContext *s, arg_USADA8 *a)
 
     t1 = load_reg(s, a->rn);
     t2 = load_reg(s, a->rm);
-    gen_helper_usad8(t1, t1, t2);
+    gen_usad8(t1, t1, t2);
     tcg_temp_free_i32(t2);
     if (a->ra != 15) {
         t2 = load_reg(s, a->ra);
@@ -7488,12 +7554,34 @@ static bool trans_UDF(DisasContext *s, arg_UDF *a)
 
 /*
  * Parallel addition and subtraction
+ *
+ * These are expanded inline one lane at a time. Each lane of the operands
+ * is sign or zero extended to 32 bits, so that the untruncated lane result
+ * directly gives the GE flag, the saturated value or the halved value.
  */
 
-static bool op_par_addsub(DisasContext *s, arg_rrr *a,
-                          void (*gen)(TCGv_i32, TCGv_i32, TCGv_i32))
-{
-    TCGv_i32 t0, t1;
+typedef enum ParAddSubOp {
+    PAR_ADD,    /* Rn[i] + Rm[i] */
+    PAR_SUB,    /* Rn[i] - Rm[i] */
+    PAR_ASX,    /* Rn[0] - Rm[1], Rn[1] + Rm[0] */
+    PAR_SAX,    /* Rn[0] + Rm[1], Rn[1] - Rm[0] */
+} ParAddSubOp;
+
+typedef enum ParAddSubKind {
+    PAR_GE,     /* modulo arithmetic, sets the GE flags */
+    PAR_SAT,    /* saturating arithmetic */
+    PAR_HALF,   /* halving arithmetic */
+} ParAddSubKind;
+
+static bool op_par_addsub(DisasContext *s, arg_rrr *a, MemOp esz, bool sign,
+                          ParAddSubOp op, ParAddSubKind kind)
+{
+    int bits = 8 << esz;
+    int lanes = 32 / bits;
+    int ge_bits = 4 / lanes;
+    TCGv_i32 rn, rm, res, x, y, ge = NULL;
+    TCGv_i32 min, max;
+    int i;
 
     if (s->thumb
         ? !arm_dc_feature(s, ARM_FEATURE_THUMB_DSP)
@@ -7501,98 +7589,134 @@ static bool op_par_addsub(DisasContext *s, arg_rrr *a,
         return false;
     }
 
-    t0 = load_reg(s, a->rn);
-    t1 = load_reg(s, a->rm);
-
-    gen(t0, t0, t1);
+    if (sign) {
+        min = tcg_constant_i32(-(1 << (bits - 1)));
+        max = tcg_constant_i32((1 << (bits - 1)) - 1);
+    } else {
+        min = tcg_constant_i32(0);
+        max = tcg_constant_i32((1 << bits) - 1);
+    }
 
-    tcg_temp_free_i32(t1);
-    store_reg(s, a->rd, t0);
-    return true;
-}
+    rn = load_reg(s, a->rn);
+    rm = load_reg(s, a->rm);
+    res = tcg_temp_new_i32();
+    x = tcg_temp_new_i32();
+    y = tcg_temp_new_i32();
+    if (kind == PAR_GE) {
+        ge = tcg_temp_new_i32();
+        tcg_gen_movi_i32(ge, 0);
+    }
 
-static bool op_par_addsub_ge(DisasContext *s, arg_rrr *a,
-                             void (*gen)(TCGv_i32, TCGv_i32,
-                                         TCGv_i32, TCGv_ptr))
-{
-    TCGv_i32 t0, t1;
-    TCGv_ptr ge;
+    for (i = 0; i < lanes; i++) {
+        bool exchange = op == PAR_ASX || op == PAR_SAX;
+        bool sub = op == PAR_SUB ||
+                   (op == PAR_ASX && i == 0) || (op == PAR_SAX && i == 1);
+        int j = exchange ? i ^ 1 : i;
 
-    if (s->thumb
-        ? !arm_dc_feature(s, ARM_FEATURE_THUMB_DSP)
-        : !ENABLE_ARCH_6) {
-        return false;
-    }
+        if (sign) {
+            tcg_gen_sextract_i32(x, rn, i * bits, bits);
+            tcg_gen_sextract_i32(y, rm, j * bits, bits);
+        } else {
+            tcg_gen_extract_i32(x, rn, i * bits, bits);
+            tcg_gen_extract_i32(y, rm, j * bits, bits);
+        }
+        if (sub) {
+            tcg_gen_sub_i32(x, x, y);
+        } else {
+            tcg_gen_add_i32(x, x, y);
+        }
 
-    t0 = load_reg(s, a->rn);
-    t1 = load_reg(s, a->rm);
+        switch (kind) {
+        case PAR_GE:
+            /*
+             * GE is set for a non-negative signed result or difference,
+             * and for an unsigned sum carrying out of the lane.
+             */
+            if (sign || sub) {
+                tcg_gen_setcondi_i32(TCG_COND_GE, y, x, 0);
+            } else {
+                tcg_gen_setcondi_i32(TCG_COND_GEU, y, x, 1 << bits);
+            }
+            tcg_gen_neg_i32(y, y);
+            tcg_gen_deposit_i32(ge, ge, y, i * ge_bits, ge_bits);
+            break;
+        case PAR_SAT:
+            tcg_gen_smax_i32(x, x, min);
+            tcg_gen_smin_i32(x, x, max);
+            break;
+        case PAR_HALF:
+            tcg_gen_sari_i32(x, x, 1);
+            break;
+        }
 
-    ge = tcg_temp_new_ptr();
-    tcg_gen_addi_ptr(ge, cpu_env, offsetof(CPUARMState, GE));
-    gen(t0, t0, t1, ge);
+        if (i == 0) {
+            tcg_gen_mov_i32(res, x);
+        } else {
+            tcg_gen_deposit_i32(res, res, x, i * bits, bits);
+        }
+    }
 
-    tcg_temp_free_ptr(ge);
-    tcg_temp_free_i32(t1);
-    store_reg(s, a->rd, t0);
+    if (ge) {
+        tcg_gen_st_i32(ge, cpu_env, offsetof(CPUARMState, GE));
+        tcg_temp_free_i32(ge);
+    }
+    tcg_temp_free_i32(y);
+    tcg_temp_free_i32(x);
+    tcg_temp_free_i32(rm);
+    tcg_temp_free_i32(rn);
+    store_reg(s, a->rd, res);
     return true;
 }
 
-#define DO_PAR_ADDSUB(NAME, helper) \
-static bool trans_##NAME(DisasContext *s, arg_rrr *a)   \
-{                                                       \
-    return op_par_addsub(s, a, helper);                 \
-}
-
-#define DO_PAR_ADDSUB_GE(NAME, helper) \
-static bool trans_##NAME(DisasContext *s, arg_rrr *a)   \
-{                                                       \
-    return op_par_addsub_ge(s, a, helper);              \
-}
-
-DO_PAR_ADDSUB_GE(SADD16, gen_helper_sadd16)
-DO_PAR_ADDSUB_GE(SASX, gen_helper_saddsubx)
-DO_PAR_ADDSUB_GE(SSAX, gen_helper_ssubaddx)
-DO_PAR_ADDSUB_GE(SSUB16, gen_helper_ssub16)
-DO_PAR_ADDSUB_GE(SADD8, gen_helper_sadd8)
-DO_PAR_ADDSUB_GE(SSUB8, gen_helper_ssub8)
-
-DO_PAR_ADDSUB_GE(UADD16, gen_helper_uadd16)
-DO_PAR_ADDSUB_GE(UASX, gen_helper_uaddsubx)
-DO_PAR_ADDSUB_GE(USAX, gen_helper_usubaddx)
-DO_PAR_ADDSUB_GE(USUB16, gen_helper_usub16)
-DO_PAR_ADDSUB_GE(UADD8, gen_helper_uadd8)
-DO_PAR_ADDSUB_GE(USUB8, gen_helper_usub8)
-
-DO_PAR_ADDSUB(QADD16, gen_helper_qadd16)
-DO_PAR_ADDSUB(QASX, gen_helper_qaddsubx)
-DO_PAR_ADDSUB(QSAX, gen_helper_qsubaddx)
-DO_PAR_ADDSUB(QSUB16, gen_helper_qsub16)
-DO_PAR_ADDSUB(QADD8, gen_helper_qadd8)
-DO_PAR_ADDSUB(QSUB8, gen_helper_qsub8)
-
-DO_PAR_ADDSUB(UQADD16, gen_helper_uqadd16)
-DO_PAR_ADDSUB(UQASX, gen_helper_uqaddsubx)
-DO_PAR_ADDSUB(UQSAX, gen_helper_uqsubaddx)
-DO_PAR_ADDSUB(UQSUB16, gen_helper_uqsub16)
-DO_PAR_ADDSUB(UQADD8, gen_helper_uqadd8)
-DO_PAR_ADDSUB(UQSUB8, gen_helper_uqsub8)
-
-DO_PAR_ADDSUB(SHADD16, gen_helper_shadd16)
-DO_PAR_ADDSUB(SHASX, gen_helper_shaddsubx)
-DO_PAR_ADDSUB(SHSAX, gen_helper_shsubaddx)
-DO_PAR_ADDSUB(SHSUB16, gen_helper_shsub16)
-DO_PAR_ADDSUB(SHADD8, gen_helper_shadd8)
-DO_PAR_ADDSUB(SHSUB8, gen_helper_shsub8)
-
-DO_PAR_ADDSUB(UHADD16, gen_helper_uhadd16)
-DO_PAR_ADDSUB(UHASX, gen_helper_uhaddsubx)
-DO_PAR_ADDSUB(UHSAX, gen_helper_uhsubaddx)
-DO_PAR_ADDSUB(UHSUB16, gen_helper_uhsub16)
-DO_PAR_ADDSUB(UHADD8, gen_helper_uhadd8)
-DO_PAR_ADDSUB(UHSUB8, gen_helper_uhsub8)
+#define DO_PAR_ADDSUB(NAME, ESZ, SIGN, OP, KIND) \
+static bool trans_##NAME(DisasContext *s, arg_rrr *a)       \
+{                                                           \
+    return op_par_addsub(s, a, ESZ, SIGN, OP, KIND);        \
+}
+
+DO_PAR_ADDSUB(SADD16, MO_16, true, PAR_ADD, PAR_GE)
+DO_PAR_ADDSUB(SASX, MO_16, true, PAR_ASX, PAR_GE)
+DO_PAR_ADDSUB(SSAX, MO_16, true, PAR_SAX, PAR_GE)
+DO_PAR_ADDSUB(SSUB16, MO_16, true, PAR_SUB, PAR_GE)
+DO_PAR_ADDSUB(SADD8, MO_8, true, PAR_ADD, PAR_GE)
+DO_PAR_ADDSUB(SSUB8, MO_8, true, PAR_SUB, PAR_GE)
+
+DO_PAR_ADDSUB(UADD16, MO_16, false, PAR_ADD, PAR_GE)
+DO_PAR_ADDSUB(UASX, MO_16, false, PAR_ASX, PAR_GE)
+DO_PAR_ADDSUB(USAX, MO_16, false, PAR_SAX, PAR_GE)
+DO_PAR_ADDSUB(USUB16, MO_16, false, PAR_SUB, PAR_GE)
+DO_PAR_ADDSUB(UADD8, MO_8, false, PAR_ADD, PAR_GE)
+DO_PAR_ADDSUB(USUB8, MO_8, false, PAR_SUB, PAR_GE)
+
+DO_PAR_ADDSUB(QADD16, MO_16, true, PAR_ADD, PAR_SAT)
+DO_PAR_ADDSUB(QASX, MO_16, true, PAR_ASX, PAR_SAT)
+DO_PAR_ADDSUB(QSAX, MO_16, true, PAR_SAX, PAR_SAT)
+DO_PAR_ADDSUB(QSUB16, MO_16, true, PAR_SUB, PAR_SAT)
+DO_PAR_ADDSUB(QADD8, MO_8, true, PAR_ADD, PAR_SAT)
+DO_PAR_ADDSUB(QSUB8, MO_8, true, PAR_SUB, PAR_SAT)
+
+DO_PAR_ADDSUB(UQADD16, MO_16, false, PAR_ADD, PAR_SAT)
+DO_PAR_ADDSUB(UQASX, MO_16, false, PAR_ASX, PAR_SAT)
+DO_PAR_ADDSUB(UQSAX, MO_16, false, PAR_SAX, PAR_SAT)
+DO_PAR_ADDSUB(UQSUB16, MO_16, false, PAR_SUB, PAR_SAT)
+DO_PAR_ADDSUB(UQADD8, MO_8, false, PAR_ADD, PAR_SAT)
+DO_PAR_ADDSUB(UQSUB8, MO_8, false, PAR_SUB, PAR_SAT)
+
+DO_PAR_ADDSUB(SHADD16, MO_16, true, PAR_ADD, PAR_HALF)
+DO_PAR_ADDSUB(SHASX, MO_16, true, PAR_ASX, PAR_HALF)
+DO_PAR_ADDSUB(SHSAX, MO_16, true, PAR_SAX, PAR_HALF)
+DO_PAR_ADDSUB(SHSUB16, MO_16, true, PAR_SUB, PAR_HALF)
+DO_PAR_ADDSUB(SHADD8, MO_8, true, PAR_ADD, PAR_HALF)
+DO_PAR_ADDSUB(SHSUB8, MO_8, true, PAR_SUB, PAR_HALF)
+
+DO_PAR_ADDSUB(UHADD16, MO_16, false, PAR_ADD, PAR_HALF)
+DO_PAR_ADDSUB(UHASX, MO_16, false, PAR_ASX, PAR_HALF)
+DO_PAR_ADDSUB(UHSAX, MO_16, false, PAR_SAX, PAR_HALF)
+DO_PAR_ADDSUB(UHSUB16, MO_16, false, PAR_SUB, PAR_HALF)
+DO_PAR_ADDSUB(UHADD8, MO_8, false, PAR_ADD, PAR_HALF)
+DO_PAR_ADDSUB(UHSUB8, MO_8, false, PAR_SUB, PAR_HALF)
 
 #undef DO_PAR_ADDSUB
-#undef DO_PAR_ADDSUB_GE
 
 /*
  * Packing, unpacking, saturation, and reversal
@@ -7754,7 +7878,13 @@ static bool trans_SEL(DisasContext *s, arg_rrr *a)
     t2 = load_reg(s, a->rm);
     t3 = tcg_temp_new_i32();
     tcg_gen_ld_i32(t3, cpu_env, offsetof(CPUARMState, GE));
-    gen_helper_sel_flags(t1, t3, t1, t2);
+    /* Move GE[i] to bit 8 * i, then widen each bit to a whole byte mask */
+    tcg_gen_muli_i32(t3, t3, 0x00204081);
+    tcg_gen_andi_i32(t3, t3, 0x01010101);
+    tcg_gen_muli_i32(t3, t3, 0xff);
+    tcg_gen_and_i32(t1, t1, t3);
+    tcg_gen_andc_i32(t2, t2, t3);
+    tcg_gen_or_i32(t1, t1, t2);
     tcg_temp_free_i32(t3);
     tcg_temp_free_i32(t2);
     store_reg(s, a->rd, t1);
@@ -8029,6 +8159,9 @@ static bool op_div(DisasContext *s, arg_rrr *a, bool u)
         return false;
     }
 
+    /* 2 to 12 cycles depending on the operands: assume the worst */
+    arm_add_cycles(s, 11);
+
     t1 = load_reg(s, a->rn);
     t2 = load_reg(s, a->rm);
     if (u) {
@@ -8136,6 +8269,7 @@ static bool op_stm(DisasContext *s, arg_ldst_block *a, int min_n)
     }
 
     s->eci_handled = true;
+    arm_add_cycles(s, n);
 
     addr = op_addr_block_pre(s, a, n);
     mem_idx = get_mem_index(s);
@@ -8217,6 +8351,7 @@ static bool do_ldm(DisasContext *s, arg_ldst_block *a, int min_n)
     }
 
     s->eci_handled = true;
+    arm_add_cycles(s, n);
 
     addr = op_addr_block_pre(s, a, n);
     mem_idx = get_mem_index(s);
@@ -8352,6 +8487,36 @@ static bool trans_B(DisasContext *s, arg_i *a)
     return true;
 }
 
+/*
+ * Emit the taken path of a conditional branch outside of an IT block, and
+ * on M-profile keep translating its not-taken path in the same TB when
+ * the taken path could be chained. The taken path then leaves the TB
+ * through a side exit, instead of the TB ending on the branch and both
+ * paths being chained to new TBs.
+ *
+ * A TB only has two goto_tb exits, so there is at most one side exit per
+ * TB, and it ends before the next insn that would need two exits itself
+ * (see thumb_insn_needs_two_exits()). With icount the instruction count
+ * of the whole TB is charged on entry, so every TB must run to its end.
+ */
+static void gen_cond_branch_jmp(DisasContext *s, target_long diff)
+{
+    uint8_t goto_tb_used = s->goto_tb_used;
+
+    gen_jmp(s, diff);
+
+    if (arm_dc_feature(s, ARM_FEATURE_M) && !s->side_exit &&
+        !(tb_cflags(s->base.tb) & CF_USE_ICOUNT) &&
+        s->base.is_jmp == DISAS_NORETURN &&
+        s->goto_tb_used != goto_tb_used) {
+        /* Carry on with the not-taken path */
+        set_disas_label(s, s->condlabel);
+        s->condjmp = 0;
+        s->side_exit = true;
+        s->base.is_jmp = DISAS_NEXT;
+    }
+}
+
 static bool trans_B_cond_thumb(DisasContext *s, arg_ci *a)
 {
     /* This has cond from encoding, required to be outside IT block.  */
@@ -8363,7 +8528,7 @@ static bool trans_B_cond_thumb(DisasContext *s, arg_ci *a)
         return true;
     }
     arm_skip_unless(s, a->cond);
-    gen_jmp(s, jmp_diff(s, a->imm));
+    gen_cond_branch_jmp(s, jmp_diff(s, a->imm));
     return true;
 }
 
@@ -8739,6 +8904,9 @@ static bool op_tbranch(DisasContext *s, arg_tbranch *a, bool half)
 {
     TCGv_i32 addr, tmp;
 
+    /* the table load, the refill is charged by store_reg() */
+    arm_add_cycles(s, 1);
+
     tmp = load_reg(s, a->rm);
     if (half) {
         tcg_gen_add_i32(tmp, tmp, tmp);
@@ -8774,7 +8942,7 @@ static bool trans_CBZ(DisasContext *s, arg_CBZ *a)
     tcg_gen_brcondi_i32(a->nz ? TCG_COND_EQ : TCG_COND_NE,
                         tmp, 0, s->condlabel.label);
     tcg_temp_free_i32(tmp);
-    gen_jmp(s, jmp_diff(s, a->imm));
+    gen_cond_branch_jmp(s, jmp_diff(s, a->imm));
     return true;
 }
 
@@ -9328,6 +9496,40 @@ static bool insn_crosses_page(CPUARMState *env, DisasContext *s)
     return !thumb_insn_is_16bit(s, s->base.pc_next, insn);
 }
 
+/*
+ * Return true if the insn at dc->base.pc_next is a conditional branch or
+ * an IT insn, which need two TB exits. Only looks within the current page.
+ */
+static bool thumb_insn_needs_two_exits(CPUARMState *env, DisasContext *s)
+{
+    target_ulong pc = s->base.pc_next;
+    uint16_t insn, insn2;
+
+    if (pc - s->page_start > TARGET_PAGE_SIZE - 4) {
+        return false;
+    }
+    insn = arm_lduw_code(env, &s->base, pc, s->sctlr_b);
+
+    if ((insn & 0xf000) == 0xd000) {
+        /* B<c> T1, 0xe and 0xf are UDF and SVC */
+        return extract32(insn, 8, 4) < 0xe;
+    }
+    if ((insn & 0xf500) == 0xb100) {
+        /* CBZ, CBNZ */
+        return true;
+    }
+    if ((insn & 0xff00) == 0xbf00 && (insn & 0xf)) {
+        /* IT, the instructions of the block may be conditional branches */
+        return true;
+    }
+    if ((insn & 0xf800) == 0xf000) {
+        /* B<c> T3 */
+        insn2 = arm_lduw_code(env, &s->base, pc + 2, s->sctlr_b);
+        return (insn2 & 0xd000) == 0x8000 && extract32(insn, 6, 4) < 0xe;
+    }
+    return false;
+}
+
 static void arm_tr_init_disas_context(DisasContextBase *dcbase, CPUState *cs)
 {
     DisasContext *dc = container_of(dcbase, DisasContext, base);
@@ -9338,6 +9540,8 @@ static void arm_tr_init_disas_context(DisasContextBase *dcbase, CPUState *cs)
 
     dc->isar = &cpu->isar;
     dc->condjmp = 0;
+    dc->goto_tb_used = 0;
+    dc->side_exit = false;
     dc->pc_save = dc->base.pc_first;
     dc->aarch64 = false;
     dc->thumb = EX_TBFLAG_AM32(tb_flags, THUMB);
@@ -9436,6 +9640,27 @@ static void arm_tr_init_disas_context(DisasContextBase *dcbase, CPUState *cs)
         dc->base.max_insns = MIN(dc->base.max_insns, bound);
     }
 
+    dc->count_cycles = arm_dc_feature(dc, ARM_FEATURE_M) && icount_cycles &&
+                       (tb_cflags(dc->base.tb) & CF_USE_ICOUNT);
+    dc->fetch_wait_states = 0;
+    dc->literal_wait_states = 0;
+    dc->fetch_line = dc->base.pc_first / M_FLASH_LINE_SIZE;
+    dc->ldst_prev = false;
+    dc->ldst_curr = false;
+#if !defined(CONFIG_USER_ONLY)
+    if (dc->count_cycles && tb_page_addr0(dc->base.tb) != -1 &&
+        qemu_ram_addr_is_rom(tb_page_addr0(dc->base.tb))) {
+        /* The branch to the TB fetches its first line, unless cached */
+        if (!cpu->flash_icache) {
+            arm_add_cycles(dc, cpu->flash_wait_states);
+        }
+        dc->fetch_wait_states =
+            cpu->flash_prefetch ? 0 : cpu->flash_wait_states;
+        dc->literal_wait_states =
+            cpu->flash_dcache ? 0 : cpu->flash_wait_states;
+    }
+#endif
+
     cpu_V0 = tcg_temp_new_i64();
     cpu_V1 = tcg_temp_new_i64();
     cpu_M0 = tcg_temp_new_i64();
@@ -9675,6 +9900,18 @@ static void thumb_tr_translate_insn(DisasContextBase *dcbase, CPUState *cpu)
     dc->base.pc_next = pc;
     dc->insn = insn;
 
+    if (dc->count_cycles) {
+        uint32_t line = (pc - 1) / M_FLASH_LINE_SIZE;
+
+        /* Sequential lines stall unless prefetched */
+        if (line != dc->fetch_line) {
+            dc->fetch_line = line;
+            arm_add_cycles(dc, dc->fetch_wait_states);
+        }
+        dc->ldst_prev = dc->ldst_curr;
+        dc->ldst_curr = false;
+    }
+
     if (dc->pstate_il) {
         /*
          * Illegal execution state. This has priority over BTI
@@ -9779,6 +10016,12 @@ static void thumb_tr_translate_insn(DisasContextBase *dcbase, CPUState *cpu)
                 && insn_crosses_page(env, dc)))) {
         dc->base.is_jmp = DISAS_TOO_MANY;
     }
+
+    /* A TB with a side exit has a single goto_tb exit left */
+    if (dc->base.is_jmp == DISAS_NEXT && dc->side_exit
+        && thumb_insn_needs_two_exits(env, dc)) {
+        dc->base.is_jmp = DISAS_TOO_MANY;
+    }
 }
 
 static void arm_tr_tb_stop(DisasContextBase *dcbase, CPUState *cpu)
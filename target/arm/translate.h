@@ -42,6 +42,25 @@ typedef struct DisasContext {
     int condjmp;
     /* The label that will be jumped to when the instruction is skipped.  */
     DisasLabel condlabel;
+    /* Mask of the goto_tb exits of the TB already emitted.  */
+    uint8_t goto_tb_used;
+    /*
+     * True once a conditional branch left the TB through a side exit,
+     * translation having carried on with its not-taken path.
+     */
+    bool side_exit;
+    /*
+     * M-profile cycle model for -icount cycles=on: whether to charge stall
+     * cycles to base.num_stalls, the wait states of each new sequential
+     * code line and of literal pool loads, the code line being fetched,
+     * and whether the previous and current insns access memory.
+     */
+    bool count_cycles;
+    uint8_t fetch_wait_states;
+    uint8_t literal_wait_states;
+    uint32_t fetch_line;
+    bool ldst_prev;
+    bool ldst_curr;
     /* Thumb-2 conditional execution bits.  */
     int condexec_mask;
     int condexec_cond;
@@ -253,6 +272,22 @@ static inline int curr_insn_len(DisasContext *s)
     return s->base.pc_next - s->pc_curr;
 }
 
+/* Cortex-M4 pipeline refill after a taken branch */
+#define M_BRANCH_REFILL_CYCLES 2
+/* Flash is read 128 bits at a time */
+#define M_FLASH_LINE_SIZE 16
+
+/*
+ * Charge @n cycles on top of the one every insn takes, when counting
+ * cycles with the M-profile cycle model.
+ */
+static inline void arm_add_cycles(DisasContext *s, int n)
+{
+    if (s->count_cycles) {
+        s->base.num_stalls += n;
+    }
+}
+
 /* is_jmp field values */
 #define DISAS_JUMP      DISAS_TARGET_0 /* only pc was modified dynamically */
 /* CPU state was modified dynamically; exit to main loop for interrupts. */
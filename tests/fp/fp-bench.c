@@ -127,6 +127,7 @@ static enum op operation;
 static enum tester tester;
 static uint64_t n_completed_ops;
 static unsigned int duration = DEFAULT_DURATION_SECS;
+static bool clear_flags;
 static int64_t ns_elapsed;
 /* disable optimizations with volatile */
 static volatile union fp res;
@@ -318,6 +319,9 @@ static void bench(enum precision prec, enum op op, int n_ops, bool no_neg)
                 float32 b = ops[1].f32;
                 float32 c = ops[2].f32;
 
+                if (clear_flags) {
+                    soft_status.float_exception_flags = 0;
+                }
                 switch (op) {
                 case OP_ADD:
                     res.f32 = float32_add(a, b, &soft_status);
@@ -528,6 +532,8 @@ static void usage_complete(int argc, char *argv[])
             "Default: disabled\n");
     fprintf(stderr, " -Z = flush output to zero (soft tester only). "
             "Default: disabled\n");
+    fprintf(stderr, " -c = clear the exception flags before each operation "
+            "(soft tester, single precision only). Default: disabled\n");
 
     g_free(tester_list);
     g_free(op_list);
@@ -615,11 +621,14 @@ static void parse_args(int argc, char *argv[])
     int rounding = ROUND_EVEN;
 
     for (;;) {
-        c = getopt(argc, argv, "d:ho:p:r:t:zZ");
+        c = getopt(argc, argv, "cd:ho:p:r:t:zZ");
         if (c < 0) {
             break;
         }
         switch (c) {
+        case 'c':
+            clear_flags = true;
+            break;
         case 'd':
             duration = atoi(optarg);
             break;
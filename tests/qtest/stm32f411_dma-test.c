@@ -0,0 +1,259 @@
+/*
+ * QTest testcase for the STM32F411 DMA controllers
+ *
+ * Copyright (c) 2023 Julien Combattelli <julien.combattelli@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "qemu/osdep.h"
+#include "libqtest.h"
+
+#define DMA1_BASE 0x40026000
+#define DMA2_BASE 0x40026400
+#define DMA_LISR 0x00
+#define DMA_HISR 0x04
+#define DMA_LIFCR 0x08
+#define DMA_HIFCR 0x0c
+#define DMA_SxCR(n) (0x10 + (n) * 0x18)
+#define DMA_SxNDTR(n) (0x14 + (n) * 0x18)
+#define DMA_SxPAR(n) (0x18 + (n) * 0x18)
+#define DMA_SxM0AR(n) (0x1c + (n) * 0x18)
+
+#define SxCR_EN (1 << 0)
+#define SxCR_TEIE (1 << 2)
+#define SxCR_TCIE (1 << 4)
+#define SxCR_P2M (0 << 6)
+#define SxCR_M2P (1 << 6)
+#define SxCR_M2M (2 << 6)
+#define SxCR_CIRC (1 << 8)
+#define SxCR_PINC (1 << 9)
+#define SxCR_MINC (1 << 10)
+#define SxCR_PSIZE_32 (2 << 11)
+#define SxCR_MSIZE_32 (2 << 13)
+#define SxCR_CHSEL(n) ((n) << 25)
+
+/* Flags of streams 0 and 4, the other streams have them further up */
+#define ISR_TEIF (1 << 3)
+#define ISR_HTIF (1 << 4)
+#define ISR_TCIF (1 << 5)
+#define ISR_STREAM2_SHIFT 16
+#define ISR_STREAM5_SHIFT 6
+#define ISR_STREAM7_SHIFT 22
+
+#define DMA1_STREAM0_IRQ 11
+#define DMA2_STREAM0_IRQ 56
+#define DMA2_STREAM5_IRQ 68
+
+#define RCC_APB2ENR 0x40023844
+#define RCC_APB2ENR_USART1EN (1 << 4)
+
+/* USART1 is connected to the first -serial */
+#define USART1_BASE 0x40011000
+#define USART_DR (USART1_BASE + 0x04)
+#define USART_CR1 (USART1_BASE + 0x0c)
+#define USART_CR3 (USART1_BASE + 0x14)
+#define USART_CR1_UE (1 << 13)
+#define USART_CR1_TE (1 << 3)
+#define USART_CR1_RE (1 << 2)
+#define USART_CR3_DMAT (1 << 7)
+#define USART_CR3_DMAR (1 << 6)
+
+#define SRC_ADDR 0x20000000
+#define DST_ADDR 0x20001000
+
+static QTestState *dma_init(void)
+{
+    QTestState *qts = qtest_init("-M st-nucleo-f411");
+
+    qtest_irq_intercept_in(qts, "/machine/soc[0]/armv7m/nvic");
+    return qts;
+}
+
+static void test_mem_to_mem(void)
+{
+    QTestState *qts = dma_init();
+    uint8_t src[16], dst[16];
+    int i;
+
+    for (i = 0; i < sizeof(src); i++) {
+        src[i] = i * 7 + 1;
+    }
+    qtest_memwrite(qts, SRC_ADDR, src, sizeof(src));
+
+    /* Memory-to-memory copies read from PAR and write to M0AR at once */
+    qtest_writel(qts, DMA2_BASE + DMA_SxPAR(0), SRC_ADDR);
+    qtest_writel(qts, DMA2_BASE + DMA_SxM0AR(0), DST_ADDR);
+    qtest_writel(qts, DMA2_BASE + DMA_SxNDTR(0), sizeof(src));
+    qtest_writel(qts, DMA2_BASE + DMA_SxCR(0),
+                 SxCR_M2M | SxCR_PINC | SxCR_MINC | SxCR_TCIE | SxCR_EN);
+
+    qtest_memread(qts, DST_ADDR, dst, sizeof(dst));
+    g_assert_cmpmem(dst, sizeof(dst), src, sizeof(src));
+    g_assert_cmpuint(qtest_readl(qts, DMA2_BASE + DMA_SxNDTR(0)), ==, 0);
+    g_assert_cmphex(qtest_readl(qts, DMA2_BASE + DMA_SxCR(0)) & SxCR_EN,
+                    ==, 0);
+    g_assert_cmphex(qtest_readl(qts, DMA2_BASE + DMA_LISR), ==,
+                    ISR_TCIF | ISR_HTIF);
+    g_assert_true(qtest_get_irq(qts, DMA2_STREAM0_IRQ));
+
+    qtest_writel(qts, DMA2_BASE + DMA_LIFCR, ISR_TCIF | ISR_HTIF);
+    g_assert_cmphex(qtest_readl(qts, DMA2_BASE + DMA_LISR), ==, 0);
+    g_assert_false(qtest_get_irq(qts, DMA2_STREAM0_IRQ));
+
+    qtest_quit(qts);
+}
+
+static void test_mem_to_mem_words(void)
+{
+    QTestState *qts = dma_init();
+    const uint32_t src[] = { 0x01234567, 0x89abcdef, 0xdeadbeef, 0x0badf00d };
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(src); i++) {
+        qtest_writel(qts, SRC_ADDR + i * 4, src[i]);
+    }
+
+    /* NDTR counts peripheral sized items, flags of stream 5 are in HISR */
+    qtest_writel(qts, DMA2_BASE + DMA_SxPAR(5), SRC_ADDR);
+    qtest_writel(qts, DMA2_BASE + DMA_SxM0AR(5), DST_ADDR);
+    qtest_writel(qts, DMA2_BASE + DMA_SxNDTR(5), ARRAY_SIZE(src));
+    qtest_writel(qts, DMA2_BASE + DMA_SxCR(5),
+                 SxCR_M2M | SxCR_PINC | SxCR_MINC | SxCR_PSIZE_32 |
+                 SxCR_MSIZE_32 | SxCR_TCIE | SxCR_EN);
+
+    for (i = 0; i < ARRAY_SIZE(src); i++) {
+        g_assert_cmphex(qtest_readl(qts, DST_ADDR + i * 4), ==, src[i]);
+    }
+    g_assert_cmpuint(qtest_readl(qts, DST_ADDR + 16), ==, 0);
+    g_assert_cmphex(qtest_readl(qts, DMA2_BASE + DMA_LISR), ==, 0);
+    g_assert_cmphex(qtest_readl(qts, DMA2_BASE + DMA_HISR), ==,
+                    (ISR_TCIF | ISR_HTIF) << ISR_STREAM5_SHIFT);
+    g_assert_true(qtest_get_irq(qts, DMA2_STREAM5_IRQ));
+
+    qtest_quit(qts);
+}
+
+static void test_mem_to_mem_dma1(void)
+{
+    QTestState *qts = dma_init();
+
+    /* Only DMA2 can copy memory: transfer error */
+    qtest_writel(qts, SRC_ADDR, 0x12345678);
+    qtest_writel(qts, DMA1_BASE + DMA_SxPAR(0), SRC_ADDR);
+    qtest_writel(qts, DMA1_BASE + DMA_SxM0AR(0), DST_ADDR);
+    qtest_writel(qts, DMA1_BASE + DMA_SxNDTR(0), 4);
+    qtest_writel(qts, DMA1_BASE + DMA_SxCR(0),
+                 SxCR_M2M | SxCR_PINC | SxCR_MINC | SxCR_TEIE | SxCR_EN);
+
+    g_assert_cmpuint(qtest_readl(qts, DST_ADDR), ==, 0);
+    g_assert_cmphex(qtest_readl(qts, DMA1_BASE + DMA_SxCR(0)) & SxCR_EN,
+                    ==, 0);
+    g_assert_cmphex(qtest_readl(qts, DMA1_BASE + DMA_LISR), ==, ISR_TEIF);
+    g_assert_true(qtest_get_irq(qts, DMA1_STREAM0_IRQ));
+
+    qtest_quit(qts);
+}
+
+static void test_usart_tx(void)
+{
+    const char msg[] = "hello";
+    char buf[sizeof(msg) - 1];
+    int sock_fd;
+    QTestState *qts = qtest_init_with_serial("-M st-nucleo-f411", &sock_fd);
+
+    qtest_writel(qts, RCC_APB2ENR, RCC_APB2ENR_USART1EN);
+    qtest_writel(qts, USART_CR1, USART_CR1_UE | USART_CR1_TE);
+    qtest_memwrite(qts, SRC_ADDR, msg, sizeof(buf));
+
+    /* USART1_TX is channel 4 of DMA2 stream 7 */
+    qtest_writel(qts, DMA2_BASE + DMA_SxPAR(7), USART_DR);
+    qtest_writel(qts, DMA2_BASE + DMA_SxM0AR(7), SRC_ADDR);
+    qtest_writel(qts, DMA2_BASE + DMA_SxNDTR(7), sizeof(buf));
+    qtest_writel(qts, DMA2_BASE + DMA_SxCR(7),
+                 SxCR_CHSEL(4) | SxCR_M2P | SxCR_MINC | SxCR_EN);
+    /* Nothing moves until the USART asks */
+    g_assert_cmpuint(qtest_readl(qts, DMA2_BASE + DMA_SxNDTR(7)), ==,
+                     sizeof(buf));
+
+    qtest_writel(qts, USART_CR3, USART_CR3_DMAT);
+    g_assert_cmpuint(qtest_readl(qts, DMA2_BASE + DMA_SxNDTR(7)), ==, 0);
+    g_assert_cmphex(qtest_readl(qts, DMA2_BASE + DMA_HISR), ==,
+                    (ISR_TCIF | ISR_HTIF) << ISR_STREAM7_SHIFT);
+
+    g_assert_cmpint(recv(sock_fd, buf, sizeof(buf), MSG_WAITALL), ==,
+                    sizeof(buf));
+    g_assert_cmpmem(buf, sizeof(buf), msg, sizeof(buf));
+
+    qtest_quit(qts);
+    close(sock_fd);
+}
+
+static void test_usart_rx_circular(void)
+{
+    uint8_t buf[4];
+    int sock_fd;
+    QTestState *qts = qtest_init_with_serial("-M st-nucleo-f411", &sock_fd);
+    gint64 end;
+
+    qtest_writel(qts, RCC_APB2ENR, RCC_APB2ENR_USART1EN);
+    qtest_writel(qts, USART_CR1, USART_CR1_UE | USART_CR1_RE);
+    qtest_writel(qts, USART_CR3, USART_CR3_DMAR);
+
+    /* USART1_RX is channel 4 of DMA2 stream 2, wrapping over 4 bytes */
+    qtest_writel(qts, DMA2_BASE + DMA_SxPAR(2), USART_DR);
+    qtest_writel(qts, DMA2_BASE + DMA_SxM0AR(2), DST_ADDR);
+    qtest_writel(qts, DMA2_BASE + DMA_SxNDTR(2), sizeof(buf));
+    qtest_writel(qts, DMA2_BASE + DMA_SxCR(2),
+                 SxCR_CHSEL(4) | SxCR_P2M | SxCR_MINC | SxCR_CIRC | SxCR_EN);
+
+    g_assert_cmpint(send(sock_fd, "abcdefg", 7, 0), ==, 7);
+
+    /* The stream wraps around and resumes with the last 3 bytes */
+    end = g_get_monotonic_time() + 10 * G_TIME_SPAN_SECOND;
+    for (;;) {
+        qtest_memread(qts, DST_ADDR, buf, sizeof(buf));
+        if (!memcmp(buf, "efgd", 4)) {
+            break;
+        }
+        g_assert_cmpint(g_get_monotonic_time(), <, end);
+        g_usleep(1000);
+    }
+    g_assert_cmpuint(qtest_readl(qts, DMA2_BASE + DMA_SxNDTR(2)), ==, 1);
+    g_assert_cmphex(qtest_readl(qts, DMA2_BASE + DMA_SxCR(2)) & SxCR_EN,
+                    ==, SxCR_EN);
+    g_assert_cmphex(qtest_readl(qts, DMA2_BASE + DMA_LISR), ==,
+                    (ISR_TCIF | ISR_HTIF) << ISR_STREAM2_SHIFT);
+
+    qtest_quit(qts);
+    close(sock_fd);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+
+    qtest_add_func("stm32f411/dma/mem-to-mem", test_mem_to_mem);
+    qtest_add_func("stm32f411/dma/mem-to-mem-words", test_mem_to_mem_words);
+    qtest_add_func("stm32f411/dma/mem-to-mem-dma1", test_mem_to_mem_dma1);
+    qtest_add_func("stm32f411/dma/usart-tx", test_usart_tx);
+    qtest_add_func("stm32f411/dma/usart-rx-circular", test_usart_rx_circular);
+
+    return g_test_run();
+}
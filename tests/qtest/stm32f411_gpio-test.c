@@ -0,0 +1,319 @@
+/*
+ * QTest testcase for the STM32F411 GPIO ports and their host link
+ *
+ * Copyright (c) 2023 Julien Combattelli <julien.combattelli@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/bswap.h"
+#include "libqtest.h"
+#include "qapi/qmp/qdict.h"
+
+#define GPIO_BASE(port) (0x40020000 + (port) * 0x400)
+#define GPIO_MODER 0x00
+#define GPIO_OTYPER 0x04
+#define GPIO_PUPDR 0x0c
+#define GPIO_IDR 0x10
+#define GPIO_ODR 0x14
+#define GPIO_BSRR 0x18
+#define GPIO_LCKR 0x1c
+
+#define GPIOA 0
+#define GPIOB 1
+#define GPIOC 2
+#define GPIOD 3
+#define NUM_PORTS 8
+
+#define SYSCFG_EXTICR4 (0x40013800 + 0x14)
+#define EXTI_IMR (0x40013c00 + 0x00)
+#define EXTI_RTSR (0x40013c00 + 0x08)
+#define EXTI_FTSR (0x40013c00 + 0x0c)
+#define EXTI_PR (0x40013c00 + 0x14)
+
+#define LINK_CMD_DRIVE 0x01
+#define LINK_CMD_RELEASE 0x02
+#define LINK_EVENT_OUTPUT 0x81
+#define LINK_EVENT_SIZE 16
+
+static uint32_t gpio_readl(QTestState *qts, int port, uint32_t reg)
+{
+    return qtest_readl(qts, GPIO_BASE(port) + reg);
+}
+
+static void gpio_writel(QTestState *qts, int port, uint32_t reg,
+                        uint32_t value)
+{
+    qtest_writel(qts, GPIO_BASE(port) + reg, value);
+}
+
+/* Drive a pin from outside the chip */
+static void gpio_set_input(QTestState *qts, int port, int pin, int level)
+{
+    g_autofree char *path = g_strdup_printf("/machine/soc[0]/gpio[%d]", port);
+
+    qtest_set_irq_in(qts, path, "input", pin, level);
+}
+
+static void test_reset(void)
+{
+    QTestState *qts = qtest_init("-M st-nucleo-f411");
+
+    /* The debug port pins */
+    g_assert_cmphex(gpio_readl(qts, GPIOA, GPIO_MODER), ==, 0xa8000000);
+    g_assert_cmphex(gpio_readl(qts, GPIOA, GPIO_PUPDR), ==, 0x64000000);
+    g_assert_cmphex(gpio_readl(qts, GPIOA, GPIO_IDR), ==, 0xa000);
+    g_assert_cmphex(gpio_readl(qts, GPIOB, GPIO_MODER), ==, 0x00000280);
+    g_assert_cmphex(gpio_readl(qts, GPIOB, GPIO_PUPDR), ==, 0x00000100);
+    g_assert_cmphex(gpio_readl(qts, GPIOB, GPIO_IDR), ==, 0x0010);
+    g_assert_cmphex(gpio_readl(qts, GPIOC, GPIO_MODER), ==, 0);
+    g_assert_cmphex(gpio_readl(qts, GPIOC, GPIO_IDR), ==, 0);
+
+    qtest_quit(qts);
+}
+
+static void test_output(void)
+{
+    QTestState *qts = qtest_init("-M st-nucleo-f411");
+
+    /* Pins 0 and 1 are outputs, 2 is an input */
+    gpio_writel(qts, GPIOC, GPIO_MODER, 0x5);
+    gpio_writel(qts, GPIOC, GPIO_ODR, 0x7);
+    g_assert_cmphex(gpio_readl(qts, GPIOC, GPIO_IDR), ==, 0x3);
+
+    /* BSRR sets take priority over resets */
+    gpio_writel(qts, GPIOC, GPIO_BSRR, 0x00030002);
+    g_assert_cmphex(gpio_readl(qts, GPIOC, GPIO_ODR), ==, 0x6);
+    g_assert_cmphex(gpio_readl(qts, GPIOC, GPIO_IDR), ==, 0x2);
+
+    /* An open-drain output set to 1 is left to the pull-up */
+    gpio_writel(qts, GPIOC, GPIO_OTYPER, 0x2);
+    g_assert_cmphex(gpio_readl(qts, GPIOC, GPIO_IDR), ==, 0);
+    gpio_writel(qts, GPIOC, GPIO_PUPDR, 0x4);
+    g_assert_cmphex(gpio_readl(qts, GPIOC, GPIO_IDR), ==, 0x2);
+    gpio_set_input(qts, GPIOC, 1, 0);
+    g_assert_cmphex(gpio_readl(qts, GPIOC, GPIO_IDR), ==, 0);
+
+    /* Analog pins read 0 */
+    gpio_writel(qts, GPIOC, GPIO_PUPDR, 0x10);
+    g_assert_cmphex(gpio_readl(qts, GPIOC, GPIO_IDR), ==, 0x4);
+    gpio_writel(qts, GPIOC, GPIO_MODER, 0x35);
+    g_assert_cmphex(gpio_readl(qts, GPIOC, GPIO_IDR), ==, 0);
+
+    qtest_quit(qts);
+}
+
+static void test_lock(void)
+{
+    QTestState *qts = qtest_init("-M st-nucleo-f411");
+
+    /* A broken sequence does not lock */
+    gpio_writel(qts, GPIOD, GPIO_LCKR, 0x10001);
+    gpio_writel(qts, GPIOD, GPIO_LCKR, 0x00003);
+    gpio_writel(qts, GPIOD, GPIO_LCKR, 0x10001);
+    g_assert_cmphex(gpio_readl(qts, GPIOD, GPIO_LCKR), ==, 0x00001);
+
+    gpio_writel(qts, GPIOD, GPIO_LCKR, 0x10001);
+    gpio_writel(qts, GPIOD, GPIO_LCKR, 0x00001);
+    gpio_writel(qts, GPIOD, GPIO_LCKR, 0x10001);
+    g_assert_cmphex(gpio_readl(qts, GPIOD, GPIO_LCKR), ==, 0x10001);
+
+    /* Pin 0 keeps its configuration until reset, ODR is not locked */
+    gpio_writel(qts, GPIOD, GPIO_MODER, 0xf);
+    g_assert_cmphex(gpio_readl(qts, GPIOD, GPIO_MODER), ==, 0xc);
+    gpio_writel(qts, GPIOD, GPIO_ODR, 0x1);
+    g_assert_cmphex(gpio_readl(qts, GPIOD, GPIO_ODR), ==, 0x1);
+    gpio_writel(qts, GPIOD, GPIO_LCKR, 0);
+    g_assert_cmphex(gpio_readl(qts, GPIOD, GPIO_LCKR), ==, 0x10001);
+
+    qobject_unref(qtest_qmp(qts, "{ 'execute': 'system_reset' }"));
+    qtest_qmp_eventwait(qts, "RESET");
+    g_assert_cmphex(gpio_readl(qts, GPIOD, GPIO_LCKR), ==, 0);
+    gpio_writel(qts, GPIOD, GPIO_MODER, 0x3);
+    g_assert_cmphex(gpio_readl(qts, GPIOD, GPIO_MODER), ==, 0x3);
+
+    qtest_quit(qts);
+}
+
+static void test_exti(void)
+{
+    QTestState *qts = qtest_init("-M st-nucleo-f411");
+
+    /* EXTI13 follows PC13, on the rising edge */
+    qtest_writel(qts, SYSCFG_EXTICR4, GPIOC << 4);
+    qtest_writel(qts, EXTI_IMR, 1 << 13);
+    qtest_writel(qts, EXTI_RTSR, 1 << 13);
+
+    /* Other ports do not reach it */
+    gpio_set_input(qts, GPIOB, 13, 1);
+    g_assert_cmphex(qtest_readl(qts, EXTI_PR), ==, 0);
+
+    gpio_set_input(qts, GPIOC, 13, 1);
+    g_assert_cmphex(gpio_readl(qts, GPIOC, GPIO_IDR), ==, 1 << 13);
+    g_assert_cmphex(qtest_readl(qts, EXTI_PR), ==, 1 << 13);
+    qtest_writel(qts, EXTI_PR, 1 << 13);
+    g_assert_cmphex(qtest_readl(qts, EXTI_PR), ==, 0);
+
+    /* Not on the falling one */
+    gpio_set_input(qts, GPIOC, 13, 0);
+    g_assert_cmphex(qtest_readl(qts, EXTI_PR), ==, 0);
+
+    /* Driven by the output stage, on both edges */
+    qtest_writel(qts, EXTI_FTSR, 1 << 13);
+    gpio_writel(qts, GPIOC, GPIO_MODER, 1 << 26);
+    gpio_writel(qts, GPIOC, GPIO_BSRR, 1 << 13);
+    g_assert_cmphex(qtest_readl(qts, EXTI_PR), ==, 1 << 13);
+    qtest_writel(qts, EXTI_PR, 1 << 13);
+    gpio_writel(qts, GPIOC, GPIO_BSRR, 1 << 29);
+    g_assert_cmphex(qtest_readl(qts, EXTI_PR), ==, 1 << 13);
+
+    qtest_quit(qts);
+}
+
+/*
+ * Start QEMU with the GPIO link connected to a socket of ours, and read the
+ * state of every port it sends when connecting.
+ */
+static QTestState *link_init(int *sock_fd)
+{
+    g_autofree char *dir = g_dir_make_tmp("qtest-stm32f411-gpio-XXXXXX", NULL);
+    g_autofree char *path = g_strdup_printf("%s/sock", dir);
+    uint8_t event[LINK_EVENT_SIZE];
+    QTestState *qts;
+    int listen_fd;
+    int i;
+
+    listen_fd = qtest_socket_server(path);
+    qts = qtest_initf("-M st-nucleo-f411 -chardev socket,id=gpio,path=%s "
+                      "-global stm32f4xx-gpio-link.chardev=gpio", path);
+    *sock_fd = accept(listen_fd, NULL, NULL);
+    g_assert_cmpint(*sock_fd, >=, 0);
+    close(listen_fd);
+    unlink(path);
+    rmdir(dir);
+
+    for (i = 0; i < NUM_PORTS; i++) {
+        g_assert_cmpint(recv(*sock_fd, event, sizeof(event), MSG_WAITALL),
+                        ==, sizeof(event));
+        g_assert_cmphex(event[0], ==, LINK_EVENT_OUTPUT);
+        g_assert_cmpuint(event[1], ==, i);
+    }
+    return qts;
+}
+
+static void link_command(uint8_t *cmd, uint8_t command, uint8_t port,
+                         uint16_t mask, uint16_t level)
+{
+    memset(cmd, 0, 8);
+    cmd[0] = command;
+    cmd[1] = port;
+    stw_le_p(&cmd[2], mask);
+    stw_le_p(&cmd[4], level);
+}
+
+/* Commands are applied asynchronously, wait for them to show up in IDR */
+static void link_wait_idr(QTestState *qts, int port, uint32_t idr)
+{
+    gint64 end = g_get_monotonic_time() + 10 * G_TIME_SPAN_SECOND;
+
+    while (gpio_readl(qts, port, GPIO_IDR) != idr) {
+        g_assert_cmpint(g_get_monotonic_time(), <, end);
+        g_usleep(1000);
+    }
+}
+
+static void test_link_commands(void)
+{
+    uint8_t cmd[3][8];
+    int sock_fd;
+    QTestState *qts = link_init(&sock_fd);
+
+    /* Several ports changed by a single message, GPIOD last */
+    link_command(cmd[0], LINK_CMD_DRIVE, GPIOC, 0x00ff, 0x0055);
+    link_command(cmd[1], LINK_CMD_RELEASE, GPIOC, 0x0003, 0);
+    link_command(cmd[2], LINK_CMD_DRIVE, GPIOD, 0x8000, 0x8000);
+    g_assert_cmpint(send(sock_fd, cmd, sizeof(cmd), 0), ==, sizeof(cmd));
+    link_wait_idr(qts, GPIOD, 0x8000);
+    g_assert_cmphex(gpio_readl(qts, GPIOC, GPIO_IDR), ==, 0x0054);
+
+    /* A command split across messages */
+    link_command(cmd[0], LINK_CMD_RELEASE, GPIOD, 0xffff, 0);
+    g_assert_cmpint(send(sock_fd, cmd[0], 3, 0), ==, 3);
+    g_usleep(10000);
+    g_assert_cmpint(send(sock_fd, cmd[0] + 3, 5, 0), ==, 5);
+    link_wait_idr(qts, GPIOD, 0);
+
+    qtest_quit(qts);
+    close(sock_fd);
+}
+
+static void test_link_events(void)
+{
+    uint8_t event[LINK_EVENT_SIZE];
+    int sock_fd;
+    QTestState *qts = link_init(&sock_fd);
+    int64_t now;
+
+    /* Events carry the virtual time of the change */
+    now = qtest_clock_step(qts, 1000);
+    gpio_writel(qts, GPIOC, GPIO_MODER, 0x5);
+    g_assert_cmpint(recv(sock_fd, event, sizeof(event), MSG_WAITALL),
+                    ==, sizeof(event));
+    g_assert_cmphex(event[0], ==, LINK_EVENT_OUTPUT);
+    g_assert_cmpuint(event[1], ==, GPIOC);
+    g_assert_cmphex(lduw_le_p(&event[2]), ==, 0);
+    g_assert_cmphex(lduw_le_p(&event[4]), ==, 0x3);
+    g_assert_cmpuint(ldq_le_p(&event[8]), ==, now);
+
+    now = qtest_clock_step(qts, 1000);
+    gpio_writel(qts, GPIOC, GPIO_BSRR, 0x1);
+    g_assert_cmpint(recv(sock_fd, event, sizeof(event), MSG_WAITALL),
+                    ==, sizeof(event));
+    g_assert_cmpuint(event[1], ==, GPIOC);
+    g_assert_cmphex(lduw_le_p(&event[2]), ==, 0x1);
+    g_assert_cmphex(lduw_le_p(&event[4]), ==, 0x3);
+    g_assert_cmpuint(ldq_le_p(&event[8]), ==, now);
+
+    /* Driving an input is not an output change */
+    gpio_set_input(qts, GPIOC, 5, 1);
+    gpio_writel(qts, GPIOD, GPIO_ODR, 0x8);
+    g_assert_cmpint(recv(sock_fd, event, sizeof(event), MSG_WAITALL),
+                    ==, sizeof(event));
+    g_assert_cmpuint(event[1], ==, GPIOD);
+    g_assert_cmphex(lduw_le_p(&event[2]), ==, 0x8);
+    g_assert_cmphex(lduw_le_p(&event[4]), ==, 0);
+
+    qtest_quit(qts);
+    close(sock_fd);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+
+    qtest_add_func("stm32f411/gpio/reset", test_reset);
+    qtest_add_func("stm32f411/gpio/output", test_output);
+    qtest_add_func("stm32f411/gpio/lock", test_lock);
+    qtest_add_func("stm32f411/gpio/exti", test_exti);
+    qtest_add_func("stm32f411/gpio/link-commands", test_link_commands);
+    qtest_add_func("stm32f411/gpio/link-events", test_link_events);
+
+    return g_test_run();
+}
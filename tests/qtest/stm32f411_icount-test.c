@@ -0,0 +1,100 @@
+/*
+ * QTest testcase for -icount cycles=on on the STM32F411
+ *
+ * Copyright (c) 2023 Julien Combattelli <julien.combattelli@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "qemu/osdep.h"
+#include "libqtest.h"
+
+#define COUNTER_ADDR 0x20000000
+
+/*
+ * Run from flash with 7 wait states and the instruction cache off, so that
+ * entering any TB costs more than the icount budget left by a SysTick
+ * counting down from 3 at the CPU clock: every TB has to be cut or run
+ * past its deadline.
+ */
+static const uint8_t kernel_flash_wait_states[] = {
+    0x00, 0x00, 0x02, 0x20,                 /* Stack top address */
+    0x09, 0x00, 0x00, 0x00,                 /* Reset handler address */
+    0x43, 0xf6, 0x00, 0x40,                 /* movw r0, #0x3c00 */
+    0xc4, 0xf2, 0x02, 0x00,                 /* movt r0, #0x4002 FLASH_ACR */
+    0x07, 0x21,                             /* movs r1, #7 LATENCY */
+    0x01, 0x60,                             /* str  r1, [r0] */
+    0x4e, 0xf2, 0x10, 0x00,                 /* movw r0, #0xe010 */
+    0xce, 0xf2, 0x00, 0x00,                 /* movt r0, #0xe000 SYST_CSR */
+    0x03, 0x21,                             /* movs r1, #3 */
+    0x41, 0x60,                             /* str  r1, [r0, #4] SYST_RVR */
+    0x05, 0x21,                             /* movs r1, #5 CLKSOURCE|ENABLE */
+    0x01, 0x60,                             /* str  r1, [r0] */
+    0x00, 0x20,                             /* movs r0, #0 */
+    0xc2, 0xf2, 0x00, 0x00,                 /* movt r0, #0x2000 */
+    0x00, 0x21,                             /* movs r1, #0 */
+    0x01, 0x31,                             /* adds r1, #1 */
+    0x01, 0x60,                             /* str  r1, [r0] */
+    0xfc, 0xe7,                             /* b    .-4 */
+};
+
+static void test_flash_wait_states(void)
+{
+    g_autofree char *codetmp = NULL;
+    QTestState *qts;
+    uint32_t count = 0;
+    gint64 end;
+    int fd;
+
+    fd = g_file_open_tmp("qtest-stm32f411-icount-XXXXXX", &codetmp, NULL);
+    g_assert(fd != -1);
+    g_assert(write(fd, kernel_flash_wait_states,
+                   sizeof(kernel_flash_wait_states)) ==
+             sizeof(kernel_flash_wait_states));
+    close(fd);
+
+    qts = qtest_initf("-M st-nucleo-f411 -kernel %s -accel tcg "
+                      "-icount shift=0,cycles=on", codetmp);
+    unlink(codetmp);
+
+    /* The loop must keep running, not retranslate TBs that never fit */
+    end = g_get_monotonic_time() + 60 * G_TIME_SPAN_SECOND;
+    while (g_get_monotonic_time() < end) {
+        count = qtest_readl(qts, COUNTER_ADDR);
+        if (count > 1000) {
+            break;
+        }
+        g_usleep(10000);
+    }
+    g_assert_cmpuint(count, >, 1000);
+
+    qtest_quit(qts);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+
+    if (qtest_has_accel("tcg")) {
+        qtest_add_func("stm32f411/icount/flash-wait-states",
+                       test_flash_wait_states);
+    }
+
+    return g_test_run();
+}
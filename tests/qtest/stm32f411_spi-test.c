@@ -0,0 +1,270 @@
+/*
+ * QTest testcase for the STM32F411 SPI interrupts and DMA
+ *
+ * Copyright (c) 2023 Julien Combattelli <julien.combattelli@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "qemu/osdep.h"
+#include "libqtest.h"
+
+#define RCC_APB2ENR 0x40023844
+#define RCC_APB2ENR_SPI1EN (1 << 12)
+
+/* Nothing is connected to the bus of SPI1, every frame reads as 0 */
+#define SPI1_BASE 0x40013000
+#define SPI_CR1 (SPI1_BASE + 0x00)
+#define SPI_CR2 (SPI1_BASE + 0x04)
+#define SPI_SR (SPI1_BASE + 0x08)
+#define SPI_DR (SPI1_BASE + 0x0c)
+#define SPI_CR1_RXONLY (1 << 10)
+#define SPI_CR1_SPE (1 << 6)
+#define SPI_CR1_MSTR (1 << 2)
+#define SPI_CR2_TXEIE (1 << 7)
+#define SPI_CR2_RXNEIE (1 << 6)
+#define SPI_CR2_ERRIE (1 << 5)
+#define SPI_CR2_TXDMAEN (1 << 1)
+#define SPI_CR2_RXDMAEN (1 << 0)
+#define SPI_SR_OVR (1 << 6)
+#define SPI_SR_TXE (1 << 1)
+#define SPI_SR_RXNE (1 << 0)
+#define SPI_SR_MASK (SPI_SR_OVR | SPI_SR_TXE | SPI_SR_RXNE)
+#define SPI1_IRQ 35
+
+/* SPI1_RX is channel 3 of DMA2 stream 0, SPI1_TX of DMA2 stream 3 */
+#define DMA2_BASE 0x40026400
+#define DMA_LISR (DMA2_BASE + 0x00)
+#define DMA_SxCR(n) (DMA2_BASE + 0x10 + (n) * 0x18)
+#define DMA_SxNDTR(n) (DMA2_BASE + 0x14 + (n) * 0x18)
+#define DMA_SxPAR(n) (DMA2_BASE + 0x18 + (n) * 0x18)
+#define DMA_SxM0AR(n) (DMA2_BASE + 0x1c + (n) * 0x18)
+#define SxCR_EN (1 << 0)
+#define SxCR_TCIE (1 << 4)
+#define SxCR_P2M (0 << 6)
+#define SxCR_M2P (1 << 6)
+#define SxCR_MINC (1 << 10)
+#define SxCR_CHSEL(n) ((n) << 25)
+#define ISR_HTIF (1 << 4)
+#define ISR_TCIF (1 << 5)
+#define ISR_STREAM3_SHIFT 22
+#define DMA2_STREAM0_IRQ 56
+#define DMA2_STREAM3_IRQ 59
+#define SPI_RX_STREAM 0
+#define SPI_TX_STREAM 3
+
+#define SRC_ADDR 0x20000000
+#define DST_ADDR 0x20001000
+
+static QTestState *spi_init(void)
+{
+    QTestState *qts = qtest_init("-M st-nucleo-f411");
+
+    qtest_irq_intercept_in(qts, "/machine/soc[0]/armv7m/nvic");
+    qtest_writel(qts, RCC_APB2ENR, RCC_APB2ENR_SPI1EN);
+    return qts;
+}
+
+static void spi_start_stream(QTestState *qts, int n, uint32_t dir,
+                             uint32_t addr, uint32_t len)
+{
+    qtest_writel(qts, DMA_SxPAR(n), SPI_DR);
+    qtest_writel(qts, DMA_SxM0AR(n), addr);
+    qtest_writel(qts, DMA_SxNDTR(n), len);
+    qtest_writel(qts, DMA_SxCR(n),
+                 SxCR_CHSEL(3) | dir | SxCR_MINC | SxCR_TCIE | SxCR_EN);
+}
+
+static void test_irq(void)
+{
+    QTestState *qts = spi_init();
+
+    /* TXE is set out of reset */
+    g_assert_cmphex(qtest_readl(qts, SPI_SR) & SPI_SR_MASK, ==, SPI_SR_TXE);
+    qtest_writel(qts, SPI_CR2, SPI_CR2_TXEIE);
+    g_assert_true(qtest_get_irq(qts, SPI1_IRQ));
+    qtest_writel(qts, SPI_CR2, SPI_CR2_RXNEIE | SPI_CR2_ERRIE);
+    g_assert_false(qtest_get_irq(qts, SPI1_IRQ));
+
+    qtest_writel(qts, SPI_CR1, SPI_CR1_MSTR | SPI_CR1_SPE);
+    qtest_writel(qts, SPI_DR, 0x55);
+    g_assert_true(qtest_get_irq(qts, SPI1_IRQ));
+
+    /* The second frame overruns the first one, which is kept */
+    qtest_writel(qts, SPI_DR, 0xaa);
+    g_assert_cmphex(qtest_readl(qts, SPI_SR) & SPI_SR_MASK, ==,
+                    SPI_SR_OVR | SPI_SR_TXE | SPI_SR_RXNE);
+    g_assert_cmphex(qtest_readl(qts, SPI_DR), ==, 0);
+    g_assert_true(qtest_get_irq(qts, SPI1_IRQ));
+
+    /* OVR is cleared by reading DR then SR */
+    g_assert_cmphex(qtest_readl(qts, SPI_SR) & SPI_SR_MASK, ==,
+                    SPI_SR_OVR | SPI_SR_TXE);
+    g_assert_false(qtest_get_irq(qts, SPI1_IRQ));
+    g_assert_cmphex(qtest_readl(qts, SPI_SR) & SPI_SR_MASK, ==, SPI_SR_TXE);
+
+    qtest_quit(qts);
+}
+
+static void test_rx_only(void)
+{
+    QTestState *qts = spi_init();
+    int i;
+
+    qtest_writel(qts, SPI_CR2, SPI_CR2_RXNEIE | SPI_CR2_ERRIE);
+    qtest_writel(qts, SPI_CR1, SPI_CR1_RXONLY | SPI_CR1_MSTR | SPI_CR1_SPE);
+
+    /* The next frame is clocked in as soon as the previous one is read */
+    for (i = 0; i < 4; i++) {
+        g_assert_true(qtest_get_irq(qts, SPI1_IRQ));
+        g_assert_cmphex(qtest_readl(qts, SPI_SR) & SPI_SR_MASK, ==,
+                        SPI_SR_TXE | SPI_SR_RXNE);
+        g_assert_cmphex(qtest_readl(qts, SPI_DR), ==, 0);
+    }
+
+    /* Disabling the SPI drops the frame received ahead */
+    qtest_writel(qts, SPI_CR1, SPI_CR1_RXONLY | SPI_CR1_MSTR);
+    g_assert_cmphex(qtest_readl(qts, SPI_SR) & SPI_SR_MASK, ==, SPI_SR_TXE);
+    g_assert_false(qtest_get_irq(qts, SPI1_IRQ));
+
+    qtest_quit(qts);
+}
+
+static void test_dma_tx(void)
+{
+    QTestState *qts = spi_init();
+    uint8_t src[16];
+    int i;
+
+    for (i = 0; i < sizeof(src); i++) {
+        src[i] = i;
+    }
+    qtest_memwrite(qts, SRC_ADDR, src, sizeof(src));
+
+    qtest_writel(qts, SPI_CR1, SPI_CR1_MSTR | SPI_CR1_SPE);
+    spi_start_stream(qts, SPI_TX_STREAM, SxCR_M2P, SRC_ADDR, sizeof(src));
+    /* Nothing moves until the SPI asks */
+    g_assert_cmpuint(qtest_readl(qts, DMA_SxNDTR(SPI_TX_STREAM)), ==,
+                     sizeof(src));
+
+    qtest_writel(qts, SPI_CR2, SPI_CR2_TXDMAEN);
+    g_assert_cmpuint(qtest_readl(qts, DMA_SxNDTR(SPI_TX_STREAM)), ==, 0);
+    g_assert_cmphex(qtest_readl(qts, DMA_LISR), ==,
+                    (ISR_TCIF | ISR_HTIF) << ISR_STREAM3_SHIFT);
+    g_assert_true(qtest_get_irq(qts, DMA2_STREAM3_IRQ));
+
+    /* Nobody read what came back: the first frame is kept, then overrun */
+    g_assert_cmphex(qtest_readl(qts, SPI_SR) & SPI_SR_MASK, ==,
+                    SPI_SR_OVR | SPI_SR_TXE | SPI_SR_RXNE);
+
+    qtest_quit(qts);
+}
+
+static void test_dma_rx_only(void)
+{
+    QTestState *qts = spi_init();
+    uint8_t buf[33];
+    int i;
+
+    memset(buf, 0xff, sizeof(buf));
+    qtest_memwrite(qts, DST_ADDR, buf, sizeof(buf));
+
+    spi_start_stream(qts, SPI_RX_STREAM, SxCR_P2M, DST_ADDR,
+                     sizeof(buf) - 1);
+    qtest_writel(qts, SPI_CR2, SPI_CR2_RXDMAEN);
+    g_assert_cmpuint(qtest_readl(qts, DMA_SxNDTR(SPI_RX_STREAM)), ==,
+                     sizeof(buf) - 1);
+
+    /* Frames are clocked in for as long as the stream asks for more */
+    qtest_writel(qts, SPI_CR1, SPI_CR1_RXONLY | SPI_CR1_MSTR | SPI_CR1_SPE);
+    g_assert_cmpuint(qtest_readl(qts, DMA_SxNDTR(SPI_RX_STREAM)), ==, 0);
+    g_assert_cmphex(qtest_readl(qts, DMA_LISR), ==, ISR_TCIF | ISR_HTIF);
+    g_assert_true(qtest_get_irq(qts, DMA2_STREAM0_IRQ));
+
+    qtest_memread(qts, DST_ADDR, buf, sizeof(buf));
+    for (i = 0; i < sizeof(buf) - 1; i++) {
+        g_assert_cmphex(buf[i], ==, 0);
+    }
+    g_assert_cmphex(buf[sizeof(buf) - 1], ==, 0xff);
+
+    /* Once the stream completed, no frame is waiting or lost */
+    g_assert_cmphex(qtest_readl(qts, SPI_SR) & SPI_SR_MASK, ==, SPI_SR_TXE);
+
+    qtest_quit(qts);
+}
+
+static void test_dma_full_duplex(void)
+{
+    QTestState *qts = spi_init();
+    uint8_t buf[101];
+    gint64 end;
+    int i;
+
+    memset(buf, 0xff, sizeof(buf));
+    qtest_memwrite(qts, DST_ADDR, buf, sizeof(buf));
+    for (i = 0; i < sizeof(buf); i++) {
+        buf[i] = i;
+    }
+    qtest_memwrite(qts, SRC_ADDR, buf, sizeof(buf));
+
+    /*
+     * More frames than the RX queue holds: transmission has to wait for
+     * the RX stream to catch up, rather than overrunning.
+     */
+    qtest_writel(qts, SPI_CR1, SPI_CR1_MSTR | SPI_CR1_SPE);
+    spi_start_stream(qts, SPI_RX_STREAM, SxCR_P2M, DST_ADDR,
+                     sizeof(buf) - 1);
+    spi_start_stream(qts, SPI_TX_STREAM, SxCR_M2P, SRC_ADDR,
+                     sizeof(buf) - 1);
+    qtest_writel(qts, SPI_CR2, SPI_CR2_TXDMAEN | SPI_CR2_RXDMAEN);
+
+    end = g_get_monotonic_time() + 10 * G_TIME_SPAN_SECOND;
+    while (qtest_readl(qts, DMA_SxNDTR(SPI_RX_STREAM))) {
+        g_assert_cmpint(g_get_monotonic_time(), <, end);
+        g_usleep(1000);
+    }
+    g_assert_cmpuint(qtest_readl(qts, DMA_SxNDTR(SPI_TX_STREAM)), ==, 0);
+    g_assert_cmphex(qtest_readl(qts, DMA_LISR), ==,
+                    (ISR_TCIF | ISR_HTIF) |
+                    (ISR_TCIF | ISR_HTIF) << ISR_STREAM3_SHIFT);
+    g_assert_true(qtest_get_irq(qts, DMA2_STREAM0_IRQ));
+    g_assert_true(qtest_get_irq(qts, DMA2_STREAM3_IRQ));
+
+    qtest_memread(qts, DST_ADDR, buf, sizeof(buf));
+    for (i = 0; i < sizeof(buf) - 1; i++) {
+        g_assert_cmphex(buf[i], ==, 0);
+    }
+    g_assert_cmphex(buf[sizeof(buf) - 1], ==, 0xff);
+    g_assert_cmphex(qtest_readl(qts, SPI_SR) & SPI_SR_MASK, ==, SPI_SR_TXE);
+
+    qtest_quit(qts);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+
+    qtest_add_func("stm32f411/spi/irq", test_irq);
+    qtest_add_func("stm32f411/spi/rx-only", test_rx_only);
+    qtest_add_func("stm32f411/spi/dma-tx", test_dma_tx);
+    qtest_add_func("stm32f411/spi/dma-rx-only", test_dma_rx_only);
+    qtest_add_func("stm32f411/spi/dma-full-duplex", test_dma_full_duplex);
+
+    return g_test_run();
+}
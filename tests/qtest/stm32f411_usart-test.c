@@ -0,0 +1,267 @@
+/*
+ * QTest testcase for the STM32F411 USART
+ *
+ * Copyright (c) 2023 Julien Combattelli <julien.combattelli@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "qemu/osdep.h"
+#include "libqtest.h"
+
+#define RCC_APB2ENR 0x40023844
+#define RCC_APB2ENR_USART1EN (1 << 4)
+
+/* USART1 is connected to the first -serial */
+#define USART1_BASE 0x40011000
+#define USART_SR (USART1_BASE + 0x00)
+#define USART_DR (USART1_BASE + 0x04)
+#define USART_BRR (USART1_BASE + 0x08)
+#define USART_CR1 (USART1_BASE + 0x0c)
+#define USART1_IRQ 37
+
+#define SR_TXE (1 << 7)
+#define SR_TC (1 << 6)
+#define SR_RXNE (1 << 5)
+#define SR_IDLE (1 << 4)
+#define SR_ORE (1 << 3)
+
+#define CR1_UE (1 << 13)
+#define CR1_M (1 << 12)
+#define CR1_TCIE (1 << 6)
+#define CR1_RXNEIE (1 << 5)
+#define CR1_IDLEIE (1 << 4)
+#define CR1_TE (1 << 3)
+#define CR1_RE (1 << 2)
+
+/* 1Mbaud from the 16MHz HSI: 10 bits of 1us per 8N1 character */
+#define BRR_1MBAUD 16
+#define CHAR_NS 10000
+
+static QTestState *usart_init(const char *extra_args, int *sock_fd)
+{
+    g_autofree char *args = g_strdup_printf("-M st-nucleo-f411 %s",
+                                            extra_args);
+    QTestState *qts = qtest_init_with_serial(args, sock_fd);
+
+    qtest_irq_intercept_in(qts, "/machine/soc[0]/armv7m/nvic");
+    qtest_writel(qts, RCC_APB2ENR, RCC_APB2ENR_USART1EN);
+    return qts;
+}
+
+static void usart_send(int sock_fd, const char *str)
+{
+    size_t len = strlen(str);
+
+    g_assert_cmpint(send(sock_fd, str, len, 0), ==, len);
+}
+
+static void usart_recv(int sock_fd, char *buf, size_t len)
+{
+    ssize_t ret;
+
+    while (len) {
+        ret = recv(sock_fd, buf, len, 0);
+        g_assert_cmpint(ret, >, 0);
+        buf += ret;
+        len -= ret;
+    }
+}
+
+/*
+ * Let QEMU pick up what was sent on the socket, moving virtual time one
+ * character at a time when the USART is paced, until RXNE is set.
+ */
+static void usart_wait_rxne(QTestState *qts, int64_t step)
+{
+    gint64 end = g_get_monotonic_time() + 10 * G_TIME_SPAN_SECOND;
+
+    while (!(qtest_readl(qts, USART_SR) & SR_RXNE)) {
+        g_assert_cmpint(g_get_monotonic_time(), <, end);
+        if (step) {
+            qtest_clock_step(qts, step);
+        } else {
+            g_usleep(1000);
+        }
+    }
+}
+
+static void test_rx_burst(void)
+{
+    int sock_fd;
+    QTestState *qts = usart_init("", &sock_fd);
+
+    /* No BRR: characters are handed over as soon as DR is read */
+    qtest_writel(qts, USART_CR1, CR1_UE | CR1_RE | CR1_RXNEIE);
+    usart_send(sock_fd, "hello");
+    usart_wait_rxne(qts, 0);
+    g_assert_true(qtest_get_irq(qts, USART1_IRQ));
+
+    g_assert_cmphex(qtest_readl(qts, USART_SR), ==, SR_TXE | SR_TC | SR_RXNE);
+    g_assert_cmphex(qtest_readl(qts, USART_DR), ==, 'h');
+    g_assert_cmphex(qtest_readl(qts, USART_DR), ==, 'e');
+    g_assert_cmphex(qtest_readl(qts, USART_DR), ==, 'l');
+    g_assert_cmphex(qtest_readl(qts, USART_DR), ==, 'l');
+
+    /* The burst ends with the last character */
+    g_assert_cmphex(qtest_readl(qts, USART_SR), ==,
+                    SR_TXE | SR_TC | SR_RXNE | SR_IDLE);
+    g_assert_cmphex(qtest_readl(qts, USART_DR), ==, 'o');
+    g_assert_cmphex(qtest_readl(qts, USART_SR), ==, SR_TXE | SR_TC);
+    g_assert_false(qtest_get_irq(qts, USART1_IRQ));
+
+    qtest_quit(qts);
+    close(sock_fd);
+}
+
+static void test_rx_paced(void)
+{
+    int sock_fd;
+    QTestState *qts = usart_init("", &sock_fd);
+
+    qtest_writel(qts, USART_BRR, BRR_1MBAUD);
+    qtest_writel(qts, USART_CR1, CR1_UE | CR1_RE | CR1_IDLEIE);
+    usart_send(sock_fd, "xyz");
+    usart_wait_rxne(qts, CHAR_NS);
+    /* RXNEIE is clear */
+    g_assert_false(qtest_get_irq(qts, USART1_IRQ));
+
+    /* One character per character time, read in time */
+    g_assert_cmphex(qtest_readl(qts, USART_DR), ==, 'x');
+    qtest_clock_step(qts, CHAR_NS - 1);
+    g_assert_cmphex(qtest_readl(qts, USART_SR), ==, SR_TXE | SR_TC);
+    qtest_clock_step(qts, 1);
+    g_assert_cmphex(qtest_readl(qts, USART_SR), ==, SR_TXE | SR_TC | SR_RXNE);
+    g_assert_cmphex(qtest_readl(qts, USART_DR), ==, 'y');
+    qtest_clock_step(qts, CHAR_NS);
+    g_assert_cmphex(qtest_readl(qts, USART_DR), ==, 'z');
+    g_assert_false(qtest_get_irq(qts, USART1_IRQ));
+
+    /* Then an idle frame */
+    qtest_clock_step(qts, CHAR_NS);
+    g_assert_cmphex(qtest_readl(qts, USART_SR), ==, SR_TXE | SR_TC | SR_IDLE);
+    g_assert_true(qtest_get_irq(qts, USART1_IRQ));
+    qtest_readl(qts, USART_DR);
+    g_assert_cmphex(qtest_readl(qts, USART_SR), ==, SR_TXE | SR_TC);
+    g_assert_false(qtest_get_irq(qts, USART1_IRQ));
+
+    /* Only once per burst */
+    qtest_clock_step(qts, 10 * CHAR_NS);
+    g_assert_cmphex(qtest_readl(qts, USART_SR), ==, SR_TXE | SR_TC);
+
+    qtest_quit(qts);
+    close(sock_fd);
+}
+
+static void test_rx_overrun(void)
+{
+    int sock_fd;
+    QTestState *qts = usart_init("", &sock_fd);
+
+    qtest_writel(qts, USART_BRR, BRR_1MBAUD);
+    qtest_writel(qts, USART_CR1, CR1_UE | CR1_RE | CR1_RXNEIE);
+    usart_send(sock_fd, "abc");
+    usart_wait_rxne(qts, CHAR_NS);
+    g_assert_true(qtest_get_irq(qts, USART1_IRQ));
+
+    /* DR is not read: the next characters are lost */
+    qtest_clock_step(qts, CHAR_NS);
+    g_assert_cmphex(qtest_readl(qts, USART_SR), ==,
+                    SR_TXE | SR_TC | SR_RXNE | SR_ORE);
+    qtest_clock_step(qts, 2 * CHAR_NS);
+    g_assert_cmphex(qtest_readl(qts, USART_SR), ==,
+                    SR_TXE | SR_TC | SR_RXNE | SR_IDLE | SR_ORE);
+
+    /* Reading SR then DR clears them all, and DR kept the first one */
+    g_assert_cmphex(qtest_readl(qts, USART_DR), ==, 'a');
+    g_assert_cmphex(qtest_readl(qts, USART_SR), ==, SR_TXE | SR_TC);
+    g_assert_false(qtest_get_irq(qts, USART1_IRQ));
+
+    qtest_quit(qts);
+    close(sock_fd);
+}
+
+static void test_tx(void)
+{
+    int sock_fd;
+    QTestState *qts = usart_init("", &sock_fd);
+    char buf[3];
+
+    qtest_writel(qts, USART_CR1, CR1_UE | CR1_TE | CR1_M);
+    qtest_writel(qts, USART_DR, 'o');
+    qtest_writel(qts, USART_DR, 'k');
+    /* The 9th bit does not make it to the chardev */
+    qtest_writel(qts, USART_DR, 0x100 | '!');
+    usart_recv(sock_fd, buf, sizeof(buf));
+    g_assert_cmpmem(buf, sizeof(buf), "ok!", 3);
+
+    /* Sent once the host took it */
+    g_assert_cmphex(qtest_readl(qts, USART_SR), ==, SR_TXE | SR_TC);
+
+    qtest_quit(qts);
+    close(sock_fd);
+}
+
+static void test_tx_paced(void)
+{
+    int sock_fd;
+    QTestState *qts = usart_init("-global stm32f2xx-usart.tx-pacing=on",
+                                 &sock_fd);
+    char buf[2];
+
+    qtest_writel(qts, USART_BRR, BRR_1MBAUD);
+    qtest_writel(qts, USART_CR1, CR1_UE | CR1_TE | CR1_TCIE);
+
+    /* The first character goes straight to the shifter */
+    qtest_writel(qts, USART_DR, 'a');
+    g_assert_cmphex(qtest_readl(qts, USART_SR), ==, SR_TXE);
+    qtest_writel(qts, USART_DR, 'b');
+    g_assert_cmphex(qtest_readl(qts, USART_SR), ==, 0);
+
+    qtest_clock_step(qts, CHAR_NS);
+    g_assert_cmphex(qtest_readl(qts, USART_SR), ==, SR_TXE);
+    g_assert_false(qtest_get_irq(qts, USART1_IRQ));
+    qtest_clock_step(qts, CHAR_NS);
+    g_assert_cmphex(qtest_readl(qts, USART_SR), ==, SR_TXE | SR_TC);
+    g_assert_true(qtest_get_irq(qts, USART1_IRQ));
+
+    usart_recv(sock_fd, buf, sizeof(buf));
+    g_assert_cmpmem(buf, sizeof(buf), "ab", 2);
+
+    /* TC is cleared by writing 0 */
+    qtest_writel(qts, USART_SR, ~SR_TC);
+    g_assert_cmphex(qtest_readl(qts, USART_SR), ==, SR_TXE);
+    g_assert_false(qtest_get_irq(qts, USART1_IRQ));
+
+    qtest_quit(qts);
+    close(sock_fd);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+
+    qtest_add_func("stm32f411/usart/rx-burst", test_rx_burst);
+    qtest_add_func("stm32f411/usart/rx-paced", test_rx_paced);
+    qtest_add_func("stm32f411/usart/rx-overrun", test_rx_overrun);
+    qtest_add_func("stm32f411/usart/tx", test_tx);
+    qtest_add_func("stm32f411/usart/tx-paced", test_tx_paced);
+
+    return g_test_run();
+}
@@ -0,0 +1,257 @@
+/*
+ * QTest testcase for the STM32F411 IWDG and WWDG
+ *
+ * Copyright (c) 2023 Julien Combattelli <julien.combattelli@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "qemu/osdep.h"
+#include "libqtest.h"
+#include "qapi/qmp/qdict.h"
+
+#define RCC_APB1ENR 0x40023840
+#define RCC_APB1ENR_WWDGEN (1 << 11)
+
+#define IWDG_BASE 0x40003000
+#define IWDG_KR (IWDG_BASE + 0x00)
+#define IWDG_PR (IWDG_BASE + 0x04)
+#define IWDG_RLR (IWDG_BASE + 0x08)
+#define IWDG_SR (IWDG_BASE + 0x0c)
+
+#define WWDG_BASE 0x40002c00
+#define WWDG_CR (WWDG_BASE + 0x00)
+#define WWDG_CFR (WWDG_BASE + 0x04)
+#define WWDG_SR (WWDG_BASE + 0x08)
+
+#define WWDG_CR_WDGA 0x80
+#define WWDG_CFR_EWI 0x200
+
+/* 4 LSI cycles of 31.25us per IWDG count with PR = 0 */
+#define IWDG_TICK_NS 125000
+/* 4096 PCLK1 cycles per WWDG count, HSI at 16MHz with WDGTB = 0 */
+#define WWDG_TICK_NS 256000
+
+/*
+ * The watchdogs report through the -action watchdog=... machinery: 'none'
+ * turns each expiry into a WATCHDOG event and nothing else, so that the
+ * test can look at the registers afterwards.
+ */
+static QTestState *watchdog_init(void)
+{
+    return qtest_init("-M st-nucleo-f411 -action watchdog=none");
+}
+
+/* Sync with QMP so that any event sent so far is queued, then look for it */
+static bool watchdog_fired(QTestState *qts)
+{
+    QDict *resp;
+
+    qobject_unref(qtest_qmp(qts, "{ 'execute': 'query-status' }"));
+    resp = qtest_qmp_event_ref(qts, "WATCHDOG");
+    if (!resp) {
+        return false;
+    }
+    qobject_unref(resp);
+    return true;
+}
+
+static void test_iwdg_lock(void)
+{
+    QTestState *qts = watchdog_init();
+
+    g_assert_cmphex(qtest_readl(qts, IWDG_PR), ==, 0);
+    g_assert_cmphex(qtest_readl(qts, IWDG_RLR), ==, 0xfff);
+
+    /* PR and RLR ignore writes until unlocked */
+    qtest_writel(qts, IWDG_PR, 3);
+    qtest_writel(qts, IWDG_RLR, 0x123);
+    g_assert_cmphex(qtest_readl(qts, IWDG_PR), ==, 0);
+    g_assert_cmphex(qtest_readl(qts, IWDG_RLR), ==, 0xfff);
+
+    qtest_writel(qts, IWDG_KR, 0x5555);
+    qtest_writel(qts, IWDG_PR, 0xff);
+    qtest_writel(qts, IWDG_RLR, 0xf123);
+    g_assert_cmphex(qtest_readl(qts, IWDG_PR), ==, 7);
+    g_assert_cmphex(qtest_readl(qts, IWDG_RLR), ==, 0x123);
+    g_assert_cmphex(qtest_readl(qts, IWDG_SR), ==, 0);
+
+    /* Any other key locks them again */
+    qtest_writel(qts, IWDG_KR, 0xaaaa);
+    qtest_writel(qts, IWDG_RLR, 0x456);
+    g_assert_cmphex(qtest_readl(qts, IWDG_RLR), ==, 0x123);
+
+    /* Not started: nothing ever expires */
+    qtest_clock_step(qts, 60 * NANOSECONDS_PER_SECOND);
+    g_assert_false(watchdog_fired(qts));
+
+    qtest_quit(qts);
+}
+
+static void test_iwdg_timeout(void)
+{
+    QTestState *qts = watchdog_init();
+
+    /* 10 counts of 125us */
+    qtest_writel(qts, IWDG_KR, 0x5555);
+    qtest_writel(qts, IWDG_PR, 0);
+    qtest_writel(qts, IWDG_RLR, 9);
+    qtest_writel(qts, IWDG_KR, 0xcccc);
+
+    /* Refreshed in time, twice */
+    qtest_clock_step(qts, 9 * IWDG_TICK_NS);
+    qtest_writel(qts, IWDG_KR, 0xaaaa);
+    qtest_clock_step(qts, 9 * IWDG_TICK_NS);
+    qtest_writel(qts, IWDG_KR, 0xaaaa);
+    qtest_clock_step(qts, 9 * IWDG_TICK_NS);
+    g_assert_false(watchdog_fired(qts));
+
+    qtest_clock_step(qts, IWDG_TICK_NS);
+    g_assert_true(watchdog_fired(qts));
+
+    /* A new RLR is only used from the next reload on */
+    qtest_writel(qts, IWDG_KR, 0x5555);
+    qtest_writel(qts, IWDG_RLR, 19);
+    qtest_writel(qts, IWDG_KR, 0xaaaa);
+    qtest_clock_step(qts, 19 * IWDG_TICK_NS);
+    g_assert_false(watchdog_fired(qts));
+    qtest_clock_step(qts, IWDG_TICK_NS);
+    g_assert_true(watchdog_fired(qts));
+
+    qtest_quit(qts);
+}
+
+static void test_wwdg_countdown(void)
+{
+    QTestState *qts = watchdog_init();
+
+    g_assert_cmphex(qtest_readl(qts, WWDG_CR), ==, 0x7f);
+    g_assert_cmphex(qtest_readl(qts, WWDG_CFR), ==, 0x7f);
+
+    qtest_writel(qts, RCC_APB1ENR, RCC_APB1ENR_WWDGEN);
+    qtest_writel(qts, WWDG_CFR, WWDG_CFR_EWI | 0x7f);
+    qtest_writel(qts, WWDG_CR, WWDG_CR_WDGA | 0x7f);
+
+    qtest_clock_step(qts, 0x10 * WWDG_TICK_NS);
+    g_assert_cmphex(qtest_readl(qts, WWDG_CR), ==, WWDG_CR_WDGA | 0x6f);
+    g_assert_cmphex(qtest_readl(qts, WWDG_SR), ==, 0);
+
+    /* Early wakeup at 0x40 */
+    qtest_clock_step(qts, 0x2f * WWDG_TICK_NS);
+    g_assert_cmphex(qtest_readl(qts, WWDG_CR), ==, WWDG_CR_WDGA | 0x40);
+    g_assert_cmphex(qtest_readl(qts, WWDG_SR), ==, 1);
+    g_assert_false(watchdog_fired(qts));
+
+    qtest_writel(qts, WWDG_SR, 0);
+    g_assert_cmphex(qtest_readl(qts, WWDG_SR), ==, 0);
+
+    /* Refresh inside the window */
+    qtest_writel(qts, WWDG_CR, 0x7f);
+    g_assert_cmphex(qtest_readl(qts, WWDG_CR), ==, WWDG_CR_WDGA | 0x7f);
+    qtest_clock_step(qts, 0x3f * WWDG_TICK_NS);
+    g_assert_cmphex(qtest_readl(qts, WWDG_SR), ==, 1);
+    g_assert_false(watchdog_fired(qts));
+
+    /* Reset when going from 0x40 to 0x3f */
+    qtest_clock_step(qts, WWDG_TICK_NS);
+    g_assert_true(watchdog_fired(qts));
+
+    qtest_quit(qts);
+}
+
+static void test_wwdg_stopped_clock(void)
+{
+    QTestState *qts = watchdog_init();
+
+    /* Without WWDGEN the counter holds */
+    qtest_writel(qts, WWDG_CR, WWDG_CR_WDGA | 0x7f);
+    qtest_clock_step(qts, 0x100 * WWDG_TICK_NS);
+    g_assert_cmphex(qtest_readl(qts, WWDG_CR), ==, WWDG_CR_WDGA | 0x7f);
+    g_assert_false(watchdog_fired(qts));
+
+    qtest_writel(qts, RCC_APB1ENR, RCC_APB1ENR_WWDGEN);
+    qtest_clock_step(qts, 0x20 * WWDG_TICK_NS);
+    g_assert_cmphex(qtest_readl(qts, WWDG_CR), ==, WWDG_CR_WDGA | 0x5f);
+
+    qtest_quit(qts);
+}
+
+static void test_wwdg_window(void)
+{
+    QTestState *qts = watchdog_init();
+
+    qtest_writel(qts, RCC_APB1ENR, RCC_APB1ENR_WWDGEN);
+    qtest_writel(qts, WWDG_CFR, 0x50);
+    qtest_writel(qts, WWDG_CR, WWDG_CR_WDGA | 0x7f);
+
+    /* Counter at 0x51: still above the window */
+    qtest_clock_step(qts, 0x2e * WWDG_TICK_NS);
+    g_assert_false(watchdog_fired(qts));
+    qtest_writel(qts, WWDG_CR, 0x7f);
+    g_assert_true(watchdog_fired(qts));
+
+    qtest_quit(qts);
+}
+
+static void test_wwdg_window_open(void)
+{
+    QTestState *qts = watchdog_init();
+
+    qtest_writel(qts, RCC_APB1ENR, RCC_APB1ENR_WWDGEN);
+    qtest_writel(qts, WWDG_CFR, 0x50);
+    qtest_writel(qts, WWDG_CR, WWDG_CR_WDGA | 0x7f);
+
+    /* Counter at 0x50: the window is open */
+    qtest_clock_step(qts, 0x2f * WWDG_TICK_NS);
+    qtest_writel(qts, WWDG_CR, 0x7f);
+    g_assert_false(watchdog_fired(qts));
+    g_assert_cmphex(qtest_readl(qts, WWDG_CR), ==, WWDG_CR_WDGA | 0x7f);
+
+    qtest_quit(qts);
+}
+
+static void test_wwdg_clear_t6(void)
+{
+    QTestState *qts = watchdog_init();
+
+    qtest_writel(qts, RCC_APB1ENR, RCC_APB1ENR_WWDGEN);
+    qtest_writel(qts, WWDG_CR, WWDG_CR_WDGA | 0x7f);
+    g_assert_false(watchdog_fired(qts));
+
+    /* W = 0x7f accepts any refresh, but T6 cleared resets right away */
+    qtest_writel(qts, WWDG_CR, 0x3f);
+    g_assert_true(watchdog_fired(qts));
+
+    qtest_quit(qts);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+
+    qtest_add_func("stm32f411/iwdg/lock", test_iwdg_lock);
+    qtest_add_func("stm32f411/iwdg/timeout", test_iwdg_timeout);
+    qtest_add_func("stm32f411/wwdg/countdown", test_wwdg_countdown);
+    qtest_add_func("stm32f411/wwdg/stopped-clock", test_wwdg_stopped_clock);
+    qtest_add_func("stm32f411/wwdg/window", test_wwdg_window);
+    qtest_add_func("stm32f411/wwdg/window-open", test_wwdg_window_open);
+    qtest_add_func("stm32f411/wwdg/clear-t6", test_wwdg_clear_t6);
+
+    return g_test_run();
+}
@@ -50,6 +50,7 @@
 
 #include "qemu/ctype.h"
 #include "qemu/cutils.h"
+#include "qemu-version.h"
 #include "qemu/error-report.h"
 
 void strpadcpy(char *buf, int buf_size, const char *str, char pad)
@@ -970,6 +971,7 @@ static inline const char *next_component(const char *dir, int *p_len)
 }
 
 static const char *exec_dir;
+static const char *exec_path;
 
 void qemu_init_exec_dir(const char *argv0)
 {
@@ -988,6 +990,7 @@ void qemu_init_exec_dir(const char *argv0)
     }
 
     buf[len] = 0;
+    exec_path = g_strdup(buf);
     p = buf + len - 1;
     while (p != buf && *p != '\\') {
         p--;
@@ -1065,6 +1068,7 @@ void qemu_init_exec_dir(const char *argv0)
         p = realpath(argv0, buf);
     }
     if (p) {
+        exec_path = g_strdup(p);
         exec_dir = g_path_get_dirname(p);
     } else {
         exec_dir = CONFIG_BINDIR;
@@ -1077,6 +1081,18 @@ const char *qemu_get_exec_dir(void)
     return exec_dir;
 }
 
+char *qemu_get_build_id(void)
+{
+    struct stat st;
+
+    if (!exec_path || stat(exec_path, &st) < 0) {
+        return g_strdup(QEMU_FULL_VERSION);
+    }
+    return g_strdup_printf(QEMU_FULL_VERSION " %" PRIu64 " %" PRId64
+                           " %" PRIu64, (uint64_t)st.st_size,
+                           (int64_t)st.st_mtime, (uint64_t)st.st_ino);
+}
+
 char *get_relocated_path(const char *dir)
 {
     size_t prefix_len = strlen(CONFIG_PREFIX);
@@ -79,6 +79,13 @@ const uint8_t *fifo8_pop_buf(Fifo8 *fifo, uint32_t max, uint32_t *num)
     return ret;
 }
 
+const uint8_t *fifo8_peek_buf(Fifo8 *fifo, uint32_t max, uint32_t *num)
+{
+    assert(max > 0 && max <= fifo->num);
+    *num = MIN(fifo->capacity - fifo->head, max);
+    return &fifo->data[fifo->head];
+}
+
 void fifo8_reset(Fifo8 *fifo)
 {
     fifo->num = 0;
@@ -599,6 +599,9 @@ void main_loop_wait(int nonblocking)
         timeout_ns = (uint64_t)mlpoll.timeout * (int64_t)(SCALE_MS);
     }
 
+    /* If the vCPUs are all idle, don't wait for QEMU_CLOCK_VIRTUAL timers */
+    cpu_idle_warp();
+
     timeout_ns = qemu_soonest_timeout(timeout_ns,
                                       timerlistgroup_deadline_ns(
                                           &main_loop_tlg));